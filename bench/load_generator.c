@@ -0,0 +1,693 @@
+/********************************************************************************************
+ * Title: Load Generator
+ * Description: Simulates many concurrent download clients against a server and reports
+ * 		throughput and latency percentiles as JSON. Each simulated client speaks the
+ * 		control/data protocol from download_server.h: the address/port handshake,
+ * 		then -l and -g commands, each answered over a data connection the server
+ * 		opens back to the client. Legacy sessions end every response with END_DATA
+ * 		and ACK it; framed sessions (-F) negotiate FRAME/1 +persist and keep one
+ * 		data connection open. Every client listens for its data connections on its
+ * 		own loopback address (127.1.x.y) so thousands of them share one data port.
+ * 		Mux sessions (-M) add +mux and read every response off the control
+ * 		connection, so each client holds a single socket.
+ * 		Clients are spread over worker threads, each driving its share with epoll.
+ * Usage: ./load_generator -p SERVER_PORT [-h HOST] [-c CLIENTS] [-t THREADS] [-d SECONDS]
+ * 		[-m NAME:WEIGHT,...] [-l LIST_PERCENT] [-k THINK_MS] [-P DATA_PORT] [-F | -M]
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Protocol constants, mirrored from download_server.h */
+#define ACK_LENGTH              10                  // "@@ACK_ADDR" and "@@ACK_PORT"
+#define DATA_GREETING           "Data connection established!"
+#define END_DATA_MESSAGE        "@@END_DATA"
+#define END_DATA_LENGTH         10
+#define ERROR_PREFIX            "@@ERROR"
+#define FRAME_HEADER_SIZE       16
+#define FRAME_END               2
+#define FRAME_ERROR             3
+#define FRAMED_PORT_SUFFIX      " FRAME/1 +persist"
+#define MUX_PORT_SUFFIX         " FRAME/1 +persist +mux"
+
+#define MAX_EVENTS              256
+#define MAX_MIX_ENTRIES         32
+#define RECV_BUFFER_SIZE        (256 * 1024)
+#define DRAIN_SECONDS           5                   // grace for in-flight commands after the run
+#define HIST_SUB_BITS           4
+#define HIST_SUB_BUCKETS        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+enum client_state {
+    CLIENT_CONNECTING,          // non-blocking connect() of the control connection
+    CLIENT_AWAIT_ADDR_ACK,
+    CLIENT_AWAIT_PORT_ACK,
+    CLIENT_THINKING,            // between commands
+    CLIENT_AWAIT_DATA,          // command sent, waiting for the server's data connection
+    CLIENT_RECEIVING,
+    CLIENT_DONE
+};
+
+enum command_kind { COMMAND_GET, COMMAND_LIST, COMMAND_KINDS };
+
+enum endpoint_kind { ENDPOINT_CONTROL, ENDPOINT_LISTEN, ENDPOINT_DATA };
+
+struct client;
+
+struct endpoint {
+    enum endpoint_kind kind;
+    struct client* client;
+};
+
+struct client {
+    int id;
+    enum client_state state;
+    int control_fd;
+    int listen_fd;
+    int data_fd;
+    struct endpoint control;
+    struct endpoint listen;
+    struct endpoint data;
+    char data_addr[INET_ADDRSTRLEN];
+    size_t ack_len;
+
+    enum command_kind command;
+    uint64_t command_start;
+    uint64_t wake_at;           // CLIENT_THINKING: when to send the next command
+    uint64_t bytes;             // response bytes received for the current command
+    int failed;                 // current command got an error response
+
+    char tail[END_DATA_LENGTH]; // legacy: last bytes received, to spot END_DATA
+    size_t tail_len;
+    unsigned char header[FRAME_HEADER_SIZE];    // framed: header being read
+    size_t header_len;
+    uint64_t payload_left;      // framed: bytes of the current frame still to skip
+    int last_opcode;
+};
+
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+struct worker_stats {
+    uint64_t commands[COMMAND_KINDS];
+    uint64_t errors;
+    uint64_t failed_connections;
+    uint64_t unfinished;        // clients still mid-handshake or mid-response when the drain ran out
+    uint64_t bytes;
+    uint64_t last_completion;
+    struct histogram latency[COMMAND_KINDS];
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    struct client* clients;
+    int num_clients;
+    struct worker_stats stats;
+};
+
+struct mix_entry {
+    char name[256];
+    unsigned int weight;
+};
+
+static struct {
+    const char* host;
+    int server_port;
+    int data_port;
+    int clients;
+    int threads;
+    int seconds;
+    int list_percent;
+    int think_ms;
+    int framed;
+    int mux;                    // framed, with responses on the control connection
+    struct mix_entry mix[MAX_MIX_ENTRIES];
+    int mix_len;
+    unsigned int mix_total;
+    struct sockaddr_in server_addr;
+    uint64_t stop_at;           // stop sending new commands
+    uint64_t drain_until;       // give up on in-flight commands
+} options = {
+    .host = "127.0.0.1", .clients = 100, .threads = 1, .seconds = 10, .list_percent = 10,
+    .think_ms = 0, .data_port = 45000
+};
+
+/********************************************* Helpers **************************************************/
+
+static uint64_t nowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/* xorshift, one state per worker thread */
+static uint64_t nextRandom(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void recordLatency(struct histogram* histogram, uint64_t micros)
+{
+    size_t index = micros;
+    if (micros >= HIST_SUB_BUCKETS) {
+        int shift = 63 - __builtin_clzll(micros) - HIST_SUB_BITS;
+        index = (size_t) (shift + 1) * HIST_SUB_BUCKETS + ((micros >> shift) & (HIST_SUB_BUCKETS - 1));
+    }
+    histogram->buckets[index]++;
+    histogram->count++;
+    if (micros > histogram->max) histogram->max = micros;
+}
+
+/* highest value of the bucket holding quantile q */
+static uint64_t latencyQuantile(const struct histogram* histogram, double q)
+{
+    if (histogram->count == 0) return 0;
+    uint64_t rank = (uint64_t) (q * histogram->count + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen < rank) continue;
+        if (b < HIST_SUB_BUCKETS) return b;
+        int shift = (int) (b / HIST_SUB_BUCKETS) - 1;
+        uint64_t highest = ((uint64_t) (HIST_SUB_BUCKETS + b % HIST_SUB_BUCKETS) << shift) + ((1ULL << shift) - 1);
+        return highest < histogram->max ? highest : histogram->max;
+    }
+    return histogram->max;
+}
+
+static int sendString(int fd, const char* message)
+{
+    size_t len = strlen(message);
+    return send(fd, message, len, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+static int watch(struct worker* worker, int fd, uint32_t events, struct endpoint* endpoint, int op)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = endpoint;
+    return epoll_ctl(worker->epoll_fd, op, fd, &ev);
+}
+
+/***************************************** Client state machine *****************************************/
+
+static void closeData(struct client* client)
+{
+    if (client->data_fd != -1) {
+        close(client->data_fd);
+        client->data_fd = -1;
+    }
+}
+
+/* stop the client for good */
+static void retireClient(struct worker* worker, struct client* client, int failed)
+{
+    if (failed) worker->stats.failed_connections++;
+    if (client->control_fd != -1) close(client->control_fd);
+    if (client->listen_fd != -1) close(client->listen_fd);
+    closeData(client);
+    client->control_fd = client->listen_fd = -1;
+    client->state = CLIENT_DONE;
+}
+
+/* the current command's response is complete */
+static void finishCommand(struct worker* worker, struct client* client, uint64_t now, uint64_t* seed)
+{
+    struct worker_stats* stats = &worker->stats;
+    stats->commands[client->command]++;
+    stats->bytes += client->bytes;
+    if (client->failed) stats->errors++;
+    recordLatency(&stats->latency[client->command], (now - client->command_start) / 1000);
+    stats->last_completion = now;
+
+    if (!options.framed) closeData(client);
+    client->state = CLIENT_THINKING;
+    client->wake_at = now;
+    if (options.think_ms > 0)       // exponentially distributed think time around the mean
+        client->wake_at += (uint64_t) (-options.think_ms * 1e6 *
+                                       log(((nextRandom(seed) >> 11) + 1) * (1.0 / 9007199254740992.0)));
+}
+
+/* pick and send the client's next command */
+static void sendCommand(struct worker* worker, struct client* client, uint64_t* seed)
+{
+    char command[300];
+    if ((int) (nextRandom(seed) % 100) < options.list_percent) {
+        client->command = COMMAND_LIST;
+        snprintf(command, sizeof(command), "-l");
+    } else {
+        unsigned int pick = (unsigned int) (nextRandom(seed) % options.mix_total);
+        int i = 0;
+        while (pick >= options.mix[i].weight) pick -= options.mix[i++].weight;
+        client->command = COMMAND_GET;
+        snprintf(command, sizeof(command), "-g %s", options.mix[i].name);
+    }
+    if (options.framed) strcat(command, "\n");
+
+    client->command_start = nowNanos();
+    client->bytes = 0;
+    client->failed = 0;
+    client->tail_len = client->header_len = 0;
+    client->payload_left = 0;
+    if (sendString(client->control_fd, command) == -1) {
+        retireClient(worker, client, 1);
+        return;
+    }
+    client->state = client->data_fd != -1 ? CLIENT_RECEIVING : CLIENT_AWAIT_DATA;
+}
+
+/* legacy response: payload then END_DATA, which the client ACKs */
+static int consumeLegacy(struct client* client, const char* bytes, size_t len)
+{
+    client->bytes += len;
+    if (len >= END_DATA_LENGTH) {
+        memcpy(client->tail, bytes + len - END_DATA_LENGTH, END_DATA_LENGTH);
+        client->tail_len = END_DATA_LENGTH;
+    } else {
+        size_t keep = client->tail_len + len > END_DATA_LENGTH ? END_DATA_LENGTH - len : client->tail_len;
+        memmove(client->tail, client->tail + client->tail_len - keep, keep);
+        memcpy(client->tail + keep, bytes, len);
+        client->tail_len = keep + len;
+    }
+    return client->tail_len == END_DATA_LENGTH && memcmp(client->tail, END_DATA_MESSAGE, END_DATA_LENGTH) == 0;
+}
+
+/* framed response: skip frames until END or ERROR */
+static int consumeFramed(struct client* client, const unsigned char* bytes, size_t len)
+{
+    client->bytes += len;
+    while (len > 0) {
+        if (client->payload_left > 0) {
+            size_t skip = len < client->payload_left ? len : (size_t) client->payload_left;
+            client->payload_left -= skip;
+            bytes += skip;
+            len -= skip;
+            continue;
+        }
+        size_t take = FRAME_HEADER_SIZE - client->header_len;
+        if (take > len) take = len;
+        memcpy(client->header + client->header_len, bytes, take);
+        client->header_len += take;
+        bytes += take;
+        len -= take;
+        if (client->header_len < FRAME_HEADER_SIZE) break;
+
+        client->header_len = 0;
+        client->last_opcode = client->header[1];
+        client->payload_left = 0;
+        for (int i = 8; i < 16; i++) client->payload_left = (client->payload_left << 8) | client->header[i];
+        if (client->last_opcode == FRAME_ERROR) client->failed = 1;
+        if (client->last_opcode == FRAME_END) return 1;
+    }
+    return client->last_opcode == FRAME_ERROR && client->payload_left == 0 && client->header_len == 0;
+}
+
+/* read whatever the data connection holds. Returns 1 once the response is complete */
+static int receiveData(struct worker* worker, struct client* client, char* buffer)
+{
+    for (;;) {
+        ssize_t n = recv(client->data_fd, buffer, RECV_BUFFER_SIZE, 0);
+        if (n > 0) {
+            int done = options.framed ? consumeFramed(client, (unsigned char*) buffer, (size_t) n)
+                                      : consumeLegacy(client, buffer, (size_t) n);
+            if (done) {
+                if (!options.framed && sendString(client->data_fd, END_DATA_MESSAGE) == -1)
+                    client->failed = 1;
+                return 1;
+            }
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            client->failed = 1;		// server closed mid-response
+            closeData(client);
+            (void) worker;
+            return 1;
+        }
+    }
+}
+
+/* handshake replies and legacy error messages on the control connection */
+static void handleControl(struct worker* worker, struct client* client, uint64_t* seed)
+{
+    char buffer[512];
+    if (client->state == CLIENT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(client->control_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0 ||
+                sendString(client->control_fd, client->data_addr) == -1) {
+            retireClient(worker, client, 1);
+            return;
+        }
+        watch(worker, client->control_fd, EPOLLIN, &client->control, EPOLL_CTL_MOD);
+        client->state = CLIENT_AWAIT_ADDR_ACK;
+        client->ack_len = 0;
+        return;
+    }
+
+    ssize_t n = recv(client->control_fd, buffer, sizeof(buffer) - 1, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        retireClient(worker, client, client->state != CLIENT_THINKING);
+        return;
+    }
+    buffer[n] = '\0';
+
+    if (client->state == CLIENT_AWAIT_ADDR_ACK) {
+        if (strncmp(buffer, ERROR_PREFIX, strlen(ERROR_PREFIX)) == 0) {
+            retireClient(worker, client, 1);	// refused by the server's admission control
+            return;
+        }
+        client->ack_len += n;
+        if (client->ack_len < ACK_LENGTH) return;
+        char port_message[64];
+        snprintf(port_message, sizeof(port_message), "%d%s", options.data_port,
+                 options.mux ? MUX_PORT_SUFFIX : options.framed ? FRAMED_PORT_SUFFIX : "");
+        if (sendString(client->control_fd, port_message) == -1) {
+            retireClient(worker, client, 1);
+            return;
+        }
+        client->state = CLIENT_AWAIT_PORT_ACK;
+        client->ack_len = 0;
+    } else if (client->state == CLIENT_AWAIT_PORT_ACK) {
+        client->ack_len += n;
+        if (client->ack_len < ACK_LENGTH) return;
+        if (options.framed && strstr(buffer, "FRAME/") == NULL) {
+            fprintf(stderr, "Server refused framing\n");
+            retireClient(worker, client, 1);
+            return;
+        }
+        if (options.mux) {
+            /* responses arrive on the control connection from here on, read as the data endpoint */
+            if (strstr(buffer, "+mux") == NULL) {
+                fprintf(stderr, "Server refused +mux\n");
+                retireClient(worker, client, 1);
+                return;
+            }
+            if ((client->data_fd = dup(client->control_fd)) == -1 ||
+                    watch(worker, client->control_fd, 0, &client->control, EPOLL_CTL_DEL) == -1 ||
+                    watch(worker, client->data_fd, EPOLLIN, &client->data, EPOLL_CTL_ADD) == -1) {
+                retireClient(worker, client, 1);
+                return;
+            }
+        }
+        client->state = CLIENT_THINKING;    // first command goes out on the next pass, unless the run is over
+        client->wake_at = nowNanos();
+    } else if (client->state == CLIENT_AWAIT_DATA && strstr(buffer, ERROR_PREFIX) != NULL) {
+        /* legacy rejections come back here and no data connection is opened */
+        client->failed = 1;
+        finishCommand(worker, client, nowNanos(), seed);
+    }
+}
+
+/* the server opened a data connection to this client */
+static void acceptData(struct worker* worker, struct client* client)
+{
+    int fd = accept4(client->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) return;
+    closeData(client);
+    client->data_fd = fd;
+    if (sendString(fd, DATA_GREETING) == -1 ||
+            watch(worker, fd, EPOLLIN, &client->data, EPOLL_CTL_ADD) == -1) {
+        retireClient(worker, client, 1);
+        return;
+    }
+    if (client->state == CLIENT_AWAIT_DATA) client->state = CLIENT_RECEIVING;
+}
+
+/* open the client's data listener and start its control connection */
+static int startClient(struct worker* worker, struct client* client)
+{
+    client->control_fd = client->listen_fd = client->data_fd = -1;
+    client->control = (struct endpoint) { ENDPOINT_CONTROL, client };
+    client->listen = (struct endpoint) { ENDPOINT_LISTEN, client };
+    client->data = (struct endpoint) { ENDPOINT_DATA, client };
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) options.data_port);
+    addr.sin_addr.s_addr = htonl(0x7F010000u + (uint32_t) client->id + 1);	// 127.1.x.y
+    inet_ntop(AF_INET, &addr.sin_addr, client->data_addr, sizeof(client->data_addr));
+
+    int yes = 1;
+    if (!options.mux) {			// mux clients are never connected back to
+        client->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (client->listen_fd == -1 ||
+                setsockopt(client->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+                bind(client->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+                listen(client->listen_fd, 4) == -1 ||
+                watch(worker, client->listen_fd, EPOLLIN, &client->listen, EPOLL_CTL_ADD) == -1)
+            return -1;
+    }
+
+    client->control_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->control_fd == -1) return -1;
+    if (connect(client->control_fd, (struct sockaddr*) &options.server_addr, sizeof(options.server_addr)) == -1 &&
+            errno != EINPROGRESS)
+        return -1;
+    client->state = CLIENT_CONNECTING;
+    return watch(worker, client->control_fd, EPOLLOUT, &client->control, EPOLL_CTL_ADD);
+}
+
+/********************************************** Worker threads *********************************************/
+
+static void* workerThread(void* arg)
+{
+    struct worker* worker = (struct worker*) arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t seed = 0x9E3779B97F4A7C15ULL ^ ((uint64_t) (uintptr_t) worker << 1);
+    char* buffer = malloc(RECV_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+
+    for (int i = 0; i < worker->num_clients; i++)
+        if (startClient(worker, &worker->clients[i]) == -1)
+            retireClient(worker, &worker->clients[i], 1);
+
+    for (;;) {
+        uint64_t now = nowNanos();
+        int active = 0;
+        uint64_t next_wake = now + 100000000ULL;
+
+        /* wake thinking clients, or retire them once the run is over */
+        for (int i = 0; i < worker->num_clients; i++) {
+            struct client* client = &worker->clients[i];
+            if (client->state == CLIENT_DONE) continue;
+            if (client->state == CLIENT_THINKING) {
+                if (now >= options.stop_at) {
+                    retireClient(worker, client, 0);
+                    continue;
+                }
+                if (client->wake_at <= now) sendCommand(worker, client, &seed);
+                else if (client->wake_at < next_wake) next_wake = client->wake_at;
+            } else if (now >= options.drain_until) {
+                worker->stats.unfinished++;
+                retireClient(worker, client, 0);
+                continue;
+            }
+            if (client->state != CLIENT_DONE) active++;
+        }
+        if (active == 0) break;
+
+        int timeout = (int) ((next_wake - now) / 1000000ULL);
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < ready; i++) {
+            struct endpoint* endpoint = (struct endpoint*) events[i].data.ptr;
+            struct client* client = endpoint->client;
+            if (client->state == CLIENT_DONE) continue;
+            switch (endpoint->kind) {
+                case ENDPOINT_CONTROL:
+                    handleControl(worker, client, &seed);
+                    break;
+                case ENDPOINT_LISTEN:
+                    acceptData(worker, client);
+                    break;
+                case ENDPOINT_DATA:
+                    if (client->state == CLIENT_RECEIVING && receiveData(worker, client, buffer)) {
+                        finishCommand(worker, client, nowNanos(), &seed);
+                        if (options.mux && client->data_fd == -1)
+                            retireClient(worker, client, 1);	// the control connection went with it
+                    } else if (client->state != CLIENT_RECEIVING) {
+                        if (options.mux) retireClient(worker, client, 0);
+                        else closeData(client);	// persistent connection dropped between commands
+                    }
+                    break;
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/********************************************** Setup and report *******************************************/
+
+static void usage()
+{
+    fprintf(stderr, "Usage: $ ./load_generator -p SERVER_PORT [-h HOST] [-c CLIENTS] [-t THREADS] "
+                    "[-d SECONDS] [-m NAME:WEIGHT,...] [-l LIST_PERCENT] [-k THINK_MS] [-P DATA_PORT] [-F | -M]\n");
+    exit(1);
+}
+
+/* parse "name:weight,name:weight" */
+static void parseMix(char* spec)
+{
+    char* saveptr;
+    for (char* item = strtok_r(spec, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        if (options.mix_len == MAX_MIX_ENTRIES) usage();
+        char* colon = strrchr(item, ':');
+        struct mix_entry* entry = &options.mix[options.mix_len++];
+        entry->weight = colon != NULL ? (unsigned int) atoi(colon + 1) : 1;
+        if (colon != NULL) *colon = '\0';
+        snprintf(entry->name, sizeof(entry->name), "%s", item);
+        options.mix_total += entry->weight;
+    }
+}
+
+static void printLatency(const char* name, const struct histogram* histogram, int last)
+{
+    printf("    \"%s\": {\"count\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu}%s\n",
+           name, (unsigned long long) histogram->count,
+           (unsigned long long) latencyQuantile(histogram, 0.5), (unsigned long long) latencyQuantile(histogram, 0.99),
+           (unsigned long long) latencyQuantile(histogram, 0.999), (unsigned long long) histogram->max,
+           last ? "" : ",");
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    char default_mix[] = "test_data.txt:1";
+    char* mix = default_mix;
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:m:l:k:P:FM")) != -1) {
+        switch (opt) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.server_port = atoi(optarg); break;
+            case 'c': options.clients = atoi(optarg); break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'd': options.seconds = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'l': options.list_percent = atoi(optarg); break;
+            case 'k': options.think_ms = atoi(optarg); break;
+            case 'P': options.data_port = atoi(optarg); break;
+            case 'F': options.framed = 1; break;
+            case 'M': options.framed = options.mux = 1; break;
+            default: usage();
+        }
+    }
+    if (options.server_port <= 0 || options.clients <= 0 || options.clients > 65000 || options.threads <= 0 ||
+            options.seconds <= 0)
+        usage();
+    if (options.threads > options.clients) options.threads = options.clients;
+    parseMix(mix);
+    if (options.mix_total == 0) usage();
+
+    options.server_addr.sin_family = AF_INET;
+    options.server_addr.sin_port = htons((uint16_t) options.server_port);
+    if (inet_pton(AF_INET, options.host, &options.server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Host must be an IPv4 address\n");
+        exit(1);
+    }
+
+    /* three sockets per client */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct client* clients = calloc(options.clients, sizeof(struct client));
+    struct worker* workers = calloc(options.threads, sizeof(struct worker));
+    if (clients == NULL || workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < options.clients; i++) clients[i].id = i;
+
+    uint64_t start = nowNanos();
+    options.stop_at = start + (uint64_t) options.seconds * 1000000000ULL;
+    options.drain_until = options.stop_at + DRAIN_SECONDS * 1000000000ULL;
+    int assigned = 0;
+    for (int w = 0; w < options.threads; w++) {
+        struct worker* worker = &workers[w];
+        worker->clients = clients + assigned;
+        worker->num_clients = options.clients / options.threads + (w < options.clients % options.threads);
+        assigned += worker->num_clients;
+        if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+                pthread_create(&worker->thread, NULL, workerThread, worker) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(1);
+        }
+    }
+
+    struct worker_stats total;
+    memset(&total, 0, sizeof(total));
+    for (int w = 0; w < options.threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+        close(workers[w].epoll_fd);
+        struct worker_stats* stats = &workers[w].stats;
+        for (int k = 0; k < COMMAND_KINDS; k++) {
+            total.commands[k] += stats->commands[k];
+            for (size_t b = 0; b < HIST_BUCKETS; b++) total.latency[k].buckets[b] += stats->latency[k].buckets[b];
+            total.latency[k].count += stats->latency[k].count;
+            if (stats->latency[k].max > total.latency[k].max) total.latency[k].max = stats->latency[k].max;
+        }
+        total.errors += stats->errors;
+        total.failed_connections += stats->failed_connections;
+        total.unfinished += stats->unfinished;
+        if (stats->last_completion > total.last_completion) total.last_completion = stats->last_completion;
+        total.bytes += stats->bytes;
+    }
+    /* rate over the time commands were completing, not the drain after it */
+    double elapsed = ((total.last_completion > start ? total.last_completion : nowNanos()) - start) / 1e9;
+
+    struct histogram all;
+    memset(&all, 0, sizeof(all));
+    for (int k = 0; k < COMMAND_KINDS; k++) {
+        for (size_t b = 0; b < HIST_BUCKETS; b++) all.buckets[b] += total.latency[k].buckets[b];
+        all.count += total.latency[k].count;
+        if (total.latency[k].max > all.max) all.max = total.latency[k].max;
+    }
+    uint64_t commands = total.commands[COMMAND_GET] + total.commands[COMMAND_LIST];
+
+    printf("{\n");
+    printf("  \"clients\": %d,\n  \"threads\": %d,\n  \"protocol\": \"%s\",\n", options.clients, options.threads,
+           options.mux ? "mux" : options.framed ? "framed" : "legacy");
+    printf("  \"duration_s\": %.3f,\n  \"think_ms\": %d,\n  \"list_percent\": %d,\n", elapsed, options.think_ms,
+           options.list_percent);
+    printf("  \"commands\": %llu,\n  \"errors\": %llu,\n  \"failed_connections\": %llu,\n  \"unfinished\": %llu,\n",
+           (unsigned long long) commands, (unsigned long long) total.errors,
+           (unsigned long long) total.failed_connections, (unsigned long long) total.unfinished);
+    printf("  \"bytes\": %llu,\n  \"commands_per_s\": %.1f,\n  \"throughput_mb_s\": %.2f,\n",
+           (unsigned long long) total.bytes, commands / elapsed, total.bytes / elapsed / (1024 * 1024));
+    printf("  \"latency\": {\n");
+    printLatency("all", &all, 0);
+    printLatency("get", &total.latency[COMMAND_GET], 0);
+    printLatency("list", &total.latency[COMMAND_LIST], 1);
+    printf("  }\n}\n");
+
+    free(clients);
+    free(workers);
+    return 0;
+}
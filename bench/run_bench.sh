@@ -0,0 +1,47 @@
+#!/bin/sh
+# Title: Benchmark Runner
+# Description: Starts a server over loopback in a scratch directory holding small, medium and
+# 		large files, drives it with the load generator and prints the generator's JSON
+# 		report. Tunables come from the environment:
+# 		ENGINE (threads), CLIENTS (200), THREADS (1), DURATION (10), LIST_PERCENT (10),
+# 		THINK_MS (0), MIX (small.bin:70,medium.bin:25,large.bin:5), PORT (46000),
+# 		FRAMED (0), MUX (0, framed over the control connection), SERVER_ARGS (extra
+# 		server options)
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+server="$here/../server/server"
+generator="$here/load_generator"
+
+ENGINE=${ENGINE:-threads}
+CLIENTS=${CLIENTS:-200}
+THREADS=${THREADS:-1}
+DURATION=${DURATION:-10}
+LIST_PERCENT=${LIST_PERCENT:-10}
+THINK_MS=${THINK_MS:-0}
+MIX=${MIX:-small.bin:70,medium.bin:25,large.bin:5}
+PORT=${PORT:-46000}
+FRAMED=${FRAMED:-0}
+MUX=${MUX:-0}
+
+files=$(mktemp -d)
+trap 'kill $server_pid 2>/dev/null; wait $server_pid 2>/dev/null || true; rm -rf "$files"' EXIT
+
+head -c 4096 /dev/urandom > "$files/small.bin"
+head -c 262144 /dev/urandom > "$files/medium.bin"
+head -c 4194304 /dev/urandom > "$files/large.bin"
+
+# every client holds three sockets, the server two per client
+ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+(cd "$files" && exec "$server" "$PORT" -e "$ENGINE" $SERVER_ARGS > /dev/null 2>&1) &
+server_pid=$!
+sleep 1
+
+framed_flag=
+[ "$FRAMED" = 1 ] && framed_flag=-F
+[ "$MUX" = 1 ] && framed_flag=-M
+
+"$generator" -p "$PORT" -c "$CLIENTS" -t "$THREADS" -d "$DURATION" -l "$LIST_PERCENT" \
+	-k "$THINK_MS" -m "$MIX" $framed_flag
@@ -6,45 +6,103 @@
 #	Date: 25 Nov, 2018
 #	Description: Parses user input to initialize an instance of DownloadClient class, which connects to a remote
 #			server to retrieve directory info and download text files. Resolves server IP address using DNS.
-#	Usage:	$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -l		# for LIST command
-#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -g {FILE_NAME}	# for GET command
+#	Usage:	$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -l [-R] [-L] [PREFIX]	# for LIST command
+#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -s		# for server statistics
+#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} [-p STREAMS] -g {FILE_NAME} [FILE_NAME ...]	# for GET command
+#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -b {FILE_NAME|'GLOB'} [...]	# for batch GET
+#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -c {FILE_NAME} [FILE_NAME ...]	# for file checksums
+#		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} [--passive] -u {FILE_NAME} [FILE_NAME ...]	# for uploads
 #		$ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT}		# for shell mode
+#		Add --passive to open the data connection to the server, or --mux to receive responses over
+#		the control connection, instead of having the server connect to CLIENT_DATA_PORT.
 #
 
 import sys, socket
 
-from download_client import DownloadClient
+from download_client import DownloadClient, buildListCommand
 
 # Catch errors in command line input
 def usageError():
-	sys.stdout.write("Usage: $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -l				# for LIST command\n")
-	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -g {FILE_NAME}	# for GET command\n")
+	sys.stdout.write("Usage: $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -l [-R] [-L] [PREFIX]		# for LIST command\n")
+	sys.stdout.write("	with	 -R to list sub-directories, -L for sizes and times, PREFIX to list matching paths only\n")
+	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -s				# for server statistics\n")
+	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} [-p STREAMS] -g {FILE_NAME} [FILE_NAME ...]	# for GET command\n")
+	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -b {FILE_NAME|'GLOB'} [...]	# for batch GET\n")
+	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -c {FILE_NAME} [FILE_NAME ...]	# for file checksums\n")
+	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT} -u {FILE_NAME} [FILE_NAME ...]	# for uploads\n")
 	sys.stdout.write("	or	 $ ./client.py {SERVER_HOSTNAME} {SERVER_COMMAND_PORT} {CLIENT_DATA_PORT}					# for shell mode\n")
+	sys.stdout.write("	with	 --passive or --mux to connect out to the server instead of accepting its data connection\n")
 	exit(1)
 
 # Parse arguments
 info = []
-cmd_mode, file_name = "", None
+cmd_mode, file_names = "", None
+segments = 1
+data_mode = "active"
 
-if ("-l" in sys.argv):			# validate LIST command arguments
-	if (len(sys.argv) != 5):
+for flag in ["--passive", "--mux"]:	# data connection mode, active unless one of these is given
+	if (flag in sys.argv):
+		if (data_mode != "active"):
+			usageError()
+		data_mode = flag[2:]
+		sys.argv.remove(flag)
+
+if ("-p" in sys.argv):			# segmented GET over STREAMS parallel data connections
+	p_index = sys.argv.index("-p")
+	try:
+		segments = int(sys.argv[p_index + 1])
+	except (IndexError, ValueError):
+		usageError()
+	if (segments < 1):
 		usageError()
+	del sys.argv[p_index:p_index + 2]
+
+if ("-l" in sys.argv):			# validate LIST command arguments, options and a prefix make it a paged listing
 	cmd_mode = "list"
 	cmd_index = sys.argv.index("-l")
+	if (cmd_index != 4):
+		usageError()
+	if (len(sys.argv) > 5):
+		file_names = sys.argv[cmd_index + 1:]
+		if (buildListCommand(file_names) == None):
+			usageError()
+	info = sys.argv[:cmd_index]
+elif ("-s" in sys.argv):		# validate STATS command arguments
+	if (len(sys.argv) != 5):
+		usageError()
+	cmd_mode = "stats"
+	cmd_index = sys.argv.index("-s")
 	for i in range(0, 5):
 		if (i != cmd_index):
 			info.append(sys.argv[i])
-elif ("-g" in sys.argv):		# validate GET command argumeents
-	if (len(sys.argv) != 6):
-		usageError()
+elif ("-g" in sys.argv):		# validate GET command argumeents, several files are pipelined
 	cmd_mode = "get"
 	cmd_index = sys.argv.index("-g")
-	if (cmd_index + 1 >= len(sys.argv)):
+	if (cmd_index != 4 or len(sys.argv) < 6):
 		usageError()
-	file_name = sys.argv[cmd_index + 1]
-	for i in range(0, 6):
-		if (i != cmd_index and i != cmd_index + 1):
-			info.append(sys.argv[i])
+	file_names = sys.argv[cmd_index + 1:]
+	info = sys.argv[:cmd_index]
+elif ("-b" in sys.argv):		# validate batch GET arguments, names or quoted globs
+	cmd_mode = "batch"
+	cmd_index = sys.argv.index("-b")
+	if (cmd_index != 4 or len(sys.argv) < 6):
+		usageError()
+	file_names = sys.argv[cmd_index + 1:]
+	info = sys.argv[:cmd_index]
+elif ("-c" in sys.argv):		# validate checksum arguments, one command per file
+	cmd_mode = "checksum"
+	cmd_index = sys.argv.index("-c")
+	if (cmd_index != 4 or len(sys.argv) < 6):
+		usageError()
+	file_names = sys.argv[cmd_index + 1:]
+	info = sys.argv[:cmd_index]
+elif ("-u" in sys.argv):		# validate upload arguments, one command per file
+	cmd_mode = "put"
+	cmd_index = sys.argv.index("-u")
+	if (cmd_index != 4 or len(sys.argv) < 6):
+		usageError()
+	file_names = sys.argv[cmd_index + 1:]
+	info = sys.argv[:cmd_index]
 else:					# validate shell mode arguments
 	if (len(sys.argv) != 4):
 		usageError()
@@ -76,7 +134,7 @@ sys.stdout.write("\t%s:%s, and \ndata socket %s:%s\n" %
 	(server_address, server_cmd_port, client_data_address, client_data_port))
 
 # Instantiate DownloadClient object
-file_client = DownloadClient(server_address, server_cmd_port, client_data_address, client_data_port, cmd_mode, file_name) 
+file_client = DownloadClient(server_address, server_cmd_port, client_data_address, client_data_port, cmd_mode, file_names, segments=segments, data_mode=data_mode)
 
 # Initialize DownloadClient 
 file_client.startup()
@@ -18,46 +18,180 @@ import sys
 import os
 import select
 import signal
+import struct
 import threading
+import time
+import zlib
+import ctypes
+import io
+from collections import deque
 
 # Global constants
 IN_BUFFER_SIZE = 4096
+RECV_BUFFER_SIZE = 256 * 1024		# preallocated receive buffer, filled in place with recv_into
 OUT_BUFFER_SIZE = 128
 SERVER_KILL_MESSAGE = "@@SERVER_KILL"
 ERROR_INVALID_COMMAND = "@@ERROR_INVALID_COMMAND"
 ERROR_BAD_FILENAME = "@@ERROR_BAD_FILENAME"
+ERROR_SERVER_BUSY = "@@ERROR_SERVER_BUSY"
+ERROR_UPLOAD_FAILED = "@@ERROR_UPLOAD_FAILED"
 END_DATA_MESSAGE = "@@END_DATA"
 GET_RES_SENTINEL = "@@GET"
 LIST_RES_SENTINEL = "@@LIST"
+ACK_PORT = "@@ACK_PORT"
+
+# Binary framing, requested by appending " FRAME/{VERSION}" to the data port message
+PROTOCOL_LEGACY = 0
+PROTOCOL_FRAMED = 1
+PROTOCOL_CAPABILITY = "FRAME/"
+FRAME_HEADER_FORMAT = "!BBHIQ"		# version, opcode, flags, reserved, payload length
+FRAME_HEADER_SIZE = struct.calcsize(FRAME_HEADER_FORMAT)
+FRAME_DATA = 1
+FRAME_END = 2
+FRAME_ERROR = 3
+FRAME_RANGE = 4
+FRAME_ENTRY = 5
+
+# Ranged GET ("-r OFFSET LENGTH FILENAME"), answered with a RANGE frame of offset, length and file size
+RANGE_MESSAGE = "-r"
+RANGE_PAYLOAD_FORMAT = "!QQQ"
+RANGE_PAYLOAD_SIZE = struct.calcsize(RANGE_PAYLOAD_FORMAT)
+
+# Batch GET ("-b NAME|GLOB ..."), answered with an ENTRY frame (file size, name) and a DATA frame per file
+BATCH_MESSAGE = "-b"
+ENTRY_SIZE_FORMAT = "!Q"
+ENTRY_SIZE_LENGTH = struct.calcsize(ENTRY_SIZE_FORMAT)
+
+# Segmented downloads record their progress next to the output file so they can be resumed
+SEGMENT_STATE_SUFFIX = ".part"
+SEGMENT_STATE_INTERVAL = 8 * 1024 * 1024	# bytes written between progress saves
+SEGMENT_CHUNK_SIZE = 256 * 1024
+
+# Persistent data connection, requested alongside framing. Commands are newline terminated
+# and may be pipelined; responses arrive in order on one long-lived data connection
+CAPABILITY_PERSIST = "+persist"
+
+# Server metrics ("-s"), answered like a LIST with the metrics in the Prometheus text format
+STATS_MESSAGE = "-s"
+
+# Compressed GETs: DATA frames flagged FRAME_FLAG_DEFLATE carry one zlib stream, inflated as it arrives
+CAPABILITY_DEFLATE = "+deflate"
+FRAME_FLAG_DEFLATE = 0x0001
+
+# Data connection modes. "active": the server connects to our data port. "passive": we connect to
+# the port the server names in its ACK ("+passive:{PORT}"), which works from behind NAT. "mux":
+# responses are framed onto the control connection itself, so a session is one socket
+CAPABILITY_PASSIVE = "+passive"
+CAPABILITY_MUX = "+mux"
+DATA_GREETING = "Data connection established!"
+
+# Checksums: with +checksum the END frame of a GET or ranged GET is flagged FRAME_FLAG_CHECKSUM and
+# carries the CRC-32 of the bytes served, checked against what was written. "-c FILENAME" asks for
+# a file's checksum alone, answered like a LIST
+CAPABILITY_CHECKSUM = "+checksum"
+FRAME_FLAG_CHECKSUM = 0x0002
+CHECKSUM_FORMAT = "!I"
+CHECKSUM_MESSAGE = "-c"
+
+# Delta GETs: a GET of a file we already have becomes "-d BLOCK_SIZE BLOCK_COUNT FILENAME" followed by the
+# Adler-32 and CRC-32 of each full block of our copy. The server answers with a RANGE frame, COPY frames
+# (first block, block count) of our copy to reuse and DATA frames of new bytes, then a checksummed END.
+# The new copy is built next to the old one and replaces it only if the checksum matches
+DELTA_MESSAGE = "-d"
+FRAME_COPY = 6
+COPY_PAYLOAD_FORMAT = "!QQ"
+COPY_PAYLOAD_SIZE = struct.calcsize(COPY_PAYLOAD_FORMAT)
+DELTA_SIGNATURE_FORMAT = "!II"
+DELTA_MIN_BLOCK = 512
+DELTA_MAX_BLOCK = 1024 * 1024
+DELTA_SUFFIX = ".delta"
+
+# Uploads ("-u SIZE FILENAME"), persistent sessions with a data connection only: once the data connection is up
+# the file's SIZE bytes follow on it, and the server answers END once the file is stored under FILENAME, or ERROR
+PUT_MESSAGE = "-u"
+
+# Paged LIST ("-l FLAGS LIMIT /PREFIX [CURSOR]"): FLAGS has 'r' to walk sub-directories and 'm' for binary
+# records of type, path length, size and mtime before each path. An END frame flagged FRAME_FLAG_CURSOR
+# carries the cursor the next page starts after, and the client asks for pages until there is none
+FRAME_FLAG_CURSOR = 0x0004
+LIST_PAGE_SIZE = 10000
+LIST_RECORD_FORMAT = "!BHQqI"		# type, path length, size, mtime seconds, mtime nanoseconds
+LIST_RECORD_SIZE = struct.calcsize(LIST_RECORD_FORMAT)
+LIST_TYPES = "fdl?"			# file, directory, symlink, other
+LIST_COMMAND_MAX = 127			# the server cuts longer commands short, so a long cursor resumes early
+
+# Turn LIST options ("-R" recursive, "-L" long, and a path prefix) into a paged LIST command. Returns None
+# if the options are invalid
+def buildListCommand(options):
+	flags, prefix = "", None
+	for option in options:
+		if (option == "-R" and "r" not in flags):
+			flags += "r"
+		elif (option == "-L" and "m" not in flags):
+			flags += "m"
+		elif (prefix == None and not option.startswith("-") and " " not in option):
+			prefix = option
+		else:
+			return None
+	return "-l %s %d /%s" % (flags or "-", LIST_PAGE_SIZE, prefix or "")
+
+# posix_fallocate from libc, for preallocating output files whose size is known up front
+try:
+	LIBC = ctypes.CDLL(None, use_errno=True)
+	LIBC.posix_fallocate
+except (OSError, AttributeError):
+	LIBC = None
 
 
 class DownloadClient:
 
     # Constructor defines several class-scoped variables
-    def __init__(self, server_address, server_port, client_data_address, client_data_port, cmd_mode, cmd_arg=None):
+    def __init__(self, server_address, server_port, client_data_address, client_data_port, cmd_mode, cmd_arg=None, framing=True, segments=1, data_mode="active"):
 		self.server_address = server_address
 		self.server_port = server_port
 		self.client_data_address = client_data_address
 		self.client_data_port = client_data_port
 		self.AWAIT_FILE = False
 		self.AWAIT_LIST = False
+		self.list_command = STATS_MESSAGE if cmd_mode == "stats" else "-l"	# LIST or STATS, same response shape
 		self.await_file_name = ""
 		self.KILL_RECEIVED = False
 		self.SERVER_DISCONNECT = False
 		self.cmd_mode = cmd_mode
 		self.cmd_arg = cmd_arg
+		self.framing = framing
+		self.protocol = PROTOCOL_LEGACY
+		self.persistent = False
+		self.checksums = False				# server sends a CRC-32 with every GET
+		self.pending = deque()				# (command, file name) awaiting a response, in order; delta GETs hold (file name, block size),
+								# uploads [file name, size, sent yet]
+		self.client_data_socket = None
+		self.segments = segments			# parallel streams per GET, on data ports client_data_port and up
+		self.data_mode = data_mode			# "active", "passive" or "mux", settled by the port ACK
+		self.passive_port = None
+		self.segment_lock = threading.Lock()
+		self.recv_buffer = bytearray(RECV_BUFFER_SIZE)	# data worker's receive buffer, reused for every response
+		self.recv_view = memoryview(self.recv_buffer)
 
     # Startup, called externally to launch client
     def startup(self):
+		if (self.cmd_mode == "get" and self.cmd_arg != None and self.segments > 1):
+			for file_name in self.cmd_arg:		# segmented downloads run their own sessions
+				self.segmentedGet(file_name)
+			exit(1)
 		self.data_worker_thread = threading.Thread(
 			target=self.dataWorkerThreadFn)
 		self.data_worker_thread.start()
-		self.establishControlConnection()
+		if (not self.establishControlConnection()):
+			self.KILL_RECEIVED = True			# no data connection will follow
+			self.clientTearDown()
 		if (self.cmd_mode == "shell"):		# shell mode
 			self.commandLoop()
-		elif (self.cmd_mode == "list"):		# single command (list)
-			self.singleService()
-		elif (self.cmd_mode == "get" and self.cmd_arg != None):	# single command (get)
+		elif (self.cmd_mode in ["list", "stats"]):		# single command (list or stats), list options if any
+			self.singleService(self.cmd_arg)
+		elif (self.cmd_mode == "get" and self.cmd_arg != None):	# single command (get), one or more files
+			self.singleService(self.cmd_arg)
+		elif (self.cmd_mode in ["batch", "checksum", "put"] and self.cmd_arg != None):	# single command (batch get, checksums or uploads)
 			self.singleService(self.cmd_arg)
 		self.clientTearDown()
 
@@ -66,24 +200,54 @@ class DownloadClient:
 		self.client_cmd_socket = socket.socket(
 			socket.AF_INET, socket.SOCK_STREAM)
 
-    # Establish the control connection
+    # Establish the control connection, returns False if the server turned the client away
     def establishControlConnection(self):
 		self.establishControlSocket()
 		self.client_cmd_socket.connect((self.server_address, self.server_port))
 		self.client_cmd_socket.send(str(self.client_data_address).encode())	# send data address for data connection
 		addr_ack = self.client_cmd_socket.recv(10).decode()
-		self.client_cmd_socket.send(str(self.client_data_port).encode())	# send data port for data connection
-		port_ack = self.client_cmd_socket.recv(10).decode()
+		if (addr_ack.startswith("@@ERROR")):
+			sys.stdout.write("Server is busy, connection refused\n")	# over the server's client limit
+			return False
+		port_message = str(self.client_data_port)
+		if (self.framing):						# ask server for binary framing
+			port_message += " %s%d %s %s %s" % (PROTOCOL_CAPABILITY, PROTOCOL_FRAMED, CAPABILITY_PERSIST, CAPABILITY_DEFLATE,
+				CAPABILITY_CHECKSUM)
+			if (self.data_mode == "passive"):
+				port_message += " " + CAPABILITY_PASSIVE
+			elif (self.data_mode == "mux"):
+				port_message += " " + CAPABILITY_MUX
+		self.client_cmd_socket.send(port_message.encode())		# send data port for data connection
+		port_ack = self.client_cmd_socket.recv(IN_BUFFER_SIZE if self.framing else len(ACK_PORT)).decode()
+		ack_tokens = port_ack.split()
+		if (self.framing and len(ack_tokens) > 1 and ack_tokens[1].startswith(PROTOCOL_CAPABILITY)):
+			self.protocol = int(ack_tokens[1][len(PROTOCOL_CAPABILITY):])
+			self.persistent = CAPABILITY_PERSIST in ack_tokens[2:]
+			self.checksums = CAPABILITY_CHECKSUM in ack_tokens[2:]
+		# fall back to active mode unless the server granted the requested one
+		granted = "active"
+		for token in ack_tokens[2:]:
+			if (token == CAPABILITY_MUX):
+				granted = "mux"
+			elif (token.startswith(CAPABILITY_PASSIVE + ":")):
+				granted = "passive"
+				self.passive_port = int(token[len(CAPABILITY_PASSIVE) + 1:])
+		if (granted != self.data_mode):
+			sys.stderr.write("Server declined %s data connections, using active mode\n" % (self.data_mode))
+		self.data_mode = granted if self.persistent else "active"
+		return True
 
     # Main loop in thread which manages control connection
     def commandLoop(self):
 		event = True
-		check_if_readable = [sys.stdin, self.client_cmd_socket]
-		while(not self.KILL_RECEIVED):
+		check_if_readable = [sys.stdin]
+		if (self.data_mode != "mux"):			# under mux the data worker reads the control socket
+			check_if_readable.append(self.client_cmd_socket)
+		while(not self.KILL_RECEIVED and not self.SERVER_DISCONNECT):
 			try:
 				readable, w, e = select.select(check_if_readable, [], [], 0.01)
 				if (event):
-					print("Please enter a command ($ -l or $ -g FILENAME)")
+					print("Please enter a command ($ -l [-R] [-L] [PREFIX], $ -s, $ -g FILENAME, $ -c FILENAME, $ -u FILENAME or $ -b FILENAME|GLOB ...)")
 					event = False
 				if (sys.stdin in readable):
 					status = self.handleClientCommand()		    # returns True if success
@@ -96,10 +260,31 @@ class DownloadClient:
 
     # Essentially runs one iteration of commandLoop() when the user has not entered shell mode
     def singleService(self, cmd_arg=None):
-		if (self.cmd_mode == "list"):
+		if (self.persistent):
+			# pipeline every command up front, the data worker stops once all responses are in
+			if (self.cmd_mode in ["list", "stats"]):
+				self.sendCommands([buildListCommand(cmd_arg) if cmd_arg else self.list_command])
+			elif (self.cmd_mode == "checksum"):
+				self.sendCommands([CHECKSUM_MESSAGE + " " + file_name for file_name in cmd_arg])
+			elif (self.cmd_mode == "get"):
+				self.sendCommands(["-g " + file_name for file_name in cmd_arg])
+			elif (self.cmd_mode == "batch"):
+				self.sendCommands([BATCH_MESSAGE + " " + " ".join(cmd_arg)])
+			elif (self.cmd_mode == "put"):
+				self.sendCommands([PUT_MESSAGE + " " + file_name for file_name in cmd_arg])
+			else:
+				return
+			if (len(self.pending) == 0):
+				self.KILL_RECEIVED = True		# every command was refused before it was sent
+				return
+		elif (self.cmd_mode in ["batch", "checksum", "put"] or cmd_arg and self.cmd_mode == "list"):
+			sys.stderr.write("Batch GET, checksums, uploads and LIST options need a framed, persistent session\n")
+			return
+		elif (self.cmd_mode in ["list", "stats"]):
 			self.AWAIT_LIST = True					# set flag
-			self.client_cmd_socket.send("-l".encode())		# send message
+			self.client_cmd_socket.send(self.list_command.encode())	# send message
 		elif (self.cmd_mode == "get"):
+			cmd_arg = cmd_arg[0]					# one command per data connection
 			query = "-g " + cmd_arg					# build query
 			self.await_file_name = cmd_arg				
 			self.AWAIT_FILE = True					# set flags
@@ -107,7 +292,7 @@ class DownloadClient:
 			self.client_cmd_socket.send(query.encode())		# send message
 		else:
 			return
-		check_if_readable = [self.client_cmd_socket]
+		check_if_readable = [self.client_cmd_socket] if self.data_mode != "mux" else []
 		while (not self.KILL_RECEIVED and not self.SERVER_DISCONNECT):
 			try:
 				readable, w, e = select.select(check_if_readable, [], [], 0.01)
@@ -117,23 +302,102 @@ class DownloadClient:
 			except:
 				sys.stderr.write("Client Error")
 
-    # Handles a single command, called from commandLoop()
+    # Handles a line of input, called from commandLoop(). Commands separated by ';' are pipelined
     def handleClientCommand(self):
-		command = raw_input()			# grab input
+		line = raw_input()			# grab input
+		commands = [command.strip() for command in line.split(";") if command.strip()]
+		if (len(commands) == 0):
+			return True
+		if (self.persistent):
+			for i, command in enumerate(commands):
+				args = command.split()
+				if (args[0] == "-l" and len(args) > 1):		# LIST options, sent as a paged listing
+					if (buildListCommand(args[1:]) == None):
+						self.handleClientCommandError(command)
+						return True
+					commands[i] = buildListCommand(args[1:])
+					continue
+				if (args[0] not in ["-g", "-l", STATS_MESSAGE, BATCH_MESSAGE, CHECKSUM_MESSAGE, PUT_MESSAGE] or
+						(args[0] not in ["-l", STATS_MESSAGE] and len(args) < 2)):
+					self.handleClientCommandError(command)
+					return True
+			self.sendCommands(commands)
+			return True
+		if (len(commands) > 1):
+			sys.stderr.write("Pipelined commands need a persistent data connection\n")
+			return True
+		command = commands[0]
 		args = command.split(" ")		# parse and handle arguments
-		if (args[0] in ["-g", "-l"]):
+		if (args[0] in ["-g", "-l", STATS_MESSAGE]):
 			if (args[0] == "-g"):
 				self.await_file_name = command.split(" ")[1]
 			if (len(self.await_file_name) > 0):
 				self.AWAIT_FILE = True
-			if (args[0] == "-l"):
+			if (args[0] in ["-l", STATS_MESSAGE]):
 				self.AWAIT_LIST = True
+				self.list_command = args[0]
 			self.BAD_FILENAME = False
 			self.client_cmd_socket.send(command.encode())	# send command
 		else:
 			self.handleClientCommandError(command)
 		return True
 
+    # Queue the expected responses, then send commands newline terminated in a single message. GETs of files
+    # we already have are sent as delta GETs, each followed by the signatures of our copy. Uploads announce
+    # the file's size and name; the data worker sends the file itself once the data connection is up
+    def sendCommands(self, commands):
+		message = []
+		for command in commands:
+			args = command.split()
+			if (args[0] == PUT_MESSAGE):
+				file_name = command[len(PUT_MESSAGE):].strip()
+				if (self.data_mode == "mux"):
+					sys.stderr.write("Uploads need a data connection of their own, not --mux\n")
+					continue
+				if (not os.path.isfile(file_name)):
+					sys.stderr.write("Client error, no file %s to upload\n" % (file_name))
+					continue
+				file_size = os.path.getsize(file_name)
+				message.append("%s %d %s\n" % (PUT_MESSAGE, file_size, os.path.basename(file_name)))
+				self.pending.append((PUT_MESSAGE, [file_name, file_size, False]))
+				continue
+			if (args[0] == "-g" and len(args) == 2 and os.path.isfile(args[1])):
+				if (any(entry[0] == DELTA_MESSAGE and entry[1][0] == args[1] for entry in self.pending)):
+					sys.stderr.write("%s is already being updated\n" % (args[1]))	# its signatures would be stale
+					continue
+				block_size = self.deltaBlockSize(os.path.getsize(args[1]))
+				signatures = self.signBlocks(args[1], block_size)
+				message.append("%s %d %d %s\n" % (DELTA_MESSAGE, block_size, len(signatures), args[1]))
+				message.extend(signatures)
+				self.pending.append((DELTA_MESSAGE, (args[1], block_size)))
+				continue
+			message.append(command + "\n")
+			if (args[0] == "-l" and len(args) > 1):
+				self.pending.append((args[0], command))		# paged LIST, the next page repeats the command
+			else:
+				self.pending.append((args[0], args[1] if len(args) > 1 else None))
+		self.client_cmd_socket.sendall(b"".join(message))
+
+    # Block size for signing a file of file_size bytes: about its square root, so signatures and
+    # block references grow slowly with the file
+    def deltaBlockSize(self, file_size):
+		block_size = DELTA_MIN_BLOCK
+		while (block_size * block_size < file_size and block_size < DELTA_MAX_BLOCK):
+			block_size *= 2
+		return block_size
+
+    # Sign every full block of a file, returns the packed Adler-32 and CRC-32 of each
+    def signBlocks(self, file_name, block_size):
+		signatures = []
+		with open(file_name, "rb") as in_file:
+			while (True):
+				block = in_file.read(block_size)
+				if (len(block) < block_size):
+					break
+				signatures.append(struct.pack(DELTA_SIGNATURE_FORMAT,
+					zlib.adler32(block) & 0xffffffff, zlib.crc32(block) & 0xffffffff))
+		return signatures
+
     # Handle client-side command errors: bad command or duplicate filename
     def handleClientCommandError(self, command):
 		sys.stderr.write("%s is not a valid command\n" % (command))
@@ -149,6 +413,12 @@ class DownloadClient:
 		if (status_message == ERROR_BAD_FILENAME):
 			sys.stdout.write("Server failed to locate file\n")
 			self.BAD_FILENAME = True
+		if (status_message == ERROR_SERVER_BUSY):
+			sys.stdout.write("Server is busy, command rejected\n")
+			self.AWAIT_FILE = False
+			self.AWAIT_LIST = False
+			if (self.cmd_mode != "shell"):
+				self.KILL_RECEIVED = True		# no data connection is coming
 
     # Main method executed by worker thread, which manages data connection and receives data sent from server
     def dataWorkerThreadFn(self):
@@ -164,17 +434,52 @@ class DownloadClient:
 		# sys.stdout.write("Data socket listening on %s:%s\n" % (self.client_data_address, self.client_data_port))
 		while ((not self.KILL_RECEIVED) and (not self.SERVER_DISCONNECT)):
 			readable, w, e = select.select(check_if_readable, [], [], 0.01)
+			if (self.persistent):
+				if (self.client_data_socket == None and self.data_mode != "active" and len(self.pending) > 0):
+					self.client_data_socket = self.w_openDataConnection()
+					if (self.client_data_socket == None):
+						self.SERVER_DISCONNECT = True
+						break
+					check_if_readable.append(self.client_data_socket)
+				elif (self.client_welcome_socket in readable):	# (re)connected, replaces any old connection
+					if (self.client_data_socket != None):
+						check_if_readable.remove(self.client_data_socket)
+						self.client_data_socket.close()
+					self.client_data_socket = self.w_establishDataConnection()
+					check_if_readable.append(self.client_data_socket)
+				elif (self.client_data_socket != None and len(self.pending) > 0 and
+						self.pending[0][0] == PUT_MESSAGE and not self.pending[0][1][2]):
+					if (not self.w_sendUpload(self.pending[0][1])):
+						self.pending.popleft()			# cut short, the server drops the connection unanswered
+						check_if_readable.remove(self.client_data_socket)
+						self.client_data_socket.close()
+						self.client_data_socket = None
+						if (self.cmd_mode != "shell" and len(self.pending) == 0):
+							self.KILL_RECEIVED = True
+				elif (self.client_data_socket in readable):
+					if (not self.w_handleNextResponse()):
+						check_if_readable.remove(self.client_data_socket)
+						if (self.data_mode == "mux"):
+							sys.stdout.write("Server closed the connection\n")
+							self.SERVER_DISCONNECT = True	# it was the control connection too
+							self.client_data_socket = None
+							break
+						self.client_data_socket.close()
+						self.client_data_socket = None
+				continue
 			if (self.client_welcome_socket in readable):
 				self.client_data_socket = self.w_establishDataConnection()
 				#sys.stdout.write("Established data connection\n")
-			if (self.AWAIT_FILE):
-				self.w_handleGetCommandResponse()
-			elif (self.AWAIT_LIST):
-				self.w_handleListCommandResponse()
+				if (self.AWAIT_FILE):
+					self.w_handleGetCommandResponse()
+				elif (self.AWAIT_LIST):
+					self.w_handleListCommandResponse(self.list_command)
 				self.client_data_socket.close()
-			if (self.cmd_mode != "shell"):
-				self.KILL_RECEIVED = True		# kill after one iteration if not in shell mode
+				if (self.cmd_mode != "shell"):
+					self.KILL_RECEIVED = True	# kill after one command if not in shell mode
 		# sys.stdout.write("Closing welcome socket\n")
+		if (self.persistent and self.client_data_socket != None and self.data_mode != "mux"):
+			self.client_data_socket.close()
 		self.client_welcome_socket.close()
 
     # Set up data connection, called from dataWorkerThreadFn when server sends a connection request to data welcome socket
@@ -183,64 +488,592 @@ class DownloadClient:
 		#sys.stdout.write("Establishing data connection\n")
 		client_data_socket, addr = self.client_welcome_socket.accept()
 		client_data_socket.settimeout(60)
-		client_data_socket.send("Data connection established!".encode())
+		client_data_socket.send(DATA_GREETING.encode())
+		return client_data_socket
+
+    # Open the data connection ourselves in passive or mux mode. Returns the socket, or None if the
+    # server's passive port can't be reached
+    def w_openDataConnection(self):
+		if (self.data_mode == "mux"):
+			return self.client_cmd_socket		# frames arrive on the control connection
+		try:
+			client_data_socket = socket.create_connection((self.server_address, self.passive_port), 10)
+		except socket.error:
+			sys.stderr.write("Failed to connect to the server's passive data port\n")
+			return None
+		client_data_socket.settimeout(60)
+		client_data_socket.send(DATA_GREETING.encode())
 		return client_data_socket
 
-    # Handle response to a GET command, called from dataWorkerThreadFn() when the AWAIT_FILE flag is set		
+    # Handle the response to the oldest pipelined command on a persistent data connection. Returns
+    # False once the server has closed the connection
+    def w_handleNextResponse(self):
+		if (len(self.pending) == 0):
+			return len(self.client_data_socket.recv(IN_BUFFER_SIZE)) > 0	# nothing expected, only a close
+		command, file_name = self.pending[0]
+		if (command == "-g"):
+			self.await_file_name = file_name
+			self.BAD_FILENAME = False
+			self.w_handleFramedGetResponse()
+		elif (command == BATCH_MESSAGE):
+			self.w_handleBatchResponse()
+		elif (command == DELTA_MESSAGE):
+			self.w_handleDeltaResponse(*file_name)
+		elif (command == PUT_MESSAGE):
+			self.w_handlePutResponse(file_name[0])
+		elif (command == "-l" and file_name != None):
+			self.w_handleListPageResponse(file_name)
+		else:
+			self.w_handleListCommandResponse(command)
+		self.pending.popleft()
+		if (self.cmd_mode != "shell" and len(self.pending) == 0):
+			self.KILL_RECEIVED = True	# every pipelined command answered
+		return not self.SERVER_DISCONNECT
+
+    # Handle response to a GET command, called from dataWorkerThreadFn() when the AWAIT_FILE flag is set
     def w_handleGetCommandResponse(self):
+		if (self.protocol != PROTOCOL_LEGACY):
+			return self.w_handleFramedGetResponse()
 		if (not self.BAD_FILENAME):
 			sys.stdout.write("Receiving %s from server\n" %
 			     (self.await_file_name))
-		DUPLICATE_FILENAME = False
 		out_file_name = self.await_file_name
+		out_fd = None
 		if (out_file_name in os.listdir(".")):
 			sys.stderr.write(
 		    		"Client error, duplicate filename %s. (Discarding data received. Please wait, This may take a minute)\n" 
 				% (out_file_name))
-			DUPLICATE_FILENAME = True
-		out_file = open(out_file_name, "w")		# open the output file
-		END_DATA_RECEIVED = False
+		else:
+			out_fd = self.w_openOutputFile(out_file_name)
+		def writePayload(payload):
+			if ((out_fd != None) and (not self.BAD_FILENAME)):		# BAD_FILENAME is set by the control thread
+				self.w_writeAll(out_fd, payload)
+		complete = self.w_recvUntilEndData(writePayload)
+		self.AWAIT_FILE = False
+		if (out_fd != None):
+			os.close(out_fd)
+			if (self.BAD_FILENAME or not complete):		# closed before END_DATA, the file is partial
+				os.remove(out_file_name)
+
+    # Handle a framed GET response: DATA frames copied to the file by length, never scanned, then END or ERROR.
+    # The CRC-32 of what is written is checked against the one the END frame carries, if any
+    def w_handleFramedGetResponse(self):
+		sys.stdout.write("Receiving %s from server\n" % (self.await_file_name))
+		out_file_name = self.await_file_name
+		out_fd = None
+		if (out_file_name in os.listdir(".")):
+			sys.stderr.write("Client error, duplicate filename %s. (Discarding data received)\n" % (out_file_name))
+		else:
+			out_fd = self.w_openOutputFile(out_file_name)
+		decompressor = None
+		crc = 0
+		while (not self.SERVER_DISCONNECT):
+			frame = self.w_recvFrameHeader()
+			if (frame == None):
+				sys.stderr.write("Data connection closed before transfer completed\n")
+				self.BAD_FILENAME = True
+				break
+			opcode, flags, length = frame
+			if (opcode == FRAME_DATA):
+				if (flags & FRAME_FLAG_DEFLATE and decompressor == None):
+					decompressor = zlib.decompressobj()
+				elif (not flags & FRAME_FLAG_DEFLATE and out_fd != None):
+					self.preallocate(out_fd, length)	# an uncompressed GET is one DATA frame of the whole file
+				crc = self.w_recvFramePayload(length, out_fd, decompressor if flags & FRAME_FLAG_DEFLATE else None, crc)
+			elif (opcode == FRAME_END):
+				if (decompressor != None and out_fd != None):
+					tail = decompressor.flush()
+					self.w_writeAll(out_fd, tail)
+					crc = zlib.crc32(tail, crc)
+				trailer = self.w_recvExactly(length) if length > 0 else b""
+				if (out_fd != None and flags & FRAME_FLAG_CHECKSUM and trailer != None and
+						struct.unpack(CHECKSUM_FORMAT, trailer)[0] != crc & 0xffffffff):
+					sys.stderr.write("Checksum mismatch, %s is corrupt. (Discarding data received)\n" % (out_file_name))
+					self.BAD_FILENAME = True
+				break
+			else:						# FRAME_ERROR, payload is the error message
+				self.w_reportFrameError(length)
+				self.BAD_FILENAME = True
+				break
+		self.AWAIT_FILE = False
+		if (out_fd != None):
+			os.close(out_fd)
+			if (self.BAD_FILENAME):
+				os.remove(out_file_name)
+
+    # Send an upload's file on the data connection, once its command is the oldest awaiting a response. The
+    # file goes out through the preallocated buffer. Returns False if it couldn't all be sent
+    def w_sendUpload(self, upload):
+		file_name, file_size = upload[0], upload[1]
+		upload[2] = True
+		sys.stdout.write("Uploading %s to server\n" % (file_name))
+		sent = 0
+		try:
+			with io.open(file_name, "rb", buffering=0) as in_file:
+				while (sent < file_size):
+					read = in_file.readinto(self.recv_view[:min(file_size - sent, RECV_BUFFER_SIZE)])
+					if (not read):
+						break				# the file shrank since its size was announced
+					self.client_data_socket.sendall(self.recv_view[:read])
+					sent += read
+		except (socket.error, IOError, OSError):
+			pass
+		if (sent < file_size):
+			sys.stderr.write("Failed to upload %s\n" % (file_name))
+			return False
+		return True
+
+    # Handle the response to an upload: END once the server has stored the file, or ERROR
+    def w_handlePutResponse(self, file_name):
+		frame = self.w_recvFrameHeader()
+		if (frame == None):
+			sys.stderr.write("Data connection closed before upload completed\n")
+			return
+		opcode, flags, length = frame
+		message = self.w_recvExactly(length) if length > 0 else b""
+		if (opcode == FRAME_END):
+			sys.stdout.write("Uploaded %s\n" % (file_name))
+		elif (message == ERROR_BAD_FILENAME):
+			sys.stdout.write("Server refused the name of %s\n" % (file_name))
+		elif (message == ERROR_SERVER_BUSY):
+			sys.stdout.write("Server is busy, command rejected\n")
+		else:
+			sys.stdout.write("Server failed to store %s\n" % (file_name))
+
+    # Handle a batch GET: ENTRY frames (size, name) each followed by that file's DATA frame, until END.
+    # Every file is written out as it streams in, so the batch is never held in memory
+    def w_handleBatchResponse(self):
+		received = 0
+		while (not self.SERVER_DISCONNECT):
+			frame = self.w_recvFrameHeader()
+			if (frame == None):
+				sys.stderr.write("Data connection closed before batch completed\n")
+				break
+			opcode, flags, length = frame
+			if (opcode == FRAME_END):
+				break
+			if (opcode != FRAME_ENTRY):
+				self.w_reportFrameError(length)
+				break
+			entry = self.w_recvExactly(length)
+			data = self.w_recvFrameHeader()
+			if (entry == None or data == None):
+				sys.stderr.write("Data connection closed before batch completed\n")
+				break
+			file_size = struct.unpack(ENTRY_SIZE_FORMAT, entry[:ENTRY_SIZE_LENGTH])[0]
+			file_name = entry[ENTRY_SIZE_LENGTH:].decode()
+			out_fd = None
+			if (os.path.basename(file_name) != file_name or file_name in [".", ".."]):
+				sys.stderr.write("Client error, unsafe filename %s. (Discarding data received)\n" % (file_name))
+			elif (os.path.exists(file_name)):
+				sys.stderr.write("Client error, duplicate filename %s. (Discarding data received)\n" % (file_name))
+			else:
+				out_fd = self.w_openOutputFile(file_name, file_size)
+			self.w_recvFramePayload(data[2], out_fd)
+			if (out_fd != None):
+				os.close(out_fd)
+				received += 1
+		sys.stdout.write("Received %d files\n" % (received))
+
+    # Handle a delta GET: the file is rebuilt into FILE.delta from COPY frames, read from our copy, and DATA
+    # frames, received, in order. It replaces our copy once the whole-file CRC-32 in the END frame matches
+    def w_handleDeltaResponse(self, file_name, block_size):
+		sys.stdout.write("Updating %s from server\n" % (file_name))
+		temp_name = file_name + DELTA_SUFFIX
+		in_fd = os.open(file_name, os.O_RDONLY)
+		out_fd = self.w_openOutputFile(temp_name)
+		crc = 0
+		copied, received = 0, 0
+		verified = False
+		while (not self.SERVER_DISCONNECT):
+			frame = self.w_recvFrameHeader()
+			if (frame == None):
+				sys.stderr.write("Data connection closed before transfer completed\n")
+				break
+			opcode, flags, length = frame
+			payload = self.w_recvExactly(length) if opcode in [FRAME_RANGE, FRAME_COPY, FRAME_END] else b""
+			if (payload == None):
+				sys.stderr.write("Data connection closed before transfer completed\n")
+				break
+			if (opcode == FRAME_RANGE):
+				self.preallocate(out_fd, struct.unpack(RANGE_PAYLOAD_FORMAT, payload)[2])
+			elif (opcode == FRAME_COPY):
+				first, count = struct.unpack(COPY_PAYLOAD_FORMAT, payload)
+				os.lseek(in_fd, first * block_size, os.SEEK_SET)
+				remaining = count * block_size
+				while (remaining > 0):
+					chunk = os.read(in_fd, min(remaining, SEGMENT_CHUNK_SIZE))
+					if (not chunk):
+						break
+					self.w_writeAll(out_fd, chunk)
+					crc = zlib.crc32(chunk, crc)
+					remaining -= len(chunk)
+				copied += count * block_size - remaining
+			elif (opcode == FRAME_DATA):
+				crc = self.w_recvFramePayload(length, out_fd, None, crc)
+				received += length
+			elif (opcode == FRAME_END):
+				verified = (flags & FRAME_FLAG_CHECKSUM and
+					struct.unpack(CHECKSUM_FORMAT, payload)[0] == crc & 0xffffffff)
+				if (not verified):
+					sys.stderr.write("Checksum mismatch, keeping the old %s\n" % (file_name))
+				break
+			else:						# FRAME_ERROR, payload is the error message
+				self.w_reportFrameError(length)
+				break
+		os.close(in_fd)
+		os.close(out_fd)
+		if (verified):
+			os.rename(temp_name, file_name)
+			sys.stdout.write("Updated %s: %d bytes received, %d bytes reused\n" % (file_name, received, copied))
+		else:
+			os.remove(temp_name)
+
+    # Handle one page of a paged LIST: paths, or records printed with their type, size and mtime. If the END
+    # frame carries a cursor, the same listing is asked for again from there
+    def w_handleListPageResponse(self, list_command):
+		args = list_command.split(" ", 4)
+		frame = self.w_recvFrameHeader()
+		while (frame != None and frame[0] == FRAME_DATA):
+			page = self.w_recvExactly(frame[2])
+			if (page == None):
+				frame = None
+				break
+			if ("m" in args[1]):
+				self.printListRecords(page)
+			else:
+				sys.stdout.write(page.decode())
+			frame = self.w_recvFrameHeader()
+		if (frame == None):
+			sys.stderr.write("Data connection closed before listing completed\n")
+		elif (frame[0] == FRAME_ERROR):
+			self.w_reportFrameError(frame[2])
+		elif (frame[2] > 0):
+			cursor = self.w_recvExactly(frame[2])
+			if (frame[1] & FRAME_FLAG_CURSOR and cursor):
+				next_command = " ".join(args[:4] + [cursor.decode()])[:LIST_COMMAND_MAX]
+				if (next_command == list_command):		# a cut cursor that can't move past this page
+					sys.stderr.write("Listing stopped, the cursor is too long to resume from\n")
+				else:
+					self.sendCommands([next_command])
+
+    # Print the binary records of a long listing, one line per entry
+    def printListRecords(self, page):
+		offset = 0
+		lines = []
+		while (offset + LIST_RECORD_SIZE <= len(page)):
+			entry_type, path_len, size, mtime, mtime_ns = struct.unpack_from(LIST_RECORD_FORMAT, page, offset)
+			offset += LIST_RECORD_SIZE
+			path = page[offset:offset + path_len].decode()
+			offset += path_len
+			lines.append("%s %12d %s %s\n" % (LIST_TYPES[min(entry_type, 3)], size,
+				time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(mtime)), path))
+		sys.stdout.write("".join(lines))
+
+    # Handle response to a List, Stats or Checksum command, called from command dataWorkerThreadFn() when AWAIT_LIST flag is set
+    def w_handleListCommandResponse(self, command="-l"):
+		if (command == STATS_MESSAGE):
+			sys.stdout.write("Receiving statistics from server\n")
+		elif (command == CHECKSUM_MESSAGE):
+			sys.stdout.write("Receiving checksum from server\n")
+		else:
+			sys.stdout.write("Receiving directory structure from server\n")
+		if (self.protocol != PROTOCOL_LEGACY):
+			frame = self.w_recvFrameHeader()
+			while (frame != None and frame[0] == FRAME_DATA):
+				payload = self.w_recvExactly(frame[2])
+				if (payload == None):
+					frame = None
+					break
+				sys.stdout.write(payload.decode())
+				frame = self.w_recvFrameHeader()
+			if (frame == None):
+				sys.stderr.write("Data connection closed before response completed\n")
+			elif (frame[0] == FRAME_ERROR):
+				self.w_reportFrameError(frame[2])
+			self.AWAIT_LIST = False
+			return
+		if (self.w_recvUntilEndData(lambda payload: sys.stdout.write(payload.tobytes().decode()))):
+			sys.stdout.write("\n")
+		self.AWAIT_LIST = False
+
+    # Receive a legacy response into the preallocated buffer, handing each piece of payload to sink() as a
+    # memoryview. END_DATA can only lie in the newly received bytes or the few held back from the previous
+    # recv, so nothing else is ever searched or copied. ACKs END_DATA, returns False if the connection closed first
+    def w_recvUntilEndData(self, sink):
+		sentinel = END_DATA_MESSAGE.encode()
+		held = 0						# tail of the last recv that may start END_DATA
 		check_if_readable = [self.client_data_socket]
-		long_message = ""				# concatenate messages received in long_message buffer
-		while ((not END_DATA_RECEIVED) and (not self.SERVER_DISCONNECT)):
+		while (not self.SERVER_DISCONNECT):
 			readable, w, e = select.select(check_if_readable, [], [], 0.01)
-			if (self.client_data_socket in readable):
-				message = self.client_data_socket.recv(
-					IN_BUFFER_SIZE).decode()
-				long_message += message
-				if (long_message.find(END_DATA_MESSAGE) != -1):				# END_DATA signal sent from server
-					if ((not DUPLICATE_FILENAME) and (not self.BAD_FILENAME)):	# write to file
-						out_file.write(
-							long_message.split(END_DATA_MESSAGE)[0])
-					END_DATA_RECEIVED = True
-					self.client_data_socket.send(END_DATA_MESSAGE.encode())		# ACK the END_DATA signal
-					self.AWAIT_FILE = False
-				elif (len(long_message) >= IN_BUFFER_SIZE + len(message)):		# drain long_message 
-					if ((not DUPLICATE_FILENAME) and (not self.BAD_FILENAME)):	# write to file
-						out_file.write(long_message[:len(message)])
-						long_message = long_message[len(message):]
-		if (self.BAD_FILENAME and (not DUPLICATE_FILENAME)):
-			os.remove(out_file_name)		
-		out_file.close()
+			if (self.client_data_socket not in readable):
+				continue
+			received = self.client_data_socket.recv_into(self.recv_view[held:])
+			if (received == 0):
+				return False
+			end = held + received
+			found = self.recv_buffer.find(sentinel, 0, end)
+			if (found != -1):					# END_DATA signal sent from server
+				if (found > 0):
+					sink(self.recv_view[:found])
+				self.client_data_socket.send(sentinel)		# ACK the END_DATA signal
+				return True
+			held = min(end, len(sentinel) - 1)
+			if (end > held):
+				sink(self.recv_view[:end - held])
+			self.recv_buffer[:held] = self.recv_buffer[end - held:end]
+		return False
+
+    # Open a file for writing received data, preallocated when its size is known. Returns the descriptor
+    def w_openOutputFile(self, file_name, file_size=0):
+		out_fd = os.open(file_name, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+		self.preallocate(out_fd, file_size)
+		return out_fd
 
-    # Handle response to a List command, called from command dataWorkerThreadFn() when AWAIT_LIST flag is set
-    def w_handleListCommandResponse(self):
-		sys.stdout.write("Receiving directory structure from server\n")
-		END_DATA_RECEIVED = False
-		long_message = ""							# concatenate messages in long_message buffer
-		while ((not END_DATA_RECEIVED) and (not self.SERVER_DISCONNECT)):
-			message = self.client_data_socket.recv(IN_BUFFER_SIZE).decode()
-			long_message += message
-			if (long_message.find(END_DATA_MESSAGE) != -1):				# END_DATA signal received
-				sys.stdout.write("%s\n" %
-						 (long_message.split(END_DATA_MESSAGE)[0]))	# print results
-				END_DATA_RECEIVED = True
-				self.client_data_socket.send(END_DATA_MESSAGE.encode())		# ACK the END_DATA signal
-				self.AWAIT_LIST = False
-			elif (len(long_message) >= IN_BUFFER_SIZE + len(message)):		# drain long_message buffer
-				sys.stdout.write("%s\n" % (long_message[0:len(message)]))	#   (unlikely to ever occur)
-				long_message = long_message[len(message):]
+    # Reserve file_size bytes for fd so large downloads are laid out without fragmenting or running out of space midway
+    def preallocate(self, fd, file_size):
+		if (file_size <= 0):
+			return
+		if (hasattr(os, "posix_fallocate")):
+			try:
+				os.posix_fallocate(fd, 0, file_size)
+			except OSError:
+				pass
+		elif (LIBC != None):
+			LIBC.posix_fallocate(fd, ctypes.c_longlong(0), ctypes.c_longlong(file_size))
+
+    # Write all of data (a string or memoryview) to a raw file descriptor
+    def w_writeAll(self, fd, data):
+		written = 0
+		while (written < len(data)):
+			written += os.write(fd, data[written:])
     
+    # Receive exactly length bytes from the data connection, returns None if it closes first
+    def w_recvExactly(self, length):
+		chunks = []
+		while (length > 0):
+			chunk = self.client_data_socket.recv(min(length, IN_BUFFER_SIZE))
+			if (not chunk):
+				return None
+			chunks.append(chunk)
+			length -= len(chunk)
+		return b"".join(chunks)
+
+    # Receive a frame header, returns (opcode, flags, payload length) or None if the connection closed
+    def w_recvFrameHeader(self):
+		header = self.w_recvExactly(FRAME_HEADER_SIZE)
+		if (header == None):
+			return None
+		version, opcode, flags, reserved, length = struct.unpack(FRAME_HEADER_FORMAT, header)
+		return (opcode, flags, length)
+
+    # Copy a frame payload of known length to out_fd (or discard it if out_fd is None), inflating it if given a
+    # decompressor. The payload passes through the preallocated buffer, never a per-recv string. Returns crc
+    # extended by the CRC-32 of the bytes written
+    def w_recvFramePayload(self, length, out_fd, decompressor=None, crc=0):
+		while (length > 0):
+			received = self.client_data_socket.recv_into(self.recv_view[:min(length, RECV_BUFFER_SIZE)])
+			if (received == 0):
+				break
+			if (out_fd != None):
+				chunk = self.recv_view[:received]
+				if (decompressor != None):
+					chunk = decompressor.decompress(chunk.tobytes())
+					crc = zlib.crc32(chunk, crc)
+				else:
+					crc = zlib.crc32(buffer(self.recv_buffer, 0, received), crc)	# zlib reads the buffer in place
+				self.w_writeAll(out_fd, chunk)
+			length -= received
+		return crc
+
+    # Consume an ERROR frame payload and tell the user what went wrong
+    def w_reportFrameError(self, length):
+		message = self.w_recvExactly(length)
+		if (message == ERROR_SERVER_BUSY):
+			sys.stdout.write("Server is busy, command rejected\n")
+		elif (message == ERROR_INVALID_COMMAND):
+			sys.stdout.write("Server rejected invalid command\n")
+		else:
+			sys.stdout.write("Server failed to locate file\n")
+
+    # Download one file over self.segments parallel streams. Each segment is a ranged GET on its own
+    # control session and data port, written straight to its offset in the preallocated output file.
+    # Progress is kept in FILE.part, so an interrupted download resumes where each segment stopped
+    def segmentedGet(self, file_name):
+		state_name = file_name + SEGMENT_STATE_SUFFIX
+		file_size = self.s_requestRange(self.client_data_port, file_name, 0, 0, None, None)
+		if (file_size == None):
+			return
+		plan = self.s_loadSegmentState(state_name, file_size)
+		if (plan == None):
+			if (file_name in os.listdir(".")):
+				sys.stderr.write("Client error, duplicate filename %s\n" % (file_name))
+				return
+			segment_length = max(1, -(-file_size // self.segments))
+			plan = [[offset, min(segment_length, file_size - offset), 0]
+				for offset in range(0, file_size, segment_length)]
+			out_fd = self.w_openOutputFile(file_name, file_size)	# preallocate, segments fill their own ranges
+			os.ftruncate(out_fd, file_size)
+			os.close(out_fd)
+			self.s_saveSegmentState(state_name, file_size, plan)
+		else:
+			sys.stdout.write("Resuming %s\n" % (file_name))
+
+		sys.stdout.write("Receiving %s from server over %d streams\n" % (file_name, len(plan)))
+		threads = []
+		for index in range(len(plan)):
+			if (plan[index][2] >= plan[index][1]):
+				continue
+			thread = threading.Thread(target=self.s_fetchSegment,
+				args=(self.client_data_port + index, file_name, state_name, file_size, plan, index))
+			thread.start()
+			threads.append(thread)
+		try:
+			while (any(thread.is_alive() for thread in threads)):
+				time.sleep(0.05)
+		except KeyboardInterrupt:
+			self.KILL_RECEIVED = True			# segments stop after their current chunk
+			for thread in threads:
+				thread.join()
+
+		self.s_saveSegmentState(state_name, file_size, plan)
+		if (all(segment[2] >= segment[1] for segment in plan)):
+			os.remove(state_name)
+			sys.stdout.write("Received %s (%d bytes)\n" % (file_name, file_size))
+		else:
+			sys.stderr.write("Download of %s incomplete, run the same command again to resume\n" % (file_name))
+
+    # Fetch the remainder of one segment, recording progress in plan[index][2]. A remainder whose checksum
+    # doesn't match is fetched again from where it started on the next run
+    def s_fetchSegment(self, data_port, file_name, state_name, file_size, plan, index):
+		offset, length, done = plan[index]
+		out_file = open(file_name, "r+b")
+		out_file.seek(offset + done)
+		unsaved = [0]
+		def recordProgress(written):
+			out_file.flush()
+			with self.segment_lock:
+				plan[index][2] += written
+				unsaved[0] += written
+				if (unsaved[0] >= SEGMENT_STATE_INTERVAL):
+					unsaved[0] = 0
+					self.s_saveSegmentState(state_name, file_size, plan)
+		result = self.s_requestRange(data_port, file_name, offset + done, length - done, out_file, recordProgress)
+		out_file.close()
+		if (result == False):
+			with self.segment_lock:
+				plan[index][2] = done
+
+    # Run one ranged GET on a fresh session. Payload bytes are written to out_file at its current position,
+    # calling progress(bytes) after each write. Returns the server's file size, None on error, or False if
+    # the bytes written don't match the server's checksum
+    def s_requestRange(self, data_port, file_name, offset, length, out_file, progress):
+		welcome_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		welcome_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		welcome_socket.bind(('', data_port))
+		welcome_socket.listen(1)
+		cmd_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		data_socket = None
+		try:
+			cmd_socket.connect((self.server_address, self.server_port))
+			cmd_socket.send(str(self.client_data_address).encode())
+			cmd_socket.recv(10)
+			cmd_socket.send(("%d %s%d %s" % (data_port, PROTOCOL_CAPABILITY, PROTOCOL_FRAMED, CAPABILITY_CHECKSUM)).encode())
+			if (not cmd_socket.recv(IN_BUFFER_SIZE).decode().startswith(ACK_PORT + " " + PROTOCOL_CAPABILITY)):
+				sys.stderr.write("Server does not support ranged GET\n")
+				return None
+			cmd_socket.send(("%s %d %d %s" % (RANGE_MESSAGE, offset, length, file_name)).encode())
+			welcome_socket.settimeout(60)
+			data_socket, addr = welcome_socket.accept()
+			data_socket.settimeout(60)
+			data_socket.send("Data connection established!".encode())
+
+			frame = self.s_recvFrameHeader(data_socket)
+			if (frame == None or frame[0] != FRAME_RANGE):
+				if (frame != None and frame[0] == FRAME_ERROR):
+					sys.stdout.write("Server failed to locate file\n")
+				return None
+			range_offset, range_length, file_size = struct.unpack(RANGE_PAYLOAD_FORMAT,
+				self.s_recvExactly(data_socket, RANGE_PAYLOAD_SIZE))
+			frame = self.s_recvFrameHeader(data_socket)
+			remaining = frame[2] if (frame != None and frame[0] == FRAME_DATA) else 0
+			chunk_buffer = bytearray(SEGMENT_CHUNK_SIZE)		# one buffer per segment, filled in place
+			chunk = memoryview(chunk_buffer)
+			crc = 0
+			while (remaining > 0 and not self.KILL_RECEIVED):
+				received = data_socket.recv_into(chunk[:min(remaining, SEGMENT_CHUNK_SIZE)])
+				if (received == 0):
+					return None
+				out_file.write(chunk[:received])
+				crc = zlib.crc32(buffer(chunk_buffer, 0, received), crc)
+				progress(received)
+				remaining -= received
+			if (remaining > 0):
+				return None
+			frame = self.s_recvFrameHeader(data_socket) if out_file != None else None
+			if (frame != None and frame[0] == FRAME_END and frame[1] & FRAME_FLAG_CHECKSUM and
+					struct.unpack(CHECKSUM_FORMAT, self.s_recvExactly(data_socket, frame[2]))[0] != crc & 0xffffffff):
+				sys.stderr.write("Checksum mismatch in %s at offset %d, run the same command again to refetch\n"
+					% (file_name, range_offset))
+				return False
+			return file_size
+		except (socket.error, socket.timeout, struct.error, TypeError):
+			sys.stderr.write("Ranged GET of %s failed\n" % (file_name))
+			return None
+		finally:
+			if (data_socket != None):
+				data_socket.close()
+			cmd_socket.close()
+			welcome_socket.close()
+
+    # Receive exactly length bytes from sock, returns None if it closes first
+    def s_recvExactly(self, sock, length):
+		chunks = []
+		while (length > 0):
+			chunk = sock.recv(min(length, IN_BUFFER_SIZE))
+			if (not chunk):
+				return None
+			chunks.append(chunk)
+			length -= len(chunk)
+		return b"".join(chunks)
+
+    # Receive a frame header from sock, returns (opcode, flags, payload length) or None
+    def s_recvFrameHeader(self, sock):
+		header = self.s_recvExactly(sock, FRAME_HEADER_SIZE)
+		if (header == None):
+			return None
+		version, opcode, flags, reserved, length = struct.unpack(FRAME_HEADER_FORMAT, header)
+		return (opcode, flags, length)
+
+    # Load the segment plan of an interrupted download, or None if there is nothing to resume
+    def s_loadSegmentState(self, state_name, file_size):
+		file_name = state_name[:-len(SEGMENT_STATE_SUFFIX)]
+		try:
+			state_file = open(state_name, "r")
+			lines = state_file.read().split("\n")
+			state_file.close()
+		except IOError:
+			return None
+		try:
+			if (int(lines[0]) == file_size and file_name in os.listdir(".")):
+				return [[int(field) for field in line.split()] for line in lines[1:] if line.strip()]
+		except ValueError:
+			pass
+		sys.stderr.write("Can't resume %s, restarting download\n" % (file_name))
+		os.remove(state_name)
+		if (file_name in os.listdir(".")):
+			os.remove(file_name)
+		return None
+
+    # Atomically record the segment plan: file size, then "offset length done" per segment
+    def s_saveSegmentState(self, state_name, file_size, plan):
+		state_file = open(state_name + ".tmp", "w")
+		state_file.write("%d\n" % (file_size))
+		for offset, length, done in plan:
+			state_file.write("%d %d %d\n" % (offset, length, done))
+		state_file.close()
+		os.rename(state_name + ".tmp", state_name)
+
     # Gracefully tear down the client, disconnecting from server and joining data worker thread
     def clientTearDown(self):
 		# print("Client tear down")
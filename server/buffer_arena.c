@@ -0,0 +1,253 @@
+/********************************************************************************************
+ * Title: Buffer arena implementation
+ * Description: Lock-free I/O buffer arena. Buffer descriptors live in one array sized from
+ * 		the memory budget; their memory is only allocated on first use. Released
+ * 		buffers go to the releasing thread's cache first and otherwise onto a Treiber
+ * 		stack whose head carries an ABA tag next to the buffer index, so pushes and
+ * 		pops are a single 64-bit compare-and-swap. There is one stack per NUMA node.
+ * 		Buffer memory is freshly mapped, so the kernel places its pages on the node
+ * 		of the thread that first touches them, the one that acquired it, and the
+ * 		buffer goes back to that node's stack. A thread takes buffers from its own
+ * 		node, then new memory, and only then another node's, so threads pinned to a
+ * 		core (sharded event loops) keep to local memory. Thread caches are arrays of
+ * 		atomic pointers in the arena rather than thread-locals, so when all of that
+ * 		fails the buffers idle in other threads' caches can still be taken: a small
+ * 		arena is never busy while a thread that has gone quiet sits on its buffers.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "download_server.h"
+#include "buffer_arena.h"
+
+static struct buffer_arena arena;
+
+static __thread struct arena_thread_cache* thread_cache;
+static __thread int thread_cache_claimed;
+static __thread int thread_node = -1;
+
+/************************************** Arena setup and teardown ****************************************/
+
+/* size the arena for a memory budget in bytes; no buffer memory is allocated yet */
+void initBufferArena(size_t budget)
+{
+    arena.capacity = budget / ARENA_BUFFER_SIZE;
+    if (arena.capacity == 0) arena.capacity = 1;
+
+    arena.slots = calloc(arena.capacity, sizeof(struct io_buffer));
+    if (arena.slots == NULL) {
+        fprintf(stderr, "Failed to allocate buffer arena\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < arena.capacity; i++)
+        arena.slots[i].index = i;
+
+    arena.caches = aligned_alloc(ARENA_ALIGNMENT, ARENA_MAX_CACHES * sizeof(struct arena_thread_cache));
+    if (arena.caches == NULL) {
+        fprintf(stderr, "Failed to allocate buffer arena\n");
+        exit(1);
+    }
+    for (int i = 0; i < ARENA_MAX_CACHES; i++)
+        for (int k = 0; k < ARENA_THREAD_CACHE; k++)
+            atomic_store(&arena.caches[i].buffers[k], NULL);
+    atomic_store(&arena.caches_claimed, 0);
+
+    for (int node = 0; node < ARENA_MAX_NODES; node++)
+        atomic_store(&arena.free_lists[node].head, 0);
+    atomic_store(&arena.slots_allocated, 0);
+    atomic_store(&arena.in_use, 0);
+}
+
+/* free every buffer, only called once all threads are done with the arena */
+void destroyBufferArena()
+{
+    uint32_t allocated = atomic_load(&arena.slots_allocated);
+    for (uint32_t i = 0; i < allocated && i < arena.capacity; i++)
+        if (arena.slots[i].data != NULL) munmap(arena.slots[i].data, ARENA_BUFFER_SIZE);
+    free(arena.slots);
+    free(arena.caches);
+    arena.slots = NULL;
+    arena.caches = NULL;
+}
+
+/************************************** Buffer allocation ************************************************/
+
+/* the calling thread's NUMA node, as of its first buffer. Pinned threads never move off it */
+static uint32_t threadNode()
+{
+    if (thread_node == -1) {
+        unsigned int cpu, node;
+        thread_node = getcpu(&cpu, &node) == 0 ? (int) (node % ARENA_MAX_NODES) : 0;
+    }
+    return (uint32_t) thread_node;
+}
+
+/* the calling thread's cache, claimed on first use. NULL once every cache has been claimed */
+static struct arena_thread_cache* threadCache()
+{
+    if (!thread_cache_claimed) {
+        thread_cache_claimed = 1;
+        uint32_t index = atomic_fetch_add(&arena.caches_claimed, 1);
+        if (index < ARENA_MAX_CACHES) thread_cache = &arena.caches[index];
+    }
+    return thread_cache;
+}
+
+/* take any buffer out of a cache, NULL if it's empty */
+static struct io_buffer* takeCachedBuffer(struct arena_thread_cache* cache)
+{
+    for (int k = 0; k < ARENA_THREAD_CACHE; k++) {
+        if (atomic_load_explicit(&cache->buffers[k], memory_order_relaxed) == NULL) continue;
+        struct io_buffer* buf = atomic_exchange(&cache->buffers[k], NULL);
+        if (buf != NULL) return buf;
+    }
+    return NULL;
+}
+
+/* steal a buffer idling in another thread's cache, NULL if every cache is empty */
+static struct io_buffer* stealCachedBuffer(struct arena_thread_cache* own)
+{
+    uint32_t claimed = atomic_load(&arena.caches_claimed);
+    if (claimed > ARENA_MAX_CACHES) claimed = ARENA_MAX_CACHES;
+    for (uint32_t i = 0; i < claimed; i++) {
+        if (&arena.caches[i] == own) continue;
+        struct io_buffer* buf = takeCachedBuffer(&arena.caches[i]);
+        if (buf != NULL) return buf;
+    }
+    return NULL;
+}
+
+/* pop a buffer off a node's free list, NULL if it's empty */
+static struct io_buffer* popFreeBuffer(uint32_t node)
+{
+    _Atomic uint64_t* free_head = &arena.free_lists[node].head;
+    uint64_t head = atomic_load(free_head);
+    while ((uint32_t) head != 0) {
+        struct io_buffer* buf = &arena.slots[(uint32_t) head - 1];
+        uint64_t next = (((head >> 32) + 1) << 32) | atomic_load(&buf->next_free);
+        if (atomic_compare_exchange_weak(free_head, &head, next))
+            return buf;
+    }
+    return NULL;
+}
+
+/* push a buffer onto its node's free list */
+static void pushFreeBuffer(struct io_buffer* buf)
+{
+    _Atomic uint64_t* free_head = &arena.free_lists[buf->node].head;
+    uint64_t head = atomic_load(free_head);
+    uint64_t next;
+    do {
+        atomic_store(&buf->next_free, (uint32_t) head);
+        next = (((head >> 32) + 1) << 32) | (buf->index + 1);
+    } while (!atomic_compare_exchange_weak(free_head, &head, next));
+}
+
+/* pop a free buffer from any node but this one, NULL if every list is empty */
+static struct io_buffer* popRemoteBuffer(uint32_t node)
+{
+    for (uint32_t i = 1; i < ARENA_MAX_NODES; i++) {
+        struct io_buffer* buf = popFreeBuffer((node + i) % ARENA_MAX_NODES);
+        if (buf != NULL) return buf;
+    }
+    return NULL;
+}
+
+/* map fresh memory for a buffer, to be placed on the calling thread's node when it touches it.
+ * Returns -1 if out of memory */
+static int mapBuffer(struct io_buffer* buf)
+{
+    void* data = mmap(NULL, ARENA_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return -1;
+    buf->data = data;
+    buf->size = ARENA_BUFFER_SIZE;
+    buf->node = threadNode();
+    return 0;
+}
+
+/* allocate memory for a slot that has never been used, NULL once the budget is spent */
+static struct io_buffer* allocateNewBuffer()
+{
+    uint32_t slot = atomic_load(&arena.slots_allocated);
+    do {
+        if (slot >= arena.capacity) return NULL;
+    } while (!atomic_compare_exchange_weak(&arena.slots_allocated, &slot, slot + 1));
+
+    struct io_buffer* buf = &arena.slots[slot];
+    if (mapBuffer(buf) == -1) {
+        /* hand the slot back through the free list, the next user retries the allocation */
+        buf->data = NULL;
+        buf->node = threadNode();
+        pushFreeBuffer(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* get a buffer for one command's I/O, local to the calling thread's node if one is free. Returns
+ * NULL when the memory budget is exhausted and no thread has a buffer cached */
+struct io_buffer* acquireBuffer()
+{
+    struct io_buffer* buf;
+    uint32_t node = threadNode();
+    struct arena_thread_cache* cache = threadCache();
+
+    if ((buf = cache != NULL ? takeCachedBuffer(cache) : NULL) != NULL) {
+        atomic_fetch_add(&arena.in_use, 1);
+        return buf;
+    }
+    if ((buf = popFreeBuffer(node)) != NULL || (buf = allocateNewBuffer()) != NULL ||
+        (buf = popRemoteBuffer(node)) != NULL || (buf = stealCachedBuffer(cache)) != NULL) {
+        if (buf->data == NULL && mapBuffer(buf) == -1) {
+            pushFreeBuffer(buf);
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+    atomic_fetch_add(&arena.in_use, 1);
+    return buf;
+}
+
+/* return a buffer, keeping it in this thread's cache if it is local and there's room */
+void releaseBuffer(struct io_buffer* buf)
+{
+    if (buf == NULL) return;
+    atomic_fetch_sub(&arena.in_use, 1);
+    struct arena_thread_cache* cache = threadCache();
+    if (cache != NULL && buf->node == threadNode()) {
+        for (int k = 0; k < ARENA_THREAD_CACHE; k++) {
+            struct io_buffer* empty = NULL;
+            if (atomic_compare_exchange_strong(&cache->buffers[k], &empty, buf)) return;
+        }
+    }
+    pushFreeBuffer(buf);
+}
+
+/* give this thread's cached buffers back to the arena, called before a thread exits */
+void flushThreadBufferCache()
+{
+    struct io_buffer* buf;
+    if (thread_cache == NULL) return;
+    while ((buf = takeCachedBuffer(thread_cache)) != NULL)
+        pushFreeBuffer(buf);
+}
+
+/******************************************** Occupancy **************************************************/
+
+uint32_t buffersInUse()
+{
+    return atomic_load(&arena.in_use);
+}
+
+uint32_t buffersAllocated()
+{
+    return atomic_load(&arena.slots_allocated);
+}
+
+uint32_t bufferCapacity()
+{
+    return arena.capacity;
+}
@@ -0,0 +1,69 @@
+/***************************************************************************************
+ * Title: Buffer Arena Specification
+ * Description: Specification for the server's I/O buffer arena. Large, cache-line
+ * 		aligned buffers are allocated lazily up to a memory budget and recycled
+ * 		through a small per-thread cache backed by a lock-free free list, so the
+ * 		number of concurrent commands is bounded by memory rather than a fixed
+ * 		pool size. Once the budget is spent, a thread that finds no free buffer
+ * 		steals one from another thread's cache before giving up. Buffers are
+ * 		handed out uncleared. Free buffers are kept per NUMA node, and a thread
+ * 		takes buffers from its own node before any other.
+ * ************************************************************************************/
+
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_BUFFER_SIZE       (256 * 1024)
+#define ARENA_DEFAULT_BUDGET_MB 64
+#define ARENA_ALIGNMENT         64          // cache line
+#define ARENA_THREAD_CACHE      4           // buffers kept by each thread before returning to the arena
+#define ARENA_MAX_NODES         8           // NUMA nodes with free lists of their own, others share them
+#define ARENA_MAX_CACHES        256         // threads with a buffer cache, later threads go without
+
+struct io_buffer {
+    unsigned char* data;                    // ARENA_BUFFER_SIZE bytes, ARENA_ALIGNMENT aligned
+    size_t size;
+    uint32_t index;
+    uint32_t node;                          // free list it returns to: its memory's NUMA node
+    _Atomic uint32_t next_free;             // index + 1 of the next free buffer, 0 ends the list
+};
+
+/* One NUMA node's free buffers, on a cache line of its own */
+struct arena_free_list {
+    _Atomic uint64_t head;                  // (ABA tag << 32) | (index + 1)
+} __attribute__((aligned(ARENA_ALIGNMENT)));
+
+/* One thread's cached buffers. Only its thread adds to it, but any thread may take from it */
+struct arena_thread_cache {
+    struct io_buffer* _Atomic buffers[ARENA_THREAD_CACHE];     // NULL where empty
+} __attribute__((aligned(ARENA_ALIGNMENT)));
+
+struct buffer_arena {
+    struct io_buffer* slots;
+    uint32_t capacity;                      // budget / ARENA_BUFFER_SIZE
+    struct arena_free_list free_lists[ARENA_MAX_NODES];
+    struct arena_thread_cache* caches;      // ARENA_MAX_CACHES
+    _Atomic uint32_t caches_claimed;
+    _Atomic uint32_t slots_allocated;       // slots whose memory has been allocated
+    _Atomic uint32_t in_use;
+};
+
+/* Arena setup and teardown */
+void initBufferArena(size_t);
+void destroyBufferArena();
+
+/* Buffer allocation, safe to call from any thread */
+struct io_buffer* acquireBuffer();
+void releaseBuffer(struct io_buffer*);
+void flushThreadBufferCache();
+
+/* Occupancy */
+uint32_t buffersInUse();
+uint32_t buffersAllocated();
+uint32_t bufferCapacity();
+
+#endif
@@ -0,0 +1,251 @@
+/********************************************************************************************
+ * Title: Checksum implementation
+ * Description: CRC-32 with runtime CPU dispatch and the whole-file checksum cache. On x86-64
+ * 		CPUs with PCLMULQDQ, 64 byte blocks are folded four lanes at a time with
+ * 		carry-less multiplies and Barrett reduced to 32 bits (Gopal et al., "Fast CRC
+ * 		Computation for Generic Polynomials Using PCLMULQDQ", Intel 2009); the tail
+ * 		and other CPUs go through zlib's crc32_z(). The cache is a fixed table of
+ * 		slots guarded by a mutex, touched once per GET.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "download_server.h"
+#include "checksum.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+struct checksum_entry {
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    uint32_t crc;
+    int valid;
+};
+
+static struct {
+    int use_clmul;
+    pthread_mutex_t lock;
+    struct checksum_entry slots[CHECKSUM_CACHE_SLOTS];
+} checksums = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/********************************************** CRC-32 **************************************************/
+
+#if defined(__x86_64__)
+/* fold len bytes (a multiple of 16, at least 64) into crc, which is the inverted running value */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Clmul(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    /* bit-reflected fold constants and the CRC-32 / Barrett polynomials from the paper */
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* four independent lanes of 16 bytes keep the multiplier busy */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) (buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*) (buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*) (buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*) (buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the lanes into one */
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+#endif
+
+/* pick the CRC-32 implementation for this CPU */
+void initChecksums()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    checksums.use_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+    printf("Checksums: CRC-32 with %s\n", checksums.use_clmul ? "PCLMULQDQ" : "zlib");
+}
+
+/* CRC-32 of a buffer, continuing from crc (0 to start) as zlib's crc32() does */
+uint32_t updateCrc32(uint32_t crc, const unsigned char* buf, size_t len)
+{
+#if defined(__x86_64__)
+    if (checksums.use_clmul && len >= CHECKSUM_SIMD_MIN) {
+        size_t folded = len & ~(size_t) 15;
+        crc = ~crc32Clmul(~crc, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+#endif
+    return (uint32_t) crc32_z(crc, buf, len);
+}
+
+/****************************************** Checksum cache ************************************************/
+
+static struct checksum_entry* slotOf(dev_t dev, ino_t inode)
+{
+    return &checksums.slots[(size_t) ((inode * 0x9E3779B97F4A7C15ULL) ^ dev) % CHECKSUM_CACHE_SLOTS];
+}
+
+/* look up the checksum of a file version. Returns 1 and sets *crc on a hit, 0 otherwise */
+int lookupChecksum(dev_t dev, ino_t inode, struct timespec mtime, off_t size, uint32_t* crc)
+{
+    struct checksum_entry* slot = slotOf(dev, inode);
+    int hit;
+
+    pthread_mutex_lock(&checksums.lock);
+    hit = slot->valid && slot->dev == dev && slot->inode == inode && slot->size == size &&
+          slot->mtime.tv_sec == mtime.tv_sec && slot->mtime.tv_nsec == mtime.tv_nsec;
+    if (hit) *crc = slot->crc;
+    pthread_mutex_unlock(&checksums.lock);
+    return hit;
+}
+
+/* remember the checksum of a file version, replacing whatever shared its slot */
+void storeChecksum(dev_t dev, ino_t inode, struct timespec mtime, off_t size, uint32_t crc)
+{
+    struct checksum_entry* slot = slotOf(dev, inode);
+
+    pthread_mutex_lock(&checksums.lock);
+    *slot = (struct checksum_entry) { dev, inode, mtime, size, crc, 1 };
+    pthread_mutex_unlock(&checksums.lock);
+}
+
+/************************************* Checksums of streaming files ***************************************/
+
+/* start summing bytes [start, end) of an open file of the given identity. The stream keeps a
+ * descriptor of its own, so the caller's may be closed afterwards. Returns NULL if out of memory
+ * or descriptors */
+struct checksum_stream* openChecksumStream(int file_fd, off_t start, off_t end, dev_t dev, ino_t inode,
+                                           struct timespec mtime, off_t size)
+{
+    struct checksum_stream* sum = calloc(1, sizeof(struct checksum_stream));
+    if (sum == NULL) return NULL;
+
+    sum->file_fd = -1;
+    if (start < end) {
+        if ((sum->buffer = malloc(CHECKSUM_READ_SIZE)) == NULL ||
+                (sum->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+            free(sum->buffer);
+            free(sum);
+            return NULL;
+        }
+    }
+    sum->done = start;
+    sum->end = end;
+    sum->whole_file = start == 0 && end == size;
+    sum->dev = dev;
+    sum->inode = inode;
+    sum->mtime = mtime;
+    sum->size = size;
+    return sum;
+}
+
+/* sum the file up to offset, which the transfer has already sent. If the file has shrunk below
+ * it, the range ends where the file now does */
+void advanceChecksum(struct checksum_stream* sum, off_t offset)
+{
+    if (offset > sum->end) offset = sum->end;
+    while (sum->done < offset) {
+        size_t want = offset - sum->done < CHECKSUM_READ_SIZE ? (size_t) (offset - sum->done) : CHECKSUM_READ_SIZE;
+        ssize_t n = pread(sum->file_fd, sum->buffer, want, sum->done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            sum->end = sum->done;
+            break;
+        }
+        sum->crc = updateCrc32(sum->crc, sum->buffer, (size_t) n);
+        sum->done += n;
+    }
+}
+
+/* sum the next bytes of the range from the buffer they were sent from, so a file the transfer
+ * reads itself (with O_DIRECT) isn't read again through the mapping */
+void sumSentBytes(struct checksum_stream* sum, const unsigned char* bytes, size_t len)
+{
+    if (sum->done >= sum->end) return;
+    if (len > (size_t) (sum->end - sum->done)) len = (size_t) (sum->end - sum->done);
+    sum->crc = updateCrc32(sum->crc, bytes, len);
+    sum->done += (off_t) len;
+}
+
+/* sum whatever is left and return the result, caching it if it covers the whole file. A file
+ * that shrank while streaming was not sent whole, so its sum is not cached */
+uint32_t finishChecksum(struct checksum_stream* sum)
+{
+    advanceChecksum(sum, sum->end);
+    if (sum->whole_file && sum->done == sum->size)
+        storeChecksum(sum->dev, sum->inode, sum->mtime, sum->size, sum->crc);
+    return sum->crc;
+}
+
+/* close and free a checksum stream, if any */
+void releaseChecksumStream(struct checksum_stream* sum)
+{
+    if (sum == NULL) return;
+    if (sum->file_fd != -1) close(sum->file_fd);
+    free(sum->buffer);
+    free(sum);
+}
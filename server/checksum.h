@@ -0,0 +1,60 @@
+/***************************************************************************************
+ * Title: Checksum Specification
+ * Description: Specification for per-file content checksums. Sessions that accepted
+ * 		+checksum get the CRC-32 of every GET and ranged GET in the END frame. The
+ * 		file is read back with pread() as it goes out, so the pages summed are the
+ * 		ones sendfile() just pulled into the page cache. It is never mapped: a file
+ * 		another writer shrinks only ends the sum early, where touching a mapping
+ * 		past its new end would raise SIGBUS. A one-shot file read with O_DIRECT is
+ * 		summed from the buffers it is sent from instead. Whole-file results are remembered per device,
+ * 		inode, mtime and size, so later GETs and the checksum command (-c) don't
+ * 		read the file again.
+ * 		CRC-32 uses zlib's polynomial, so clients can check it with zlib; it is
+ * 		folded with carry-less multiplies (PCLMULQDQ) when the CPU has them.
+ * ************************************************************************************/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define CHECKSUM_LENGTH         4       // CRC-32, network byte order
+#define CHECKSUM_CACHE_SLOTS    4096    // direct mapped by inode, a newer version replaces the old
+#define CHECKSUM_SIMD_MIN       64      // shorter runs aren't worth folding
+#define CHECKSUM_READ_SIZE      (64 * 1024)     // bytes read back per pread()
+
+/* CRC-32 of a file range, summed as the range streams out */
+struct checksum_stream {
+    int file_fd;                // the stream's own descriptor, -1 once the range is summed
+    unsigned char* buffer;      // CHECKSUM_READ_SIZE bytes the file is read back into
+    off_t done;                 // summed up to here
+    off_t end;
+    uint32_t crc;
+    int whole_file;             // the range is the whole file, so the result is cached
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+};
+
+/* Setup, picks the CRC implementation for this CPU */
+void initChecksums();
+
+/* CRC-32 of a buffer, continuing from crc (0 to start) as zlib's crc32() does */
+uint32_t updateCrc32(uint32_t, const unsigned char*, size_t);
+
+/* Cached whole-file checksums, safe to call from any thread */
+int lookupChecksum(dev_t, ino_t, struct timespec, off_t, uint32_t*);
+void storeChecksum(dev_t, ino_t, struct timespec, off_t, uint32_t);
+
+/* Checksums of streaming files */
+struct checksum_stream* openChecksumStream(int, off_t, off_t, dev_t, ino_t, struct timespec, off_t);
+void advanceChecksum(struct checksum_stream*, off_t);
+void sumSentBytes(struct checksum_stream*, const unsigned char*, size_t);
+uint32_t finishChecksum(struct checksum_stream*);
+void releaseChecksumStream(struct checksum_stream*);
+
+#endif
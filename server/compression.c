@@ -0,0 +1,363 @@
+/********************************************************************************************
+ * Title: Compression implementation
+ * Description: zlib compression for GET responses and the compressed-copy cache. The cache
+ * 		lives in a private temporary directory; each copy is written under a
+ * 		temporary name while it streams and renamed into place once complete, so
+ * 		readers only ever open finished copies. Entries are hashed by inode and
+ * 		evicted least recently used first once the byte budget is exceeded. A mutex
+ * 		guards the entry table only, never a compression or a send.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "download_server.h"
+#include "compression.h"
+#include "checksum.h"
+
+struct compressed_entry {
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    int incompressible;         // negative entry, send the file raw
+    off_t compressed_size;
+    uint64_t last_used;
+    struct compressed_entry* next;
+};
+
+static struct {
+    int enabled;
+    pthread_mutex_t lock;
+    char dir[64];
+    struct compressed_entry* buckets[COMPRESS_CACHE_BUCKETS];
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint64_t clock;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/****************************************** Cache entries ************************************************/
+
+static size_t bucketOf(dev_t dev, ino_t inode)
+{
+    return (size_t) ((inode * 0x9E3779B97F4A7C15ULL) ^ dev) % COMPRESS_CACHE_BUCKETS;
+}
+
+/* path of the cached copy for a key */
+static void cachePath(char* path, size_t len, dev_t dev, ino_t inode, struct timespec mtime, off_t size)
+{
+    snprintf(path, len, "%s/%lx-%lx-%lx.%lx-%lx.z", cache.dir, (unsigned long) dev, (unsigned long) inode,
+             (unsigned long) mtime.tv_sec, (unsigned long) mtime.tv_nsec, (unsigned long) size);
+}
+
+/* find the entry for a file, NULL if none. Call with the lock held */
+static struct compressed_entry* findEntry(const struct stat* st)
+{
+    struct compressed_entry* entry = cache.buckets[bucketOf(st->st_dev, st->st_ino)];
+    for (; entry != NULL; entry = entry->next)
+        if (entry->dev == st->st_dev && entry->inode == st->st_ino && entry->size == st->st_size &&
+                entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec)
+            return entry;
+    return NULL;
+}
+
+/* unlink an entry from its bucket and delete its copy. Call with the lock held */
+static void removeEntry(struct compressed_entry* victim)
+{
+    struct compressed_entry** link = &cache.buckets[bucketOf(victim->dev, victim->inode)];
+    while (*link != victim)
+        link = &(*link)->next;
+    *link = victim->next;
+
+    if (!victim->incompressible) {
+        char path[128];
+        cachePath(path, sizeof(path), victim->dev, victim->inode, victim->mtime, victim->size);
+        unlink(path);
+        cache.bytes -= victim->compressed_size;
+    }
+    cache.entries--;
+    free(victim);
+}
+
+/* evict least recently used entries until the cache fits its budget. Call with the lock held */
+static void evictEntries(struct compressed_entry* keep)
+{
+    while (cache.bytes > cache.budget || cache.entries > COMPRESS_CACHE_MAX_ENTRIES) {
+        struct compressed_entry* oldest = NULL;
+        for (size_t i = 0; i < COMPRESS_CACHE_BUCKETS; i++)
+            for (struct compressed_entry* entry = cache.buckets[i]; entry != NULL; entry = entry->next)
+                if (entry != keep && (oldest == NULL || entry->last_used < oldest->last_used))
+                    oldest = entry;
+        if (oldest == NULL) break;
+        removeEntry(oldest);
+    }
+}
+
+/* record a finished copy or an incompressible file. Call with the lock held */
+static struct compressed_entry* addEntry(dev_t dev, ino_t inode, struct timespec mtime, off_t size,
+                                         int incompressible, off_t compressed_size)
+{
+    struct compressed_entry* entry = calloc(1, sizeof(struct compressed_entry));
+    if (entry == NULL) return NULL;
+    entry->dev = dev;
+    entry->inode = inode;
+    entry->mtime = mtime;
+    entry->size = size;
+    entry->incompressible = incompressible;
+    entry->compressed_size = compressed_size;
+    entry->last_used = ++cache.clock;
+
+    size_t bucket = bucketOf(dev, inode);
+    entry->next = cache.buckets[bucket];
+    cache.buckets[bucket] = entry;
+    cache.entries++;
+    if (!incompressible) cache.bytes += compressed_size;
+    evictEntries(entry);
+    return entry;
+}
+
+/************************************* Cache setup and teardown ******************************************/
+
+/* create the cache directory. A budget of 0 compresses without caching. Returns -1 if the
+ * directory can't be created, in which case copies aren't cached either */
+int initCompressionCache(size_t budget)
+{
+    cache.budget = budget;
+    if (budget == 0) return 0;
+
+    snprintf(cache.dir, sizeof(cache.dir), "/tmp/download_server.XXXXXX");
+    if (mkdtemp(cache.dir) == NULL) {
+        fprintf(stderr, "Failed to create compression cache directory\n");
+        return -1;
+    }
+    cache.enabled = 1;
+    return 0;
+}
+
+/* delete every cached copy and the cache directory */
+void destroyCompressionCache()
+{
+    if (!cache.enabled) return;
+    pthread_mutex_lock(&cache.lock);
+    cache.enabled = 0;
+    for (size_t i = 0; i < COMPRESS_CACHE_BUCKETS; i++)
+        while (cache.buckets[i] != NULL)
+            removeEntry(cache.buckets[i]);
+
+    /* partial copies of transfers still in flight */
+    DIR* _dir = opendir(cache.dir);
+    if (_dir != NULL) {
+        struct dirent* _dirent;
+        while ((_dirent = readdir(_dir)) != NULL)
+            unlinkat(dirfd(_dir), _dirent->d_name, 0);
+        closedir(_dir);
+    }
+    rmdir(cache.dir);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/************************************** Per-transfer compression ******************************************/
+
+/* returns 1 if deflating the file's leading bytes saves at least COMPRESS_MIN_SAVING percent */
+static int worthCompressing(int file_fd, off_t size)
+{
+    size_t sample_len = size < COMPRESS_SAMPLE_SIZE ? (size_t) size : COMPRESS_SAMPLE_SIZE;
+    unsigned char* sample = malloc(sample_len);
+    uLongf compressed_len = compressBound(sample_len);
+    unsigned char* compressed = malloc(compressed_len);
+    int worth = 0;
+
+    if (sample != NULL && compressed != NULL) {
+        ssize_t n = pread(file_fd, sample, sample_len, 0);
+        if (n > 0 && compress2(compressed, &compressed_len, sample, n, COMPRESS_LEVEL) == Z_OK)
+            worth = compressed_len * 100 <= (uLongf) n * (100 - COMPRESS_MIN_SAVING);
+    }
+    free(sample);
+    free(compressed);
+    return worth;
+}
+
+/* whether openCompressedFile() would send this file raw: it's too small to bother or is
+ * already known not to compress */
+int sentUncompressed(dev_t dev, ino_t inode, struct timespec mtime, off_t size)
+{
+    if (size < COMPRESS_MIN_SIZE) return 1;
+
+    struct stat st = { .st_dev = dev, .st_ino = inode, .st_mtim = mtime, .st_size = size };
+    pthread_mutex_lock(&cache.lock);
+    struct compressed_entry* entry = cache.enabled ? findEntry(&st) : NULL;
+    int incompressible = entry != NULL && entry->incompressible;
+    pthread_mutex_unlock(&cache.lock);
+    return incompressible;
+}
+
+/* decide how a GET of an open file goes out to a +deflate session. COMPRESS_CACHED swaps
+ * the stream for the cached copy; COMPRESS_STREAM moves the file into a new compress_stream
+ * returned through zstream. Without use_cached (the caller sums the original as it streams)
+ * a cached copy is passed over and the file compressed afresh */
+enum compress_mode openCompressedFile(struct file_stream* file, struct compress_stream** zstream, int use_cached)
+{
+    struct stat st;
+    if (file->end < COMPRESS_MIN_SIZE || fstat(file->file_fd, &st) == -1)
+        return COMPRESS_NONE;
+
+    pthread_mutex_lock(&cache.lock);
+    struct compressed_entry* entry = cache.enabled ? findEntry(&st) : NULL;
+    if (entry != NULL && (use_cached || entry->incompressible)) {
+        entry->last_used = ++cache.clock;
+        if (entry->incompressible) {
+            pthread_mutex_unlock(&cache.lock);
+            return COMPRESS_NONE;
+        }
+        char path[128];
+        struct file_stream cached;
+        cachePath(path, sizeof(path), st.st_dev, st.st_ino, st.st_mtim, st.st_size);
+        if (openFileStream(&cached, path) == 0) {
+            pthread_mutex_unlock(&cache.lock);
+            closeFileStream(file);
+            *file = cached;
+            return COMPRESS_CACHED;
+        }
+        removeEntry(entry);				// copy vanished, compress afresh
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (!worthCompressing(file->file_fd, file->end)) {
+        pthread_mutex_lock(&cache.lock);
+        if (cache.enabled && findEntry(&st) == NULL)
+            addEntry(st.st_dev, st.st_ino, st.st_mtim, st.st_size, 1, 0);
+        pthread_mutex_unlock(&cache.lock);
+        return COMPRESS_NONE;
+    }
+
+    struct compress_stream* zs = calloc(1, sizeof(struct compress_stream));
+    if (zs == NULL) return COMPRESS_NONE;
+    zs->out_cap = FRAME_HEADER_SIZE + deflateBound(NULL, COMPRESS_CHUNK_SIZE);
+    if ((zs->out = malloc(zs->out_cap)) == NULL || deflateInit(&zs->z, COMPRESS_LEVEL) != Z_OK) {
+        free(zs->out);
+        free(zs);
+        return COMPRESS_NONE;
+    }
+
+    zs->source = *file;
+    file->file_fd = file->pipe_fds[0] = file->pipe_fds[1] = -1;	// the compress stream owns it now
+    zs->dev = st.st_dev;
+    zs->inode = st.st_ino;
+    zs->mtime = st.st_mtim;
+    zs->size = st.st_size;
+
+    zs->cache_fd = -1;
+    if (cache.enabled && entry == NULL) {		// a copy passed over is still there
+        snprintf(zs->cache_tmp, sizeof(zs->cache_tmp), "%s/partial.XXXXXX", cache.dir);
+        zs->cache_fd = mkostemp(zs->cache_tmp, O_CLOEXEC);
+    }
+    *zstream = zs;
+    return COMPRESS_STREAM;
+}
+
+/* drop the partial copy, e.g. after a failed write */
+static void abandonCachedCopy(struct compress_stream* zs)
+{
+    if (zs->cache_fd == -1) return;
+    close(zs->cache_fd);
+    unlink(zs->cache_tmp);
+    zs->cache_fd = -1;
+}
+
+/* move the finished copy into place and record it */
+static void publishCachedCopy(struct compress_stream* zs)
+{
+    if (zs->cache_fd == -1) return;
+    close(zs->cache_fd);
+    zs->cache_fd = -1;
+
+    char path[128];
+    cachePath(path, sizeof(path), zs->dev, zs->inode, zs->mtime, zs->size);
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.enabled || findEntry(&(struct stat) { .st_dev = zs->dev, .st_ino = zs->inode,
+                                     .st_mtim = zs->mtime, .st_size = zs->size }) != NULL) {
+        unlink(zs->cache_tmp);			// another transfer cached it first
+    } else if (rename(zs->cache_tmp, path) == 0) {
+        addEntry(zs->dev, zs->inode, zs->mtime, zs->size, 0, zs->compressed_size);
+        storeChecksum(zs->dev, zs->inode, zs->mtime, zs->size, zs->source_crc);
+    } else {
+        unlink(zs->cache_tmp);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* deflate the next piece of the file into a DATA frame. Returns -1 on error */
+static int compressNextFrame(struct compress_stream* zs)
+{
+    struct file_stream* source = &zs->source;
+    if (zs->z.avail_in == 0 && source->offset < source->end) {
+        size_t want = source->end - source->offset;
+        if (want > COMPRESS_CHUNK_SIZE) want = COMPRESS_CHUNK_SIZE;
+        ssize_t n = pread(source->file_fd, zs->in, want, source->offset);
+        if (n == -1) {
+            if (errno == EINTR) return 0;
+            return -1;
+        }
+        if (n == 0) {
+            source->end = source->offset;		// file shrank underneath us
+            abandonCachedCopy(zs);
+        }
+        zs->source_crc = updateCrc32(zs->source_crc, zs->in, (size_t) n);
+        source->offset += n;
+        zs->z.next_in = zs->in;
+        zs->z.avail_in = n;
+    }
+
+    int flush = source->offset >= source->end ? Z_FINISH : Z_NO_FLUSH;
+    zs->z.next_out = zs->out + FRAME_HEADER_SIZE;
+    zs->z.avail_out = zs->out_cap - FRAME_HEADER_SIZE;
+    int ret = deflate(&zs->z, flush);
+    if (ret == Z_STREAM_ERROR) return -1;
+    if (ret == Z_STREAM_END) zs->finished = 1;
+
+    size_t produced = zs->out_cap - FRAME_HEADER_SIZE - zs->z.avail_out;
+    encodeFrameHeader(zs->out, FRAME_DATA, FRAME_FLAG_DEFLATE, produced);
+    zs->out_len = produced > 0 ? FRAME_HEADER_SIZE + produced : 0;
+    zs->out_off = 0;
+    zs->compressed_size += produced;
+
+    if (zs->cache_fd != -1 && produced > 0 &&
+            write(zs->cache_fd, zs->out + FRAME_HEADER_SIZE, produced) != (ssize_t) produced)
+        abandonCachedCopy(zs);
+    return 0;
+}
+
+/* send the compressed file as DATA frames, starting no new frame once budget bytes have gone
+ * out. Returns 1 once the whole zlib stream is on the socket, 0 if the socket would block or
+ * the budget is spent, -1 on error */
+int pumpCompressStream(int sock_fd, struct compress_stream* zs, uint64_t budget)
+{
+    uint64_t start = zs->wire_bytes;
+    for (;;) {
+        size_t before = zs->out_off;
+        int result = pumpBytes(sock_fd, zs->out, zs->out_len, &zs->out_off);
+        zs->wire_bytes += zs->out_off - before;
+        if (result != 1) return result;
+        if (zs->finished) {
+            publishCachedCopy(zs);
+            return 1;
+        }
+        if (zs->wire_bytes - start >= budget) return 0;		// shaped, the next frame waits for a grant
+        if (compressNextFrame(zs) == -1) return -1;
+    }
+}
+
+/* release a compress stream, discarding its copy if it never finished */
+void releaseCompressStream(struct compress_stream* zs)
+{
+    if (zs == NULL) return;
+    abandonCachedCopy(zs);
+    deflateEnd(&zs->z);
+    closeFileStream(&zs->source);
+    free(zs->out);
+    free(zs);
+}
@@ -0,0 +1,73 @@
+/***************************************************************************************
+ * Title: Compression Specification
+ * Description: Specification for negotiated GET compression. Sessions that accepted
+ * 		+deflate get compressible files as a zlib stream split across DATA frames
+ * 		flagged FRAME_FLAG_DEFLATE, compressed on the fly as the socket drains.
+ * 		The compressed output is also written to a cache directory keyed by the
+ * 		file's device, inode, mtime and size, so later GETs of an unchanged file
+ * 		sendfile() the cached copy. Files whose leading bytes barely compress are
+ * 		remembered as incompressible and sent raw. The original's CRC-32 is taken
+ * 		while it is compressed and cached with the copy, since a +checksum GET
+ * 		sent from the copy never reads the original to sum it.
+ * ************************************************************************************/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "transfer.h"
+
+#define COMPRESS_LEVEL              1               // fastest zlib level
+#define COMPRESS_MIN_SIZE           1024            // smaller files go out raw
+#define COMPRESS_CHUNK_SIZE         (64 * 1024)     // file bytes deflated per DATA frame
+#define COMPRESS_SAMPLE_SIZE        (64 * 1024)     // leading bytes test-compressed on a miss
+#define COMPRESS_MIN_SAVING         10              // percent saved on the sample to bother
+#define COMPRESS_DEFAULT_CACHE_MB   256
+#define COMPRESS_CACHE_BUCKETS      1024
+#define COMPRESS_CACHE_MAX_ENTRIES  4096
+
+/* How openCompressedFile() decided to send a file */
+enum compress_mode {
+    COMPRESS_NONE,          // raw, the file stream is untouched
+    COMPRESS_CACHED,        // the file stream now reads the cached compressed copy
+    COMPRESS_STREAM         // compress on the fly with the returned compress_stream
+};
+
+/* On-the-fly compression of one file, teeing the output into the cache */
+struct compress_stream {
+    struct file_stream source;
+    z_stream z;
+    int finished;               // deflate() returned Z_STREAM_END
+    unsigned char in[COMPRESS_CHUNK_SIZE];
+    unsigned char* out;         // frame header + deflate output
+    size_t out_cap;
+    size_t out_len;
+    size_t out_off;
+    uint64_t wire_bytes;        // compressed frames put on the socket so far
+
+    int cache_fd;               // partial cache copy, -1 if not caching
+    char cache_tmp[128];
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    off_t compressed_size;
+    uint32_t source_crc;        // CRC-32 of the file bytes deflated so far
+};
+
+/* Cache setup and teardown */
+int initCompressionCache(size_t);
+void destroyCompressionCache();
+
+/* Per-transfer compression */
+enum compress_mode openCompressedFile(struct file_stream*, struct compress_stream**, int);
+int pumpCompressStream(int, struct compress_stream*, uint64_t);
+int sentUncompressed(dev_t, ino_t, struct timespec, off_t);
+void releaseCompressStream(struct compress_stream*);
+
+#endif
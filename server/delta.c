@@ -0,0 +1,266 @@
+/********************************************************************************************
+ * Title: Delta transfer implementation
+ * Description: Matches a file against the client's block signatures. The signatures are
+ * 		indexed by weak sum in an open hash table with chains for repeated sums.
+ * 		The scan keeps Adler-32 of the window under the cursor and rolls it one
+ * 		byte at a time through unmatched data, so a file is scanned in one pass
+ * 		whatever was inserted or removed. A hit jumps the window a whole block,
+ * 		and the block following the last match is tried first so runs of matching
+ * 		blocks coalesce into one reference.
+ * *****************************************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "checksum.h"
+
+#define ADLER_MOD   65521
+
+struct signature_index {
+    const unsigned char* signatures;
+    size_t count;
+    uint32_t mask;
+    int32_t* heads;         // first block with a weak sum in each bucket, -1 if none
+    int32_t* chain;         // next block in the same bucket
+};
+
+/* bytes [base, base + len) of the source, the scan's window and what follows it */
+struct source_window {
+    struct delta_source* source;
+    unsigned char* data;
+    size_t capacity;
+    uint64_t base;
+    size_t len;
+};
+
+/************************************** Signature index *************************************************/
+
+static uint32_t readUint32(const unsigned char* bytes)
+{
+    return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+}
+
+static uint32_t weakOf(const struct signature_index* index, size_t block)
+{
+    return readUint32(index->signatures + block * DELTA_SIGNATURE_LENGTH);
+}
+
+static uint32_t strongOf(const struct signature_index* index, size_t block)
+{
+    return readUint32(index->signatures + block * DELTA_SIGNATURE_LENGTH + 4);
+}
+
+static uint32_t bucketOf(const struct signature_index* index, uint32_t weak)
+{
+    return (weak * 0x9E3779B1u) >> 7 & index->mask;
+}
+
+/* index the signatures by weak sum. Returns -1 if out of memory */
+static int buildIndex(struct signature_index* index, const unsigned char* signatures, size_t count)
+{
+    size_t buckets = 16;
+    while (buckets < count * 2) buckets <<= 1;
+
+    index->signatures = signatures;
+    index->count = count;
+    index->mask = (uint32_t) (buckets - 1);
+    index->heads = malloc(buckets * sizeof(int32_t));
+    index->chain = malloc((count ? count : 1) * sizeof(int32_t));
+    if (index->heads == NULL || index->chain == NULL) {
+        free(index->heads);
+        free(index->chain);
+        return -1;
+    }
+    memset(index->heads, 0xff, buckets * sizeof(int32_t));
+
+    /* inserted backwards so each chain lists its blocks in file order */
+    for (size_t i = count; i-- > 0; ) {
+        uint32_t bucket = bucketOf(index, weakOf(index, i));
+        index->chain[i] = index->heads[bucket];
+        index->heads[bucket] = (int32_t) i;
+    }
+    return 0;
+}
+
+/****************************************** Source window ***********************************************/
+
+/* read the source on from the end of the window until it holds need bytes from its base, summing
+ * what is read. Returns -1 if the file ended first, the source's size is then lowered to match */
+static int fillWindow(struct source_window* window, size_t need)
+{
+    struct delta_source* source = window->source;
+    while (window->len < need) {
+        uint64_t next = window->base + window->len;
+        size_t want = window->capacity - window->len;
+        if ((uint64_t) source->size - next < want) want = (size_t) ((uint64_t) source->size - next);
+        ssize_t n = want > 0 ? pread(source->file_fd, window->data + window->len, want, (off_t) next) : 0;
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            source->size = (off_t) next;		// shrank, or unreadable past here
+            return -1;
+        }
+        if (source->sum) source->crc = updateCrc32(source->crc, window->data + window->len, (size_t) n);
+        window->len += (size_t) n;
+    }
+    return 0;
+}
+
+/* bytes [pos, pos + need) of the source, sliding the window up to pos if they aren't in it.
+ * Returns NULL if the file ends before them */
+static const unsigned char* windowAt(struct source_window* window, uint64_t pos, size_t need)
+{
+    if (pos + need <= window->base + window->len) return window->data + (pos - window->base);
+
+    size_t kept = window->base + window->len - pos;
+    memmove(window->data, window->data + (pos - window->base), kept);
+    window->base = pos;
+    window->len = kept;
+    return fillWindow(window, need) == 0 ? window->data : NULL;
+}
+
+/* read the rest of the source, so its sum covers the whole file */
+static void drainWindow(struct source_window* window)
+{
+    while (window->base + window->len < (uint64_t) window->source->size) {
+        window->base += window->len;
+        window->len = 0;
+        if (fillWindow(window, 1) == -1) break;
+    }
+}
+
+/******************************************* Delta computation *********************************************/
+
+/* append an operation, extending the previous one if it continues it. Returns -1 if out of memory */
+static int appendOp(struct transfer_delta* delta, enum delta_op_kind kind, uint64_t start, uint64_t count)
+{
+    if (count == 0) return 0;
+    if (delta->count > 0) {
+        struct delta_op* last = &delta->ops[delta->count - 1];
+        if (last->kind == kind && last->start + last->count == start) {
+            last->count += count;
+            return 0;
+        }
+    }
+
+    /* capacity is 16, then doubles whenever count reaches a power of two */
+    if (delta->count == 0 || (delta->count >= 16 && (delta->count & (delta->count - 1)) == 0)) {
+        struct delta_op* ops = realloc(delta->ops, (delta->count ? delta->count * 2 : 16) * sizeof(struct delta_op));
+        if (ops == NULL) return -1;
+        delta->ops = ops;
+    }
+    delta->ops[delta->count++] = (struct delta_op) { kind, start, count };
+    return 0;
+}
+
+/* Adler-32 of a window, split into its two halves */
+static void sumWindow(const unsigned char* data, uint32_t len, uint32_t* a, uint32_t* b)
+{
+    uint32_t sum = (uint32_t) adler32(1, data, len);
+    *a = sum & 0xffff;
+    *b = sum >> 16;
+}
+
+/* the signed block the window at data matches, or -1. preferred is tried first */
+static int64_t matchWindow(const struct signature_index* index, const unsigned char* data, uint32_t len,
+                           uint32_t weak, int64_t preferred)
+{
+    int32_t block = index->heads[bucketOf(index, weak)];
+    int have_strong = 0;
+    uint32_t strong = 0;
+
+    if (block == -1) return -1;
+    if (preferred >= 0 && (size_t) preferred < index->count && weakOf(index, preferred) == weak) {
+        strong = updateCrc32(0, data, len);
+        have_strong = 1;
+        if (strongOf(index, preferred) == strong) return preferred;
+    }
+    for (; block != -1; block = index->chain[block]) {
+        if (weakOf(index, block) != weak) continue;
+        if (!have_strong) {
+            strong = updateCrc32(0, data, len);
+            have_strong = 1;
+        }
+        if (strongOf(index, block) == strong) return block;
+    }
+    return -1;
+}
+
+/* match the source against count signatures of block_size blocks, producing the operations that
+ * rebuild it from the signed copy, and sum the whole source if asked to. A source that shrinks
+ * meanwhile is matched up to where it ended. Returns NULL if out of memory */
+struct transfer_delta* computeDelta(struct delta_source* source, uint32_t block_size,
+                                    const unsigned char* signatures, size_t count)
+{
+    struct signature_index index;
+    struct source_window window = { source, NULL, (size_t) block_size + DELTA_READ_SIZE, 0, 0 };
+    struct transfer_delta* delta = calloc(1, sizeof(struct transfer_delta));
+    if (delta == NULL) return NULL;
+    delta->block_size = block_size;
+    if ((window.data = malloc(window.capacity)) == NULL || buildIndex(&index, signatures, count) == -1) {
+        free(window.data);
+        free(delta);
+        return NULL;
+    }
+
+    uint64_t pos = 0, literal = 0;
+    uint32_t out_weight = block_size % ADLER_MOD;
+    uint32_t a = 0, b = 0;
+    int64_t preferred = -1;
+    int failed = 0, summed = 0;
+    const unsigned char* data;
+
+    while (count > 0 && pos + block_size <= (uint64_t) source->size) {
+        /* the window under the cursor, and the byte rolled in after it if there is one */
+        size_t need = pos + block_size < (uint64_t) source->size ? (size_t) block_size + 1 : block_size;
+        if ((data = windowAt(&window, pos, need)) == NULL) continue;	// shrank, the loop re-checks
+        if (!summed) sumWindow(data, block_size, &a, &b);
+        summed = 1;
+
+        int64_t block = matchWindow(&index, data, block_size, b << 16 | a, preferred);
+        if (block >= 0) {
+            failed |= appendOp(delta, DELTA_LITERAL, literal, pos - literal);
+            failed |= appendOp(delta, DELTA_COPY, (uint64_t) block, 1);
+            if (failed) break;
+            pos += block_size;
+            literal = pos;
+            preferred = block + 1;
+            summed = 0;
+            continue;
+        }
+
+        /* roll the window one byte: drop data[0], at pos, take in data[block_size] */
+        if (need > block_size) {
+            uint32_t out = data[0], in = data[block_size];
+            a = (a + ADLER_MOD - out + in) % ADLER_MOD;
+            b = (b + 2 * ADLER_MOD - out_weight * out % ADLER_MOD + a - 1) % ADLER_MOD;
+        }
+        pos++;
+    }
+    if (source->sum) drainWindow(&window);
+    failed |= appendOp(delta, DELTA_LITERAL, literal, (uint64_t) source->size - literal);
+
+    free(window.data);
+    free(index.heads);
+    free(index.chain);
+    if (failed) {
+        releaseDelta(delta);
+        return NULL;
+    }
+    for (size_t i = 0; i < delta->count; i++) {
+        if (delta->ops[i].kind == DELTA_COPY) delta->copied_bytes += delta->ops[i].count * block_size;
+        else delta->literal_bytes += delta->ops[i].count;
+    }
+    return delta;
+}
+
+/* free a delta and its operations, if any */
+void releaseDelta(struct transfer_delta* delta)
+{
+    if (delta == NULL) return;
+    free(delta->ops);
+    free(delta);
+}
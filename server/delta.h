@@ -0,0 +1,65 @@
+/***************************************************************************************
+ * Title: Delta Transfer Specification
+ * Description: Specification for rsync-style delta GETs. The client signs every full
+ * 		block of its copy of a file with a weak and a strong sum; the server rolls
+ * 		the weak sum over its own copy one byte at a time and, wherever a weak hit
+ * 		is confirmed by the strong sum, refers to the client's block instead of
+ * 		sending the bytes. The result is a list of operations, block references and
+ * 		literal runs of the file, streamed in file order. The weak sum is Adler-32
+ * 		and the strong sum CRC-32, both as zlib computes them, so the client signs
+ * 		its blocks at native speed; the whole-file CRC-32 in the END frame catches
+ * 		the rare block that matched both sums by chance. The file is read with
+ * 		pread() into a window that slides along with the scan, never mapped, so a
+ * 		file another writer shrinks only ends the scan early.
+ * ************************************************************************************/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DELTA_SIGNATURE_LENGTH  8           // Adler-32 then CRC-32 of a block, network byte order
+#define DELTA_MIN_BLOCK         512
+#define DELTA_MAX_BLOCK         (1 << 20)
+#define DELTA_MAX_BLOCKS        (1 << 20)   // 8MB of signatures at most
+#define DELTA_READ_SIZE         (1 << 20)   // file bytes read at a time, beyond the block in the window
+
+struct transfer;
+
+enum delta_op_kind {
+    DELTA_COPY,             // blocks [start, start + count) of the client's copy
+    DELTA_LITERAL           // bytes [start, start + count) of the server's file
+};
+
+struct delta_op {
+    enum delta_op_kind kind;
+    uint64_t start;
+    uint64_t count;
+};
+
+/* The file being matched, read as the scan goes */
+struct delta_source {
+    int file_fd;
+    off_t size;                 // bytes to match, lowered to where the file ended if it shrank
+    int sum;                    // also take the CRC-32 of the whole file, in the same pass
+    uint32_t crc;
+};
+
+/* Operations rebuilding a file from the client's copy, sent in order */
+struct transfer_delta {
+    struct delta_op* ops;       // heap, owned by the delta
+    size_t count;
+    size_t next;                // next operation to start
+    uint32_t block_size;
+    uint64_t copied_bytes;
+    uint64_t literal_bytes;
+    int (*op_head)(struct transfer*, const struct delta_op*);  // appends an op's head, -1 if it doesn't fit
+};
+
+/* Delta computation */
+struct transfer_delta* computeDelta(struct delta_source*, uint32_t, const unsigned char*, size_t);
+void releaseDelta(struct transfer_delta*);
+
+#endif
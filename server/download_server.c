@@ -3,13 +3,60 @@
  * Author: Sean Hinds
  * Date: 25 Nov, 2018
  * Description: Implementation for TCP download server. Server listens for connections on a
- * 		specified port. When a connection is received, a new thread is spawned to 
- * 		manage that connection. Handles LIST (-l) and GET (-g FILENAME) commands from
+ * 		specified port. When a connection is received, it is handed to a pool of
+ * 		worker threads (worker_pool.c). Handles LIST (-l) and GET (-g FILENAME) commands from
  * 		client. When a valid command is recieved, a separate data connection is 
  * 		requested by the server to transfer the file or directory contents.
  * *****************************************************************************************/
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include "download_server.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "transfer.h"
+#include "buffer_arena.h"
+#include "file_index.h"
+#include "compression.h"
+#include "file_cache.h"
+#include "checksum.h"
+#include "delta.h"
+#include "listing.h"
+#include "scheduler.h"
+#include "socket_tuning.h"
+#include "shard.h"
+#include "readahead.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <fnmatch.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+/* Global flags */
+int SERVER_DISCONNECT;
+
+/* Global variables */
+struct server_options server_options = {
+    .engine = ENGINE_THREADS,
+    .num_loops = 0,
+    .num_workers = 0,
+    .max_clients = POOL_DEFAULT_MAX_CLIENTS,
+    .buffer_budget_mb = ARENA_DEFAULT_BUDGET_MB,
+    .compress_cache_mb = COMPRESS_DEFAULT_CACHE_MB,
+    .file_cache_mb = FILE_CACHE_DEFAULT_MB,
+    .metrics_port = 0,
+    .total_mbit = 0,
+    .client_mbit = 0,
+    .interactive_weight = SCHEDULER_DEFAULT_WEIGHT,
+    .shard_steering = SHARD_OFF,
+    .direct_mb = 0,
+    .log_level = LOG_INFO
+};
+
+static _Atomic uint64_t session_ids;      // last id handed to a session, for its log records
 
 /************************************* Server setup ****************************************/
 
@@ -18,18 +65,34 @@ void initializeServer(char* port_str)
 {
     SERVER_DISCONNECT = 0;
 
-    /* initialize mutexes and allocate buffers*/
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        pthread_mutex_init(&io_mutexes[i], NULL);
-        in_buffers[i] = (unsigned char*) malloc(IN_BUFFER_SIZE * sizeof(char));
-        out_buffers[i] = (unsigned char*) malloc(OUT_BUFFER_SIZE * sizeof(char));
-    } 
+    /* log records are formatted and written by a background thread from here on */
+    initLogging(server_options.log_level);
 
-    sockets = malloc(SOCKETS_ALLOWED * sizeof(int));
+    /* size the I/O buffer arena, buffers are allocated on first use */
+    initBufferArena((size_t) server_options.buffer_budget_mb * 1024 * 1024);
+
+    /* index the served directory; without inotify GET and LIST scan it per command */
+    initFileIndex();
+
+    /* compressed copies of hot files for +deflate sessions */
+    initCompressionCache((size_t) server_options.compress_cache_mb * 1024 * 1024);
+
+    /* small hot files kept mmap'd */
+    initFileCache((size_t) server_options.file_cache_mb * 1024 * 1024);
+
+    /* CRC-32 implementation for +checksum sessions and -c */
+    initChecksums();
+
+    /* bandwidth shaping, off unless a rate was given */
+    initScheduler((uint64_t) server_options.total_mbit * 125000, (uint64_t) server_options.client_mbit * 125000,
+                  (uint64_t) server_options.interactive_weight);
+
+    /* socket profiles for control and data connections, checked against the kernel */
+    initSocketProfiles();
+
+    /* per-thread metrics for STATS, and the Prometheus port if one was asked for */
+    initMetrics(server_options.metrics_port);
 
-    for (int i = 0; i < SOCKETS_ALLOWED; i++) {
-        sockets[i] = -1;
-    }
     int server_welcome_fd = createWelcomeSocket(port_str);
 
     startServer(server_welcome_fd, port_str);
@@ -38,12 +101,12 @@ void initializeServer(char* port_str)
 /* parse command line arguments to ensure a valid port number selected */
 char* getValidPort(int argc, char** argv)
 {   
-    if (argc < 2) {
-        fprintf(stderr, "Usage: $ ./server {PORT}\n");
+    parseServerOptions(argc, argv);
+    if (optind >= argc) {
+        fprintf(stderr, SERVER_USAGE);
         exit(1);
     }
-    int valid = 0;
-    char* port_str = argv[1];
+    char* port_str = argv[optind];
     int port = atoi(port_str);
     if (port_str[0] == '0' || port != 0) {
         return port_str;
@@ -53,6 +116,132 @@ char* getValidPort(int argc, char** argv)
     }
 }
 
+/* parse optional server flags, leaving optind at the port argument */
+void parseServerOptions(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "e:n:w:a:m:z:c:p:R:r:q:t:T:S:D:L:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    server_options.engine = ENGINE_THREADS;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    server_options.engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    server_options.engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Unknown engine %s (expected threads, epoll or uring)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                server_options.num_loops = atoi(optarg);
+                if (server_options.num_loops < 0) {
+                    fprintf(stderr, "Please enter a valid number of event loops\n");
+                    exit(1);
+                }
+                break;
+            case 'w':
+                server_options.num_workers = atoi(optarg);
+                if (server_options.num_workers < 0) {
+                    fprintf(stderr, "Please enter a valid number of worker threads\n");
+                    exit(1);
+                }
+                break;
+            case 'a':
+                server_options.max_clients = atoi(optarg);
+                if (server_options.max_clients <= 0) {
+                    fprintf(stderr, "Please enter a valid client limit\n");
+                    exit(1);
+                }
+                break;
+            case 'm':
+                server_options.buffer_budget_mb = atoi(optarg);
+                if (server_options.buffer_budget_mb <= 0) {
+                    fprintf(stderr, "Please enter a valid buffer memory budget in MB\n");
+                    exit(1);
+                }
+                break;
+            case 'z':
+                server_options.compress_cache_mb = atoi(optarg);
+                if (server_options.compress_cache_mb < 0) {
+                    fprintf(stderr, "Please enter a valid compression cache size in MB\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                server_options.file_cache_mb = atoi(optarg);
+                if (server_options.file_cache_mb < 0) {
+                    fprintf(stderr, "Please enter a valid file cache size in MB\n");
+                    exit(1);
+                }
+                break;
+            case 'p':
+                server_options.metrics_port = atoi(optarg);
+                if (server_options.metrics_port <= 0 || server_options.metrics_port > 65535) {
+                    fprintf(stderr, "Please enter a valid metrics port\n");
+                    exit(1);
+                }
+                break;
+            case 'R':
+                server_options.total_mbit = atoi(optarg);
+                if (server_options.total_mbit < 0) {
+                    fprintf(stderr, "Please enter a valid total rate in Mbit/s\n");
+                    exit(1);
+                }
+                break;
+            case 'r':
+                server_options.client_mbit = atoi(optarg);
+                if (server_options.client_mbit < 0) {
+                    fprintf(stderr, "Please enter a valid per-client rate in Mbit/s\n");
+                    exit(1);
+                }
+                break;
+            case 'q':
+                server_options.interactive_weight = atoi(optarg);
+                if (server_options.interactive_weight <= 0) {
+                    fprintf(stderr, "Please enter a valid interactive weight\n");
+                    exit(1);
+                }
+                break;
+            case 't':
+            case 'T':
+                if (selectSocketProfile(opt == 't' ? SOCKET_DATA : SOCKET_CONTROL, optarg) == -1) {
+                    fprintf(stderr, "Unknown socket profile %s (expected kernel, interactive, bulk, throughput "
+                            "or latency)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                if ((server_options.shard_steering = parseShardSteering(optarg)) == -1) {
+                    fprintf(stderr, "Unknown shard steering %s (expected hash, cpu or bpf)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                server_options.direct_mb = atoi(optarg);
+                if (server_options.direct_mb < 0) {
+                    fprintf(stderr, "Please enter a valid O_DIRECT threshold in MB\n");
+                    exit(1);
+                }
+                break;
+            case 'L':
+                if ((server_options.log_level = parseLogLevel(optarg)) == -1) {
+                    fprintf(stderr, "Unknown log level %s (expected error, warn, info or debug)\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, SERVER_USAGE);
+                exit(1);
+        }
+    }
+    if (server_options.shard_steering != SHARD_OFF && server_options.engine == ENGINE_THREADS) {
+        fprintf(stderr, "Sharded listeners need the epoll or uring engine\n");
+        exit(1);
+    }
+}
+
 /************************************* Server startup, runs in main thread ************************************/
 
 /* initialize the welcome socket for incoming control connections */
@@ -92,6 +281,12 @@ int bindWelcomeSocket(struct addrinfo* hints, struct addrinfo** server_addrinfo,
             fprintf(stderr, "setsockopt() failed\n");
             exit(1);
         }
+        if (server_options.shard_steering != SHARD_OFF &&
+                setsockopt(server_welcome_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == -1) {
+            fprintf(stderr, "SO_REUSEPORT unsupported, can't shard listeners\n");
+            exit(1);
+        }
+        applySocketProfile(server_welcome_fd, socketProfile(SOCKET_CONTROL));	// inherited by accepted sockets
         if (bind(server_welcome_fd, 
                     (*ptr_addrinfo)->ai_addr, 
                     (*ptr_addrinfo)->ai_addrlen) == -1) {
@@ -118,286 +313,995 @@ void startServer(int server_welcome_fd, char* port_str)
         exit(1);
     }
 
-    establishCommandConnection(server_welcome_fd, port_str);
+    if (server_options.engine != ENGINE_THREADS) {
+        runEventLoops(server_welcome_fd, port_str);
+    } else {
+        runWorkerPool(server_welcome_fd, port_str);
+    }
 }
 
-/* worker thread main function. Services a single client */
-void* worker_thread(void* arg)
-{
-    pthread_detach(pthread_self());
-    int worker_cmd_fd = *((int*) arg);
-    
-    /* get data socket info */
-    char** client_data_socket_info = malloc(2 * sizeof(char*));
-    client_data_socket_info[0] = malloc(ADDRESS_LENGTH * sizeof(char));
-    client_data_socket_info[1] = malloc(PORT_LENGTH * sizeof(char));
-    memset(client_data_socket_info[0], 0, ADDRESS_LENGTH);
-    memset(client_data_socket_info[1], 0, PORT_LENGTH); 
-    int result = getClientDataSocketInfo(worker_cmd_fd, arg, client_data_socket_info);
+/*************************** Command connection handling in worker thread *********************************/
 
-    if (result == -1) {
-        printf("Failed to get client data socket info\n");
-        workerThreadComplete(worker_cmd_fd, NULL, arg);
+/* called by a pool worker (runClientTask) to receive commands and run every complete one */
+int handleClientCmd(int worker_cmd_fd, struct client_session* session)
+{ 
+    unsigned char in_buffer[IN_BUFFER_SIZE];
+    unsigned char command[IN_BUFFER_SIZE];
+    int retval = 0;
+
+    ssize_t received = recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE - 1, 0);
+    if (received <= 0) {
+        handleClientDisconnect(session);
+        return -1;
+    }
+    if (queueCommandBytes(session, in_buffer, received) == -1) {
+        logEvent(session->id, LOG_COMMAND_TOO_LONG, NULL);
+        session->commands_len = 0;
+        return 1;
     }
 
-    char* client_data_addr = client_data_socket_info[0];
-    char* client_data_port = client_data_socket_info[1];
+    /* pipelined commands run back to back, their responses stream out in order. A command's
+     * payload is read in full before it runs, blocking like the rest of the command */
+    while (1) {
+        while (nextCommand(session, command))
+            retval = executeClientCmd(worker_cmd_fd, session, command);
+        if (session->upload_size == 0) break;
+        if (receiveUpload(session, worker_cmd_fd) == -1) {
+            handleClientDisconnect(session);
+            return -1;
+        }
+    }
+    return retval;
+} 
 
-    printf("Worker thread connected to client %s data port: %s\n", client_data_addr, client_data_port);
+/* run one command to completion */
+int executeClientCmd(int worker_cmd_fd, struct client_session* session, unsigned char* command)
+{
+    int persistent = session->capabilities & CAP_PERSIST;
+    int valid = validCommand(session, command);
+    beginCommand(session);
+
+    /* without +persist, rejections go out on the control connection */
+    if (!valid) {
+        logEvent(session->id, LOG_COMMAND_INVALID, command);
+        countMetric(METRIC_COMMANDS_REJECTED, 1);
+    }
+    if (!valid && !persistent) {
+        unsigned char out_buffer[IN_BUFFER_SIZE];
+        handleInvalidCmd(worker_cmd_fd, command, out_buffer);
+        return 1;
+    }
 
-    /* launch control loop to process commands */
-    ctrlLoop(worker_cmd_fd, client_data_socket_info, arg); 
+    /* each command in flight holds one arena buffer, so the memory budget bounds concurrency */
+    struct io_buffer* io_buf = acquireBuffer();
+    if (io_buf == NULL && valid) {
+        logEvent(session->id, LOG_COMMAND_BUSY, NULL);
+        countMetric(METRIC_COMMANDS_REJECTED, 1);
+        if (!persistent) {
+            send(worker_cmd_fd, ERROR_SERVER_BUSY, strlen(ERROR_SERVER_BUSY), 0);
+            return 1;
+        }
+    }
 
-    /* complete execution */
-    workerThreadComplete(worker_cmd_fd, client_data_socket_info, arg);
-    return (void*) 0;
+    logEvent(session->id, LOG_COMMAND_RECEIVED, command);
+    int worker_data_fd = establishDataConnection(session); 
+    if (worker_data_fd != -1) {
+        /* parse args  */
+        if (valid && strncmp((char*) command, PUT_MESSAGE, 2) == 0) {
+            handlePutCmd(session, worker_data_fd, command, io_buf);	// reads the payload even if busy
+        } else if (!valid || io_buf == NULL) {
+            struct transfer xfer;
+            buildErrorResponse(session, valid ? ERROR_SERVER_BUSY : ERROR_INVALID_COMMAND, &xfer);
+            beginTransfer(session, &xfer);
+            if (pumpTransfer(worker_data_fd, &xfer) == -1 || strncmp((char*) command, PUT_MESSAGE, 2) == 0)
+                closeSessionDataConnection(session);	// a malformed upload's payload would be taken for the next one's
+        } else if (strncmp((char*) command, LIST_MESSAGE, 2) == 0) {
+            handleListCmd(session, worker_data_fd, worker_cmd_fd, command, io_buf);
+        } else if (strncmp((char*) command, STATS_MESSAGE, 2) == 0) {
+            handleStatsCmd(session, worker_data_fd, io_buf);
+        } else {
+            handleGetCmd(session, worker_data_fd, worker_cmd_fd, command, io_buf);	// -g, -r, -b, -c, -d
+        }
+        if (!persistent) closeSessionDataConnection(session);
+    }
+    releaseBuffer(io_buf);
+    return valid ? 0 : 1;
 }
 
-/*************************** Command connection handling in worker thread *********************************/
+/* parse "-u {SIZE} {FILE_NAME}", pointing *name into command. Returns -1 if it's malformed */
+static int parsePutCommand(unsigned char* command, uint64_t* size, char** name)
+{
+    unsigned long long announced;
+    int name_off = 0;
 
-/* establish the command connection */
-void establishCommandConnection(int server_welcome_fd, char* port_str)
+    if (strncmp((char*) command, PUT_MESSAGE " ", 3) != 0 || command[3] < '0' || command[3] > '9' ||
+            sscanf((char*) command + 3, "%llu %n", &announced, &name_off) != 1 || name_off == 0 ||
+            command[3 + name_off] == '\0')
+        return -1;
+    *size = (uint64_t) announced;
+    *name = (char*) command + 3 + name_off;
+    return 0;
+}
+
+/* returns 0 if an invalid command received, 1 if a valid command received */
+int validCommand(struct client_session* session, unsigned char* command)
 {
-    socklen_t sin_size;
-    struct sockaddr_storage client_addr;
-    int server_cmd_fd;
-    pthread_t worker;
+    if (strncmp((char*) command, GET_MESSAGE, 2) == 0 ||
+        strncmp((char*) command, STATS_MESSAGE, 2) == 0) {
+            return 1; 
+    } else if (strncmp((char*) command, LIST_MESSAGE, 2) == 0) {
+            return command[2] == '\0' || session->protocol != PROTOCOL_LEGACY;	// paged listings need framing
+    } else if (strncmp((char*) command, RANGE_MESSAGE, 2) == 0 ||
+               strncmp((char*) command, BATCH_MESSAGE, 2) == 0 ||
+               strncmp((char*) command, CHECKSUM_MESSAGE, 2) == 0) {
+            return session->protocol != PROTOCOL_LEGACY;	// range, entry and checksum metadata need framing
+    } else if (strncmp((char*) command, DELTA_MESSAGE, 2) == 0) {
+            return (session->capabilities & CAP_PERSIST) != 0;	// signatures follow the command line
+    } else if (strncmp((char*) command, PUT_MESSAGE, 2) == 0) {
+            uint64_t size;
+            char* name;
+            /* the file follows on the data connection, which must outlive the command */
+            return (session->capabilities & CAP_PERSIST) && !(session->capabilities & CAP_MUX) &&
+                   parsePutCommand(command, &size, &name) == 0;
+    } else {
+        return 0;
+    }
+} 
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
- 
-    fd_set read_fds;
+/**************************** Data connection handling in worker thread **************************************/
 
-    int printPrompt;
+int getClientDataSocketInfo(int worker_cmd_fd, struct client_session* session) 
+{
+    unsigned char in_buffer[IN_BUFFER_SIZE];
+    char ack[IN_BUFFER_SIZE];
+	
+    /* get data address and port from client */
+    memset(in_buffer, 0, IN_BUFFER_SIZE);
+    if (recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE - 1, 0) <= 0) return -1;
+    storeDataAddress(session, in_buffer);
+    if (send(worker_cmd_fd, ACK_ADDR, strlen(ACK_ADDR), 0) == -1) return -1;
+
+    /* port message may carry a framing request, answered in the port ACK */
+    memset(in_buffer, 0, IN_BUFFER_SIZE);
+    if (recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE - 1, 0) <= 0) return -1;
+    negotiateProtocol(session, worker_cmd_fd, in_buffer, ack);
+    if (send(worker_cmd_fd, ack, strlen(ack), 0) == -1) return -1;
+    if (session->capabilities & CAP_MUX) {
+        if ((session->data_fd = dup(worker_cmd_fd)) == -1) return -1;	// frames go out on the control socket
+    } else if (!(session->capabilities & CAP_PASSIVE)) {
+        resolveDataAddress(session);
+    }
 
-    while(!SERVER_DISCONNECT) {
+    return 0;	// success
+}
 
-        if(printPrompt) {
-            printf("Server listening on %s\n", port_str);
-            printPrompt = 0;
+/* establish the data connection to transfer directory contents or file to client, reusing the
+ * open one if the session negotiated +persist */
+int establishDataConnection(struct client_session* session) 
+{ 
+    if (session->data_fd != -1) {
+        if (!peerClosed(session->data_fd)) return session->data_fd;
+        closeSessionDataConnection(session);		// client dropped it between commands
+    }
+    if (session->capabilities & CAP_MUX) return -1;	// the control connection itself is gone
+
+    int server_data_fd;
+    if (session->passive_fd != -1) {
+        struct pollfd listener = { .fd = session->passive_fd, .events = POLLIN };
+        if (poll(&listener, 1, PASSIVE_ACCEPT_TIMEOUT_MS) <= 0 ||
+                (server_data_fd = acceptPassiveConnection(session, 0)) == -1) {
+            logEvent(session->id, LOG_PASSIVE_TIMEOUT, NULL);
+            return -1;
+        }
+    } else {
+        if (session->data_sockaddr_len == 0) {
+            logEvent(session->id, LOG_DATA_ADDRESS_FAILED, session->data_addr);
+            return -1;
         }
 
-        FD_ZERO(&read_fds);
-        FD_SET(server_welcome_fd, &read_fds);
-        int connections_requested = select(server_welcome_fd+1, &read_fds, NULL, NULL, &tv);
+        server_data_fd = socket(session->data_sockaddr.ss_family, SOCK_STREAM, 0);
+        if (server_data_fd != -1) applySocketProfile(server_data_fd, socketProfile(SOCKET_DATA));
+        if (server_data_fd == -1 ||
+                connect(server_data_fd, (struct sockaddr*) &session->data_sockaddr, session->data_sockaddr_len) == -1) {
+            if (server_data_fd != -1) close(server_data_fd);
+            logEvent(session->id, LOG_DATA_CONNECT_FAILED, NULL);
+            return -1;
+        }
+    }
 
-        if (FD_ISSET(server_welcome_fd, &read_fds) && connections_requested > 0) {
-            sin_size = sizeof(client_addr);
-            server_cmd_fd = accept(server_welcome_fd, (struct sockaddr *) &client_addr, &sin_size);
-            if (server_cmd_fd == -1) {
-                continue;
-            }
+    char conn_ack[DATA_GREETING_LENGTH];
+    if (recv(server_data_fd, conn_ack, DATA_GREETING_LENGTH, MSG_WAITALL) != DATA_GREETING_LENGTH) {
+        close(server_data_fd);
+        logEvent(session->id, LOG_DATA_CONNECT_FAILED, NULL);
+        return -1;
+    }
+    //printf("%s\n", conn_ack);
 
-            /* spawn pthread for new client */
-            int* worker_cmd_fd_ptr = malloc(sizeof(server_cmd_fd));
-            *worker_cmd_fd_ptr = server_cmd_fd;
-            if (pthread_create(&worker, NULL, worker_thread, worker_cmd_fd_ptr) == 0) {
-                //printf("Worker thread spawned\n");
-                printPrompt = 1;
-            } else {
-                fprintf(stderr, "Failed to create worker thread\n");
-            }
+    session->data_fd = server_data_fd;
+    return server_data_fd;
+}
+
+/* close the session's data connection, if open. Under +mux that ends the control connection
+ * too, since a response cut short leaves the frame stream unusable */
+void closeSessionDataConnection(struct client_session* session)
+{
+    if (session->data_fd != -1) {
+        if (session->capabilities & CAP_MUX) shutdown(session->data_fd, SHUT_RDWR);
+        close(session->data_fd);
+        session->data_fd = -1;
+    }
+}
+
+/* legacy protocol: wait for the client to ACK the END_DATA_MESSAGE trailer */
+void awaitEndDataAck(int worker_data_fd)
+{
+    char fin_ack[strlen(END_DATA_MESSAGE)];
+    recv(worker_data_fd, fin_ack, strlen(END_DATA_MESSAGE), MSG_WAITALL);
+}
+
+/************************************ Protocol negotiation and framing ***********************************/
+
+/* reset a session before its handshake */
+void initSession(struct client_session* session)
+{
+    memset(session, 0, sizeof(struct client_session));
+    session->data_fd = -1;
+    session->passive_fd = -1;
+    session->id = atomic_fetch_add(&session_ids, 1) + 1;
+    session->accepted_ns = monotonicNanos();
+}
+
+/* note that a command is starting, timing the client's first one from its accept */
+void beginCommand(struct client_session* session)
+{
+    session->command_ns = monotonicNanos();
+    if (session->commands_run++ == 0)
+        recordMetric(METRIC_ACCEPT_TO_COMMAND, (session->command_ns - session->accepted_ns) / 1000);
+    countMetric(METRIC_COMMANDS, 1);
+}
+
+/* record the data address sent as the first handshake message */
+void storeDataAddress(struct client_session* session, unsigned char* message)
+{
+    snprintf(session->data_addr, sizeof(session->data_addr), "%s", (char*) message);
+}
+
+/* capability tokens a framed client may request after its frame version */
+static const struct {
+    const char* token;
+    unsigned int bit;
+} capability_tokens[] = {
+    { CAPABILITY_PERSIST, CAP_PERSIST },
+    { CAPABILITY_DEFLATE, CAP_DEFLATE },
+    { CAPABILITY_PASSIVE, CAP_PASSIVE },
+    { CAPABILITY_MUX, CAP_MUX },
+    { CAPABILITY_CHECKSUM, CAP_CHECKSUM }
+};
+
+/* record the data port sent as the second handshake message, along with any framing request
+ * and capabilities ("{PORT} FRAME/{VERSION} [+capability ...]"). Opens the +passive listener
+ * on the control connection's address. Writes the ACK to send back into ack and returns it */
+const char* negotiateProtocol(struct client_session* session, int cmd_fd, unsigned char* message, char* ack)
+{
+    char* saveptr;
+    char* token = strtok_r((char*) message, " ", &saveptr);
+    size_t num_tokens = sizeof(capability_tokens) / sizeof(capability_tokens[0]);
+
+    session->protocol = PROTOCOL_LEGACY;
+    session->capabilities = 0;
+    snprintf(session->data_port, sizeof(session->data_port), "%s", token != NULL ? token : "");
+
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        if (strncmp(token, PROTOCOL_CAPABILITY, strlen(PROTOCOL_CAPABILITY)) == 0) {
+            int requested = atoi(token + strlen(PROTOCOL_CAPABILITY));
+            if (requested > 0)
+                session->protocol = requested < PROTOCOL_FRAMED ? requested : PROTOCOL_FRAMED;
+            continue;
         }
+        for (size_t i = 0; i < num_tokens; i++)
+            if (strcmp(token, capability_tokens[i].token) == 0)
+                session->capabilities |= capability_tokens[i].bit;
     }
-    serverTearDown();
-} 
 
-/* Called within worker thread to begin processing incoming commands */
-void ctrlLoop(int worker_cmd_fd, char** client_data_socket_info, void* arg)
+    if (session->protocol == PROTOCOL_LEGACY) {
+        session->capabilities = 0;			// every extension rides on framing
+        snprintf(ack, IN_BUFFER_SIZE, "%s", ACK_PORT);
+        return ack;
+    }
+
+    if (session->capabilities & CAP_MUX) {
+        session->capabilities = (session->capabilities | CAP_PERSIST) & ~CAP_PASSIVE;
+        applySocketProfile(cmd_fd, socketProfile(SOCKET_DATA));	// responses go out on it
+        /* commands arrive on the socket responses go out on, so the client delays its ACKs
+         * and Nagle would hold each response's small END frame back for them */
+        int nodelay = 1;
+        setsockopt(cmd_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    if ((session->capabilities & CAP_PASSIVE) && openPassiveListener(session, cmd_fd) == -1) {
+        logEvent(session->id, LOG_PASSIVE_FAILED, NULL);
+        session->capabilities &= ~CAP_PASSIVE;	// the client falls back to accepting
+    }
+
+    int len = snprintf(ack, IN_BUFFER_SIZE, "%s %s%d", ACK_PORT, PROTOCOL_CAPABILITY, session->protocol);
+    for (size_t i = 0; i < num_tokens; i++) {
+        if (!(session->capabilities & capability_tokens[i].bit)) continue;
+        len += snprintf(ack + len, IN_BUFFER_SIZE - len, " %s", capability_tokens[i].token);
+        if (capability_tokens[i].bit == CAP_PASSIVE)
+            len += snprintf(ack + len, IN_BUFFER_SIZE - len, ":%d", session->passive_port);
+    }
+    return ack;
+}
+
+/* resolve the client data address once per session. Returns -1 if it can't be resolved */
+int resolveDataAddress(struct client_session* session)
 {
-    int connection_status = 0;
+    struct addrinfo hints, *server_info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
- 
-    fd_set read_fds;
-
-    while (connection_status != CLIENT_DISCONNECTED && !SERVER_DISCONNECT)
-    {
-        FD_ZERO(&read_fds);
-        FD_SET(worker_cmd_fd, &read_fds);
-        select(worker_cmd_fd+1, &read_fds, NULL, NULL, &tv);
-        if (FD_ISSET(worker_cmd_fd, &read_fds)) {		// if a command has been received
-            connection_status = handleClientCmd(worker_cmd_fd, client_data_socket_info);
-        } 
+    session->data_sockaddr_len = 0;
+    if (getaddrinfo(session->data_addr, session->data_port, &hints, &server_info) != 0) {
+        logEvent(session->id, LOG_DATA_ADDRESS_FAILED, session->data_addr);
+        return -1;
     }
-    if (connection_status != CLIENT_DISCONNECTED)
-    {
-        //printf("Worker thread sending kill message to client\n");
-        sendKillToClient(worker_cmd_fd);
+    memcpy(&session->data_sockaddr, server_info->ai_addr, server_info->ai_addrlen);
+    session->data_sockaddr_len = server_info->ai_addrlen;
+    freeaddrinfo(server_info);
+    return 0;
+}
+
+/* listen for the session's passive data connection on an ephemeral port of the address the
+ * client reached us on, accepting only the control connection's peer. Returns -1 on failure */
+int openPassiveListener(struct client_session* session, int cmd_fd)
+{
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(session->passive_peer);
+
+    if (getsockname(cmd_fd, (struct sockaddr*) &local, &local_len) == -1 ||
+            getpeername(cmd_fd, (struct sockaddr*) &session->passive_peer, &peer_len) == -1)
+        return -1;
+    if (local.ss_family == AF_INET) ((struct sockaddr_in*) &local)->sin_port = 0;
+    else if (local.ss_family == AF_INET6) ((struct sockaddr_in6*) &local)->sin6_port = 0;
+    else return -1;
+
+    int listen_fd = socket(local.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) return -1;
+    applySocketProfile(listen_fd, socketProfile(SOCKET_DATA));
+    if (bind(listen_fd, (struct sockaddr*) &local, local_len) == -1 || listen(listen_fd, 1) == -1 ||
+            getsockname(listen_fd, (struct sockaddr*) &local, &local_len) == -1) {
+        close(listen_fd);
+        return -1;
     }
+
+    session->passive_fd = listen_fd;
+    session->passive_port = ntohs(local.ss_family == AF_INET ? ((struct sockaddr_in*) &local)->sin_port
+                                                            : ((struct sockaddr_in6*) &local)->sin6_port);
+    return 0;
 }
 
-/* called by ctrlLoop() (worker thread) to handle a single command */
-int handleClientCmd(int worker_cmd_fd, char** client_data_socket_info)
-{ 
-    /* acquire a free io mutex */
-    int mutex_idx = acquireFreeIOMutex(); 
-
-    if (mutex_idx != -1) {
-        /* already memset to 0 by acquireFreeIOMutex */
-        unsigned char* in_buffer = in_buffers[mutex_idx];
-        unsigned char* out_buffer = out_buffers[mutex_idx];
-
-        int retval;
-
-        recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE, 0);
-        
-        if (strcmp((char*) in_buffer, "\0") == 0) {
-            handleClientDisconnect(worker_cmd_fd);
-            retval = -1;
-        } else if (validCommand(in_buffer)) {
-	    printf("Command received: %s\n", in_buffer);
-            int worker_data_fd = establishDataConnection(client_data_socket_info); 
-            if (worker_data_fd != -1) {
-                /* parse args  */
-                if (strncmp((char*) in_buffer, GET_MESSAGE, 2)   == 0)       
-                    handleGetCmd(worker_data_fd, worker_cmd_fd, in_buffer, out_buffer);
-                else if (strncmp((char*) in_buffer, LIST_MESSAGE, 2) == 0)  
-		    printf("handling list\n");
-                    handleListCmd(worker_data_fd, worker_cmd_fd, in_buffer, out_buffer);
-            }
-            close(worker_data_fd);
-            retval = 0;
-        } else {
-	    /* invalid command received */
-            handleInvalidCmd(worker_cmd_fd, in_buffer, out_buffer);
-            retval = 1;
+/* accept the client's data connection on the passive listener, closing any from another host.
+ * flags go to accept4(). Returns the socket, or -1 (EAGAIN if none is pending) */
+int acceptPassiveConnection(struct client_session* session, int flags)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+
+    while (1) {
+        peer_len = sizeof(peer);
+        int data_fd = accept4(session->passive_fd, (struct sockaddr*) &peer, &peer_len, flags | SOCK_CLOEXEC);
+        if (data_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return -1;
         }
-        pthread_mutex_unlock(&io_mutexes[mutex_idx]);
-        //printf("Worker unlocked mutex %d\n", mutex_idx);
-        return retval;
-    } else {
-        fprintf(stderr, "No IO mutex available\n");
-        return 1;
+
+        int same_host = peer.ss_family == session->passive_peer.ss_family &&
+            (peer.ss_family == AF_INET
+                ? memcmp(&((struct sockaddr_in*) &peer)->sin_addr,
+                         &((struct sockaddr_in*) &session->passive_peer)->sin_addr, sizeof(struct in_addr)) == 0
+                : memcmp(&((struct sockaddr_in6*) &peer)->sin6_addr,
+                         &((struct sockaddr_in6*) &session->passive_peer)->sin6_addr, sizeof(struct in6_addr)) == 0);
+        if (same_host) return data_fd;
+        logEvent(session->id, LOG_PASSIVE_REFUSED, NULL);
+        close(data_fd);
     }
-} 
+}
 
-/* returns 0 if an invalid command received, 1 if a valid command received */
-int validCommand(unsigned char* command)
+/* close the session's passive listener, if open */
+void closePassiveListener(struct client_session* session)
 {
-    if (strncmp((char*) command, GET_MESSAGE, 2) == 0 ||
-        strncmp((char*) command, LIST_MESSAGE, 2) == 0) {
-            return 1; 
-    } else {
+    if (session->passive_fd != -1) {
+        close(session->passive_fd);
+        session->passive_fd = -1;
+    }
+}
+
+/* append bytes received on the control connection to the command queue. Legacy and
+ * non-pipelining sessions send one command per message, so each message is terminated
+ * here. Returns -1 if the queue is full */
+int queueCommandBytes(struct client_session* session, unsigned char* bytes, size_t len)
+{
+    int terminate = !(session->capabilities & CAP_PERSIST);
+    if (session->commands_len + len + terminate > COMMAND_QUEUE_SIZE) return -1;
+    memcpy(session->commands + session->commands_len, bytes, len);
+    session->commands_len += len;
+    if (terminate) session->commands[session->commands_len++] = '\n';
+    return 0;
+}
+
+/* length of the payload following a command on the control connection, 0 if it has none.
+ * Only delta GETs of +persist sessions carry one */
+static size_t commandPayloadLength(struct client_session* session, unsigned char* command)
+{
+    unsigned long block_size;
+    unsigned long long count;
+
+    if (!(session->capabilities & CAP_PERSIST) || strncmp((char*) command, DELTA_MESSAGE " ", 3) != 0)
+        return 0;
+    if (sscanf((char*) command + 3, "%lu %llu", &block_size, &count) != 2 || count > DELTA_MAX_BLOCKS)
+        return 0;
+    return (size_t) count * DELTA_SIGNATURE_LENGTH;
+}
+
+/* move queued bytes into the pending payload. Once it's complete, its command goes into
+ * command and 1 is returned */
+static int takeUpload(struct client_session* session, unsigned char* command)
+{
+    size_t wanted = session->upload_size - session->upload_len;
+    size_t len = session->commands_len < wanted ? session->commands_len : wanted;
+
+    if (session->upload != NULL) memcpy(session->upload + session->upload_len, session->commands, len);
+    session->upload_len += len;
+    session->commands_len -= len;
+    memmove(session->commands, session->commands + len, session->commands_len);
+    if (session->upload_len < session->upload_size) return 0;
+
+    memcpy(command, session->upload_command, IN_BUFFER_SIZE);
+    session->upload_size = 0;
+    return 1;
+}
+
+/* pop the next complete command off the queue into command (IN_BUFFER_SIZE bytes). A command
+ * with a payload isn't complete until all of it is in session->upload, where it stays for the
+ * command's handler. Returns 0 if no complete command is queued */
+int nextCommand(struct client_session* session, unsigned char* command)
+{
+    if (session->upload_size > 0) return takeUpload(session, command);
+
+    char* newline = memchr(session->commands, '\n', session->commands_len);
+    if (newline == NULL) {
+        if (session->commands_len == COMMAND_QUEUE_SIZE) session->commands_len = 0;	// garbage, drop it
         return 0;
     }
-} 
 
-/**************************** Data connection handling in worker thread **************************************/
+    size_t line_len = newline - session->commands;
+    size_t copy_len = line_len < IN_BUFFER_SIZE - 1 ? line_len : IN_BUFFER_SIZE - 1;
+    memcpy(command, session->commands, copy_len);
+    command[copy_len] = '\0';
+    if (copy_len > 0 && command[copy_len - 1] == '\r') command[copy_len - 1] = '\0';
+
+    session->commands_len -= line_len + 1;
+    memmove(session->commands, newline + 1, session->commands_len);
+
+    size_t payload = commandPayloadLength(session, command);
+    if (payload == 0) return 1;
+    releaseUpload(session);
+    memcpy(session->upload_command, command, IN_BUFFER_SIZE);
+    session->upload = malloc(payload);		// NULL: the payload is discarded, the command fails
+    session->upload_size = payload;
+    return takeUpload(session, command);
+}
 
-int getClientDataSocketInfo(int worker_cmd_fd, void* arg, char** dest) 
+/* read the rest of a pending payload straight from the control connection, bypassing the
+ * command queue. Returns 1 if bytes were read, 0 if the socket would block or nothing is
+ * pending, -1 if the client disconnected */
+int receiveUpload(struct client_session* session, int cmd_fd)
 {
-    int mutex_idx = acquireFreeIOMutex();
-    unsigned char* in_buffer = in_buffers[mutex_idx];
-    if (mutex_idx != -1) {
-	
-	/* get data address and port from client */
-        if (recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE, 0) == -1) return -1;
-        char* client_data_addr = malloc(strlen((char*) in_buffer));
-        memset(client_data_addr, 0, strlen((char*) in_buffer));
-        strcpy(client_data_addr, (char*) in_buffer);
-        memset(in_buffer, 0, IN_BUFFER_SIZE);
+    unsigned char discard[OUT_BUFFER_SIZE];
+    size_t wanted = session->upload_size - session->upload_len;
+    ssize_t n;
+
+    if (wanted == 0) return 0;
+    if (session->upload == NULL && wanted > sizeof(discard)) wanted = sizeof(discard);
+    do {
+        n = recv(cmd_fd, session->upload != NULL ? session->upload + session->upload_len : discard, wanted, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) {
+        session->upload_len += n;
+        return 1;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+}
 
-        if (send(worker_cmd_fd, ACK_ADDR, strlen(ACK_ADDR), 0) == -1) return -1;
+/* free a command payload the command's handler didn't take */
+void releaseUpload(struct client_session* session)
+{
+    free(session->upload);
+    session->upload = NULL;
+    session->upload_len = session->upload_size = 0;
+}
 
-        if (recv(worker_cmd_fd, in_buffer, IN_BUFFER_SIZE, 0) == -1) return -1;
-        char* client_data_port = malloc(strlen((char*) in_buffer));
-        memset(client_data_port, 0, strlen((char*) in_buffer));
-        strcpy(client_data_port, (char*) in_buffer);
+/* write value into dst as 8 bytes in network byte order */
+static void encodeUint64(unsigned char* dst, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        dst[i] = (unsigned char) (value >> (56 - 8 * i));
+}
 
-        if (send(worker_cmd_fd, ACK_PORT, strlen(ACK_PORT), 0) == -1) return -1;
+/* write a frame header into dst, which must hold FRAME_HEADER_SIZE bytes */
+void encodeFrameHeader(unsigned char* dst, int opcode, int flags, uint64_t length)
+{
+    dst[0] = PROTOCOL_FRAMED;
+    dst[1] = (unsigned char) opcode;
+    dst[2] = (unsigned char) (flags >> 8);
+    dst[3] = (unsigned char) flags;
+    memset(dst + 4, 0, 4);
+    encodeUint64(dst + 8, length);
+}
 
-        //printf("Received data socket info from client: %s:%s\n", client_data_addr, client_data_port);
+/* build a framed ERROR response carrying message */
+void buildErrorResponse(struct client_session* session, char* message, struct transfer* xfer)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    initTransfer(xfer);
+    encodeFrameHeader(header, FRAME_ERROR, 0, strlen(message));
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    appendTransferHead(xfer, message, strlen(message));
+}
 
-        pthread_mutex_unlock(&io_mutexes[mutex_idx]);
+/* stamp a response with its command's start, tune it to the data socket profile, and open its
+ * flow if responses are shaped. The threads engine sends on blocking sockets, so its flows sleep
+ * out their waits */
+void beginTransfer(struct client_session* session, struct transfer* xfer)
+{
+    xfer->command_ns = session->command_ns;
+    xfer->framed = session->protocol != PROTOCOL_LEGACY;	// only END_DATA may follow a short file
+    xfer->conn = session->id;
+    initSocketTuning(&xfer->tuning, socketProfile(SOCKET_DATA));
+    xfer->flow = openShapedFlow(xfer, &session->rate_tat_ns, server_options.engine == ENGINE_THREADS);
+}
 
-	/* store results in dest */
-        dest[0] = client_data_addr;
-	dest[1] = client_data_port;
-		
-        return 0;	// success
+/* append the end-of-response marker for the session's protocol */
+static void appendEndOfResponse(struct client_session* session, struct transfer* xfer)
+{
+    if (session->protocol == PROTOCOL_LEGACY) {
+        appendTransferTail(xfer, END_DATA_MESSAGE, strlen(END_DATA_MESSAGE));
     } else {
-        fprintf(stderr, "Couldn't get client data socket info\n");
-        return -1;
+        unsigned char header[FRAME_HEADER_SIZE];
+        encodeFrameHeader(header, FRAME_END, 0, 0);
+        appendTransferTail(xfer, header, FRAME_HEADER_SIZE);
     }
 }
 
-/* establish the data connection to transfer directory contents or file to client */
-int establishDataConnection(char** client_data_socket_info) 
-{ 
-    int server_data_fd = 0;
+/* append an END frame carrying crc, for +checksum sessions. A transfer still summing its file
+ * overwrites the value once the file is sent */
+static void appendChecksummedEnd(struct transfer* xfer, uint32_t crc)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t wire_crc = htonl(crc);
+    encodeFrameHeader(header, FRAME_END, FRAME_FLAG_CHECKSUM, CHECKSUM_LENGTH);
+    appendTransferTail(xfer, header, FRAME_HEADER_SIZE);
+    appendTransferTail(xfer, &wire_crc, CHECKSUM_LENGTH);
+}
 
-    int rv;
-    struct addrinfo hints, *server_info, *address_ptr;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+/* find the CRC-32 of bytes [start, end) of the transfer's open file: from the cache if it's
+ * the whole file and known, otherwise by summing the file as it streams. Returns 1 with *crc
+ * set, 0 if the transfer will sum it, -1 if the file can't be summed */
+static int checksumFileStream(struct transfer* xfer, off_t start, off_t end, uint32_t* crc)
+{
+    struct file_stream* file = &xfer->file;
+    off_t size = file->end;
+
+    if (start == 0 && end == size && lookupChecksum(file->dev, file->inode, file->mtime, size, crc))
+        return 1;
+    xfer->checksum = openChecksumStream(file->file_fd, start, end, file->dev, file->inode, file->mtime, size);
+    return xfer->checksum != NULL ? 0 : -1;
+}
+
+/* send a file range of at least -D MB as a one-shot download: read with O_DIRECT, or failing that
+ * dropped from the page cache behind the sender, so it doesn't evict the hot working set. A range
+ * summed as it streams keeps its pages, the sum reads them back after they are sent */
+static void sendOneShot(struct transfer* xfer)
+{
+    if (server_options.direct_mb == 0 || !xfer->has_file) return;
+    if (xfer->file.end - xfer->file.offset < (off_t) server_options.direct_mb * 1024 * 1024) return;
+
+    xfer->direct = openDirectStream(&xfer->file, server_options.engine == ENGINE_THREADS);
+    if (xfer->direct == NULL) {
+        xfer->file.drop_behind = xfer->checksum == NULL;
+        return;
+    }
+    xfer->direct->checksum = xfer->checksum;
+    closeFileStream(&xfer->file);
+    xfer->has_file = 0;
+}
+ 
+/* Get command handling */
+void handleGetCmd(struct client_session* session, int worker_data_fd, int worker_cmd_fd, 
+                    unsigned char* arg, struct io_buffer* io_buf)
+{   
+    struct transfer xfer;
 
-    //printf("Getting dynamic IP address info for data socket %s:%s\n", client_data_socket_info[0], client_data_socket_info[1]);
+    if (buildFileResponse(session, arg, &xfer) == 0) {
+        logEvent(session->id, LOG_SENDING_FILE, arg);
+    } else {
+        logEvent(session->id, LOG_FILE_NOT_FOUND, arg);
+        if (session->protocol == PROTOCOL_LEGACY) {
+            sendError(worker_cmd_fd, ERROR_BAD_FILENAME, io_buf->data);
+            send(worker_cmd_fd, END_DATA_MESSAGE, strlen(END_DATA_MESSAGE), 0);
+        }
+    }
+    beginTransfer(session, &xfer);
+    if (pumpTransfer(worker_data_fd, &xfer) == -1) {
+        logEvent(session->id, LOG_SEND_FAILED, NULL, logLiteral("file"));
+        closeSessionDataConnection(session);
+    }
+    releaseTransfer(&xfer);
+
+    if (session->protocol == PROTOCOL_LEGACY)
+        awaitEndDataAck(worker_data_fd);
+}
+
+/* build the response to a GET, ranged GET, batch GET, checksum or delta GET command */
+int buildFileResponse(struct client_session* session, unsigned char* command, struct transfer* xfer)
+{
+    if (strncmp((char*) command, RANGE_MESSAGE, 2) == 0)
+        return buildRangeResponse(session, (char*) (command + 3), xfer);
+    if (strncmp((char*) command, BATCH_MESSAGE, 2) == 0)
+        return buildBatchResponse(session, (char*) (command + 3), xfer);
+    if (strncmp((char*) command, CHECKSUM_MESSAGE, 2) == 0)
+        return buildChecksumResponse(session, (char*) (command + 3), xfer);
+    if (strncmp((char*) command, DELTA_MESSAGE, 2) == 0)
+        return buildDeltaResponse(session, (char*) (command + 3), xfer);
+    return buildGetResponse(session, (char*) (command + 3), xfer);
+}
 
-    if ((rv = getaddrinfo(client_data_socket_info[0], 
-                            client_data_socket_info[1], 
-                            &hints, &server_info)) != 0) {
-        fprintf(stderr, "Failed to get resolve dynamic IP address\n");
+/* build the response to a GET. File contents go out with sendfile(), or from the hot-file cache
+ * for small files, framed with a DATA header carrying the exact file size when the session
+ * negotiated framing, and ended by the file's CRC-32 for +checksum. Returns 0 on success, -1
+ * if the file doesn't exist (the transfer then holds the error response) */
+int buildGetResponse(struct client_session* session, char* file_name, struct transfer* xfer)
+{
+    initTransfer(xfer);
+
+    /* small hot files go out of their cached mapping without reading the file, unless the
+     * session would get them compressed or needs a sum that isn't known yet. The mapping is
+     * never read here: a file shrunk under it would fault, so an unknown sum is taken from the
+     * file as it streams */
+    uint32_t crc = 0;
+    int found = serverHasFile(file_name);
+    struct cached_file* cached;
+    if (found && (cached = xfer->cached = acquireCachedFile(file_name)) != NULL &&
+            (((session->capabilities & CAP_DEFLATE) &&
+              !sentUncompressed(cached->dev, cached->inode, cached->mtime, cached->size)) ||
+             ((session->capabilities & CAP_CHECKSUM) &&
+              !lookupChecksum(cached->dev, cached->inode, cached->mtime, cached->size, &crc)))) {
+        releaseCachedFile(xfer->cached);
+        xfer->cached = NULL;
+    }
+
+    if (!found || (xfer->cached == NULL && openFileStream(&xfer->file, file_name) != 0)) {
+        if (session->protocol == PROTOCOL_LEGACY)
+            appendEndOfResponse(session, xfer);
+        else
+            buildErrorResponse(session, ERROR_BAD_FILENAME, xfer);
         return -1;
     }
 
-    for (address_ptr = server_info; address_ptr != NULL; address_ptr = address_ptr->ai_next) {
-        if ((server_data_fd = socket(address_ptr->ai_family, address_ptr->ai_socktype, address_ptr->ai_protocol)) == -1) {
-            continue;
+    uint64_t file_size;
+    int summed = -1;			// 1: crc known, 0: summed as the file streams, -1: none
+    if (xfer->cached != NULL) {
+        xfer->body = xfer->cached->data;
+        xfer->body_len = file_size = (uint64_t) xfer->cached->size;
+        if (session->capabilities & CAP_CHECKSUM) summed = 1;	// looked up above
+    } else {
+        xfer->has_file = 1;
+        file_size = (uint64_t) xfer->file.end;
+        if (session->capabilities & CAP_CHECKSUM)
+            summed = checksumFileStream(xfer, 0, xfer->file.end, &crc);
+    }
+    if (session->protocol != PROTOCOL_LEGACY) {
+        int flags = 0;
+        if (xfer->has_file && (session->capabilities & CAP_DEFLATE)) {
+            /* a cached copy goes out without the original, so it's only used if the sum is known */
+            switch (openCompressedFile(&xfer->file, &xfer->zstream, summed != 0)) {
+                case COMPRESS_STREAM:
+                    xfer->has_file = 0;		// the compress stream frames the file itself
+                    break;
+                case COMPRESS_CACHED:
+                    flags = FRAME_FLAG_DEFLATE;
+                    file_size = (uint64_t) xfer->file.end;
+                    break;
+                case COMPRESS_NONE:
+                    break;
+            }
         }
-        if (connect(server_data_fd, address_ptr->ai_addr, address_ptr->ai_addrlen) == -1) {
-            close(server_data_fd);
-            continue;
+        if (xfer->zstream == NULL) {
+            unsigned char header[FRAME_HEADER_SIZE];
+            encodeFrameHeader(header, FRAME_DATA, flags, file_size);
+            appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
         }
-        break;
     }
+    if (summed >= 0) appendChecksummedEnd(xfer, crc);
+    else appendEndOfResponse(session, xfer);
+    sendOneShot(xfer);
+    return 0;
+}
 
-    if (address_ptr == NULL) {
-        fprintf(stderr, "Failed to connect to client data socket\n");
+/* build the response to a ranged GET, args being "{OFFSET} {LENGTH} {FILE_NAME}". Only the
+ * requested part of the file goes out with sendfile(), preceded by a RANGE frame describing
+ * it. Returns 0 on success, -1 if the request is malformed or the file doesn't exist (the
+ * transfer then holds an ERROR frame) */
+int buildRangeResponse(struct client_session* session, char* args, struct transfer* xfer)
+{
+    unsigned long long offset, length;
+    int name_start = 0;
+    initTransfer(xfer);
+
+    if (sscanf(args, "%llu %llu %n", &offset, &length, &name_start) != 2 || name_start == 0) {
+        buildErrorResponse(session, ERROR_INVALID_COMMAND, xfer);
+        return -1;
+    }
+    char* file_name = args + name_start;
+    if (!serverHasFile(file_name) || openFileStream(&xfer->file, file_name) != 0) {
+        buildErrorResponse(session, ERROR_BAD_FILENAME, xfer);
         return -1;
     }
 
-    char conn_ack[28];
-    recv(server_data_fd, conn_ack, 28, 0);
-    //printf("%s\n", conn_ack);
+    /* clamp to the file, the RANGE frame tells the client what it actually gets */
+    uint64_t file_size = (uint64_t) xfer->file.end;
+    if (offset > file_size) offset = file_size;
+    if (length > file_size - offset) length = file_size - offset;
+    xfer->file.offset = (off_t) offset;
+    xfer->file.end = (off_t) (offset + length);
+    xfer->has_file = 1;
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned char range[RANGE_PAYLOAD_SIZE];
+    encodeUint64(range, offset);
+    encodeUint64(range + 8, length);
+    encodeUint64(range + 16, file_size);
+
+    encodeFrameHeader(header, FRAME_RANGE, 0, RANGE_PAYLOAD_SIZE);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    appendTransferHead(xfer, range, RANGE_PAYLOAD_SIZE);
+    encodeFrameHeader(header, FRAME_DATA, 0, length);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+
+    uint32_t crc = 0;
+    if ((session->capabilities & CAP_CHECKSUM) &&
+            checksumFileStream(xfer, xfer->file.offset, xfer->file.end, &crc) >= 0)
+        appendChecksummedEnd(xfer, crc);
+    else
+        appendEndOfResponse(session, xfer);
+    sendOneShot(xfer);
+    return 0;
+}
 
-    return server_data_fd;
+/* head of one batch entry: an ENTRY frame with the file size and name, then the DATA header */
+static void appendBatchEntryHead(struct transfer* xfer, const char* name, off_t size)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned char entry_size[ENTRY_SIZE_LENGTH];
+    size_t name_len = strlen(name);
+
+    encodeFrameHeader(header, FRAME_ENTRY, 0, ENTRY_SIZE_LENGTH + name_len);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    encodeUint64(entry_size, (uint64_t) size);
+    appendTransferHead(xfer, entry_size, ENTRY_SIZE_LENGTH);
+    appendTransferHead(xfer, name, name_len);
+    encodeFrameHeader(header, FRAME_DATA, 0, (uint64_t) size);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
 }
 
-/* send a signal to client that all data has been sent */
-void sendEndData(int worker_data_fd)
+static int compareNames(const void* a, const void* b)
 {
-    //printf("Sending END_DATA_MESSAGE\n");
-    send(worker_data_fd, END_DATA_MESSAGE, strlen(END_DATA_MESSAGE), 0);
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* add every directory entry matching a glob to the batch, in name order */
+static void addMatchingFiles(struct transfer_batch* batch, const char* pattern)
+{
+    char name[NAME_MAX + 1];
+    size_t first = batch->count;
+    struct index_reader reader;
+    int indexed = fileIndexEnabled();
+    const struct index_snapshot* snapshot = indexed ? beginIndexRead(&reader) : NULL;
+
+    if (snapshot != NULL) {
+        const char* line = snapshot->listing;
+        const char* end = snapshot->listing + snapshot->listing_len;
+        while (line < end) {
+            const char* newline = memchr(line, '\n', end - line);
+            size_t len = newline - line;
+            if (len <= NAME_MAX) {
+                memcpy(name, line, len);
+                name[len] = '\0';
+                if (fnmatch(pattern, name, FNM_PERIOD) == 0) addBatchEntry(batch, name);
+            }
+            line = newline + 1;
+        }
+    }
+    if (indexed) endIndexRead(&reader);
+
+    if (snapshot == NULL) {
+        struct dirent* _dirent;
+        DIR* _dir = getDirectoryContents(".");
+        if (_dir == NULL) return;
+        while ((_dirent = readdir(_dir)) != NULL)
+            if (fnmatch(pattern, _dirent->d_name, FNM_PERIOD) == 0)
+                addBatchEntry(batch, _dirent->d_name);
+        closedir(_dir);
+    }
+    qsort(batch->names + first, batch->count - first, sizeof(char*), compareNames);
+}
+
+/* build the response to a batch GET, args being space separated names and globs. Files are
+ * opened one at a time as the batch streams; anything that isn't a readable regular file by
+ * then is skipped. Returns 0, or -1 if the batch can't be allocated */
+int buildBatchResponse(struct client_session* session, char* args, struct transfer* xfer)
+{
+    char* saveptr;
+    initTransfer(xfer);
+
+    struct transfer_batch* batch = calloc(1, sizeof(struct transfer_batch));
+    if (batch == NULL) {
+        buildErrorResponse(session, ERROR_SERVER_BUSY, xfer);
+        return -1;
+    }
+    batch->entry_head = appendBatchEntryHead;
+    xfer->batch = batch;
+
+    for (char* pattern = strtok_r(args, " ", &saveptr); pattern != NULL; pattern = strtok_r(NULL, " ", &saveptr)) {
+        if (strpbrk(pattern, "*?[") != NULL)
+            addMatchingFiles(batch, pattern);
+        else if (serverHasFile(pattern))
+            addBatchEntry(batch, pattern);
+    }
+    appendEndOfResponse(session, xfer);
+    return 0;
+}
+
+/* build the response to a checksum command: one DATA frame with the file's CRC-32, size and
+ * name. A checksum not yet cached is summed here, reading the whole file once, so the event
+ * loops build this response on a helper thread. A file that shrinks meanwhile is reported with
+ * the length summed. Returns 0 on success, -1 if the file doesn't exist (the transfer then
+ * holds an ERROR frame) */
+int buildChecksumResponse(struct client_session* session, char* file_name, struct transfer* xfer)
+{
+    struct file_stream file;
+    uint32_t crc;
+    off_t size;
+    char line[TRANSFER_INLINE_SIZE - FRAME_HEADER_SIZE];
+    initTransfer(xfer);
+
+    if (!serverHasFile(file_name) || openFileStream(&file, file_name) != 0) {
+        buildErrorResponse(session, ERROR_BAD_FILENAME, xfer);
+        return -1;
+    }
+    size = file.end;
+    if (!lookupChecksum(file.dev, file.inode, file.mtime, file.end, &crc)) {
+        struct checksum_stream* sum = openChecksumStream(file.file_fd, 0, file.end, file.dev, file.inode,
+                                                         file.mtime, file.end);
+        if (sum == NULL) {
+            closeFileStream(&file);
+            buildErrorResponse(session, ERROR_SERVER_BUSY, xfer);
+            return -1;
+        }
+        crc = finishChecksum(sum);
+        size = sum->end;
+        releaseChecksumStream(sum);
+    }
+    closeFileStream(&file);
+
+    int len = snprintf(line, sizeof(line), "%08x %lld %s\n", crc, (long long) size, file_name);
+    if (len < 0 || (size_t) len >= sizeof(line)) len = sizeof(line) - 1;
+    unsigned char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, FRAME_DATA, 0, (uint64_t) len);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    appendTransferHead(xfer, line, (size_t) len);
+    appendEndOfResponse(session, xfer);
+    return 0;
+}
+
+/* head of one delta operation: a COPY frame, or the DATA header of a literal run */
+static int appendDeltaOpHead(struct transfer* xfer, const struct delta_op* op)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    if (op->kind == DELTA_LITERAL) {
+        if (xfer->head_len + FRAME_HEADER_SIZE > TRANSFER_INLINE_SIZE) return -1;
+        encodeFrameHeader(header, FRAME_DATA, 0, op->count);
+        return appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    }
+
+    unsigned char copy[COPY_PAYLOAD_SIZE];
+    if (xfer->head_len + FRAME_HEADER_SIZE + COPY_PAYLOAD_SIZE > TRANSFER_INLINE_SIZE) return -1;
+    encodeFrameHeader(header, FRAME_COPY, 0, COPY_PAYLOAD_SIZE);
+    encodeUint64(copy, op->start);
+    encodeUint64(copy + 8, op->count);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    return appendTransferHead(xfer, copy, COPY_PAYLOAD_SIZE);
+}
+
+/* build the response to a delta GET, args being "{BLOCK_SIZE} {BLOCK_COUNT} {FILE_NAME}" and the
+ * client's block signatures in session->upload. The file is read with pread() and matched against
+ * them here and now, so event loops call this on a helper thread; the resulting literal runs go
+ * out with sendfile() as the transfer streams. A file that shrinks meanwhile is sent as far as it
+ * was matched. Returns 0 on success, -1 if the request is malformed or the file doesn't exist
+ * (the transfer then holds an ERROR frame) */
+int buildDeltaResponse(struct client_session* session, char* args, struct transfer* xfer)
+{
+    unsigned long block_size;
+    unsigned long long count;
+    int name_start = 0;
+    initTransfer(xfer);
+
+    if (sscanf(args, "%lu %llu %n", &block_size, &count, &name_start) != 2 || name_start == 0 ||
+            block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK ||
+            (count > 0 && (session->upload == NULL || session->upload_len != count * DELTA_SIGNATURE_LENGTH))) {
+        releaseUpload(session);
+        buildErrorResponse(session, ERROR_INVALID_COMMAND, xfer);
+        return -1;
+    }
+    char* file_name = args + name_start;
+    if (!serverHasFile(file_name) || openFileStream(&xfer->file, file_name) != 0) {
+        releaseUpload(session);
+        buildErrorResponse(session, ERROR_BAD_FILENAME, xfer);
+        return -1;
+    }
+
+    struct file_stream* file = &xfer->file;
+    off_t size = file->end;
+    uint32_t crc = 0;
+    struct delta_source source = { file->file_fd, size, 0, 0 };
+    source.sum = !lookupChecksum(file->dev, file->inode, file->mtime, size, &crc);
+    xfer->delta = computeDelta(&source, (uint32_t) block_size, session->upload, (size_t) count);
+    if (xfer->delta != NULL && source.sum) {
+        crc = source.crc;
+        if (source.size == size) storeChecksum(file->dev, file->inode, file->mtime, size, crc);
+    }
+    file->end = size = source.size;
+    releaseUpload(session);
+    if (xfer->delta == NULL) {
+        closeFileStream(file);
+        buildErrorResponse(session, ERROR_SERVER_BUSY, xfer);
+        return -1;
+    }
+    xfer->delta->op_head = appendDeltaOpHead;
+    logEvent(session->id, LOG_DELTA, file_name, xfer->delta->copied_bytes, xfer->delta->literal_bytes);
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned char range[RANGE_PAYLOAD_SIZE];
+    encodeUint64(range, 0);
+    encodeUint64(range + 8, (uint64_t) size);
+    encodeUint64(range + 16, (uint64_t) size);
+    encodeFrameHeader(header, FRAME_RANGE, 0, RANGE_PAYLOAD_SIZE);
+    appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    appendTransferHead(xfer, range, RANGE_PAYLOAD_SIZE);
+    appendChecksummedEnd(xfer, crc);
+    return 0;
 }
- 
-/* Get command handling */
-void handleGetCmd(int worker_data_fd, int worker_cmd_fd, unsigned char* arg, unsigned char* output_buffer)
-{   
-    char* file_name = (char*) (arg + 3);
-    DIR* _dir = getDirectoryContents("."); 		// open directory
-    if (directoryContains(_dir, file_name)) {		// verify directory contains file
-        printf("Sending file %s to client\n", arg);
-        FILE *fp = fopen(file_name, "r");
-        do {
-			memset(output_buffer, 0, OUT_BUFFER_SIZE);
-			fread(output_buffer, OUT_BUFFER_SIZE, 1, fp);
-			//printf("Buffer fill: %d / %d\n", strlen(output_buffer), OUT_BUFFER_SIZE);
-			send(worker_data_fd, output_buffer, OUT_BUFFER_SIZE, 0);
-		} while (strlen(output_buffer) == OUT_BUFFER_SIZE);
-        fclose(fp);
-    } else {
-        fprintf(stderr, "File not Found\n");
-        sendError(worker_cmd_fd, ERROR_BAD_FILENAME, output_buffer);
-        send(worker_cmd_fd, END_DATA_MESSAGE, strlen(END_DATA_MESSAGE), 0);
 
+/* returns 1 if file_name is an entry of the served directory, from the index when it's running */
+int serverHasFile(char* file_name)
+{
+    int found = 0;
+    if (fileIndexEnabled()) {
+        struct index_reader reader;
+        found = lookupIndexedFile(beginIndexRead(&reader), file_name) != NULL;
+        endIndexRead(&reader);
+        return found;
     }
-    sendDataDisconnectToClient(worker_data_fd);
-    closedir(_dir);
+
+    DIR* _dir = getDirectoryContents(".");
+    if (_dir != NULL) {
+        found = directoryContains(_dir, file_name);
+        closedir(_dir);
+    }
+    return found;
 }
 
 /* returns 0 if directory does not contain file, 1 if directory does contain file */
@@ -410,23 +1314,221 @@ int directoryContains(DIR* _dir, char* file_name)
     return 0;
 }
 
+/* Put command handling */
+void handlePutCmd(struct client_session* session, int worker_data_fd, unsigned char* command,
+                    struct io_buffer* io_buf)
+{
+    struct file_ingest ingest;
+    struct transfer xfer;
+    struct pollfd data = { .fd = worker_data_fd, .events = POLLIN };
+    int result;
+
+    /* the payload is spliced on a non-blocking pipe, so wait for the socket between passes */
+    beginPutCommand(session, command, &ingest, io_buf);
+    while ((result = pumpIngest(worker_data_fd, &ingest)) == 0) {
+        if (SERVER_DISCONNECT || (poll(&data, 1, INGEST_WAIT_MS) == -1 && errno != EINTR)) {
+            result = -1;
+            break;
+        }
+    }
+
+    if (result == -1) {
+        logEvent(session->id, LOG_UPLOAD_CUT_SHORT, ingest.name);
+        closeSessionDataConnection(session);
+    } else {
+        buildPutResponse(session, &ingest, &xfer);
+        beginTransfer(session, &xfer);
+        if (pumpTransfer(worker_data_fd, &xfer) == -1) {
+            logEvent(session->id, LOG_SEND_FAILED, NULL, logLiteral("upload response"));
+            closeSessionDataConnection(session);
+        }
+        releaseTransfer(&xfer);
+    }
+    releaseIngest(&ingest);
+}
+
+/* start receiving a PUT's payload into ingest. Without an I/O buffer the server is busy, and the
+ * payload is discarded before that is the response */
+void beginPutCommand(struct client_session* session, unsigned char* command, struct file_ingest* ingest,
+                     struct io_buffer* io_buf)
+{
+    uint64_t size = 0;
+    char* name = NULL;
+
+    parsePutCommand(command, &size, &name);		// validCommand() checked it
+    if (io_buf == NULL) {
+        rejectIngest(ingest, session->id, size, ERROR_SERVER_BUSY);
+    } else if (openIngest(ingest, session->id, name, size) == 0) {
+        logEvent(session->id, LOG_RECEIVING_FILE, name);
+    }
+}
+
+/* build the response to a fully received PUT: store the file under its name and answer END, or
+ * answer with the error that kept it from being stored */
+void buildPutResponse(struct client_session* session, struct file_ingest* ingest, struct transfer* xfer)
+{
+    if (ingest->error == NULL && commitIngest(ingest) == 0) {
+        logEvent(session->id, LOG_UPLOAD_STORED, ingest->name, ingest->size);
+        initTransfer(xfer);
+        appendEndOfResponse(session, xfer);
+    } else {
+        buildErrorResponse(session, ingest->error, xfer);
+    }
+}
+
 /* List command handling */
-void handleListCmd(int worker_data_fd, int worker_cmd_fd, unsigned char* arg, unsigned char* output_buffer)
+void handleListCmd(struct client_session* session, int worker_data_fd, int worker_cmd_fd, 
+                    unsigned char* arg, struct io_buffer* io_buf)
 {   
-    struct dirent* _dirent;
-    DIR* _dir = getDirectoryContents(".");
-    if (_dir != NULL) { 
-	printf("Sending directory contents to client\n"); 
-        while ((_dirent = readdir(_dir)) != NULL) {
-	    /* send each file or sub-directory name, followed by a newline */
-            send(worker_data_fd, (char*) _dirent->d_name, strlen((char*) _dirent->d_name), 0);
-            send(worker_data_fd, "\n", 1, 0);
+    struct transfer xfer;
+    int listed = buildListResponse(session, (char*) (arg + 2), &xfer, io_buf);
+    if (listed == 0 || session->protocol != PROTOCOL_LEGACY) {	// framed failures send an ERROR frame
+        if (listed == 0) logEvent(session->id, LOG_SENDING_LISTING, NULL);
+        beginTransfer(session, &xfer);
+        if (pumpTransfer(worker_data_fd, &xfer) == -1) {
+            logEvent(session->id, LOG_SEND_FAILED, NULL, logLiteral("directory contents"));
+            closeSessionDataConnection(session);
         }
-        send(worker_data_fd, END_DATA_MESSAGE, strlen(END_DATA_MESSAGE), 0);	// done sending 
-        closedir(_dir);
-        char fin_ack[strlen(END_DATA_MESSAGE)];
-        recv(worker_data_fd, fin_ack, strlen(END_DATA_MESSAGE), 0);		// receive FIN ACK
+        releaseTransfer(&xfer);
+        if (session->protocol == PROTOCOL_LEGACY)
+            awaitEndDataAck(worker_data_fd);		// receive FIN ACK
+    }
+}
+
+/* make room for len more body bytes, moving the body from the arena buffer to the heap once
+ * it outgrows it. Returns -1 if out of memory, the body then still holds what was listed */
+static int reserveListBody(struct transfer* xfer, struct io_buffer* io_buf, size_t* capacity, size_t len)
+{
+    while (xfer->body_len + len > *capacity) {
+        size_t grown = *capacity * 2;
+        unsigned char* body;
+        if (xfer->body_on_heap) {
+            body = realloc(xfer->body, grown);
+        } else if ((body = malloc(grown)) != NULL) {
+            memcpy(body, io_buf->data, xfer->body_len);
+        }
+        if (body == NULL) return -1;
+        xfer->body = body;
+        xfer->body_on_heap = 1;
+        *capacity = grown;
+    }
+    return 0;
+}
+
+/* appends listing entries to the transfer's body */
+struct list_body {
+    struct transfer* xfer;
+    struct io_buffer* io_buf;
+    size_t capacity;
+};
+
+static int appendListBody(void* ctx, const void* bytes, size_t len)
+{
+    struct list_body* list = (struct list_body*) ctx;
+    struct transfer* xfer = list->xfer;
+    if (reserveListBody(xfer, list->io_buf, &list->capacity, len) == -1) return -1;
+    memcpy(xfer->body + xfer->body_len, bytes, len);
+    xfer->body_len += len;
+    return 0;
+}
+
+/* drop a listing that couldn't be built; framed sessions are answered ERROR_SERVER_BUSY instead */
+static int abandonListResponse(struct client_session* session, struct transfer* xfer)
+{
+    if (xfer->body_on_heap) free(xfer->body);
+    initTransfer(xfer);
+    if (session->protocol != PROTOCOL_LEGACY)
+        buildErrorResponse(session, ERROR_SERVER_BUSY, xfer);
+    return -1;
+}
+
+/* build the response to a LIST. A plain LIST (empty args) is every file or sub-directory name
+ * followed by a newline, copied from the index when it's running. Framed sessions may page
+ * through the tree instead with "{FLAGS} {LIMIT} /{PREFIX} [{CURSOR}]" (see listing.h); the
+ * END frame then carries the cursor of the next page, if there is one. Entries are collected
+ * in the command's arena buffer (spilling to the heap for huge directories) and go out as one
+ * DATA frame. Returns -1 if the directory can't be read or the listing outgrows memory */
+int buildListResponse(struct client_session* session, char* args, struct transfer* xfer, struct io_buffer* io_buf)
+{
+    struct list_request request;
+    char next_cursor[PATH_MAX];
+    int paged = args[0] == ' ';
+    initTransfer(xfer);
+
+    struct list_body list = { xfer, io_buf, io_buf->size };
+    struct list_sink sink = { appendListBody, &list };
+    xfer->body = io_buf->data;
+
+    if (paged && parseListRequest(args + 1, &request) == -1) {
+        buildErrorResponse(session, ERROR_INVALID_COMMAND, xfer);
+        return -1;
+    }
+
+    const struct index_snapshot* snapshot = NULL;
+    struct index_reader reader;
+    int indexed = !paged && fileIndexEnabled();
+    int appended = 0;
+    if (indexed && (snapshot = beginIndexRead(&reader)) != NULL)
+        appended = appendListBody(&list, snapshot->listing, snapshot->listing_len);
+    if (indexed) endIndexRead(&reader);
+    if (appended == -1) return abandonListResponse(session, xfer);
+
+    int listed = 0;
+    if (snapshot == NULL) {
+        if (!paged) memset(&request, 0, sizeof(request));
+        if ((listed = listDirectory(".", &request, &sink, next_cursor)) == -1)
+            return abandonListResponse(session, xfer);
+    }
+
+    if (session->protocol != PROTOCOL_LEGACY) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        encodeFrameHeader(header, FRAME_DATA, 0, xfer->body_len);
+        appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
     }
+    if (listed == 1) {
+        /* a cursor may be longer than the tail holds, so the END frame follows the entries in the body */
+        unsigned char header[FRAME_HEADER_SIZE];
+        size_t cursor_len = strlen(next_cursor);
+        encodeFrameHeader(header, FRAME_END, FRAME_FLAG_CURSOR, cursor_len);
+        if (appendListBody(&list, header, FRAME_HEADER_SIZE) == -1 ||
+                appendListBody(&list, next_cursor, cursor_len) == -1)
+            return abandonListResponse(session, xfer);
+    } else {
+        appendEndOfResponse(session, xfer);
+    }
+    return 0;
+}
+
+/* Stats command handling */
+void handleStatsCmd(struct client_session* session, int worker_data_fd, struct io_buffer* io_buf)
+{
+    struct transfer xfer;
+    buildStatsResponse(session, &xfer, io_buf);
+    logEvent(session->id, LOG_SENDING_STATS, NULL);
+    beginTransfer(session, &xfer);
+    if (pumpTransfer(worker_data_fd, &xfer) == -1) {
+        logEvent(session->id, LOG_SEND_FAILED, NULL, logLiteral("server statistics"));
+        closeSessionDataConnection(session);
+    }
+    releaseTransfer(&xfer);
+    if (session->protocol == PROTOCOL_LEGACY)
+        awaitEndDataAck(worker_data_fd);
+}
+
+/* build the response to a STATS command: the server's metrics in the Prometheus text format,
+ * written into the command's arena buffer */
+int buildStatsResponse(struct client_session* session, struct transfer* xfer, struct io_buffer* io_buf)
+{
+    initTransfer(xfer);
+    xfer->body = io_buf->data;
+    xfer->body_len = formatMetrics((char*) io_buf->data, io_buf->size);
+    if (session->protocol != PROTOCOL_LEGACY) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        encodeFrameHeader(header, FRAME_DATA, 0, xfer->body_len);
+        appendTransferHead(xfer, header, FRAME_HEADER_SIZE);
+    }
+    appendEndOfResponse(session, xfer);
+    return 0;
 }
 
 /* returns a pointer to DIR for the current working directory */
@@ -452,9 +1554,9 @@ void printDirectory(DIR* _dir)
 /* send an error message to client */
 void sendError(int worker_cmd_fd, char* error, unsigned char* out_buffer)
 {
-    memset(out_buffer, 0, OUT_BUFFER_SIZE);
-    memcpy(out_buffer, error, strlen(error));
-    send(worker_cmd_fd, out_buffer, strlen((char*) out_buffer), 0);
+    size_t len = strlen(error);
+    memcpy(out_buffer, error, len);
+    send(worker_cmd_fd, out_buffer, len, 0);
 }
 
 /* handle invalid command (not used currently, handled by client) */
@@ -462,7 +1564,6 @@ void handleInvalidCmd(int worker_cmd_fd,
                         unsigned char* command, 
                         unsigned char* output_buffer) 
 {
-    fprintf(stderr, "Invalid command\n"); 
     sendError(worker_cmd_fd, ERROR_INVALID_COMMAND, output_buffer);
 }
 
@@ -471,43 +1572,21 @@ void handleBadFilename(int worker_cmd_fd,
                         char* file_name,
                         unsigned char* output_buffer)
 {
-    fprintf(stderr, "Invalid filename\n");
+    logEvent(0, LOG_FILE_NOT_FOUND, file_name);
     sendError(worker_cmd_fd, ERROR_BAD_FILENAME, output_buffer);
 }
 
 /********************************** Connection termination **********************************************/
 
 /* client has disconnected */
-void handleClientDisconnect(int worker_cmd_fd)
+void handleClientDisconnect(struct client_session* session)
 {
-    fprintf(stderr, "Client disconnected\n");
+    logEvent(session->id, LOG_CLIENT_DISCONNECTED, NULL);
 }
 
-/* tell client to disconnect */
-void sendDataDisconnectToClient(int worker_data_fd)
-{
-    //printf("Sending %s\n", END_DATA_MESSAGE);
-    sendEndData(worker_data_fd);
-    char fin_ack[strlen(END_DATA_MESSAGE)];
-    recv(worker_data_fd, fin_ack, strlen(END_DATA_MESSAGE), 0);
-} 
 
 /*************************************** Shutdown handling ***********************************************/
 
-/* terminate a worker thread, called from within the worker thread itself */
-void workerThreadComplete(int worker_cmd_fd, char** client_data_socket_info, void* arg)
-{
-    //printf("Worker thread complete\n");
-    close(worker_cmd_fd);
-    if (client_data_socket_info[0]) free(client_data_socket_info[0]);
-    if (client_data_socket_info[1]) free(client_data_socket_info[1]);
-    if (client_data_socket_info) free(client_data_socket_info);
-    if (arg) free(arg);
-    //printf("Worker thread exiting\n");
-    pthread_exit(NULL);					// worker thread exits, rather than being joined
-										// main thread does not need to keep track of threads
-}
-
 /* send a message to client indicating that client should shut down */
 void sendKillToClient(int worker_cmd_fd)
 {
@@ -518,48 +1597,35 @@ void sendKillToClient(int worker_cmd_fd)
 /* deallocate heap memory */
 void serverTearDown()
 {
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        if (in_buffers[i]) free(in_buffers[i]);
-        if (out_buffers[i]) free(out_buffers[i]);
-    }
-    for (int i = 0; i < socket_count; i++) {
-        int try = send(sockets[i], "TEST", 4, 0);
-        if (try != -1) {
-            close(sockets[i]);
-        }
-    }
-    free(sockets);
+    stopLogging();
+    stopMetrics();
+    stopFileIndex();
+    destroyCompressionCache();
+
+    struct file_cache_stats cache_stats;
+    getFileCacheStats(&cache_stats);
+    printf("File cache: %llu hits, %llu misses, %llu evictions, %llu invalidations\n",
+           (unsigned long long) cache_stats.hits, (unsigned long long) cache_stats.misses,
+           (unsigned long long) cache_stats.evictions, (unsigned long long) cache_stats.invalidations);
+    destroyFileCache();
+    destroyListingCache();
+    flushThreadBufferCache();
+    destroyBufferArena();
     printf("Server teardown complete, exiting\n");
     exit(1); 
 }
 
-/****************************** IO resource sharing among threads *************************/
-
-/* returns a mutex which can be used to access corresponding thread-safe buffers to store
- * strings to send to client or strings received to client */
-int acquireFreeIOMutex() {
-    int acquired = -1, idx = 0;
-    while (idx < NUM_BUFFERS && acquired == -1) {
-        if (pthread_mutex_trylock(&io_mutexes[idx]) == 0) {
-            acquired = 1;
-            //printf("Mutex %d acquired\n", idx);
-        } else {
-            idx++;
-        }
-    }
-    if (acquired > 0) {
-        memset(in_buffers[idx], 0, IN_BUFFER_SIZE);
-        memset(out_buffers[idx], 0, OUT_BUFFER_SIZE);
-        return idx;
-    } else {
-        return acquired;
-    }
-}
-
 /*************************************** Signal handling **********************************/
 
 void sigint_intercept(int signal_number)
 {
     printf("SIGINT received, terminating server...\n");
     SERVER_DISCONNECT = 1;
+    wakeEventLoops();
+    wakeWorkerPool();
+}
+
+void sigusr1_intercept(int signal_number)
+{
+    cycleLogLevel();		// the log thread reports the new level
 }
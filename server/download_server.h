@@ -8,7 +8,11 @@
  * 		to the client.
  * ************************************************************************************/
 
+#ifndef DOWNLOAD_SERVER_H
+#define DOWNLOAD_SERVER_H
+
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -19,24 +23,35 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <getopt.h>
+
+#define SERVER_USAGE "Usage: $ ./server {PORT} [-e threads|epoll|uring] [-n NUM_LOOPS] [-w WORKERS] [-a MAX_CLIENTS] [-m BUFFER_MB] [-z CACHE_MB] [-c CACHE_MB] [-p METRICS_PORT] [-R TOTAL_MBIT] [-r CLIENT_MBIT] [-q WEIGHT] [-t DATA_PROFILE] [-T CONTROL_PROFILE] [-S hash|cpu|bpf] [-D DIRECT_MB] [-L error|warn|info|debug]\n"
 
 /* Global constants */
 #define IN_BUFFER_SIZE      128
 #define OUT_BUFFER_SIZE     4096
-#define NUM_BUFFERS         5
 
-#define CONNECTION_BACKLOG  10
-#define SOCKETS_ALLOWED     24
+#define CONNECTION_BACKLOG  1024    // admission control decides, not SYN drops
 
 #define ADDRESS_LENGTH      15
 #define PORT_LENGTH         5
+#define DATA_GREETING_LENGTH 28
+#define COMMAND_QUEUE_SIZE  4096
 
 /* Message definitions */
 #define GET_MESSAGE         "-g"
+#define RANGE_MESSAGE       "-r"
+#define BATCH_MESSAGE       "-b"
 #define LIST_MESSAGE        "-l"
+#define STATS_MESSAGE       "-s"
+#define CHECKSUM_MESSAGE    "-c"
+#define DELTA_MESSAGE       "-d"
+#define PUT_MESSAGE         "-u"
 
 #define ERROR_INVALID_COMMAND   "@@ERROR_INVALID_COMMAND"
 #define ERROR_BAD_FILENAME      "@@ERROR_BAD_FILENAME"
+#define ERROR_SERVER_BUSY       "@@ERROR_SERVER_BUSY"
+#define ERROR_UPLOAD_FAILED     "@@ERROR_UPLOAD_FAILED"
 #define SERVER_KILL_MESSAGE     "@@SERVER_KILL"
 
 #define ACK_ADDR            "@@ACK_ADDR"
@@ -46,8 +61,113 @@
 #define LIST_RES_SENTINEL   "@@LIST"
 #define END_DATA_MESSAGE    "@@END_DATA"
 
+/* Binary framing. A client asks for it by appending " FRAME/{VERSION}" to its data port
+ * message, optionally followed by capability tokens; the server echoes the version and
+ * tokens it accepted after ACK_PORT. Clients that don't ask get the legacy text protocol
+ * (payload, END_DATA_MESSAGE, ACK from client). Capabilities require framing. */
+#define PROTOCOL_LEGACY         0
+#define PROTOCOL_FRAMED         1       // highest frame version this server speaks
+#define PROTOCOL_CAPABILITY     "FRAME/"
+
+/* +persist: the data connection stays open across commands, and commands are newline
+ * terminated so a client may pipeline several before the first response arrives. Every
+ * command, including rejected ones, gets exactly one response on the data connection,
+ * in the order the commands were sent. */
+#define CAPABILITY_PERSIST      "+persist"
+
+/* +deflate: a GET of a compressible file may come back as a zlib stream split across DATA
+ * frames flagged FRAME_FLAG_DEFLATE; the client inflates their payloads in order */
+#define CAPABILITY_DEFLATE      "+deflate"
+
+/* +passive: the client opens the data connection instead of the server. The server listens
+ * on an ephemeral port of the control connection's local address, named in the port ACK as
+ * "+passive:{PORT}". Only the control connection's peer may connect, and it sends the usual
+ * data connection greeting. Works from behind NAT and never resolves the client's address. */
+#define CAPABILITY_PASSIVE      "+passive"
+#define PASSIVE_ACCEPT_TIMEOUT_MS   10000
+
+/* +mux: responses are framed onto the control connection itself, so a session is a single
+ * socket and a command needs no connection setup. Implies +persist, and replaces +passive
+ * if both are asked for. Commands keep arriving newline terminated on the same socket. */
+#define CAPABILITY_MUX          "+mux"
+
+/* +checksum: the END frame of a GET or ranged GET is flagged FRAME_FLAG_CHECKSUM and its payload
+ * is the CRC-32 (zlib's polynomial, network byte order) of the file bytes served, uncompressed */
+#define CAPABILITY_CHECKSUM     "+checksum"
+
+enum session_capability {
+    CAP_PERSIST  = 1 << 0,
+    CAP_DEFLATE  = 1 << 1,
+    CAP_PASSIVE  = 1 << 2,
+    CAP_MUX      = 1 << 3,
+    CAP_CHECKSUM = 1 << 4
+};
+
+/* Frame header on the data connection, multi-byte fields in network byte order:
+ *   byte  0     protocol version
+ *   byte  1     opcode (enum frame_opcode)
+ *   bytes 2-3   flags
+ *   bytes 4-7   reserved, 0
+ *   bytes 8-15  payload length
+ * A response is DATA frames followed by END, or a single ERROR frame whose payload is
+ * the error message. Without +persist the data connection is closed after END/ERROR.
+ * No ACK is sent either way. */
+#define FRAME_HEADER_SIZE   16
+#define FRAME_FLAG_DEFLATE  0x0001      // DATA payload is part of a zlib stream
+#define FRAME_FLAG_CHECKSUM 0x0002      // END payload is the response's CRC-32
+#define FRAME_FLAG_CURSOR   0x0004      // END payload is where the next page of a LIST starts
+
+enum frame_opcode {
+    FRAME_DATA = 1,
+    FRAME_END,
+    FRAME_ERROR,
+    FRAME_RANGE,
+    FRAME_ENTRY,
+    FRAME_COPY
+};
+
+/* Ranged GET, framed sessions only: "-r {OFFSET} {LENGTH} {FILE_NAME}". The range is clamped
+ * to the file. The response is a RANGE frame whose payload is the offset, length and file
+ * size actually served (64-bit each, network byte order), a DATA frame of that length, then
+ * END. A LENGTH of 0 just reports the file size, so clients can plan segmented downloads. */
+#define RANGE_PAYLOAD_SIZE  24
+
+/* Batch GET, framed sessions only: "-b {NAME|GLOB} [{NAME|GLOB} ...]". Every matching regular
+ * file is sent as an ENTRY frame (64-bit file size, then the name) followed by a DATA frame of
+ * the file, and the batch ends with END. Names that match nothing are skipped. */
+#define ENTRY_SIZE_LENGTH   8
+
+/* Paged LIST, framed sessions only: "-l {FLAGS} {LIMIT} /{PREFIX} [{CURSOR}]". FLAGS holds 'm'
+ * for binary records with metadata and 'r' to walk sub-directories, or is '-'; LIMIT is the most
+ * entries in the page, 0 for all; only paths starting with PREFIX (without spaces) are listed,
+ * "/" for all; CURSOR, the rest of the line, resumes the walk after that path. The page is one
+ * DATA frame of "{PATH}\n" lines, or of records: type (0 file, 1 directory, 2 symlink, 3 other),
+ * 16-bit path length, 64-bit size, 64-bit mtime seconds, 32-bit mtime nanoseconds, then the path,
+ * in network byte order. Entries come sorted, depth first. If more are left, the END frame is
+ * flagged FRAME_FLAG_CURSOR and carries the cursor for the next page. */
+
+/* Checksum, framed sessions only: "-c {FILE_NAME}". The response is one DATA frame holding the
+ * line "{CRC-32 as 8 hex digits} {FILE_SIZE} {FILE_NAME}\n", then END. The checksum is cached
+ * per file version, so asking again (or after a GET) doesn't read the file. */
+
+/* Delta GET, +persist sessions only: "-d {BLOCK_SIZE} {BLOCK_COUNT} {FILE_NAME}", followed on the
+ * control connection by BLOCK_COUNT signatures of the client's copy, one per full block: Adler-32
+ * then CRC-32 of the block, 32 bits each in network byte order. The response is a RANGE frame
+ * (0, file size, file size), then COPY and DATA frames in file order, then END carrying the
+ * CRC-32 of the whole file as with +checksum. A COPY frame's payload is a first block and a
+ * block count (64-bit each, network byte order) to take from the client's copy; DATA frames are
+ * literal bytes. */
+#define COPY_PAYLOAD_SIZE   16
+
+/* Upload, +persist sessions with a data connection (not +mux) only: "-u {SIZE} {FILE_NAME}".
+ * Once the data connection is up the client sends exactly SIZE bytes of the file on it, and the
+ * response is END once the file is stored under FILE_NAME, replacing any file of that name, or an
+ * ERROR frame (ERROR_BAD_FILENAME for a name with '/' or a leading '.', ERROR_UPLOAD_FAILED if it
+ * couldn't be stored). Either way the whole payload is read first. Until the END frame the file's
+ * name still refers to the old file, if any, so no one sees a partial upload. */
+
 /* Global flags */
-int SERVER_DISCONNECT;
+extern int SERVER_DISCONNECT;
 
 /* Types */
 enum client_status {
@@ -56,63 +176,141 @@ enum client_status {
     CLIENT_INVALID_CONNECTED
 };
 
-/* Global variables */
-static pthread_mutex_t io_mutexes[NUM_BUFFERS];
+/* I/O engine used to service clients, selected with -e on the command line */
+enum server_engine {
+    ENGINE_THREADS = 0,     // a fixed pool of blocking worker threads
+    ENGINE_EPOLL,           // edge-triggered epoll event loops, one per core
+    ENGINE_URING            // the epoll loops, sending files through io_uring
+};
+
+/* Per-client state shared by both engines */
+struct client_session {
+    uint64_t id;            // tags the client's log records, never 0
+    char data_addr[IN_BUFFER_SIZE];
+    char data_port[IN_BUFFER_SIZE];
+    int protocol;           // PROTOCOL_LEGACY or the negotiated frame version
+    unsigned int capabilities;                  // CAP_* bits accepted in the handshake
+    struct sockaddr_storage data_sockaddr;      // client data address, resolved once
+    socklen_t data_sockaddr_len;                // 0 if resolution failed
+    int data_fd;            // threaded engine: open data connection (+mux: a dup of the control socket), -1 if none
+    int passive_fd;         // +passive: listener the client connects its data connection to, -1 if none
+    int passive_port;
+    struct sockaddr_storage passive_peer;       // +passive: the only address allowed to connect
+    char commands[COMMAND_QUEUE_SIZE];          // received but not yet executed commands
+    size_t commands_len;
+    char upload_command[IN_BUFFER_SIZE];        // command whose payload is being received
+    unsigned char* upload;  // the payload, on the heap. NULL if refused, it is then discarded
+    size_t upload_len;
+    size_t upload_size;     // payload length announced by the command, 0 if none pending
+    uint64_t accepted_ns;   // when the control connection was accepted
+    uint64_t command_ns;    // when the current command started
+    uint64_t commands_run;
+    uint64_t rate_tat_ns;   // per-client token bucket (-r): when it is full again
+};
+
+struct transfer;
+struct io_buffer;
+struct file_ingest;
+
+struct server_options {
+    enum server_engine engine;
+    int num_loops;          // event loops to run in ENGINE_EPOLL (0 = one per core)
+    int num_workers;        // worker threads in ENGINE_THREADS (0 = POOL_THREADS_PER_CORE per core)
+    int max_clients;        // ENGINE_THREADS clients served at once, more wait or are refused
+    int buffer_budget_mb;   // memory the I/O buffer arena may allocate
+    int compress_cache_mb;  // disk the compressed-copy cache may use (0 = don't cache)
+    int file_cache_mb;      // memory small hot files may keep mmap'd (0 = don't cache)
+    int metrics_port;       // local port serving Prometheus metrics (0 = STATS command only)
+    int total_mbit;         // egress shaped to this many Mbit/s in total (0 = unlimited)
+    int client_mbit;        // ... and per client (0 = unlimited)
+    int interactive_weight; // fair share of an interactive response relative to a bulk one
+    int shard_steering;     // enum shard_steering: SHARD_OFF, or each event loop listens on its own socket
+    int direct_mb;          // files at least this large are read with O_DIRECT (0 = never)
+    int log_level;          // enum log_level: records below it are skipped, SIGUSR1 cycles it
+};
 
-unsigned char* in_buffers[NUM_BUFFERS];
-unsigned char* out_buffers[NUM_BUFFERS];
-int* sockets;
-int socket_count;
+/* Global variables */
+extern struct server_options server_options;
 
 /* Server setup */
 void initializeServer(char*);
 char* getValidPort(int, char**);
+void parseServerOptions(int, char**);
 
 /* Server startup, runs in main thread */
 int createWelcomeSocket(char*);
 int bindWelcomeSocket(struct addrinfo*, struct addrinfo**, struct addrinfo**);
 void startServer(int, char*);
 
-/* worker thread main function */
-void* worker_thread(void*);
-
 /* Command connection handling in worker thread */
-void establishCommandConnection(int, char*);
-void ctrlLoop(int, char**, void*);
-int handleClientCmd(int, char**);
+int handleClientCmd(int, struct client_session*);
+int executeClientCmd(int, struct client_session*, unsigned char*);
 void displayMessage(unsigned char*);
-int validCommand(unsigned char*);
+int validCommand(struct client_session*, unsigned char*);
 
 /* Data connection handling in worker thread */
-int getClientDataSocketInfo(int, void*, char**);
-int establishDataConnection(char**);
-void sendEndData(int);
+int getClientDataSocketInfo(int, struct client_session*);
+int establishDataConnection(struct client_session*);
+void closeSessionDataConnection(struct client_session*);
+void awaitEndDataAck(int);
+
+/* Protocol negotiation and framing, shared by both engines */
+void initSession(struct client_session*);
+void beginCommand(struct client_session*);
+void storeDataAddress(struct client_session*, unsigned char*);
+const char* negotiateProtocol(struct client_session*, int, unsigned char*, char*);
+int resolveDataAddress(struct client_session*);
+int openPassiveListener(struct client_session*, int);
+int acceptPassiveConnection(struct client_session*, int);
+void closePassiveListener(struct client_session*);
+int queueCommandBytes(struct client_session*, unsigned char*, size_t);
+int nextCommand(struct client_session*, unsigned char*);
+int receiveUpload(struct client_session*, int);
+void releaseUpload(struct client_session*);
+void encodeFrameHeader(unsigned char*, int, int, uint64_t);
+void buildErrorResponse(struct client_session*, char*, struct transfer*);
+void beginTransfer(struct client_session*, struct transfer*);
 
 /* Get command handling */
-void handleGetCmd(int, int, unsigned char*, unsigned char*);
+void handleGetCmd(struct client_session*, int, int, unsigned char*, struct io_buffer*);
+int buildFileResponse(struct client_session*, unsigned char*, struct transfer*);
+int buildGetResponse(struct client_session*, char*, struct transfer*);
+int buildRangeResponse(struct client_session*, char*, struct transfer*);
+int buildBatchResponse(struct client_session*, char*, struct transfer*);
+int buildChecksumResponse(struct client_session*, char*, struct transfer*);
+int buildDeltaResponse(struct client_session*, char*, struct transfer*);
+int serverHasFile(char*);
 int directoryContains(DIR*, char*);
 
+/* Put command handling */
+void handlePutCmd(struct client_session*, int, unsigned char*, struct io_buffer*);
+void beginPutCommand(struct client_session*, unsigned char*, struct file_ingest*, struct io_buffer*);
+void buildPutResponse(struct client_session*, struct file_ingest*, struct transfer*);
+
 /* List command handling */
-void handleListCmd(int, int, unsigned char*, unsigned char*);
+void handleListCmd(struct client_session*, int, int, unsigned char*, struct io_buffer*);
+int buildListResponse(struct client_session*, char*, struct transfer*, struct io_buffer*);
 DIR* getDirectoryContents(char*);
 void printDirectory(DIR*);
 
+/* Stats command handling */
+void handleStatsCmd(struct client_session*, int, struct io_buffer*);
+int buildStatsResponse(struct client_session*, struct transfer*, struct io_buffer*);
+
 /* Error handling */
 void sendError(int, char*, unsigned char*);
 void handleInvalidCmd(int, unsigned char*, unsigned char*);
 void handleBadFilename(int, char*, unsigned char*);
 
 /* Connection termination */
-void handleClientDisconnect(int);
-void sendDataDisconnectToClient(int);
+void handleClientDisconnect(struct client_session*);
 
 /* Shutdown handling */
-void workerThreadComplete(int, char**, void*);
 void sendKillToClient(int);
 void serverTearDown();
 
-/* IO resource sharing among thread */
-int acquireFreeIOMutex();
-
 /* Signal handling */
 void sigint_intercept();
+void sigusr1_intercept();
+
+#endif
@@ -0,0 +1,1022 @@
+/********************************************************************************************
+ * Title: Event loop engine implementation
+ * Description: Implementation for the epoll engine (./server {PORT} -e epoll). Every loop
+ * 		thread registers the shared welcome socket with EPOLLEXCLUSIVE, or with -S
+ * 		its own SO_REUSEPORT shard of it, accepts clients until EAGAIN and keeps
+ * 		them for their lifetime. A sharded loop pins itself to its core before it
+ * 		sets up its ring, so ring memory is placed on that core's NUMA node. Sockets are
+ * 		edge-triggered, so each handler retries its operation until it would block
+ * 		and the state machine in advanceConnection() never waits on a socket.
+ * 		A shaped transfer out of bandwidth waits on the loop's throttled list; one
+ * 		timerfd per loop is armed for the earliest of their wake times.
+ * 		A response built on a helper thread parks its connection in
+ * 		CONN_DATA_PREPARING; the helper owns its session, command and transfer
+ * 		until the job is back on the loop, so a connection retired meanwhile
+ * 		keeps them, and its memory, until then.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "download_server.h"
+#include "event_loop.h"
+#include "buffer_arena.h"
+#include "uring.h"
+#include "scheduler.h"
+#include "socket_tuning.h"
+#include "shard.h"
+#include "readahead.h"
+#include "metrics.h"
+#include "log.h"
+
+static struct event_loop* event_loops;
+static int num_event_loops;
+static int loop_wakeup_fd = -1;
+
+/************************************* Engine startup and shutdown **************************************/
+
+/* start the event loops and block until they have all shut down */
+void runEventLoops(int server_welcome_fd, char* port_str)
+{
+    num_event_loops = server_options.num_loops;
+    if (num_event_loops <= 0) {
+        num_event_loops = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_event_loops <= 0) num_event_loops = 1;
+    }
+
+    /* sharded: each loop gets a core and a welcome socket of its own, the first being the one
+     * already listening */
+    int sharded = server_options.shard_steering != SHARD_OFF;
+    if (sharded && initShardCpus(num_event_loops) == -1) {
+        fprintf(stderr, "Failed to assign event loops to cores\n");
+        exit(1);
+    }
+
+    /* checksum and delta responses are built off the loops; without helpers, on them */
+    if (startHelpers(OFFLOAD_HELPERS) == -1)
+        fprintf(stderr, "No helper threads, event loops build every response themselves\n");
+
+    /* a single eventfd wakes every loop on shutdown */
+    if ((loop_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        fprintf(stderr, "Failed to create event loop wakeup fd\n");
+        exit(1);
+    }
+
+    event_loops = calloc(num_event_loops, sizeof(struct event_loop));
+    for (int i = 0; i < num_event_loops; i++) {
+        struct event_loop* loop = &event_loops[i];
+        struct epoll_event ev;
+
+        loop->id = i;
+        loop->port_str = port_str;
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            fprintf(stderr, "epoll_create1() failed\n");
+            exit(1);
+        }
+
+        loop->welcome.kind = ENDPOINT_WELCOME;
+        loop->welcome.fd = sharded && i > 0 ? openShardListener(port_str, i) : server_welcome_fd;
+        if (setNonBlocking(loop->welcome.fd) == -1) {
+            fprintf(stderr, "Failed to make welcome socket non-blocking\n");
+            exit(1);
+        }
+        ev.events = EPOLLIN | EPOLLET | (sharded ? 0 : EPOLLEXCLUSIVE);	// only one loop woken per connection
+        ev.data.ptr = &loop->welcome;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->welcome.fd, &ev) == -1) {
+            fprintf(stderr, "Failed to register welcome socket\n");
+            exit(1);
+        }
+
+        loop->wakeup.kind = ENDPOINT_WAKEUP;
+        loop->wakeup.fd = loop_wakeup_fd;
+        ev.events = EPOLLIN;					// level-triggered, every loop sees it
+        ev.data.ptr = &loop->wakeup;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop_wakeup_fd, &ev) == -1) {
+            fprintf(stderr, "Failed to register wakeup fd\n");
+            exit(1);
+        }
+
+        /* helpers signal the jobs they finish for the loop's connections */
+        loop->jobs.kind = ENDPOINT_JOBS;
+        if (initOffloadQueue(&loop->finished) == -1) {
+            fprintf(stderr, "Failed to create event loop job queue\n");
+            exit(1);
+        }
+        loop->jobs.fd = loop->finished.event_fd;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->jobs;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->jobs.fd, &ev) == -1) {
+            fprintf(stderr, "Failed to register event loop job queue\n");
+            exit(1);
+        }
+
+        /* shaped transfers waiting for bandwidth are resumed by the loop's timer */
+        loop->timer.kind = ENDPOINT_TIMER;
+        loop->timer.fd = -1;
+        if (schedulerEnabled()) {
+            if ((loop->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+                fprintf(stderr, "Failed to create event loop timer\n");
+                exit(1);
+            }
+            ev.events = EPOLLIN;
+            ev.data.ptr = &loop->timer;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer.fd, &ev) == -1) {
+                fprintf(stderr, "Failed to register event loop timer\n");
+                exit(1);
+            }
+        }
+    }
+
+    if (sharded && server_options.shard_steering != SHARD_HASH) {
+        int* welcome_fds = calloc(num_event_loops, sizeof(int));
+        for (int i = 0; welcome_fds != NULL && i < num_event_loops; i++)
+            welcome_fds[i] = event_loops[i].welcome.fd;
+        if (welcome_fds == NULL || attachShardSteering(welcome_fds, num_event_loops) == -1)
+            fprintf(stderr, "Shard steering unavailable, connections are hashed across shards\n");
+        free(welcome_fds);
+    }
+
+    for (int i = 0; i < num_event_loops; i++) {
+        if (pthread_create(&event_loops[i].thread, NULL, event_loop_thread, &event_loops[i]) != 0) {
+            fprintf(stderr, "Failed to create event loop thread\n");
+            exit(1);
+        }
+    }
+    printf("Server listening on %s (%d event loops%s%s%s)\n", port_str, num_event_loops,
+           server_options.engine == ENGINE_URING ? ", io_uring" : "",
+           sharded ? ", sharded listeners with steering " : "",
+           sharded ? shardSteeringName(server_options.shard_steering) : "");
+
+    for (int i = 0; i < num_event_loops; i++) {
+        pthread_join(event_loops[i].thread, NULL);
+        destroyRing(event_loops[i].ring);
+        if (event_loops[i].timer.fd != -1) close(event_loops[i].timer.fd);
+        destroyOffloadQueue(&event_loops[i].finished);
+        if (event_loops[i].welcome.fd != server_welcome_fd) close(event_loops[i].welcome.fd);
+        close(event_loops[i].epoll_fd);
+    }
+    stopHelpers();
+    free(event_loops);
+    releaseShardCpus();
+    close(loop_wakeup_fd);
+    close(server_welcome_fd);
+    serverTearDown();
+}
+
+/* wake every event loop so it notices SERVER_DISCONNECT, safe to call from a signal handler */
+void wakeEventLoops()
+{
+    if (loop_wakeup_fd != -1) {
+        uint64_t one = 1;
+        ssize_t ignored = write(loop_wakeup_fd, &one, sizeof(one));
+        (void) ignored;
+    }
+}
+
+/****************************************** Event loop thread *******************************************/
+
+/* uring engine: send files through a ring of the loop's own, or with sendfile() if it can't be set up */
+static void setupLoopRing(struct event_loop* loop)
+{
+    if (server_options.engine != ENGINE_URING) return;
+    if ((loop->ring = createRing()) == NULL) {
+        fprintf(stderr, "io_uring unavailable, event loop %d falls back to sendfile()\n", loop->id);
+        return;
+    }
+
+    struct epoll_event ev;
+    loop->ring_events.kind = ENDPOINT_RING;
+    loop->ring_events.fd = loop->ring->event_fd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->ring_events;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->ring->event_fd, &ev) == -1) {
+        fprintf(stderr, "Failed to register io_uring eventfd\n");
+        exit(1);
+    }
+}
+
+/* event loop main function. Dispatches readiness events to the connection state machines */
+void* event_loop_thread(void* arg)
+{
+    struct event_loop* loop = (struct event_loop*) arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    /* memory this thread touches first, its ring and connections among it, lands on its node */
+    if (server_options.shard_steering != SHARD_OFF && pinShardThread(loop->id) == -1)
+        fprintf(stderr, "Failed to pin event loop %d to core %d\n", loop->id, shardCpu(loop->id));
+    setupLoopRing(loop);
+
+    while (!SERVER_DISCONNECT) {
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait() failed\n");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct endpoint* ep = (struct endpoint*) events[i].data.ptr;
+            switch (ep->kind) {
+                case ENDPOINT_WELCOME:
+                    acceptClients(loop);
+                    break;
+                case ENDPOINT_WAKEUP:
+                    break;				// SERVER_DISCONNECT checked by loop condition
+                case ENDPOINT_RING:
+                    reapRing(loop->ring, ringChainDone);
+                    break;
+                case ENDPOINT_TIMER:
+                    wakeThrottled(loop);
+                    break;
+                case ENDPOINT_JOBS:
+                    finishJobs(loop, 1);
+                    break;
+                case ENDPOINT_DATA:
+                    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                        ep->conn->data_ready = 1;
+                    if ((events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+                            ep->conn->state == CONN_IDLE)
+                        closeDataSocket(ep->conn);	// client dropped its persistent data connection
+                    /* fall through */
+                case ENDPOINT_PASSIVE:
+                case ENDPOINT_DISK:
+                case ENDPOINT_CMD:
+                    if (ep->conn->state == CONN_CLOSING) break;	// retired earlier in this batch
+                    advanceConnection(ep->conn);
+                    if (ep->conn->state == CONN_CLOSING)
+                        retireConnection(ep->conn);
+                    break;
+            }
+        }
+
+        /* every chain queued while handling this batch goes to the kernel in one io_uring_enter() */
+        if (loop->ring != NULL) submitRing(loop->ring);
+
+        /* later events in the batch may still point at retired connections, free them now */
+        while (loop->retired != NULL) {
+            struct connection* conn = loop->retired;
+            loop->retired = conn->next;
+            free(conn);
+        }
+    }
+
+    closeLoopConnections(loop);
+    flushThreadBufferCache();
+    return (void*) 0;
+}
+
+/* a connection's io_uring chain completed, carry on sending its response */
+void ringChainDone(void* owner)
+{
+    struct connection* conn = (struct connection*) owner;
+    advanceConnection(conn);
+    if (conn->state == CONN_CLOSING)
+        retireConnection(conn);
+}
+
+/* take back the jobs helpers have run for this loop's connections. Each connection carries on
+ * with the response its job built, or, if it was retired meanwhile, is released now. At
+ * shutdown (resume 0) they are only taken back */
+void finishJobs(struct event_loop* loop, int resume)
+{
+    struct offload_job* job = takeFinishedJobs(&loop->finished);
+    while (job != NULL) {
+        struct offload_job* next = job->next;
+        struct connection* conn = (struct connection*) job->owner;
+        conn->job_running = 0;
+        loop->jobs_running--;
+        if (conn->state == CONN_CLOSING) {
+            releaseConnection(conn);
+        } else if (resume) {
+            finishTransferSetup(conn, job->result);
+            advanceConnection(conn);
+            if (conn->state == CONN_CLOSING)
+                retireConnection(conn);
+        }
+        job = next;
+    }
+}
+
+/* accept every pending control connection; the accepting loop owns the client from here on */
+void acceptClients(struct event_loop* loop)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t sin_size;
+
+    while (1) {
+        sin_size = sizeof(client_addr);
+        int server_cmd_fd = accept4(loop->welcome.fd, (struct sockaddr*) &client_addr, &sin_size,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (server_cmd_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logEvent(0, LOG_ACCEPT_FAILED, NULL);
+            return;
+        }
+        if (createConnection(loop, server_cmd_fd) == NULL) {
+            logEvent(0, LOG_REGISTER_FAILED, NULL, logLiteral("register"));
+            close(server_cmd_fd);
+        }
+    }
+}
+
+/* send kill message to every client on this loop and release them, once the helpers are done
+ * with any of their jobs */
+void closeLoopConnections(struct event_loop* loop)
+{
+    struct pollfd jobs = { .fd = loop->finished.event_fd, .events = POLLIN };
+    while (loop->jobs_running > 0) {
+        poll(&jobs, 1, -1);
+        finishJobs(loop, 0);
+    }
+
+    while (loop->connections != NULL) {
+        struct connection* conn = loop->connections;
+        if (!(conn->session.capabilities & CAP_MUX))		// +mux clients only read frames
+            send(conn->cmd.fd, SERVER_KILL_MESSAGE, strlen(SERVER_KILL_MESSAGE), MSG_NOSIGNAL);
+        retireConnection(conn);
+    }
+    while (loop->retired != NULL) {
+        struct connection* conn = loop->retired;
+        loop->retired = conn->next;
+        free(conn);
+    }
+}
+
+/*************************************** Connection state machine ***************************************/
+
+/* allocate per-client state and register its control socket */
+struct connection* createConnection(struct event_loop* loop, int server_cmd_fd)
+{
+    struct connection* conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL) return NULL;
+
+    conn->loop = loop;
+    conn->state = CONN_AWAIT_ADDR;
+    conn->cmd.kind = ENDPOINT_CMD;
+    conn->cmd.fd = server_cmd_fd;
+    conn->cmd.conn = conn;
+    conn->data.kind = ENDPOINT_DATA;
+    conn->data.fd = -1;
+    conn->data.conn = conn;
+    conn->passive.kind = ENDPOINT_PASSIVE;
+    conn->passive.conn = conn;
+    conn->disk.kind = ENDPOINT_DISK;
+    conn->disk.conn = conn;
+    initSession(&conn->session);
+    initTransfer(&conn->xfer);
+    initIngest(&conn->ingest);
+    countMetric(METRIC_CONNECTIONS_OPENED, 1);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &conn->cmd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, server_cmd_fd, &ev) == -1) {
+        free(conn);
+        return NULL;
+    }
+
+    conn->next = loop->connections;
+    if (loop->connections) loop->connections->prev = conn;
+    loop->connections = conn;
+    return conn;
+}
+
+/* close a client's control connection and release it, or leave that to finishJobs() if a
+ * helper is still building its response */
+void retireConnection(struct connection* conn)
+{
+    struct event_loop* loop = conn->loop;
+    close(conn->cmd.fd);				// close() also removes fd from the epoll set
+    conn->state = CONN_CLOSING;
+    countMetric(METRIC_CONNECTIONS_CLOSED, 1);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+
+    if (!conn->job_running) releaseConnection(conn);
+}
+
+/* close the rest of a retired client and move it to the loop's retired list to be freed */
+void releaseConnection(struct connection* conn)
+{
+    closeDataConnection(conn);
+    closePassiveListener(&conn->session);
+    releaseUpload(&conn->session);
+    conn->next = conn->loop->retired;
+    conn->loop->retired = conn;
+}
+
+/* run the state machine until every socket it needs would block */
+void advanceConnection(struct connection* conn)
+{
+    unsigned char message[IN_BUFFER_SIZE];
+    int progress = 1;
+
+    while (progress && conn->state != CONN_CLOSING) {
+        progress = 0;
+        if (flushControl(conn) == -1) {
+            conn->state = CONN_CLOSING;
+            break;
+        }
+
+        int result;
+        switch (conn->state) {
+            case CONN_IDLE:
+                /* run queued (pipelined) commands before reading more */
+                if (nextCommand(&conn->session, conn->command)) {
+                    progress = 1;
+                    startCommand(conn);
+                    break;
+                }
+                /* a command's payload is read straight into its buffer */
+                if (conn->session.upload_size > 0) {
+                    result = receiveUpload(&conn->session, conn->cmd.fd);
+                    if (result == -1) {
+                        handleClientDisconnect(&conn->session);
+                        conn->state = CONN_CLOSING;
+                    }
+                    progress = result == 1;
+                    break;
+                }
+                /* fall through */
+            case CONN_AWAIT_ADDR:
+            case CONN_AWAIT_PORT:
+                result = readControlMessage(conn, message);
+                if (result == 0) break;
+                if (result == -1) {
+                    handleClientDisconnect(&conn->session);
+                    conn->state = CONN_CLOSING;
+                    break;
+                }
+                progress = 1;
+                if (conn->state == CONN_AWAIT_ADDR) {
+                    storeDataAddress(&conn->session, message);
+                    queueControlMessage(conn, ACK_ADDR);
+                    conn->state = CONN_AWAIT_PORT;
+                } else if (conn->state == CONN_AWAIT_PORT) {
+                    char ack[IN_BUFFER_SIZE];
+                    queueControlMessage(conn, negotiateProtocol(&conn->session, conn->cmd.fd, message, ack));
+                    conn->state = CONN_IDLE;
+                    if (conn->session.capabilities & CAP_MUX) {
+                        /* frames go out on the control socket, watched as the data endpoint */
+                        int mux_fd = dup(conn->cmd.fd);
+                        if (mux_fd == -1 || watchDataSocket(conn, mux_fd, EPOLLOUT | EPOLLET) == -1) {
+                            if (mux_fd != -1) close(mux_fd);
+                            conn->state = CONN_CLOSING;
+                        }
+                    } else if (conn->session.passive_fd != -1) {
+                        struct epoll_event ev;
+                        ev.events = EPOLLIN | EPOLLET;
+                        ev.data.ptr = &conn->passive;
+                        conn->passive.fd = conn->session.passive_fd;
+                        if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, conn->passive.fd, &ev) == -1)
+                            conn->state = CONN_CLOSING;
+                    } else {
+                        resolveDataAddress(&conn->session);
+                    }
+                    logEvent(conn->session.id, LOG_LOOP_CONNECTED, conn->session.data_addr, conn->loop->id,
+                             strtoul(conn->session.data_port, NULL, 10), conn->session.protocol);
+                } else if (queueCommandBytes(&conn->session, message, result) == -1) {
+                    logEvent(conn->session.id, LOG_COMMAND_TOO_LONG, NULL);
+                    conn->session.commands_len = 0;
+                }
+                break;
+
+            case CONN_DATA_CONNECTING:
+                if (!conn->data_ready) break;
+                progress = 1;
+                if (finishDataConnect(conn) == -1) {
+                    logEvent(conn->session.id, LOG_DATA_CONNECT_FAILED, NULL);
+                    closeDataConnection(conn);
+                    conn->state = CONN_IDLE;
+                } else {
+                    conn->state = CONN_DATA_GREETING;
+                }
+                break;
+
+            case CONN_DATA_ACCEPTING:
+                result = acceptDataConnection(conn);
+                if (result == 0) break;
+                progress = 1;
+                if (result == -1) {
+                    logEvent(conn->session.id, LOG_DATA_ACCEPT_FAILED, NULL);
+                    closeDataConnection(conn);
+                    conn->state = CONN_IDLE;
+                } else {
+                    conn->state = CONN_DATA_GREETING;
+                }
+                break;
+
+            case CONN_DATA_GREETING:
+                result = readDataGreeting(conn);
+                if (result == 0) break;
+                progress = 1;
+                if (result == -1) {
+                    closeDataConnection(conn);
+                    conn->state = CONN_IDLE;
+                } else {
+                    startResponse(conn);
+                }
+                break;
+
+            case CONN_DATA_RECEIVING:
+                result = pumpIngest(conn->data.fd, &conn->ingest);
+                if (result == 0) break;
+                progress = 1;
+                if (result == -1) {
+                    logEvent(conn->session.id, LOG_UPLOAD_CUT_SHORT, conn->ingest.name);
+                    closeDataConnection(conn);
+                    conn->state = CONN_IDLE;
+                } else {
+                    prepareTransfer(conn);
+                }
+                break;
+
+            case CONN_DATA_PREPARING:
+                break;					// resumed by finishJobs()
+
+            case CONN_DATA_SENDING:
+                result = sendTransfer(conn);
+                if (result == 0) break;
+                progress = 1;
+                if (result == -1) {
+                    closeDataConnection(conn);
+                    /* a +mux response cut short leaves the control connection unusable too */
+                    conn->state = (conn->session.capabilities & CAP_MUX) ? CONN_CLOSING : CONN_IDLE;
+                } else if (conn->session.protocol == PROTOCOL_LEGACY) {
+                    conn->state = CONN_DATA_AWAIT_ACK;
+                } else {
+                    /* framed responses end with END/ERROR, no ACK round trip */
+                    finishCommand(conn);
+                }
+                break;
+
+            case CONN_DATA_AWAIT_ACK:
+                result = readEndDataAck(conn);
+                if (result == 0) break;
+                progress = 1;
+                finishCommand(conn);
+                break;
+
+            case CONN_CLOSING:
+                break;
+        }
+    }
+}
+
+/* read one control message into message. Returns its length, 0 if it would block, -1 if the
+ * client disconnected */
+int readControlMessage(struct connection* conn, unsigned char* message)
+{
+    ssize_t n;
+    memset(message, 0, IN_BUFFER_SIZE);
+    do {
+        n = recv(conn->cmd.fd, message, IN_BUFFER_SIZE - 1, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) return (int) n;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+}
+
+/* append a message to the control output queue and try to send it */
+int queueControlMessage(struct connection* conn, const char* message)
+{
+    size_t len = strlen(message);
+    if (conn->ctrl_off == conn->ctrl_len) conn->ctrl_off = conn->ctrl_len = 0;
+    if (conn->ctrl_len + len > OUT_BUFFER_SIZE) return -1;
+    memcpy(conn->ctrl_out + conn->ctrl_len, message, len);
+    conn->ctrl_len += len;
+    return flushControl(conn);
+}
+
+/* send queued control bytes. Returns 0 when sent or blocked, -1 on error */
+int flushControl(struct connection* conn)
+{
+    while (conn->ctrl_off < conn->ctrl_len) {
+        ssize_t n = send(conn->cmd.fd, conn->ctrl_out + conn->ctrl_off,
+                         conn->ctrl_len - conn->ctrl_off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->ctrl_off += n;
+    }
+    return 0;
+}
+
+/* whether the pending command was rejected as malformed, rather than for lack of a buffer */
+static int rejectedAsInvalid(struct connection* conn)
+{
+    return conn->pending_error != NULL && strcmp(conn->pending_error, ERROR_INVALID_COMMAND) == 0;
+}
+
+/* handle a command from an idle client */
+void startCommand(struct connection* conn)
+{
+    int persistent = conn->session.capabilities & CAP_PERSIST;
+
+    /* without +persist, rejections go out on the control connection */
+    conn->pending_error = NULL;
+    beginCommand(&conn->session);
+    if (!validCommand(&conn->session, conn->command)) {
+        logEvent(conn->session.id, LOG_COMMAND_INVALID, conn->command);
+        countMetric(METRIC_COMMANDS_REJECTED, 1);
+        if (!persistent) {
+            queueControlMessage(conn, ERROR_INVALID_COMMAND);
+            return;
+        }
+        conn->pending_error = ERROR_INVALID_COMMAND;
+    } else if ((conn->io_buf = acquireBuffer()) == NULL) {
+        /* each command in flight holds one arena buffer, so the memory budget bounds concurrency */
+        logEvent(conn->session.id, LOG_COMMAND_BUSY, NULL);
+        countMetric(METRIC_COMMANDS_REJECTED, 1);
+        if (!persistent) {
+            queueControlMessage(conn, ERROR_SERVER_BUSY);
+            return;
+        }
+        conn->pending_error = ERROR_SERVER_BUSY;
+    }
+
+    logEvent(conn->session.id, LOG_COMMAND_RECEIVED, conn->command);
+    if (conn->data.fd != -1) {
+        if (!peerClosed(conn->data.fd)) {
+            /* persistent data connection is still up, respond straight away */
+            startResponse(conn);
+            return;
+        }
+        closeDataSocket(conn);
+    }
+
+    if (conn->session.passive_fd != -1) {
+        conn->state = CONN_DATA_ACCEPTING;		// the client connects once it has sent the command
+        return;
+    }
+    if (startDataConnection(conn) == -1) {
+        logEvent(conn->session.id, LOG_DATA_CONNECT_FAILED, NULL);
+        closeDataConnection(conn);
+        return;
+    }
+    conn->state = CONN_DATA_CONNECTING;
+}
+
+/* wrap up the current command, keeping the data connection open for +persist sessions. A
+ * malformed PUT's payload would be taken for the next one's, so it closes the connection */
+void finishCommand(struct connection* conn)
+{
+    int malformed_put = rejectedAsInvalid(conn) &&
+                        strncmp((char*) conn->command, PUT_MESSAGE, 2) == 0;
+
+    if ((conn->session.capabilities & CAP_PERSIST) && !malformed_put) {
+        releaseTransfer(&conn->xfer);
+        releaseIngest(&conn->ingest);
+        releaseBuffer(conn->io_buf);
+        conn->io_buf = NULL;
+    } else {
+        closeDataConnection(conn);
+    }
+    conn->state = CONN_IDLE;
+}
+
+/**************************************** Data connection handling ****************************************/
+
+/* begin a non-blocking connect() to the client data port, resolved once at handshake */
+int startDataConnection(struct connection* conn)
+{
+    struct client_session* session = &conn->session;
+    if (session->data_sockaddr_len == 0) return -1;		// also +mux, whose data socket is gone
+
+    int server_data_fd = socket(session->data_sockaddr.ss_family,
+                                SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_data_fd == -1) return -1;
+    applySocketProfile(server_data_fd, socketProfile(SOCKET_DATA));
+    if (connect(server_data_fd, (struct sockaddr*) &session->data_sockaddr, session->data_sockaddr_len) == -1 &&
+            errno != EINPROGRESS) {
+        close(server_data_fd);
+        return -1;
+    }
+
+    if (watchDataSocket(conn, server_data_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+        close(server_data_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* accept the client's connection on the +passive listener. Returns 1 once accepted,
+ * 0 if it would block, -1 on error */
+int acceptDataConnection(struct connection* conn)
+{
+    int server_data_fd = acceptPassiveConnection(&conn->session, SOCK_NONBLOCK);
+    if (server_data_fd == -1) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    if (watchDataSocket(conn, server_data_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+        close(server_data_fd);
+        return -1;
+    }
+    return 1;
+}
+
+/* register a new data socket with the loop as the connection's data endpoint */
+int watchDataSocket(struct connection* conn, int server_data_fd, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &conn->data;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, server_data_fd, &ev) == -1) return -1;
+
+    conn->data.fd = server_data_fd;
+    conn->data_ready = 0;
+    conn->greeting_len = 0;
+    return 0;
+}
+
+/* check the outcome of the non-blocking connect() */
+int finishDataConnect(struct connection* conn)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->data.fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+        return -1;
+    return 0;
+}
+
+/* read the client's "Data connection established!" greeting. Returns 1 once complete,
+ * 0 if it would block, -1 on error */
+int readDataGreeting(struct connection* conn)
+{
+    while (conn->greeting_len < DATA_GREETING_LENGTH) {
+        ssize_t n = recv(conn->data.fd, conn->greeting + conn->greeting_len,
+                         DATA_GREETING_LENGTH - conn->greeting_len, 0);
+        if (n > 0) {
+            conn->greeting_len += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* once the data connection is up: receive a PUT's file before its response, set up any other
+ * command's response straight away */
+void startResponse(struct connection* conn)
+{
+    if (!rejectedAsInvalid(conn) && strncmp((char*) conn->command, PUT_MESSAGE, 2) == 0) {
+        beginPutCommand(&conn->session, conn->command, &conn->ingest, conn->io_buf);
+        conn->state = CONN_DATA_RECEIVING;
+        return;
+    }
+    prepareTransfer(conn);
+}
+
+/* wake the connection as its one-shot file's O_DIRECT reads complete. If the loop can't watch
+ * them, the sender waits for each read instead */
+static void watchDirectReads(struct connection* conn)
+{
+    struct direct_stream* direct = conn->xfer.direct;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &conn->disk;
+    conn->disk.fd = direct->event_fd;		// closed with the stream, which removes it from the set
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, direct->event_fd, &ev) == -1) {
+        close(direct->event_fd);
+        direct->event_fd = -1;
+    }
+}
+
+/* build the response to a received PUT, a LIST or a file command. Returns 0 if the file was
+ * found or the listing built */
+static int buildResponse(struct connection* conn)
+{
+    if (strncmp((char*) conn->command, PUT_MESSAGE, 2) == 0) {
+        buildPutResponse(&conn->session, &conn->ingest, &conn->xfer);	// the file has been received
+        return 0;
+    }
+    if (strncmp((char*) conn->command, LIST_MESSAGE, 2) == 0)
+        return buildListResponse(&conn->session, (char*) (conn->command + 2), &conn->xfer, conn->io_buf);
+    return buildFileResponse(&conn->session, conn->command, &conn->xfer);	// -g, -r, -b, -c, -d
+}
+
+/* build the pending command's response, on a helper thread */
+static void buildResponseJob(struct offload_job* job)
+{
+    job->result = buildResponse((struct connection*) job->owner);
+}
+
+/* have a helper build the response of a command that blocks on the disk before its first byte:
+ * a checksum, which is the response, a delta, matched against the client's blocks and summed,
+ * a listing, read and stat'ed directory by directory, or an upload's END, once it is flushed
+ * and renamed. Returns -1 if it must be built here and now */
+static int offloadResponse(struct connection* conn)
+{
+    if (strncmp((char*) conn->command, CHECKSUM_MESSAGE, 2) != 0 &&
+            strncmp((char*) conn->command, DELTA_MESSAGE, 2) != 0 &&
+            strncmp((char*) conn->command, LIST_MESSAGE, 2) != 0 &&
+            strncmp((char*) conn->command, PUT_MESSAGE, 2) != 0)
+        return -1;
+
+    conn->job.run = buildResponseJob;
+    conn->job.owner = conn;
+    conn->job.done = &conn->loop->finished;
+    if (submitJob(&conn->job) == -1) return -1;
+    conn->job_running = 1;
+    conn->loop->jobs_running++;
+    conn->state = CONN_DATA_PREPARING;
+    return 0;
+}
+
+/* set up the response for the pending command once the data connection is up, and start
+ * sending it unless a helper is building it */
+void prepareTransfer(struct connection* conn)
+{
+    conn->ack_len = 0;
+    if (conn->pending_error != NULL) {
+        buildErrorResponse(&conn->session, conn->pending_error, &conn->xfer);
+    } else if (strncmp((char*) conn->command, STATS_MESSAGE, 2) == 0) {
+        buildStatsResponse(&conn->session, &conn->xfer, conn->io_buf);
+        logEvent(conn->session.id, LOG_SENDING_STATS, NULL);
+    } else if (offloadResponse(conn) == -1) {
+        finishTransferSetup(conn, buildResponse(conn));
+        return;
+    } else {
+        return;						// finishJobs() carries on once it's built
+    }
+    beginTransfer(&conn->session, &conn->xfer);
+    conn->state = CONN_DATA_SENDING;
+}
+
+/* start sending a PUT, LIST or file response, built with result 0 if the file was found or
+ * the listing built */
+void finishTransferSetup(struct connection* conn, int result)
+{
+    if (strncmp((char*) conn->command, PUT_MESSAGE, 2) == 0) {
+        /* END or an ERROR, buildPutResponse() has logged which */
+    } else if (strncmp((char*) conn->command, LIST_MESSAGE, 2) == 0) {
+        if (result == 0) logEvent(conn->session.id, LOG_SENDING_LISTING, NULL);
+    } else if (result == 0) {
+        logEvent(conn->session.id, LOG_SENDING_FILE, conn->command);
+        if (conn->loop->ring != NULL && (conn->xfer.has_file || conn->xfer.batch != NULL || conn->xfer.delta != NULL))
+            conn->xfer.ring = attachRingTransfer(conn->loop->ring, conn);
+        if (conn->xfer.direct != NULL) watchDirectReads(conn);
+    } else {
+        logEvent(conn->session.id, LOG_FILE_NOT_FOUND, conn->command);
+        if (conn->session.protocol == PROTOCOL_LEGACY) {
+            queueControlMessage(conn, ERROR_BAD_FILENAME);
+            queueControlMessage(conn, END_DATA_MESSAGE);
+        }
+    }
+    beginTransfer(&conn->session, &conn->xfer);
+    conn->state = CONN_DATA_SENDING;
+}
+
+/* send as much of the response as the data socket accepts. Returns 1 once complete,
+ * 0 if it would block, -1 on error */
+int sendTransfer(struct connection* conn)
+{
+    int result = pumpTransfer(conn->data.fd, &conn->xfer);
+    if (result == 0 && conn->xfer.flow != NULL && conn->xfer.flow->wake_ns != 0)
+        throttleConnection(conn);		// out of bandwidth, not socket space: no event will come
+    if (result != 0) {
+        unthrottleConnection(conn);
+        releaseTransfer(&conn->xfer);
+    }
+    return result;
+}
+
+/* wait for the client to ACK END_DATA. Returns 1 once received (or the client closed the
+ * data connection), 0 if it would block */
+int readEndDataAck(struct connection* conn)
+{
+    unsigned char fin_ack[OUT_BUFFER_SIZE];
+    size_t ack_total = strlen(END_DATA_MESSAGE);
+
+    while (conn->ack_len < ack_total) {
+        ssize_t n = recv(conn->data.fd, fin_ack, ack_total - conn->ack_len, 0);
+        if (n > 0) {
+            conn->ack_len += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/* close the data connection, discard any unfinished response or upload and release the command's
+ * buffer */
+void closeDataConnection(struct connection* conn)
+{
+    unthrottleConnection(conn);
+    releaseTransfer(&conn->xfer);
+    releaseIngest(&conn->ingest);
+    releaseBuffer(conn->io_buf);
+    conn->io_buf = NULL;
+    closeDataSocket(conn);
+}
+
+/* close just the data socket. Under +mux that ends the control connection too */
+void closeDataSocket(struct connection* conn)
+{
+    if (conn->data.fd != -1) {
+        if (conn->session.capabilities & CAP_MUX) shutdown(conn->data.fd, SHUT_RDWR);
+        close(conn->data.fd);
+        conn->data.fd = -1;
+    }
+    conn->data_ready = 0;
+}
+
+/****************************************** Shaped transfers ********************************************/
+
+/* arm the loop's timer for wake_ns, or disarm it for 0 */
+static void armLoopTimer(struct event_loop* loop, uint64_t wake_ns)
+{
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = (time_t) (wake_ns / 1000000000ULL);
+    when.it_value.tv_nsec = (long) (wake_ns % 1000000000ULL);
+    timerfd_settime(loop->timer.fd, TFD_TIMER_ABSTIME, &when, NULL);
+    loop->timer_ns = wake_ns;
+}
+
+/* park a shaped transfer until its flow's wake time */
+void throttleConnection(struct connection* conn)
+{
+    struct event_loop* loop = conn->loop;
+    uint64_t wake_ns = conn->xfer.flow->wake_ns;
+
+    if (!conn->throttled) {
+        conn->throttled = 1;
+        conn->throttle_prev = NULL;
+        conn->throttle_next = loop->throttled;
+        if (loop->throttled) loop->throttled->throttle_prev = conn;
+        loop->throttled = conn;
+    }
+    if (loop->timer_ns == 0 || wake_ns < loop->timer_ns) armLoopTimer(loop, wake_ns);
+}
+
+/* take a connection off the throttled list, if it's on it */
+void unthrottleConnection(struct connection* conn)
+{
+    if (!conn->throttled) return;
+    if (conn->throttle_prev) conn->throttle_prev->throttle_next = conn->throttle_next;
+    else conn->loop->throttled = conn->throttle_next;
+    if (conn->throttle_next) conn->throttle_next->throttle_prev = conn->throttle_prev;
+    conn->throttled = 0;
+    conn->throttle_prev = conn->throttle_next = NULL;
+}
+
+/* the loop's timer fired: resume every transfer whose wait is over, then re-arm for the
+ * earliest of those still waiting */
+void wakeThrottled(struct event_loop* loop)
+{
+    uint64_t expirations;
+    ssize_t ignored = read(loop->timer.fd, &expirations, sizeof(expirations));
+    (void) ignored;
+
+    uint64_t now = monotonicNanos();
+    loop->timer_ns = 0;
+    struct connection* conn = loop->throttled;
+    while (conn != NULL) {
+        struct connection* next = conn->throttle_next;		// advancing may re-park conn at the head
+        struct shaped_flow* flow = conn->xfer.flow;
+        if (flow == NULL || flow->wake_ns <= now) {
+            unthrottleConnection(conn);
+            advanceConnection(conn);
+            if (conn->state == CONN_CLOSING)
+                retireConnection(conn);
+        }
+        conn = next;
+    }
+
+    uint64_t earliest = 0;
+    for (conn = loop->throttled; conn != NULL; conn = conn->throttle_next)
+        if (conn->xfer.flow != NULL && (earliest == 0 || conn->xfer.flow->wake_ns < earliest))
+            earliest = conn->xfer.flow->wake_ns;
+    armLoopTimer(loop, earliest);
+}
+
+/******************************************* Socket helpers *********************************************/
+
+/* set O_NONBLOCK on a file descriptor */
+int setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
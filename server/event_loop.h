@@ -0,0 +1,159 @@
+/***************************************************************************************
+ * Title: Event Loop Engine Specification
+ * Description: Specification for the epoll engine. A fixed set of event loops (one per
+ * 		core by default) share the welcome socket and own every control and data
+ * 		socket they accept or open. Each client is driven by a non-blocking state
+ * 		machine instead of a dedicated worker thread. The uring engine is the same
+ * 		loops with files sent through a per-loop io_uring. Shaped transfers that
+ * 		must wait for bandwidth park on their loop's timer. With -S each loop is
+ * 		a shard: it listens on its own SO_REUSEPORT socket, pinned to a core.
+ * 		Responses that must read a whole file first are built on helper threads
+ * 		while their connection waits, so no loop blocks on the disk.
+ * ************************************************************************************/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/types.h>
+
+#include "transfer.h"
+#include "ingest.h"
+#include "offload.h"
+
+#define MAX_EPOLL_EVENTS    64
+
+/* Identifies which socket of a connection an epoll event refers to */
+enum endpoint_kind {
+    ENDPOINT_WELCOME,
+    ENDPOINT_WAKEUP,
+    ENDPOINT_RING,              // io_uring completion eventfd
+    ENDPOINT_TIMER,             // timerfd resuming shaped transfers
+    ENDPOINT_CMD,
+    ENDPOINT_DATA,
+    ENDPOINT_PASSIVE,           // +passive listener for the client's data connection
+    ENDPOINT_DISK,              // eventfd signalled as a one-shot file's O_DIRECT reads complete
+    ENDPOINT_JOBS               // eventfd signalled as helper threads finish the loop's jobs
+};
+
+/* Per-client state, advanced whenever one of its sockets becomes ready */
+enum connection_state {
+    CONN_AWAIT_ADDR,            // waiting for client data address
+    CONN_AWAIT_PORT,            // waiting for client data port
+    CONN_IDLE,                  // waiting for a command (a +persist data connection may stay open)
+    CONN_DATA_CONNECTING,       // non-blocking connect() to client data port in flight
+    CONN_DATA_ACCEPTING,        // +passive: waiting for the client to connect to our listener
+    CONN_DATA_GREETING,         // reading the client's data connection greeting
+    CONN_DATA_RECEIVING,        // PUT: reading the uploaded file off the data connection
+    CONN_DATA_PREPARING,        // a helper thread is building the response
+    CONN_DATA_SENDING,          // streaming the response over the data connection
+    CONN_DATA_AWAIT_ACK,        // waiting for the client to ACK END_DATA (legacy protocol)
+    CONN_CLOSING
+};
+
+struct connection;
+struct event_loop;
+struct uring;
+
+struct endpoint {
+    enum endpoint_kind kind;
+    int fd;
+    struct connection* conn;
+};
+
+struct connection {
+    struct event_loop* loop;
+    struct connection* prev;
+    struct connection* next;
+    struct endpoint cmd;
+    struct endpoint data;
+    struct endpoint passive;
+    struct endpoint disk;
+    enum connection_state state;
+    int data_ready;             // data socket reported writable/errored while connecting
+
+    struct client_session session;
+    unsigned char command[IN_BUFFER_SIZE];
+
+    unsigned char ctrl_out[OUT_BUFFER_SIZE];    // queued control messages
+    size_t ctrl_len;
+    size_t ctrl_off;
+
+    unsigned char greeting[DATA_GREETING_LENGTH];
+    size_t greeting_len;
+    size_t ack_len;
+
+    struct transfer xfer;       // response to the current command
+    struct file_ingest ingest;  // PUT: the file being received
+    struct io_buffer* io_buf;   // arena buffer held while a command is in flight
+    char* pending_error;        // +persist: rejection to send as the command's response
+    struct offload_job job;     // builds the response while CONN_DATA_PREPARING, or after retiring
+    int job_running;            // until then the helper owns the session, command, transfer and ingest
+    int throttled;              // on the loop's throttled list, waiting for bandwidth
+    struct connection* throttle_prev;
+    struct connection* throttle_next;
+};
+
+struct event_loop {
+    int id;
+    int epoll_fd;
+    pthread_t thread;
+    struct endpoint welcome;        // shared by every loop, or with -S this loop's shard
+    struct endpoint wakeup;
+    struct endpoint ring_events;
+    struct endpoint timer;          // shaping only, -1 otherwise
+    struct endpoint jobs;           // signalled by finished
+    struct offload_queue finished;  // jobs the helpers have run for this loop's connections
+    int jobs_running;
+    struct uring* ring;             // uring engine: sends files through io_uring, NULL otherwise
+    struct connection* connections;
+    struct connection* retired;     // closed this batch, freed once events are dispatched
+    struct connection* throttled;   // shaped transfers waiting for their next grant
+    uint64_t timer_ns;              // when the timer fires, 0 if disarmed
+    char* port_str;
+};
+
+/* Engine startup and shutdown, runs in main thread */
+void runEventLoops(int, char*);
+void wakeEventLoops();
+
+/* Event loop thread */
+void* event_loop_thread(void*);
+void acceptClients(struct event_loop*);
+void closeLoopConnections(struct event_loop*);
+void ringChainDone(void*);
+void finishJobs(struct event_loop*, int);
+
+/* Connection state machine */
+struct connection* createConnection(struct event_loop*, int);
+void retireConnection(struct connection*);
+void releaseConnection(struct connection*);
+void advanceConnection(struct connection*);
+int readControlMessage(struct connection*, unsigned char*);
+int queueControlMessage(struct connection*, const char*);
+int flushControl(struct connection*);
+void startCommand(struct connection*);
+void finishCommand(struct connection*);
+
+/* Data connection handling */
+int startDataConnection(struct connection*);
+int finishDataConnect(struct connection*);
+int acceptDataConnection(struct connection*);
+int watchDataSocket(struct connection*, int, uint32_t);
+int readDataGreeting(struct connection*);
+void startResponse(struct connection*);
+void prepareTransfer(struct connection*);
+void finishTransferSetup(struct connection*, int);
+int sendTransfer(struct connection*);
+int readEndDataAck(struct connection*);
+void closeDataConnection(struct connection*);
+void closeDataSocket(struct connection*);
+
+/* Shaped transfers */
+void throttleConnection(struct connection*);
+void unthrottleConnection(struct connection*);
+void wakeThrottled(struct event_loop*);
+
+/* Socket helpers */
+int setNonBlocking(int);
+
+#endif
@@ -0,0 +1,243 @@
+/********************************************************************************************
+ * Title: File Cache implementation
+ * Description: mmap'd hot-file cache. Entries hang off a hashed bucket array for lookups
+ * 		and a circular list swept by the CLOCK hand for eviction. A mutex guards both,
+ * 		but is only held to find, insert or unlink an entry: files are mapped before
+ * 		taking it and sends run from the mapping without it. The cache holds one
+ * 		reference to each entry and every transfer sending from it another, the
+ * 		last reference dropped unmaps the file.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "download_server.h"
+#include "file_cache.h"
+
+static struct {
+    int enabled;
+    pthread_mutex_t lock;
+    struct cached_file* buckets[FILE_CACHE_BUCKETS];
+    struct cached_file* hand;   // next entry the CLOCK sweep looks at
+    struct file_cache_stats stats;
+} file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/****************************************** Cache entries ************************************************/
+
+/* FNV-1a of a file name */
+static uint64_t hashFileName(const char* name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* whether a cached copy is still the file that st describes */
+static int entryMatches(const struct cached_file* entry, const struct stat* st)
+{
+    return entry->dev == st->st_dev && entry->inode == st->st_ino && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* find the entry cached under name, NULL if none. Call with the lock held */
+static struct cached_file* findEntry(const char* name, uint64_t hash)
+{
+    struct cached_file* entry = file_cache.buckets[hash % FILE_CACHE_BUCKETS];
+    for (; entry != NULL; entry = entry->hash_next)
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return entry;
+    return NULL;
+}
+
+/* drop one reference, unmapping the file with the last one */
+static void dropReference(struct cached_file* entry)
+{
+    if (atomic_fetch_sub(&entry->refs, 1) != 1) return;
+    munmap(entry->data, entry->size);
+    free(entry->name);
+    free(entry);
+}
+
+/* unlink an entry from the bucket and the CLOCK ring and drop the cache's reference.
+ * Transfers still sending from it keep the mapping alive. Call with the lock held */
+static void removeEntry(struct cached_file* victim)
+{
+    struct cached_file** link = &file_cache.buckets[victim->hash % FILE_CACHE_BUCKETS];
+    while (*link != victim)
+        link = &(*link)->hash_next;
+    *link = victim->hash_next;
+
+    if (victim->clock_next == victim) {
+        file_cache.hand = NULL;
+    } else {
+        victim->clock_prev->clock_next = victim->clock_next;
+        victim->clock_next->clock_prev = victim->clock_prev;
+        if (file_cache.hand == victim) file_cache.hand = victim->clock_next;
+    }
+    file_cache.stats.files--;
+    file_cache.stats.bytes -= victim->size;
+    dropReference(victim);
+}
+
+/* sweep the CLOCK hand until the cache fits its budget, giving entries hit since the last
+ * sweep a second chance. Call with the lock held */
+static void evictEntries(struct cached_file* keep)
+{
+    while (file_cache.stats.bytes > file_cache.stats.budget && file_cache.stats.files > 1) {
+        struct cached_file* entry = file_cache.hand;
+        file_cache.hand = entry->clock_next;
+        if (entry == keep) continue;
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        removeEntry(entry);
+        file_cache.stats.evictions++;
+    }
+}
+
+/* add an entry behind the CLOCK hand, so it's swept last. Call with the lock held */
+static void insertEntry(struct cached_file* entry)
+{
+    size_t bucket = entry->hash % FILE_CACHE_BUCKETS;
+    entry->hash_next = file_cache.buckets[bucket];
+    file_cache.buckets[bucket] = entry;
+
+    if (file_cache.hand == NULL) {
+        entry->clock_prev = entry->clock_next = entry;
+        file_cache.hand = entry;
+    } else {
+        entry->clock_next = file_cache.hand;
+        entry->clock_prev = file_cache.hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        file_cache.hand->clock_prev = entry;
+    }
+    file_cache.stats.files++;
+    file_cache.stats.bytes += entry->size;
+    evictEntries(entry);
+}
+
+/* map the open file fd, described by st, for the cache. NULL if it can't be mapped */
+static struct cached_file* loadEntry(const char* name, uint64_t hash, int fd, const struct stat* st)
+{
+    /* populate up front so hits never fault on the send path */
+    void* data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) return NULL;
+
+    struct cached_file* entry;
+    if ((entry = calloc(1, sizeof(struct cached_file))) == NULL ||
+            (entry->name = strdup(name)) == NULL) {
+        free(entry);
+        munmap(data, st->st_size);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->dev = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->size = st->st_size;
+    entry->data = data;
+    atomic_init(&entry->refs, 1);
+    return entry;
+}
+
+/************************************* Cache setup and teardown ******************************************/
+
+/* set the byte budget for mapped files, 0 disables the cache */
+void initFileCache(size_t budget)
+{
+    file_cache.stats.budget = budget;
+    file_cache.enabled = budget > 0;
+}
+
+/* drop every entry. Mappings still being sent from are unmapped by their last transfer */
+void destroyFileCache()
+{
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache.enabled = 0;
+    while (file_cache.hand != NULL)
+        removeEntry(file_cache.hand);
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+/*************************************** Cached file access **********************************************/
+
+/* get a referenced mapping of a file, loading it on a miss. Returns NULL if the file isn't
+ * cacheable, in which case the caller streams it from disk. A hit is only served after an fstat
+ * of the file shows it unchanged, the directory index can lag a write. Release with
+ * releaseCachedFile() */
+struct cached_file* acquireCachedFile(const char* name)
+{
+    if (!file_cache.enabled) return NULL;
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+            st.st_size > FILE_CACHE_MAX_FILE || (size_t) st.st_size > file_cache.stats.budget) {
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t hash = hashFileName(name);
+    pthread_mutex_lock(&file_cache.lock);
+    struct cached_file* entry = findEntry(name, hash);
+    if (entry != NULL && entryMatches(entry, &st)) {
+        entry->referenced = 1;
+        atomic_fetch_add(&entry->refs, 1);
+        file_cache.stats.hits++;
+        pthread_mutex_unlock(&file_cache.lock);
+        close(fd);
+        return entry;
+    }
+    if (entry != NULL) {
+        removeEntry(entry);
+        file_cache.stats.invalidations++;
+    }
+    file_cache.stats.misses++;
+    pthread_mutex_unlock(&file_cache.lock);
+
+    struct cached_file* loaded = loadEntry(name, hash, fd, &st);
+    close(fd);
+    if (loaded == NULL) return NULL;
+
+    /* another thread may have loaded the same file meanwhile, keep whichever is current */
+    pthread_mutex_lock(&file_cache.lock);
+    if (!file_cache.enabled) {
+        pthread_mutex_unlock(&file_cache.lock);
+        return loaded;      // uncached, the caller's reference is the only one
+    }
+    if ((entry = findEntry(name, hash)) != NULL) {
+        if (entryMatches(entry, &st)) {
+            atomic_fetch_add(&entry->refs, 1);
+            pthread_mutex_unlock(&file_cache.lock);
+            dropReference(loaded);
+            return entry;
+        }
+        removeEntry(entry);
+        file_cache.stats.invalidations++;
+    }
+    atomic_fetch_add(&loaded->refs, 1);
+    insertEntry(loaded);
+    pthread_mutex_unlock(&file_cache.lock);
+    return loaded;
+}
+
+/* done sending from a mapping */
+void releaseCachedFile(struct cached_file* entry)
+{
+    if (entry != NULL) dropReference(entry);
+}
+
+/* snapshot of the cache counters */
+void getFileCacheStats(struct file_cache_stats* stats)
+{
+    pthread_mutex_lock(&file_cache.lock);
+    *stats = file_cache.stats;
+    pthread_mutex_unlock(&file_cache.lock);
+}
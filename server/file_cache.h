@@ -0,0 +1,58 @@
+/***************************************************************************************
+ * Title: File Cache Specification
+ * Description: Specification for the hot-file cache. Files up to FILE_CACHE_MAX_FILE
+ * 		bytes are mmap'd on their first GET and kept mapped under a total byte
+ * 		budget, evicted by the CLOCK algorithm. Entries are validated against an
+ * 		fstat of the file's current inode, size and mtime before every hit, and
+ * 		reference counted, so a mapping is only unmapped once no transfer is still
+ * 		sending from it.
+ * ************************************************************************************/
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define FILE_CACHE_DEFAULT_MB   64
+#define FILE_CACHE_MAX_FILE     (1024 * 1024)   // larger files are streamed with sendfile()
+#define FILE_CACHE_BUCKETS      4096
+
+struct cached_file {
+    char* name;
+    uint64_t hash;
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    unsigned char* data;            // read-only mapping of the whole file
+    _Atomic int refs;               // the cache's own reference plus one per transfer
+    int referenced;                 // CLOCK bit, set on every hit
+    struct cached_file* hash_next;
+    struct cached_file* clock_prev;
+    struct cached_file* clock_next;
+};
+
+struct file_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;     // entries dropped because the file changed
+    size_t files;
+    size_t bytes;
+    size_t budget;
+};
+
+/* Cache setup and teardown */
+void initFileCache(size_t);
+void destroyFileCache();
+
+/* Cached file access, safe to call from any thread */
+struct cached_file* acquireCachedFile(const char*);
+void releaseCachedFile(struct cached_file*);
+void getFileCacheStats(struct file_cache_stats*);
+
+#endif
@@ -0,0 +1,532 @@
+/********************************************************************************************
+ * Title: File index implementation
+ * Description: Directory index kept fresh with inotify. The index thread owns a mutable
+ * 		open-addressing table (linear probing, backward-shift deletion) which it
+ * 		updates incrementally, one stat() per changed name and batch. After each
+ * 		batch of events it publishes an immutable snapshot with a single pointer
+ * 		swap: rebuilt when names came or went, otherwise a copy of the current one
+ * 		with only the pages of the changed entries replaced.
+ * 		Readers register in one of two epoch counters before loading the snapshot;
+ * 		the index thread frees the previous snapshot only after flipping the epoch
+ * 		twice and watching each counter drain, so readers never lock or block.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "download_server.h"
+#include "file_index.h"
+
+#define INDEX_WATCH_MASK    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                             IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR)
+#define INDEX_BATCH_SLOTS   8192    // distinct names one read of events can carry, twice over
+
+/* Mutable table, only touched by the index thread (and by initFileIndex before it starts) */
+struct index_table {
+    struct index_entry* slots;
+    char** names;               // names[i] belongs to slots[i]
+    size_t capacity;
+    size_t count;
+    int reshaped;               // names were added or removed since the last snapshot
+    size_t changed[INDEX_PATCH_MAX];    // slots whose file changed since the last snapshot
+    size_t changed_count;       // may exceed INDEX_PATCH_MAX, the snapshot is then rebuilt
+};
+
+static struct {
+    int enabled;
+    int inotify_fd;
+    int wakeup_fd;
+    pthread_t thread;
+    struct index_table table;
+    uint64_t version;
+    _Atomic(struct index_snapshot*) current;
+    _Atomic unsigned int epoch;
+    _Atomic long readers[2];    // readers registered under each epoch parity
+} file_index;
+
+/******************************************* Hash table **************************************************/
+
+/* FNV-1a, never 0 since 0 marks an empty slot */
+static uint64_t hashName(const char* name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/* find the slot holding name, or the empty slot where it belongs */
+static size_t findSlot(struct index_table* table, const char* name, size_t len, uint64_t hash)
+{
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].hash != 0) {
+        if (table->slots[i].hash == hash && table->slots[i].name_len == len &&
+                memcmp(table->names[i], name, len) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int allocTable(struct index_table* table, size_t capacity)
+{
+    table->slots = calloc(capacity, sizeof(struct index_entry));
+    table->names = calloc(capacity, sizeof(char*));
+    if (table->slots == NULL || table->names == NULL) {
+        free(table->slots);
+        free(table->names);
+        return -1;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    table->reshaped = 1;        // slots moved, no snapshot can be patched from it
+    table->changed_count = 0;
+    return 0;
+}
+
+static void freeTable(struct index_table* table)
+{
+    for (size_t i = 0; i < table->capacity; i++)
+        free(table->names[i]);
+    free(table->slots);
+    free(table->names);
+    memset(table, 0, sizeof(struct index_table));
+}
+
+/* double the table, keeping it at most half full */
+static int growTable(struct index_table* table)
+{
+    struct index_table grown;
+    if (allocTable(&grown, table->capacity * 2) == -1) return -1;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].hash == 0) continue;
+        size_t j = findSlot(&grown, table->names[i], table->slots[i].name_len, table->slots[i].hash);
+        grown.slots[j] = table->slots[i];
+        grown.names[j] = table->names[i];
+        grown.count++;
+    }
+    free(table->slots);
+    free(table->names);
+    *table = grown;
+    return 0;
+}
+
+static int sameMetadata(const struct index_entry* entry, const struct stat* st)
+{
+    return entry->size == st->st_size && entry->inode == st->st_ino &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* insert name or refresh its metadata, noting what the next snapshot has to pick up */
+static void updateEntry(struct index_table* table, const char* name, const struct stat* st)
+{
+    size_t len = strlen(name);
+    uint64_t hash = hashName(name, len);
+    size_t i = findSlot(table, name, len, hash);
+
+    if (table->slots[i].hash == 0) {
+        if ((table->count + 1) * 2 > table->capacity) {
+            if (growTable(table) == -1) return;
+            i = findSlot(table, name, len, hash);
+        }
+        if ((table->names[i] = strdup(name)) == NULL) return;
+        table->slots[i].hash = hash;
+        table->slots[i].name_len = len;
+        table->count++;
+        table->reshaped = 1;
+    } else if (sameMetadata(&table->slots[i], st)) {
+        return;
+    } else {
+        if (table->changed_count < INDEX_PATCH_MAX) table->changed[table->changed_count] = i;
+        table->changed_count++;
+    }
+    table->slots[i].size = st->st_size;
+    table->slots[i].mtime = st->st_mtim;
+    table->slots[i].inode = st->st_ino;
+}
+
+/* remove name, shifting later entries of its probe run back into the hole */
+static void removeEntry(struct index_table* table, const char* name)
+{
+    size_t len = strlen(name);
+    size_t mask = table->capacity - 1;
+    size_t hole = findSlot(table, name, len, hashName(name, len));
+    if (table->slots[hole].hash == 0) return;
+
+    free(table->names[hole]);
+    for (size_t j = (hole + 1) & mask; table->slots[j].hash != 0; j = (j + 1) & mask) {
+        size_t home = table->slots[j].hash & mask;
+        int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (stays) continue;
+        table->slots[hole] = table->slots[j];
+        table->names[hole] = table->names[j];
+        hole = j;
+    }
+    memset(&table->slots[hole], 0, sizeof(struct index_entry));
+    table->names[hole] = NULL;
+    table->count--;
+    table->reshaped = 1;
+}
+
+/* stat name and update or drop its entry. Dangling symlinks stay listed, as readdir() would */
+static void refreshEntry(struct index_table* table, const char* name)
+{
+    struct stat st;
+    if (stat(name, &st) == 0 || lstat(name, &st) == 0)
+        updateEntry(table, name, &st);
+    else
+        removeEntry(table, name);
+}
+
+/* rebuild the table from a full scan of the working directory */
+static int scanDirectory(struct index_table* table)
+{
+    struct dirent* _dirent;
+    DIR* _dir = opendir(".");
+    if (_dir == NULL) return -1;
+
+    size_t capacity = table->capacity;
+    freeTable(table);
+    if (allocTable(table, capacity) == -1) {
+        closedir(_dir);
+        return -1;
+    }
+    while ((_dirent = readdir(_dir)) != NULL)
+        refreshEntry(table, _dirent->d_name);
+    closedir(_dir);
+    return 0;
+}
+
+/***************************************** Snapshots *****************************************************/
+
+/* slot i of a snapshot */
+static inline struct index_entry* snapshotSlot(const struct index_snapshot* snapshot, size_t i)
+{
+    return &snapshot->pages[i / INDEX_PAGE_SLOTS][i % INDEX_PAGE_SLOTS];
+}
+
+/* find the snapshot slot holding name, or the empty slot ending its probe run */
+static size_t probeSnapshot(const struct index_snapshot* snapshot, const char* name, size_t len,
+                            uint64_t hash)
+{
+    size_t mask = snapshot->capacity - 1;
+    size_t i = hash & mask;
+    for (struct index_entry* entry; (entry = snapshotSlot(snapshot, i))->hash != 0; i = (i + 1) & mask)
+        if (entry->hash == hash && entry->name_len == len &&
+                memcmp(snapshot->listing + entry->name_off, name, len) == 0)
+            break;
+    return i;
+}
+
+/* free a snapshot, except for the pages and listing it shares with keep (NULL if none) */
+static void freeSnapshot(struct index_snapshot* snapshot, const struct index_snapshot* keep)
+{
+    if (snapshot == NULL) return;
+    int related = keep != NULL && keep->capacity == snapshot->capacity;
+    for (size_t p = 0; snapshot->pages != NULL && p < snapshot->capacity / INDEX_PAGE_SLOTS; p++)
+        if (!related || keep->pages[p] != snapshot->pages[p])
+            free(snapshot->pages[p]);
+    if (keep == NULL || keep->listing != snapshot->listing)
+        free(snapshot->listing);
+    free(snapshot->pages);
+    free(snapshot);
+}
+
+/* copy the table into a compact immutable snapshot whose listing also stores the names */
+static struct index_snapshot* buildSnapshot(struct index_table* table)
+{
+    struct index_snapshot* snapshot = calloc(1, sizeof(struct index_snapshot));
+    if (snapshot == NULL) return NULL;
+
+    snapshot->capacity = INDEX_MIN_CAPACITY;
+    while (snapshot->capacity < table->count * 2)
+        snapshot->capacity <<= 1;
+    for (size_t i = 0; i < table->capacity; i++)
+        if (table->slots[i].hash != 0)
+            snapshot->listing_len += table->slots[i].name_len + 1;
+
+    size_t pages = snapshot->capacity / INDEX_PAGE_SLOTS;
+    snapshot->pages = calloc(pages, sizeof(struct index_entry*));
+    snapshot->listing = malloc(snapshot->listing_len + 1);
+    if (snapshot->pages == NULL || snapshot->listing == NULL) {
+        freeSnapshot(snapshot, NULL);
+        return NULL;
+    }
+    for (size_t p = 0; p < pages; p++) {
+        if ((snapshot->pages[p] = calloc(INDEX_PAGE_SLOTS, sizeof(struct index_entry))) == NULL) {
+            freeSnapshot(snapshot, NULL);
+            return NULL;
+        }
+    }
+
+    size_t mask = snapshot->capacity - 1;
+    size_t offset = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        struct index_entry entry = table->slots[i];
+        if (entry.hash == 0) continue;
+
+        entry.name_off = offset;
+        memcpy(snapshot->listing + offset, table->names[i], entry.name_len);
+        offset += entry.name_len;
+        snapshot->listing[offset++] = '\n';
+
+        size_t j = entry.hash & mask;
+        while (snapshotSlot(snapshot, j)->hash != 0)
+            j = (j + 1) & mask;
+        *snapshotSlot(snapshot, j) = entry;
+        snapshot->count++;
+    }
+    return snapshot;
+}
+
+/* copy current with the metadata of the table's changed entries patched in. No name came or
+ * went, so the copy shares the listing and every page that holds none of them */
+static struct index_snapshot* patchSnapshot(const struct index_snapshot* current,
+                                            struct index_table* table)
+{
+    size_t pages = current->capacity / INDEX_PAGE_SLOTS;
+    struct index_snapshot* snapshot = malloc(sizeof(struct index_snapshot));
+    if (snapshot == NULL) return NULL;
+    *snapshot = *current;
+    if ((snapshot->pages = malloc(pages * sizeof(struct index_entry*))) == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+    memcpy(snapshot->pages, current->pages, pages * sizeof(struct index_entry*));
+
+    for (size_t c = 0; c < table->changed_count; c++) {
+        const struct index_entry* changed = &table->slots[table->changed[c]];
+        size_t i = probeSnapshot(snapshot, table->names[table->changed[c]], changed->name_len,
+                                 changed->hash);
+        size_t page = i / INDEX_PAGE_SLOTS;
+        if (snapshotSlot(current, i)->hash == 0) continue;
+        if (snapshot->pages[page] == current->pages[page]) {
+            struct index_entry* copy = malloc(INDEX_PAGE_SLOTS * sizeof(struct index_entry));
+            if (copy == NULL) {
+                freeSnapshot(snapshot, current);
+                return NULL;
+            }
+            memcpy(copy, current->pages[page], INDEX_PAGE_SLOTS * sizeof(struct index_entry));
+            snapshot->pages[page] = copy;
+        }
+        struct index_entry* entry = snapshotSlot(snapshot, i);
+        entry->size = changed->size;
+        entry->mtime = changed->mtime;
+        entry->inode = changed->inode;
+    }
+    return snapshot;
+}
+
+/* wait until no reader can still hold a snapshot that was current before this call. A reader
+ * registered under one parity or the other before loading it; draining both in turn covers
+ * it whichever it was */
+static void waitForReaders()
+{
+    for (int round = 0; round < 2; round++) {
+        unsigned int draining = atomic_fetch_add(&file_index.epoch, 1) & 1;
+        while (atomic_load(&file_index.readers[draining]) != 0)
+            sched_yield();
+    }
+}
+
+/* swap in a new snapshot and free the old one, but for what the new one shares with it, once
+ * no reader can still hold it. Returns -1 if the snapshot couldn't be built */
+static int publishSnapshot(struct index_snapshot* snapshot)
+{
+    if (snapshot == NULL) {
+        fprintf(stderr, "Failed to allocate directory index snapshot\n");
+        return -1;
+    }
+    snapshot->version = ++file_index.version;
+    struct index_snapshot* old = atomic_exchange(&file_index.current, snapshot);
+    if (old == NULL) return 0;
+    waitForReaders();
+    freeSnapshot(old, snapshot);
+    return 0;
+}
+
+/* publish what the table has picked up since the last snapshot: a rebuild if names came or went
+ * (or too many files changed to patch), else a patched copy of the current snapshot. What
+ * fails to publish is kept for the next batch */
+static void publishChanges(struct index_table* table)
+{
+    struct index_snapshot* current = atomic_load(&file_index.current);
+    int published;
+    if (table->reshaped || current == NULL || table->changed_count > INDEX_PATCH_MAX)
+        published = publishSnapshot(buildSnapshot(table));
+    else if (table->changed_count > 0)
+        published = publishSnapshot(patchSnapshot(current, table));
+    else
+        return;
+    if (published == -1) return;
+    table->reshaped = 0;
+    table->changed_count = 0;
+}
+
+/**************************************** Index thread ***************************************************/
+
+/* whether name is the first of its kind in a read of events. seen holds the names already met */
+static int firstInBatch(const char** seen, const char* name)
+{
+    size_t mask = INDEX_BATCH_SLOTS - 1;
+    for (size_t i = hashName(name, strlen(name)) & mask; ; i = (i + 1) & mask) {
+        if (seen[i] == NULL) {
+            seen[i] = name;
+            return 1;
+        }
+        if (strcmp(seen[i], name) == 0) return 0;
+    }
+}
+
+/* apply every queued inotify event to the table, then publish once for the whole batch. Names
+ * are stat'ed once per read however many events they queued, so a file being written, which
+ * raises IN_MODIFY on every write, costs one stat() per batch */
+static void applyEvents()
+{
+    char events[INDEX_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    static const char* seen[INDEX_BATCH_SLOTS];     // only the index thread applies events
+    int rescan = 0;
+
+    for (;;) {
+        ssize_t n = read(file_index.inotify_fd, events, sizeof(events));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        memset(seen, 0, sizeof(seen));
+        for (char* ptr = events; ptr < events + n; ) {
+            struct inotify_event* event = (struct inotify_event*) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = 1;			// events were dropped, only a full scan is trustworthy
+            } else if (event->len > 0 && firstInBatch(seen, event->name)) {
+                refreshEntry(&file_index.table, event->name);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (rescan && scanDirectory(&file_index.table) == -1)
+        fprintf(stderr, "Failed to rescan directory after inotify overflow\n");
+    publishChanges(&file_index.table);
+}
+
+static void* file_index_thread(void* arg)
+{
+    struct pollfd fds[2] = {
+        { .fd = file_index.inotify_fd, .events = POLLIN },
+        { .fd = file_index.wakeup_fd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Directory index poll failed, index will go stale\n");
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents) applyEvents();
+    }
+    return NULL;
+}
+
+/************************************ Index setup and teardown *******************************************/
+
+/* scan the working directory and start watching it. Returns -1 if inotify is unavailable, in
+ * which case callers fall back to scanning the directory themselves */
+int initFileIndex()
+{
+    file_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (file_index.inotify_fd == -1) {
+        fprintf(stderr, "inotify unavailable, directory index disabled\n");
+        return -1;
+    }
+    /* watch before scanning so nothing created in between is missed */
+    if (inotify_add_watch(file_index.inotify_fd, ".", INDEX_WATCH_MASK) == -1 ||
+            (file_index.wakeup_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        fprintf(stderr, "Failed to watch directory, directory index disabled\n");
+        close(file_index.inotify_fd);
+        return -1;
+    }
+
+    if (allocTable(&file_index.table, INDEX_MIN_CAPACITY) == -1 ||
+            scanDirectory(&file_index.table) == -1) {
+        fprintf(stderr, "Failed to scan directory, directory index disabled\n");
+        freeTable(&file_index.table);
+        close(file_index.inotify_fd);
+        close(file_index.wakeup_fd);
+        return -1;
+    }
+    publishChanges(&file_index.table);
+
+    if (atomic_load(&file_index.current) == NULL ||
+            pthread_create(&file_index.thread, NULL, file_index_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to start directory index thread\n");
+        freeSnapshot(atomic_exchange(&file_index.current, NULL), NULL);
+        freeTable(&file_index.table);
+        close(file_index.inotify_fd);
+        close(file_index.wakeup_fd);
+        return -1;
+    }
+    file_index.enabled = 1;
+    printf("Indexed %zu directory entries\n", file_index.table.count);
+    return 0;
+}
+
+/* stop the index thread and free the index, once no reader can still be using it */
+void stopFileIndex()
+{
+    if (!file_index.enabled) return;
+    file_index.enabled = 0;
+
+    uint64_t one = 1;
+    if (write(file_index.wakeup_fd, &one, sizeof(one)) == -1)
+        fprintf(stderr, "Failed to wake directory index thread\n");
+    pthread_join(file_index.thread, NULL);
+
+    struct index_snapshot* last = atomic_exchange(&file_index.current, NULL);
+    waitForReaders();
+    freeSnapshot(last, NULL);
+    freeTable(&file_index.table);
+    close(file_index.inotify_fd);
+    close(file_index.wakeup_fd);
+}
+
+int fileIndexEnabled()
+{
+    return file_index.enabled;
+}
+
+/***************************************** Lookups *******************************************************/
+
+/* pin the current snapshot. Every beginIndexRead() must be paired with endIndexRead() */
+const struct index_snapshot* beginIndexRead(struct index_reader* reader)
+{
+    reader->epoch = atomic_load(&file_index.epoch) & 1;
+    atomic_fetch_add(&file_index.readers[reader->epoch], 1);
+    reader->snapshot = atomic_load(&file_index.current);
+    return reader->snapshot;
+}
+
+void endIndexRead(struct index_reader* reader)
+{
+    atomic_fetch_sub(&file_index.readers[reader->epoch], 1);
+    reader->snapshot = NULL;
+}
+
+/* returns name's entry in snapshot, NULL if the directory doesn't contain it */
+const struct index_entry* lookupIndexedFile(const struct index_snapshot* snapshot, const char* name)
+{
+    if (snapshot == NULL) return NULL;
+
+    size_t len = strlen(name);
+    const struct index_entry* entry = snapshotSlot(snapshot, probeSnapshot(snapshot, name, len,
+                                                                           hashName(name, len)));
+    return entry->hash != 0 ? entry : NULL;
+}
@@ -0,0 +1,63 @@
+/***************************************************************************************
+ * Title: File Index Specification
+ * Description: Specification for the server's directory index. The served directory is
+ * 		scanned once at startup into an open-addressing hash of name to metadata,
+ * 		then kept fresh by a thread watching it with inotify. Readers see immutable
+ * 		snapshots which the index thread swaps in after each batch of changes, so
+ * 		GET lookups are O(1) and LIST copies a ready-made listing, without locks.
+ * 		A snapshot's slots are held in pages: a batch that only changed files
+ * 		copies the pages holding them and shares the rest, and the listing, with
+ * 		the snapshot before it.
+ * ************************************************************************************/
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define INDEX_MIN_CAPACITY      64          // slots, always a power of two
+#define INDEX_EVENT_BUFFER      (64 * 1024) // inotify events read per batch
+#define INDEX_PAGE_SLOTS        64          // snapshot slots per page, the unit a changed file copies
+#define INDEX_PATCH_MAX         1024        // changed files a batch patches in, more rebuild
+
+/* One directory entry. hash 0 marks an empty slot */
+struct index_entry {
+    uint64_t hash;
+    size_t name_off;            // snapshot: offset of the name in listing
+    size_t name_len;
+    off_t size;
+    struct timespec mtime;
+    ino_t inode;
+};
+
+/* Immutable view of the directory, published by the index thread */
+struct index_snapshot {
+    uint64_t version;
+    size_t capacity;
+    size_t count;
+    struct index_entry** pages; // slot i is pages[i / INDEX_PAGE_SLOTS][i % INDEX_PAGE_SLOTS]
+    char* listing;              // "name\n" for every entry, names are matched in place
+    size_t listing_len;
+};
+
+/* Read-side handle. A snapshot stays valid until endIndexRead() */
+struct index_reader {
+    unsigned int epoch;
+    const struct index_snapshot* snapshot;
+};
+
+/* Index setup and teardown */
+int initFileIndex();
+void stopFileIndex();
+int fileIndexEnabled();
+
+/* Lock-free lookups, safe to call from any thread */
+const struct index_snapshot* beginIndexRead(struct index_reader*);
+void endIndexRead(struct index_reader*);
+const struct index_entry* lookupIndexedFile(const struct index_snapshot*, const char*);
+
+#endif
@@ -0,0 +1,248 @@
+/********************************************************************************************
+ * Title: Upload ingest implementation
+ * Description: The payload is spliced from the socket into a pipe of up to INGEST_PIPE_SIZE
+ * 		and from the pipe into the file at its write offset, the pipe being drained
+ * 		before the socket is read again. Both splices are non-blocking, so the
+ * 		epoll engine resumes on the data socket's next EPOLLIN and the threads
+ * 		engine polls it. Writeback is started every INGEST_FLUSH_BYTES so dirty
+ * 		pages don't pile up until the final fdatasync(). Where splice() isn't
+ * 		supported bytes are copied through a per-thread buffer instead. The file is
+ * 		opened with O_TMPFILE in the served directory, which has no name until it
+ * 		is linked under a hidden temporary one at commit; file systems without it
+ * 		get that hidden name up front. Either way it's then renamed over the final
+ * 		name, which is atomic. A failed upload keeps reading its payload and throws
+ * 		it away, so the data connection stays in step for the next command.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+
+#include "download_server.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "log.h"
+
+#define INGEST_COPY_SIZE        (64 * 1024)
+
+static _Atomic unsigned int temp_sequence;
+static __thread unsigned char copy_buffer[INGEST_COPY_SIZE];
+
+/* reset an ingest to hold nothing */
+void initIngest(struct file_ingest* ingest)
+{
+    memset(ingest, 0, sizeof(struct file_ingest));
+    ingest->file_fd = ingest->pipe_fds[0] = ingest->pipe_fds[1] = -1;
+}
+
+/* whether name may be uploaded to: a plain file name in the served directory, not hidden (temporary
+ * names are) and short enough to take the temporary suffix */
+static int validUploadName(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 0 && len < NAME_MAX - 32 && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+/* choose a hidden name for the upload that no other upload, in this or another process, is using */
+static int makeTempName(struct file_ingest* ingest)
+{
+    unsigned int sequence = atomic_fetch_add(&temp_sequence, 1);
+    int len = snprintf(ingest->temp_name, sizeof(ingest->temp_name), ".%s" INGEST_TEMP_SUFFIX "-%d-%u",
+                       ingest->name, (int) getpid(), sequence);
+    return len > 0 && (size_t) len < sizeof(ingest->temp_name) ? 0 : -1;
+}
+
+/* give up on storing the upload: remove the file and discard the rest of the payload */
+static void failIngest(struct file_ingest* ingest, char* error)
+{
+    if (ingest->error == NULL) ingest->error = error;
+    if (ingest->file_fd != -1) close(ingest->file_fd);
+    if (ingest->temp_name[0] != '\0') unlink(ingest->temp_name);
+    ingest->file_fd = -1;
+    ingest->temp_name[0] = '\0';
+}
+
+/* start receiving size bytes for session conn into a new file that will be called name. Returns -1
+ * if the name isn't allowed or the file can't be created, the ingest then discards the payload and
+ * holds the error */
+int openIngest(struct file_ingest* ingest, uint64_t conn, const char* name, uint64_t size)
+{
+    initIngest(ingest);
+    ingest->conn = conn;
+    ingest->size = size;
+    if (!validUploadName(name)) {
+        ingest->error = ERROR_BAD_FILENAME;
+        return -1;
+    }
+    strcpy(ingest->name, name);
+
+    ingest->file_fd = open(".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    ingest->unnamed = ingest->file_fd != -1;
+    if (ingest->file_fd == -1 && makeTempName(ingest) == 0)
+        ingest->file_fd = open(ingest->temp_name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (ingest->file_fd == -1) {
+        logEvent(ingest->conn, LOG_UPLOAD_FAILED, name, logLiteral("create"));
+        ingest->temp_name[0] = '\0';
+        failIngest(ingest, ERROR_UPLOAD_FAILED);
+        return -1;
+    }
+
+    /* reserve the whole file now, so a full disk is found before any of it is received */
+    if (size > 0 && fallocate(ingest->file_fd, 0, 0, (off_t) size) == -1 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+        logEvent(ingest->conn, LOG_UPLOAD_FAILED, name, logLiteral("preallocate"));
+        failIngest(ingest, ERROR_UPLOAD_FAILED);
+        return -1;
+    }
+
+    if (pipe2(ingest->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        ingest->pipe_fds[0] = ingest->pipe_fds[1] = -1;
+        ingest->use_recv = 1;
+        return 0;
+    }
+    fcntl(ingest->pipe_fds[1], F_SETPIPE_SZ, INGEST_PIPE_SIZE);
+    int pipe_size = fcntl(ingest->pipe_fds[1], F_GETPIPE_SZ);
+    ingest->pipe_size = pipe_size > 0 ? (size_t) pipe_size : 65536;
+    return 0;
+}
+
+/* discard a payload of size bytes for session conn, then answer with error */
+void rejectIngest(struct file_ingest* ingest, uint64_t conn, uint64_t size, char* error)
+{
+    initIngest(ingest);
+    ingest->conn = conn;
+    ingest->size = size;
+    ingest->error = error;
+}
+
+/* start writing back what has been written since the last flush, once there is enough of it */
+static void startWriteback(struct file_ingest* ingest)
+{
+    if (ingest->written - ingest->flushed < INGEST_FLUSH_BYTES) return;
+    sync_file_range(ingest->file_fd, ingest->flushed, ingest->written - ingest->flushed, SYNC_FILE_RANGE_WRITE);
+    ingest->flushed = ingest->written;
+}
+
+/* move everything in the pipe into the file, or throw it away if the upload failed. Returns -1 if
+ * the pipe can't be read */
+static int drainPipe(struct file_ingest* ingest)
+{
+    while (ingest->pipe_bytes > 0) {
+        ssize_t n;
+        if (ingest->file_fd != -1)
+            n = splice(ingest->pipe_fds[0], NULL, ingest->file_fd, &ingest->written, ingest->pipe_bytes, SPLICE_F_MOVE);
+        else
+            n = read(ingest->pipe_fds[0], copy_buffer,
+                     ingest->pipe_bytes < INGEST_COPY_SIZE ? ingest->pipe_bytes : INGEST_COPY_SIZE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0 && ingest->file_fd != -1) {
+            logEvent(ingest->conn, LOG_UPLOAD_FAILED, ingest->name, logLiteral("write"));
+            failIngest(ingest, ERROR_UPLOAD_FAILED);		// ENOSPC, EIO: drop the rest
+            continue;
+        }
+        if (n <= 0) return -1;
+        ingest->pipe_bytes -= n;
+    }
+    if (ingest->file_fd != -1) startWriteback(ingest);
+    return 0;
+}
+
+/* receive up to len bytes through the copy buffer, writing them to the file unless the upload
+ * failed. Returns what recv() did */
+static ssize_t copyFromSocket(int sock_fd, struct file_ingest* ingest, uint64_t len)
+{
+    ssize_t n = recv(sock_fd, copy_buffer, len < INGEST_COPY_SIZE ? (size_t) len : INGEST_COPY_SIZE, MSG_DONTWAIT);
+    for (ssize_t done = 0; n > 0 && done < n && ingest->file_fd != -1; ) {
+        ssize_t written = pwrite(ingest->file_fd, copy_buffer + done, n - done, ingest->written);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) {
+            logEvent(ingest->conn, LOG_UPLOAD_FAILED, ingest->name, logLiteral("write"));
+            failIngest(ingest, ERROR_UPLOAD_FAILED);
+            break;
+        }
+        done += written;
+        ingest->written += written;
+    }
+    if (n > 0 && ingest->file_fd != -1) startWriteback(ingest);
+    return n;
+}
+
+/* receive as much of the payload as the data socket has. Returns 1 once all of it is in (stored or
+ * discarded), 0 if the socket would block, -1 if the client closed it early or on error */
+int pumpIngest(int sock_fd, struct file_ingest* ingest)
+{
+    while (ingest->received < ingest->size || ingest->pipe_bytes > 0) {
+        if (ingest->pipe_bytes > 0) {
+            if (drainPipe(ingest) == -1) return -1;
+            continue;
+        }
+
+        uint64_t remaining = ingest->size - ingest->received;
+        ssize_t n;
+        if (ingest->file_fd != -1 && !ingest->use_recv) {
+            size_t len = remaining < ingest->pipe_size ? (size_t) remaining : ingest->pipe_size;
+            n = splice(sock_fd, NULL, ingest->pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1 && errno == EINVAL) {
+                ingest->use_recv = 1;		// not a socket splice() can read from
+                continue;
+            }
+            if (n > 0) ingest->pipe_bytes += n;
+        } else {
+            n = copyFromSocket(sock_fd, ingest, remaining);
+        }
+
+        if (n == 0) return -1;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        ingest->received += n;
+        countMetric(METRIC_BYTES_RECEIVED, n);
+    }
+    return 1;
+}
+
+/* put a fully received upload under its name: flush it, then rename it over whatever file has the
+ * name now. Returns -1 if that fails, the ingest then holds the error and no file is left behind */
+int commitIngest(struct file_ingest* ingest)
+{
+    char path[64];
+    if (ingest->file_fd == -1) return -1;
+
+    if (fdatasync(ingest->file_fd) == -1) {
+        logEvent(ingest->conn, LOG_UPLOAD_FAILED, ingest->name, logLiteral("flush"));
+        failIngest(ingest, ERROR_UPLOAD_FAILED);
+        return -1;
+    }
+    if (ingest->unnamed) {
+        /* an O_TMPFILE file can only be linked under a new name, so it goes through a temporary one */
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", ingest->file_fd);
+        if (makeTempName(ingest) == -1 ||
+                linkat(AT_FDCWD, path, AT_FDCWD, ingest->temp_name, AT_SYMLINK_FOLLOW) == -1) {
+            logEvent(ingest->conn, LOG_UPLOAD_FAILED, ingest->name, logLiteral("link"));
+            ingest->temp_name[0] = '\0';
+            failIngest(ingest, ERROR_UPLOAD_FAILED);
+            return -1;
+        }
+        ingest->unnamed = 0;
+    }
+    if (rename(ingest->temp_name, ingest->name) == -1) {
+        logEvent(ingest->conn, LOG_UPLOAD_FAILED, ingest->name, logLiteral("rename"));
+        failIngest(ingest, ERROR_UPLOAD_FAILED);
+        return -1;
+    }
+    ingest->temp_name[0] = '\0';
+    return 0;
+}
+
+/* release the upload's file and pipe, removing the file if it was never committed */
+void releaseIngest(struct file_ingest* ingest)
+{
+    if (ingest->file_fd != -1) close(ingest->file_fd);
+    if (ingest->temp_name[0] != '\0') unlink(ingest->temp_name);
+    if (ingest->pipe_fds[0] != -1) close(ingest->pipe_fds[0]);
+    if (ingest->pipe_fds[1] != -1) close(ingest->pipe_fds[1]);
+    initIngest(ingest);
+}
@@ -0,0 +1,50 @@
+/***************************************************************************************
+ * Title: Upload Ingest Specification
+ * Description: Specification for receiving uploaded files (PUT). A PUT's payload arrives
+ * 		on the data connection and is spliced socket -> pipe -> file, so it never
+ * 		passes through a user-space buffer. The file is preallocated to the
+ * 		announced size and written without a name (O_TMPFILE) or under a hidden
+ * 		temporary one, and only renamed onto its final name once every byte is
+ * 		on disk, so readers see the old file or the whole new one, never a part.
+ * 		Every upload has its own file and pipe, so sessions upload in parallel.
+ * ************************************************************************************/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define INGEST_PIPE_SIZE        (1024 * 1024)       // asked of F_SETPIPE_SZ, the kernel may give less
+#define INGEST_FLUSH_BYTES      (8 * 1024 * 1024)   // writeback is started every this many bytes
+#define INGEST_WAIT_MS          100                 // a blocking receiver rechecks for shutdown this often
+#define INGEST_TEMP_SUFFIX      ".upload"
+
+/* One upload in progress. With error set the payload is read and discarded instead */
+struct file_ingest {
+    int file_fd;                // the new file, -1 if discarding
+    int pipe_fds[2];
+    size_t pipe_size;
+    size_t pipe_bytes;          // spliced from the socket, not yet into the file
+    int use_recv;               // splice() unsupported, bytes are copied through a buffer
+    char name[NAME_MAX + 1];
+    char temp_name[NAME_MAX + 1];   // hidden name the file is written or linked under, "" if none
+    int unnamed;                // O_TMPFILE: the file has no name until it is committed
+    uint64_t conn;              // session id its log records carry
+    uint64_t size;              // payload length announced by the command
+    uint64_t received;
+    off_t written;
+    off_t flushed;              // writeback started up to here
+    char* error;                // response once the payload is drained, NULL if it is stored
+};
+
+/* Upload ingest */
+void initIngest(struct file_ingest*);
+int openIngest(struct file_ingest*, uint64_t, const char*, uint64_t);
+void rejectIngest(struct file_ingest*, uint64_t, uint64_t, char*);
+int pumpIngest(int, struct file_ingest*);
+int commitIngest(struct file_ingest*);
+void releaseIngest(struct file_ingest*);
+
+#endif
@@ -0,0 +1,421 @@
+/********************************************************************************************
+ * Title: Directory listing implementation
+ * Description: Reads each directory with getdents64() into a buffer shared by the whole
+ * 		walk, so a directory of any size costs a handful of system calls, then
+ * 		sorts its names and visits them in order. Resuming descends straight along
+ * 		the cursor's components, skipping everything before it without reading
+ * 		the directories it passed. Metadata comes from fstatat() relative to the
+ * 		directory being walked, and symbolic links are listed but never followed.
+ * 		Reads of large directories are kept, sorted, in a small cache validated
+ * 		against the directory's mtime and ctime, so paging through a directory
+ * 		reads and sorts it once and each page finds its cursor by binary search.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "listing.h"
+
+/* getdents64() record, as the kernel lays it out */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct list_entry {
+    size_t name_off;            // in the directory's name pool
+    unsigned char type;         // DT_* from getdents64()
+};
+
+/* A directory's entries, read and sorted once. Never modified after the read, so the walks of
+ * every page can share it while the directory is unchanged */
+struct sorted_dir {
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;      // as fstat() saw them before the read
+    struct timespec ctime;
+    char* pool;                 // the entries' names
+    struct list_entry* entries; // sorted by name
+    size_t count;
+    size_t bytes;               // pool and entries, counted against LIST_CACHE_BYTES
+    _Atomic int refs;           // the cache's own reference, while cached, plus one per walk
+    uint64_t used;              // when a walk last took it, the least recent is evicted first
+};
+
+struct list_walk {
+    const struct list_request* request;
+    struct list_sink* sink;
+    unsigned char* dents;       // getdents64() buffer, shared by every directory
+    char path[PATH_MAX];        // path of the entry being visited
+    char last[PATH_MAX];        // path of the last entry listed
+    size_t prefix_len;
+    size_t listed;
+    int more;                   // stopped at the page limit with entries left
+    int failed;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct sorted_dir* dirs[LIST_CACHE_DIRS];
+    size_t bytes;
+    uint64_t clock;
+} list_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**************************************** Request parsing ***********************************************/
+
+/* parse "{FLAGS} {LIMIT} /{PREFIX} [{CURSOR}]". FLAGS is any of 'm' (metadata) and 'r' (recursive),
+ * or '-' for neither; LIMIT is the page size, 0 for no limit; the prefix is rooted at '/' and the
+ * cursor is the rest of the line. Returns -1 if malformed */
+int parseListRequest(const char* args, struct list_request* request)
+{
+    char flags[8], prefix[PATH_MAX];
+    unsigned long long limit;
+    int cursor_start = 0;
+
+    memset(request, 0, sizeof(struct list_request));
+    if (sscanf(args, "%7s %llu %4095s %n", flags, &limit, prefix, &cursor_start) != 3 || prefix[0] != '/')
+        return -1;
+    for (const char* flag = flags; *flag != '\0'; flag++) {
+        if (*flag == 'm') request->flags |= LIST_FLAG_METADATA;
+        else if (*flag == 'r') request->flags |= LIST_FLAG_RECURSIVE;
+        else if (*flag != '-') return -1;
+    }
+    request->limit = (size_t) limit;
+    snprintf(request->prefix, sizeof(request->prefix), "%s", prefix + 1);
+    if (cursor_start > 0)
+        snprintf(request->cursor, sizeof(request->cursor), "%s", args + cursor_start);
+    return 0;
+}
+
+/*********************************************** Reading ************************************************/
+
+static int compareEntries(const void* a, const void* b, void* pool)
+{
+    return strcmp((char*) pool + ((const struct list_entry*) a)->name_off,
+                  (char*) pool + ((const struct list_entry*) b)->name_off);
+}
+
+/* read every entry of a directory except . and .. into dir's name pool and entry array, sorted
+ * by name. Returns -1 on error */
+static int readDirectory(struct list_walk* walk, int dir_fd, struct sorted_dir* dir)
+{
+    size_t pool_len = 0, pool_cap = 4096, count = 0, cap = 64;
+    char** pool = &dir->pool;
+    struct list_entry** entries = &dir->entries;
+    *pool = malloc(pool_cap);
+    *entries = malloc(cap * sizeof(struct list_entry));
+    if (*pool == NULL || *entries == NULL) goto fail;
+
+    while (1) {
+        long n = syscall(SYS_getdents64, dir_fd, walk->dents, LIST_DENTS_BUFFER);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) goto fail;
+        if (n == 0) break;
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64* dent = (struct linux_dirent64*) (walk->dents + off);
+            off += dent->d_reclen;
+            if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) continue;
+
+            size_t len = strlen(dent->d_name) + 1;
+            if (pool_len + len > pool_cap) {
+                while (pool_len + len > pool_cap) pool_cap *= 2;
+                char* grown = realloc(*pool, pool_cap);
+                if (grown == NULL) goto fail;
+                *pool = grown;
+            }
+            if (count == cap) {
+                struct list_entry* grown = realloc(*entries, (cap *= 2) * sizeof(struct list_entry));
+                if (grown == NULL) goto fail;
+                *entries = grown;
+            }
+            memcpy(*pool + pool_len, dent->d_name, len);
+            (*entries)[count++] = (struct list_entry) { pool_len, dent->d_type };
+            pool_len += len;
+        }
+    }
+    qsort_r(*entries, count, sizeof(struct list_entry), compareEntries, *pool);
+    dir->count = count;
+    dir->bytes = pool_cap + cap * sizeof(struct list_entry);
+    return 0;
+
+fail:
+    free(*pool);
+    free(*entries);
+    return -1;
+}
+
+/************************************************ Cache *************************************************/
+
+/* drop one reference, freeing the read with the last one */
+static void dropSortedDir(struct sorted_dir* dir)
+{
+    if (atomic_fetch_sub(&dir->refs, 1) != 1) return;
+    free(dir->pool);
+    free(dir->entries);
+    free(dir);
+}
+
+static int sameTime(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* take the cached directory in slot i out of the cache. Call with the lock held */
+static void evictSortedDir(size_t i)
+{
+    list_cache.bytes -= list_cache.dirs[i]->bytes;
+    dropSortedDir(list_cache.dirs[i]);
+    list_cache.dirs[i] = NULL;
+}
+
+/* keep dir for later pages in place of any older read of it, evicting the least recently walked
+ * directories to make room. Call with the lock held */
+static void cacheSortedDir(struct sorted_dir* dir)
+{
+    for (size_t i = 0; i < LIST_CACHE_DIRS; i++)
+        if (list_cache.dirs[i] != NULL && list_cache.dirs[i]->dev == dir->dev &&
+                list_cache.dirs[i]->inode == dir->inode)
+            evictSortedDir(i);
+
+    for (;;) {
+        size_t empty = LIST_CACHE_DIRS, victim = LIST_CACHE_DIRS;
+        for (size_t i = 0; i < LIST_CACHE_DIRS; i++) {
+            if (list_cache.dirs[i] == NULL)
+                empty = i;
+            else if (victim == LIST_CACHE_DIRS ||
+                     list_cache.dirs[i]->used < list_cache.dirs[victim]->used)
+                victim = i;
+        }
+        if (empty < LIST_CACHE_DIRS && list_cache.bytes + dir->bytes <= LIST_CACHE_BYTES) {
+            atomic_fetch_add(&dir->refs, 1);
+            list_cache.dirs[empty] = dir;
+            list_cache.bytes += dir->bytes;
+            return;
+        }
+        evictSortedDir(victim);
+    }
+}
+
+/* the sorted entries of the directory open at dir_fd: the cached read while the directory is
+ * unchanged, else a fresh one. NULL if it can't be read. Release with dropSortedDir() */
+static struct sorted_dir* acquireSortedDir(struct list_walk* walk, int dir_fd)
+{
+    struct stat st;
+    struct timespec now;
+    if (fstat(dir_fd, &st) == -1) return NULL;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    pthread_mutex_lock(&list_cache.lock);
+    for (size_t i = 0; i < LIST_CACHE_DIRS; i++) {
+        struct sorted_dir* dir = list_cache.dirs[i];
+        if (dir == NULL || dir->dev != st.st_dev || dir->inode != st.st_ino) continue;
+        if (sameTime(&dir->mtime, &st.st_mtim) && sameTime(&dir->ctime, &st.st_ctim)) {
+            dir->used = ++list_cache.clock;
+            atomic_fetch_add(&dir->refs, 1);
+            pthread_mutex_unlock(&list_cache.lock);
+            return dir;
+        }
+        evictSortedDir(i);			// entries came or went since it was read
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+
+    struct sorted_dir* dir = calloc(1, sizeof(struct sorted_dir));
+    if (dir == NULL) return NULL;
+    if (readDirectory(walk, dir_fd, dir) == -1) {
+        free(dir);
+        return NULL;
+    }
+    dir->dev = st.st_dev;
+    dir->inode = st.st_ino;
+    dir->mtime = st.st_mtim;
+    dir->ctime = st.st_ctim;
+    atomic_init(&dir->refs, 1);
+
+    /* a directory changed within the second its read began may change again without its
+     * timestamps moving, so only one that was still before then is kept */
+    if (dir->count >= LIST_CACHE_MIN_ENTRIES && dir->bytes <= LIST_CACHE_BYTES &&
+            st.st_ctim.tv_sec < now.tv_sec) {
+        pthread_mutex_lock(&list_cache.lock);
+        dir->used = ++list_cache.clock;
+        cacheSortedDir(dir);
+        pthread_mutex_unlock(&list_cache.lock);
+    }
+    return dir;
+}
+
+/* drop every cached directory. Reads still being walked are freed by their walk */
+void destroyListingCache()
+{
+    pthread_mutex_lock(&list_cache.lock);
+    for (size_t i = 0; i < LIST_CACHE_DIRS; i++)
+        if (list_cache.dirs[i] != NULL) evictSortedDir(i);
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+/******************************************** Walking ***************************************************/
+
+static void encodeBigEndian(unsigned char* dst, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        dst[i] = (unsigned char) (value >> (8 * (bytes - 1 - i)));
+}
+
+/* pack the entry at walk->path into the sink */
+static int packEntry(struct list_walk* walk, int dir_fd, const char* name, unsigned char type, size_t path_len)
+{
+    if (!(walk->request->flags & LIST_FLAG_METADATA)) {
+        walk->path[path_len] = '\n';
+        int result = walk->sink->append(walk->sink->ctx, walk->path, path_len + 1);
+        walk->path[path_len] = '\0';
+        return result;
+    }
+
+    struct stat st;
+    unsigned char record[LIST_RECORD_SIZE];
+    memset(&st, 0, sizeof(st));
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)		// the stat is authoritative
+        type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+
+    record[0] = type == DT_REG ? LIST_TYPE_FILE : type == DT_DIR ? LIST_TYPE_DIRECTORY :
+                type == DT_LNK ? LIST_TYPE_SYMLINK : LIST_TYPE_OTHER;
+    encodeBigEndian(record + 1, path_len, 2);
+    encodeBigEndian(record + 3, (uint64_t) st.st_size, 8);
+    encodeBigEndian(record + 11, (uint64_t) st.st_mtim.tv_sec, 8);
+    encodeBigEndian(record + 19, (uint64_t) st.st_mtim.tv_nsec, 4);
+    if (walk->sink->append(walk->sink->ctx, record, LIST_RECORD_SIZE) == -1) return -1;
+    return walk->sink->append(walk->sink->ctx, walk->path, path_len);
+}
+
+/* length of the cursor component at resume, up to '/' or the end */
+static size_t componentLength(const char* resume)
+{
+    const char* slash = strchr(resume, '/');
+    return slash != NULL ? (size_t) (slash - resume) : strlen(resume);
+}
+
+/* order of name against the cursor component at resume, component bytes long, as strcmp() has it */
+static int compareComponent(const char* name, const char* resume, size_t component)
+{
+    int order = strncmp(name, resume, component);
+    return order == 0 && name[component] != '\0' ? 1 : order;
+}
+
+/* index of the first of dir's entries not before the cursor component at resume */
+static size_t seekComponent(const struct sorted_dir* dir, const char* resume)
+{
+    size_t component = componentLength(resume);
+    size_t low = 0, high = dir->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compareComponent(dir->pool + dir->entries[middle].name_off, resume, component) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/* visit the directory open at dir_fd, whose path (without a trailing '/') is walk->path up to
+ * path_len. resume is what's left of the cursor below this directory, NULL once past it */
+static void walkDirectory(struct list_walk* walk, int dir_fd, size_t path_len, const char* resume, int depth)
+{
+    struct sorted_dir* dir = acquireSortedDir(walk, dir_fd);
+    if (dir == NULL) return;			// unreadable sub-directories are left out
+
+    size_t first = resume != NULL ? seekComponent(dir, resume) : 0;
+    for (size_t i = first; i < dir->count && !walk->more && !walk->failed; i++) {
+        const char* name = dir->pool + dir->entries[i].name_off;
+        unsigned char type = dir->entries[i].type;
+        size_t name_len = strlen(name);
+        const char* below = NULL;		// cursor left for this entry's children
+        int listed_already = 0;
+
+        if (resume != NULL) {
+            size_t component = componentLength(resume);
+            int order = compareComponent(name, resume, component);
+            if (order < 0) continue;
+            if (order == 0) {
+                listed_already = 1;		// the cursor itself or one of its parents
+                below = resume[component] == '/' ? resume + component + 1 : NULL;
+            } else {
+                resume = NULL;			// everything from here on is new
+            }
+        }
+
+        size_t child_len = path_len + (path_len > 0) + name_len;
+        if (child_len >= PATH_MAX) continue;
+        if (path_len > 0) walk->path[path_len] = '/';
+        memcpy(walk->path + path_len + (path_len > 0), name, name_len + 1);
+
+        int matches = strncmp(walk->path, walk->request->prefix, walk->prefix_len) == 0;
+        if (matches && !listed_already) {
+            if (walk->request->limit > 0 && walk->listed == walk->request->limit) {
+                walk->more = 1;
+                break;
+            }
+            if (packEntry(walk, dir_fd, name, type, child_len) == -1) {
+                walk->failed = 1;
+                break;
+            }
+            walk->listed++;
+            memcpy(walk->last, walk->path, child_len + 1);
+        }
+
+        /* descend where the prefix may still match below, i.e. the path is within it or leads to it */
+        int leads_to_prefix = child_len < walk->prefix_len && walk->request->prefix[child_len] == '/' &&
+                              strncmp(walk->path, walk->request->prefix, child_len) == 0;
+        if ((walk->request->flags & LIST_FLAG_RECURSIVE) && depth < LIST_MAX_DEPTH &&
+                (matches || leads_to_prefix) && (type == DT_DIR || type == DT_UNKNOWN)) {
+            int child_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd != -1) {
+                walkDirectory(walk, child_fd, child_len, below, depth + 1);
+                close(child_fd);
+            }
+        }
+        walk->path[path_len] = '\0';
+    }
+    dropSortedDir(dir);
+}
+
+/* list dir_name into the sink as the request asks. Returns 1 if the page filled up with entries
+ * left, copying the path to resume after into next_cursor (PATH_MAX bytes), 0 once the listing
+ * is complete, -1 if the directory can't be read or the sink refused an entry */
+int listDirectory(const char* dir_name, const struct list_request* request, struct list_sink* sink, char* next_cursor)
+{
+    struct list_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.request = request;
+    walk.sink = sink;
+    walk.prefix_len = strlen(request->prefix);
+
+    int dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) return -1;
+    if ((walk.dents = malloc(LIST_DENTS_BUFFER)) == NULL) {
+        close(dir_fd);
+        return -1;
+    }
+
+    walkDirectory(&walk, dir_fd, 0, request->cursor[0] != '\0' ? request->cursor : NULL, 0);
+    close(dir_fd);
+    free(walk.dents);
+
+    if (walk.failed) return -1;
+    if (!walk.more) return 0;
+    memcpy(next_cursor, walk.last, PATH_MAX);
+    return 1;
+}
@@ -0,0 +1,56 @@
+/***************************************************************************************
+ * Title: Directory Listing Specification
+ * Description: Specification for the LIST engine. Directories are read in bulk with
+ * 		getdents64() into one large buffer, sorted by name and walked depth first,
+ * 		so a listing has a stable order and can be resumed from the path of the
+ * 		last entry sent. Entries are packed into the response as they are walked:
+ * 		newline terminated paths, or fixed-size binary records carrying the type,
+ * 		size and mtime before the path. Large directories stay sorted in memory
+ * 		while unchanged, so the pages after the first don't read them again.
+ * ************************************************************************************/
+
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIST_DENTS_BUFFER   (64 * 1024)     // getdents64() reads this much per call
+#define LIST_MAX_DEPTH      32              // directories deeper than this aren't walked
+#define LIST_RECORD_SIZE    23              // binary record header, before the path
+#define LIST_CACHE_DIRS     16              // sorted directories kept for the pages that follow
+#define LIST_CACHE_BYTES    (64 * 1024 * 1024)  // ... in at most this much memory
+#define LIST_CACHE_MIN_ENTRIES  1024        // smaller directories are cheaper to read again
+
+#define LIST_FLAG_METADATA  0x1             // binary records with type, size and mtime
+#define LIST_FLAG_RECURSIVE 0x2             // walk sub-directories too
+
+/* Entry types in binary records */
+enum list_entry_type {
+    LIST_TYPE_FILE = 0,
+    LIST_TYPE_DIRECTORY,
+    LIST_TYPE_SYMLINK,
+    LIST_TYPE_OTHER
+};
+
+/* What to list and where to resume */
+struct list_request {
+    int flags;
+    size_t limit;               // entries per page, 0 for no limit
+    char prefix[PATH_MAX];      // only paths starting with this are listed, "" for all
+    char cursor[PATH_MAX];      // resume after this path, "" to start at the beginning
+};
+
+/* Receives the packed entries of a listing. Returns -1 if it can't take more */
+struct list_sink {
+    int (*append)(void*, const void*, size_t);
+    void* ctx;
+};
+
+/* Listing */
+int parseListRequest(const char*, struct list_request*);
+int listDirectory(const char*, const struct list_request*, struct list_sink*, char*);
+void destroyListingCache();
+
+#endif
@@ -0,0 +1,417 @@
+/********************************************************************************************
+ * Title: Logging implementation
+ * Description: Each thread's ring is allocated on its first record and linked into a global
+ * 		list, like its metrics block. The ring has one producer (its thread) and one
+ * 		consumer (the drainer), so head and tail are plain atomics on separate cache
+ * 		lines: the producer fills the slot at head and publishes it with a release
+ * 		store, the drainer formats up to head and frees the slots with a release
+ * 		store of tail. Each pass merges the rings by timestamp, since a client of
+ * 		the threads engine moves between workers. The mutex only guards linking
+ * 		and unlinking rings; a ring whose thread has exited is freed by the drainer
+ * 		once it is empty. Lines are batched per stream, warnings and errors on
+ * 		stderr and the rest on stdout, and written through stdio so they stay in
+ * 		order with the server's other output. Before the drainer starts, and if it
+ * 		can't, records are formatted and written by the thread that logs them.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <time.h>
+
+#include "download_server.h"
+#include "metrics.h"
+#include "log.h"
+
+#define LOG_LINE_MAX            512                 // longest formatted line, longer ones are cut
+
+/* One thread's records, written by that thread and formatted by the drainer */
+struct log_ring {
+    _Atomic uint64_t head __attribute__((aligned(64)));     // records filled, producer only
+    _Atomic uint64_t tail __attribute__((aligned(64)));     // records formatted, drainer only
+    _Atomic uint64_t dropped;   // records the ring was too full for
+    _Atomic int retired;        // the thread has exited, freed once drained
+    uint64_t dropped_reported;  // drainer only
+    uint64_t drain_tail;        // drainer only: next record of this pass
+    uint64_t drain_head;        // drainer only: records filled when the pass started
+    struct log_ring* next;
+    struct log_record records[LOG_RING_RECORDS];
+};
+
+/* Formatted lines waiting to be written to one stream */
+struct log_batch {
+    FILE* stream;
+    size_t len;
+    char data[LOG_BATCH_SIZE];
+};
+
+_Static_assert(sizeof(struct log_record) == 256, "log records are 256 bytes");
+_Static_assert((LOG_RING_RECORDS & (LOG_RING_RECORDS - 1)) == 0, "log rings are a power of two");
+
+_Atomic enum log_level log_level = LOG_INFO;
+
+const struct log_event_format log_events[LOG_EVENTS] = {
+    [LOG_WORKER_CONNECTED]      = { LOG_INFO,  "Worker thread connected to client %s data port: %u (protocol %d)" },
+    [LOG_LOOP_CONNECTED]        = { LOG_INFO,  "Event loop %d connected to client %s data port: %u (protocol %d)" },
+    [LOG_HANDSHAKE_FAILED]      = { LOG_WARN,  "Failed to get client data socket info" },
+    [LOG_CLIENT_DISCONNECTED]   = { LOG_INFO,  "Client disconnected" },
+    [LOG_CLIENT_REFUSED]        = { LOG_WARN,  "Client limit reached, refusing connection" },
+    [LOG_ACCEPT_FAILED]         = { LOG_ERROR, "accept() failed" },
+    [LOG_REGISTER_FAILED]       = { LOG_ERROR, "Failed to %S client control connection" },
+    [LOG_COMMAND_RECEIVED]      = { LOG_INFO,  "Command received: %s" },
+    [LOG_COMMAND_TOO_LONG]      = { LOG_WARN,  "Command too long, discarding" },
+    [LOG_COMMAND_INVALID]       = { LOG_WARN,  "Invalid command: %s" },
+    [LOG_COMMAND_BUSY]          = { LOG_WARN,  "No I/O buffer available, rejecting command" },
+    [LOG_DATA_CONNECT_FAILED]   = { LOG_WARN,  "Failed to connect to client data socket" },
+    [LOG_DATA_ACCEPT_FAILED]    = { LOG_WARN,  "Failed to accept client data connection" },
+    [LOG_DATA_ADDRESS_FAILED]   = { LOG_WARN,  "Failed to resolve client data address %s" },
+    [LOG_PASSIVE_FAILED]        = { LOG_WARN,  "Failed to open passive data listener" },
+    [LOG_PASSIVE_TIMEOUT]       = { LOG_WARN,  "Client did not open its data connection" },
+    [LOG_PASSIVE_REFUSED]       = { LOG_WARN,  "Refusing passive data connection from another host" },
+    [LOG_SENDING_FILE]          = { LOG_INFO,  "Sending file %s to client" },
+    [LOG_SENDING_LISTING]       = { LOG_INFO,  "Sending directory contents to client" },
+    [LOG_SENDING_STATS]         = { LOG_INFO,  "Sending server statistics to client" },
+    [LOG_FILE_NOT_FOUND]        = { LOG_WARN,  "File not found: %s" },
+    [LOG_SEND_FAILED]           = { LOG_WARN,  "Failed to send %S" },
+    [LOG_DELTA]                 = { LOG_INFO,  "Delta of %s: %u bytes matched, %u literal" },
+    [LOG_RECEIVING_FILE]        = { LOG_INFO,  "Receiving file %s from client" },
+    [LOG_UPLOAD_STORED]         = { LOG_INFO,  "Stored upload %s (%u bytes)" },
+    [LOG_UPLOAD_CUT_SHORT]      = { LOG_WARN,  "Upload of %s cut short" },
+    [LOG_UPLOAD_FAILED]         = { LOG_ERROR, "Failed to %S upload of %s" },
+    [LOG_TRANSFER_COMPLETE]     = { LOG_INFO,  "Transfer complete: %u bytes in %f ms (%f Mbit/s)" },
+    [LOG_TRANSFER_TUNED]        = { LOG_INFO,  "Transfer complete: %u bytes in %f ms (%f Mbit/s), %s profile: rtt %u us "
+                                               "(min %u), bdp %u, send buffer %d, grown %u times" }
+};
+
+static const char* level_names[LOG_LEVELS] = { "error", "warn", "info", "debug" };
+static const char* level_tags[LOG_LEVELS] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_key_t key;              // destructor retires an exiting thread's ring
+    int key_ready;
+    struct log_ring* _Atomic rings;
+    _Atomic uint64_t dropped;       // records dropped by threads that couldn't get a ring
+    uint64_t dropped_reported;
+    int level_reported;             // drainer's view of log_level, to note SIGUSR1 changes
+    pthread_t drainer;
+    _Atomic int running;
+    struct log_batch out;
+    struct log_batch err;
+} logging = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct log_ring* local_ring;
+
+/*************************************** Formatting ******************************************************/
+
+/* snprintf onto the end of buf, never past cap */
+static void appendf(char* buf, size_t cap, size_t* len, const char* format, ...)
+{
+    if (*len + 1 >= cap) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, cap - *len, format, args);
+    va_end(args);
+    if (n > 0) *len += (size_t) n < cap - *len ? (size_t) n : cap - *len - 1;
+}
+
+/* the record's event format, filled in from its text and arguments */
+static void formatMessage(char* buf, size_t cap, size_t* len, const struct log_record* record)
+{
+    int arg = 0;
+    for (const char* f = log_events[record->event].format; *f != '\0' && *len + 1 < cap; f++) {
+        if (*f != '%' || f[1] == '\0') {
+            buf[(*len)++] = *f;
+            continue;
+        }
+        uint64_t value = arg < LOG_ARGS ? record->args[arg] : 0;
+        union { uint64_t bits; double value; } cast = { .bits = value };
+        switch (*++f) {
+            case 's':
+                appendf(buf, cap, len, "%.*s", (int) record->text_len, record->text);
+                break;
+            case 'S':
+                appendf(buf, cap, len, "%s", value != 0 ? (const char*) (uintptr_t) value : "");
+                arg++;
+                break;
+            case 'u':
+                appendf(buf, cap, len, "%llu", (unsigned long long) value);
+                arg++;
+                break;
+            case 'd':
+                appendf(buf, cap, len, "%lld", (long long) (int64_t) value);
+                arg++;
+                break;
+            case 'f':
+                appendf(buf, cap, len, "%.1f", cast.value);
+                arg++;
+                break;
+            default:
+                buf[(*len)++] = *f;		// "%%"
+        }
+    }
+}
+
+/* "date time.micros LEVEL [conn N] message\n" for a record, at most cap bytes. Returns its length */
+static size_t formatRecord(char* buf, size_t cap, const struct log_record* record)
+{
+    static __thread time_t stamped_sec = -1;
+    static __thread char stamp[32];
+    size_t len = 0;
+
+    /* the date and time only change once a second */
+    time_t sec = (time_t) (record->time_ns / 1000000000ULL);
+    if (sec != stamped_sec) {
+        struct tm local;
+        localtime_r(&sec, &local);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+        stamped_sec = sec;
+    }
+    appendf(buf, cap, &len, "%s.%06u %s ", stamp, (unsigned int) (record->time_ns % 1000000000ULL / 1000),
+            level_tags[log_events[record->event].level]);
+    if (record->conn != 0) appendf(buf, cap, &len, "[conn %llu] ", (unsigned long long) record->conn);
+    formatMessage(buf, cap - 1, &len, record);
+    buf[len++] = '\n';
+    return len;
+}
+
+static void fillRecord(struct log_record* record, uint64_t conn, enum log_event event, const char* text,
+                       const uint64_t* args)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+    record->conn = conn;
+    record->event = (uint16_t) event;
+    memcpy(record->args, args, sizeof(record->args));
+    size_t text_len = text != NULL ? strnlen(text, LOG_TEXT_SIZE) : 0;
+    memcpy(record->text, text, text_len);
+    record->text_len = (uint8_t) text_len;
+}
+
+/*************************************** Per-thread rings ************************************************/
+
+/* mark an exiting thread's ring for the drainer to free */
+static void retireThreadRing(void* arg)
+{
+    struct log_ring* ring = (struct log_ring*) arg;
+    atomic_store_explicit(&ring->retired, 1, memory_order_release);
+}
+
+/* the calling thread's ring, allocated on first use. NULL if out of memory */
+static struct log_ring* localRing()
+{
+    if (local_ring != NULL) return local_ring;
+
+    struct log_ring* ring = aligned_alloc(64, sizeof(struct log_ring));
+    if (ring == NULL) return NULL;
+    memset(ring, 0, sizeof(struct log_ring));
+    pthread_mutex_lock(&logging.lock);
+    ring->next = atomic_load_explicit(&logging.rings, memory_order_relaxed);
+    atomic_store_explicit(&logging.rings, ring, memory_order_release);
+    pthread_mutex_unlock(&logging.lock);
+    if (logging.key_ready) pthread_setspecific(logging.key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+/* count a record there was no room for */
+static void dropRecord(struct log_ring* ring)
+{
+    atomic_fetch_add_explicit(ring != NULL ? &ring->dropped : &logging.dropped, 1, memory_order_relaxed);
+    countMetric(METRIC_LOG_DROPPED, 1);
+}
+
+/*********************************************** Recording **********************************************/
+
+/* record an event for the drainer, or drop it if the thread's ring is full. Called through logEvent() */
+void logRecord(uint64_t conn, enum log_event event, const char* text, const uint64_t* args)
+{
+    if (!atomic_load_explicit(&logging.running, memory_order_acquire)) {
+        /* no drainer: format and write it here */
+        struct log_record record;
+        char line[LOG_LINE_MAX];
+        fillRecord(&record, conn, event, text, args);
+        size_t len = formatRecord(line, sizeof(line), &record);
+        fwrite(line, 1, len, log_events[event].level <= LOG_WARN ? stderr : stdout);
+        return;
+    }
+
+    struct log_ring* ring = localRing();
+    if (ring == NULL) {
+        dropRecord(NULL);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_RECORDS) {
+        dropRecord(ring);
+        return;
+    }
+    fillRecord(&ring->records[head & (LOG_RING_RECORDS - 1)], conn, event, text, args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*********************************************** Draining ***********************************************/
+
+static void flushBatch(struct log_batch* batch)
+{
+    if (batch->len == 0) return;
+    fwrite(batch->data, 1, batch->len, batch->stream);
+    fflush(batch->stream);
+    batch->len = 0;
+}
+
+/* the batch a line of the given level goes to, with room for one more line */
+static struct log_batch* batchFor(enum log_level level)
+{
+    struct log_batch* batch = level <= LOG_WARN ? &logging.err : &logging.out;
+    if (batch->len + LOG_LINE_MAX > LOG_BATCH_SIZE) flushBatch(batch);
+    return batch;
+}
+
+/* a line of the drainer's own, about the logging itself */
+static void appendNotice(enum log_level level, const char* format, ...)
+{
+    struct log_batch* batch = batchFor(level);
+    struct timespec now;
+    struct tm local;
+    char stamp[32];
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    appendf(batch->data, LOG_BATCH_SIZE, &batch->len, "%s.%06u %s ", stamp, (unsigned int) (now.tv_nsec / 1000),
+            level_tags[level]);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(batch->data + batch->len, LOG_LINE_MAX / 2, format, args);
+    va_end(args);
+    if (n > 0) batch->len += (size_t) n < LOG_LINE_MAX / 2 ? (size_t) n : LOG_LINE_MAX / 2 - 1;
+    batch->data[batch->len++] = '\n';
+}
+
+/* format every record waiting in every ring, free drained rings of exited threads, and write the
+ * lines out. Returns the number of records formatted */
+static uint64_t drainRings()
+{
+    struct log_ring* rings = atomic_load_explicit(&logging.rings, memory_order_acquire);
+    uint64_t drained = 0, dropped = 0;
+    int retired = 0;
+
+    for (struct log_ring* ring = rings; ring != NULL; ring = ring->next) {
+        ring->drain_tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        ring->drain_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+
+    /* a client's records may be spread over several threads' rings, so they are merged by time */
+    while (1) {
+        struct log_ring* oldest = NULL;
+        for (struct log_ring* ring = rings; ring != NULL; ring = ring->next) {
+            if (ring->drain_tail != ring->drain_head && (oldest == NULL ||
+                    ring->records[ring->drain_tail & (LOG_RING_RECORDS - 1)].time_ns <
+                    oldest->records[oldest->drain_tail & (LOG_RING_RECORDS - 1)].time_ns))
+                oldest = ring;
+        }
+        if (oldest == NULL) break;
+        struct log_record* record = &oldest->records[oldest->drain_tail & (LOG_RING_RECORDS - 1)];
+        struct log_batch* batch = batchFor(log_events[record->event].level);
+        batch->len += formatRecord(batch->data + batch->len, LOG_LINE_MAX, record);
+        atomic_store_explicit(&oldest->tail, ++oldest->drain_tail, memory_order_release);
+        drained++;
+    }
+
+    for (struct log_ring* ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t ring_dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        dropped += ring_dropped - ring->dropped_reported;
+        ring->dropped_reported = ring_dropped;
+        if (atomic_load_explicit(&ring->retired, memory_order_acquire)) retired = 1;
+    }
+    uint64_t unringed = atomic_load_explicit(&logging.dropped, memory_order_relaxed);
+    dropped += unringed - logging.dropped_reported;
+    logging.dropped_reported = unringed;
+
+    if (dropped > 0) appendNotice(LOG_WARN, "Logging dropped %llu records, rings full", (unsigned long long) dropped);
+    int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+    if (level != logging.level_reported) {
+        appendNotice(LOG_WARN, "Log level set to %s", level_names[level]);
+        logging.level_reported = level;
+    }
+    flushBatch(&logging.err);
+    flushBatch(&logging.out);
+
+    /* an exited thread logs nothing more, so once its ring is empty it can go */
+    if (retired) {
+        pthread_mutex_lock(&logging.lock);
+        struct log_ring* prev = NULL;
+        struct log_ring* next;
+        for (struct log_ring* ring = atomic_load(&logging.rings); ring != NULL; ring = next) {
+            next = ring->next;
+            if (atomic_load(&ring->retired) && atomic_load(&ring->tail) == atomic_load(&ring->head)) {
+                if (prev != NULL) prev->next = next;
+                else atomic_store(&logging.rings, next);
+                free(ring);
+            } else {
+                prev = ring;
+            }
+        }
+        pthread_mutex_unlock(&logging.lock);
+    }
+    return drained;
+}
+
+/* format and write records until logging stops, then write whatever is left */
+static void* drainThread(void* arg)
+{
+    (void) arg;
+    struct timespec idle = { 0, LOG_DRAIN_MS * 1000000L };
+    while (atomic_load(&logging.running)) {
+        if (drainRings() == 0) nanosleep(&idle, NULL);
+    }
+    drainRings();
+    return (void*) 0;
+}
+
+/**************************************** Logging setup and teardown *************************************/
+
+/* the level named by -L. Returns -1 if there is no such level */
+int parseLogLevel(const char* name)
+{
+    for (int i = 0; i < LOG_LEVELS; i++)
+        if (strcmp(name, level_names[i]) == 0) return i;
+    return -1;
+}
+
+const char* logLevelName(int level)
+{
+    return level_names[level];
+}
+
+/* start logging at level through the drainer thread */
+void initLogging(int level)
+{
+    atomic_store(&log_level, level);
+    logging.level_reported = level;
+    logging.out.stream = stdout;
+    logging.err.stream = stderr;
+    if (pthread_key_create(&logging.key, retireThreadRing) == 0)
+        logging.key_ready = 1;
+
+    atomic_store(&logging.running, 1);
+    if (pthread_create(&logging.drainer, NULL, drainThread, NULL) != 0) {
+        fprintf(stderr, "Failed to create log thread, logging synchronously\n");
+        atomic_store(&logging.running, 0);
+    }
+}
+
+/* stop the drainer once it has written every record. Records logged after this are written directly */
+void stopLogging()
+{
+    if (!atomic_load(&logging.running)) return;
+    atomic_store(&logging.running, 0);
+    pthread_join(logging.drainer, NULL);
+}
+
+/* raise the log level by one, wrapping from debug back to error. Async-signal-safe, for SIGUSR1 */
+void cycleLogLevel()
+{
+    int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+    atomic_store_explicit(&log_level, (level + 1) % LOG_LEVELS, memory_order_relaxed);
+}
@@ -0,0 +1,116 @@
+/***************************************************************************************
+ * Title: Logging Specification
+ * Description: Specification for logging off the transfer path. A thread logs by filling
+ * 		a fixed-size binary record (time, connection id, event, numeric arguments
+ * 		and one short string) in its own single-producer ring; nothing is formatted
+ * 		and no lock is taken. A background thread drains every ring, formats the
+ * 		records from their event's format string and writes them out in batches.
+ * 		A record whose ring is full is dropped and counted rather than waited for,
+ * 		so logging never blocks a transfer. Events below the log level (-L, cycled
+ * 		at runtime with SIGUSR1) are skipped before their record is built.
+ * ************************************************************************************/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LOG_ARGS                8                   // numeric arguments a record carries
+#define LOG_TEXT_SIZE           172                 // string argument, truncated to fit a 256 byte record
+#define LOG_RING_RECORDS        512                 // records per thread, a power of two
+#define LOG_BATCH_SIZE          (64 * 1024)         // formatted bytes written at once
+#define LOG_DRAIN_MS            5                   // the drainer sleeps this long when every ring is empty
+
+enum log_level {
+    LOG_ERROR = 0,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_LEVELS
+};
+
+/* What a record says; each has a level and a format in log.c */
+enum log_event {
+    LOG_WORKER_CONNECTED = 0,
+    LOG_LOOP_CONNECTED,
+    LOG_HANDSHAKE_FAILED,
+    LOG_CLIENT_DISCONNECTED,
+    LOG_CLIENT_REFUSED,
+    LOG_ACCEPT_FAILED,
+    LOG_REGISTER_FAILED,
+    LOG_COMMAND_RECEIVED,
+    LOG_COMMAND_TOO_LONG,
+    LOG_COMMAND_INVALID,
+    LOG_COMMAND_BUSY,
+    LOG_DATA_CONNECT_FAILED,
+    LOG_DATA_ACCEPT_FAILED,
+    LOG_DATA_ADDRESS_FAILED,
+    LOG_PASSIVE_FAILED,
+    LOG_PASSIVE_TIMEOUT,
+    LOG_PASSIVE_REFUSED,
+    LOG_SENDING_FILE,
+    LOG_SENDING_LISTING,
+    LOG_SENDING_STATS,
+    LOG_FILE_NOT_FOUND,
+    LOG_SEND_FAILED,
+    LOG_DELTA,
+    LOG_RECEIVING_FILE,
+    LOG_UPLOAD_STORED,
+    LOG_UPLOAD_CUT_SHORT,
+    LOG_UPLOAD_FAILED,
+    LOG_TRANSFER_COMPLETE,
+    LOG_TRANSFER_TUNED,
+    LOG_EVENTS
+};
+
+/* One log record, filled by the logging thread and formatted by the drainer */
+struct log_record {
+    uint64_t time_ns;           // CLOCK_REALTIME
+    uint64_t conn;              // connection id, 0 if none
+    uint64_t args[LOG_ARGS];    // %u, %d and %f arguments, in format order
+    uint16_t event;
+    uint8_t text_len;
+    char text[LOG_TEXT_SIZE];   // %s argument, not terminated
+};
+
+struct log_event_format {
+    enum log_level level;
+    const char* format;         // %s text, %u unsigned, %d signed, %f logDouble(), %S logLiteral(), %% a '%'
+};
+
+extern const struct log_event_format log_events[LOG_EVENTS];
+extern _Atomic enum log_level log_level;
+
+/* log event for connection conn (0 if none), with text (may be NULL) and up to LOG_ARGS numbers
+ * for its format. Cheap when the event is below the log level, and never blocks */
+#define logEvent(conn, event, text, ...)                                                          \
+    do {                                                                                          \
+        if (log_events[event].level <= atomic_load_explicit(&log_level, memory_order_relaxed))   \
+            logRecord((conn), (event), (const char*) (text), (const uint64_t[LOG_ARGS]) { __VA_ARGS__ }); \
+    } while (0)
+
+/* a double as a %f argument */
+static inline uint64_t logDouble(double value)
+{
+    union { double value; uint64_t bits; } cast = { .value = value };
+    return cast.bits;
+}
+
+/* a string literal as a %S argument. Only its address is recorded, so it must outlive the record */
+static inline uint64_t logLiteral(const char* literal)
+{
+    return (uint64_t) (uintptr_t) literal;
+}
+
+/* Logging setup and teardown */
+int parseLogLevel(const char*);
+const char* logLevelName(int);
+void initLogging(int);
+void stopLogging();
+void cycleLogLevel();
+
+/* Recording, safe to call from any thread */
+void logRecord(uint64_t, enum log_event, const char*, const uint64_t*);
+
+#endif
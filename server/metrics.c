@@ -0,0 +1,366 @@
+/********************************************************************************************
+ * Title: Metrics implementation
+ * Description: Per-thread counters and histograms, summed on demand. A thread's block is
+ * 		allocated on its first recording and linked into a global list. The worker
+ * 		pool, event loops and their helpers are fixed and live until shutdown, but
+ * 		any thread that does exit has its totals folded into a retired block and
+ * 		its block freed, so no counts are lost. The mutex only guards that list,
+ * 		so recording stays lock-free. Histogram values below 16 get a bucket
+ * 		each, larger ones are bucketed by their top five significant bits.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "download_server.h"
+#include "buffer_arena.h"
+#include "file_cache.h"
+#include "transfer.h"
+#include "scheduler.h"
+#include "metrics.h"
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_key_t key;              // destructor folds an exiting thread's block into retired
+    int key_ready;
+    struct thread_metrics* threads;
+    struct thread_metrics retired;
+    int http_fd;
+    pthread_t http_thread;
+    _Atomic int http_running;
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER, .http_fd = -1 };
+
+static __thread struct thread_metrics* local_metrics;
+
+static const char* counter_names[METRIC_COUNTERS] = {
+    "connections_opened", "connections_closed", "connections_rejected", "commands", "commands_rejected",
+    "transfers_completed", "transfers_failed", "sent_bytes", "received_bytes", "shaper_waits",
+    "log_records_dropped"
+};
+
+/* name, help text and scale to the exported unit of every histogram */
+static const struct {
+    const char* name;
+    const char* help;
+    double scale;
+} histogram_info[METRIC_HISTOGRAMS] = {
+    { "accept_to_command_seconds", "Time from accepting a client to its first command", 1e-6 },
+    { "command_to_first_byte_seconds", "Time from a command to the first byte of its response", 1e-6 },
+    { "transfer_duration_seconds", "Time from a command to the last byte of its response", 1e-6 },
+    { "transfer_throughput_bytes_per_second", "Response bytes per second over a whole transfer", 1.0 }
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/*********************************************** Histograms **********************************************/
+
+static size_t bucketIndex(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) return (size_t) value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (size_t) (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* largest value that lands in a bucket */
+static uint64_t bucketHighest(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = (int) (index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t lowest = (uint64_t) (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((1ULL << shift) - 1);
+}
+
+/* single-writer add: a relaxed load and store, no locked instruction */
+static void bump(_Atomic uint64_t* value, uint64_t amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+static uint64_t peek(_Atomic uint64_t* value)
+{
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+/* add every count in src into dst. dst must not be written concurrently */
+static void mergeMetrics(struct thread_metrics* dst, struct thread_metrics* src)
+{
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+        bump(&dst->counters[i], peek(&src->counters[i]));
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        struct histogram* d = &dst->histograms[h];
+        struct histogram* s = &src->histograms[h];
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+            bump(&d->buckets[b], peek(&s->buckets[b]));
+        bump(&d->count, peek(&s->count));
+        bump(&d->sum, peek(&s->sum));
+        if (peek(&s->max) > peek(&d->max)) atomic_store_explicit(&d->max, peek(&s->max), memory_order_relaxed);
+    }
+}
+
+/* value at quantile q, reported as the highest value of its bucket */
+static uint64_t histogramQuantile(struct histogram* histogram, double q)
+{
+    uint64_t count = peek(&histogram->count);
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t) (q * count + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += peek(&histogram->buckets[b]);
+        if (seen >= rank) {
+            uint64_t highest = bucketHighest(b);
+            return highest < peek(&histogram->max) ? highest : peek(&histogram->max);
+        }
+    }
+    return peek(&histogram->max);
+}
+
+/**************************************** Per-thread blocks ***********************************************/
+
+/* fold an exiting thread's block into the retired totals */
+static void retireThreadMetrics(void* arg)
+{
+    struct thread_metrics* block = (struct thread_metrics*) arg;
+    pthread_mutex_lock(&metrics.lock);
+    mergeMetrics(&metrics.retired, block);
+    struct thread_metrics** link = &metrics.threads;
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+    pthread_mutex_unlock(&metrics.lock);
+    free(block);
+}
+
+/* the calling thread's block, allocated on first use. NULL if out of memory */
+static struct thread_metrics* localMetrics()
+{
+    if (local_metrics != NULL) return local_metrics;
+
+    struct thread_metrics* block = calloc(1, sizeof(struct thread_metrics));
+    if (block == NULL) return NULL;
+    pthread_mutex_lock(&metrics.lock);
+    block->next = metrics.threads;
+    metrics.threads = block;
+    pthread_mutex_unlock(&metrics.lock);
+    if (metrics.key_ready) pthread_setspecific(metrics.key, block);
+    local_metrics = block;
+    return block;
+}
+
+/* sum of every thread's metrics into total */
+static void collectMetrics(struct thread_metrics* total)
+{
+    pthread_mutex_lock(&metrics.lock);
+    mergeMetrics(total, &metrics.retired);
+    for (struct thread_metrics* block = metrics.threads; block != NULL; block = block->next)
+        mergeMetrics(total, block);
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+/*********************************************** Recording **********************************************/
+
+uint64_t monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+void countMetric(enum metric_counter counter, uint64_t amount)
+{
+    struct thread_metrics* block = localMetrics();
+    if (block != NULL) bump(&block->counters[counter], amount);
+}
+
+void recordMetric(enum metric_histogram which, uint64_t value)
+{
+    struct thread_metrics* block = localMetrics();
+    if (block == NULL) return;
+    struct histogram* histogram = &block->histograms[which];
+    bump(&histogram->buckets[bucketIndex(value)], 1);
+    bump(&histogram->count, 1);
+    bump(&histogram->sum, value);
+    if (value > peek(&histogram->max)) atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+/*********************************************** Reporting ***********************************************/
+
+/* snprintf onto the end of buf, never past cap */
+static void appendf(char* buf, size_t cap, size_t* len, const char* format, ...)
+{
+    if (*len >= cap) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, cap - *len, format, args);
+    va_end(args);
+    if (n > 0) *len += (size_t) n < cap - *len ? (size_t) n : cap - *len - 1;
+}
+
+static void appendGauge(char* buf, size_t cap, size_t* len, const char* name, const char* help, uint64_t value)
+{
+    appendf(buf, cap, len, "# HELP download_server_%s %s\n# TYPE download_server_%s gauge\n", name, help, name);
+    appendf(buf, cap, len, "download_server_%s %llu\n", name, (unsigned long long) value);
+}
+
+/* write every metric into buf in the Prometheus text format. Returns the length written */
+size_t formatMetrics(char* buf, size_t cap)
+{
+    size_t len = 0;
+    struct thread_metrics* total = calloc(1, sizeof(struct thread_metrics));
+    if (total == NULL || cap == 0) {
+        free(total);
+        return 0;
+    }
+    collectMetrics(total);
+
+    uint64_t opened = peek(&total->counters[METRIC_CONNECTIONS_OPENED]);
+    uint64_t closed = peek(&total->counters[METRIC_CONNECTIONS_CLOSED]);
+    appendGauge(buf, cap, &len, "connections_active", "Control connections currently open",
+                opened > closed ? opened - closed : 0);
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        appendf(buf, cap, &len, "# TYPE download_server_%s_total counter\n", counter_names[i]);
+        appendf(buf, cap, &len, "download_server_%s_total %llu\n", counter_names[i],
+                (unsigned long long) peek(&total->counters[i]));
+    }
+
+    appendGauge(buf, cap, &len, "io_buffers_in_use", "Arena buffers held by commands in flight", buffersInUse());
+    appendGauge(buf, cap, &len, "io_buffers_allocated", "Arena buffers allocated so far", buffersAllocated());
+    appendGauge(buf, cap, &len, "io_buffers_capacity", "Arena buffers the memory budget allows", bufferCapacity());
+
+    struct file_cache_stats cache_stats;
+    getFileCacheStats(&cache_stats);
+    appendGauge(buf, cap, &len, "file_cache_files", "Files mapped by the hot-file cache", cache_stats.files);
+    appendGauge(buf, cap, &len, "file_cache_bytes", "Bytes mapped by the hot-file cache", cache_stats.bytes);
+    appendf(buf, cap, &len, "# TYPE download_server_file_cache_lookups_total counter\n");
+    appendf(buf, cap, &len, "download_server_file_cache_lookups_total{result=\"hit\"} %llu\n",
+            (unsigned long long) cache_stats.hits);
+    appendf(buf, cap, &len, "download_server_file_cache_lookups_total{result=\"miss\"} %llu\n",
+            (unsigned long long) cache_stats.misses);
+    appendf(buf, cap, &len, "# TYPE download_server_file_cache_evictions_total counter\n");
+    appendf(buf, cap, &len, "download_server_file_cache_evictions_total %llu\n",
+            (unsigned long long) cache_stats.evictions);
+
+    struct scheduler_stats shaping;
+    getSchedulerStats(&shaping);
+    appendGauge(buf, cap, &len, "shaper_total_rate_bytes", "Total egress rate limit, 0 if unlimited",
+                shaping.total_rate);
+    appendGauge(buf, cap, &len, "shaper_client_rate_bytes", "Per-client egress rate limit, 0 if unlimited",
+                shaping.client_rate);
+    appendGauge(buf, cap, &len, "shaper_interactive_weight", "Fair share weight of interactive responses",
+                shaping.interactive_weight);
+    appendf(buf, cap, &len, "# HELP download_server_shaper_active_flows Shaped responses in flight\n"
+            "# TYPE download_server_shaper_active_flows gauge\n");
+    appendf(buf, cap, &len, "download_server_shaper_active_flows{class=\"interactive\"} %llu\n",
+            (unsigned long long) shaping.active[FLOW_INTERACTIVE]);
+    appendf(buf, cap, &len, "download_server_shaper_active_flows{class=\"bulk\"} %llu\n",
+            (unsigned long long) shaping.active[FLOW_BULK]);
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        struct histogram* histogram = &total->histograms[h];
+        const char* name = histogram_info[h].name;
+        double scale = histogram_info[h].scale;
+        appendf(buf, cap, &len, "# HELP download_server_%s %s\n# TYPE download_server_%s summary\n",
+                name, histogram_info[h].help, name);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            appendf(buf, cap, &len, "download_server_%s{quantile=\"%g\"} %g\n", name, quantiles[q],
+                    histogramQuantile(histogram, quantiles[q]) * scale);
+        appendf(buf, cap, &len, "download_server_%s_sum %g\n", name, peek(&histogram->sum) * scale);
+        appendf(buf, cap, &len, "download_server_%s_count %llu\n", name,
+                (unsigned long long) peek(&histogram->count));
+    }
+
+    free(total);
+    return len;
+}
+
+/*********************************************** HTTP export *********************************************/
+
+/* answer every request on the metrics port with the current metrics, one per connection */
+static void* metricsHttpThread(void* arg)
+{
+    (void) arg;
+    size_t cap = 256 * 1024;
+    char* body = malloc(cap);
+    if (body == NULL) return (void*) 0;
+
+    struct pollfd pfd = { .fd = metrics.http_fd, .events = POLLIN };
+    while (atomic_load(&metrics.http_running) && !SERVER_DISCONNECT) {
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        int client_fd = accept4(metrics.http_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) continue;
+
+        /* the request itself doesn't matter, every path gets the metrics */
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char request[1024];
+        ssize_t ignored = recv(client_fd, request, sizeof(request), 0);
+        (void) ignored;
+
+        size_t len = formatMetrics(body, cap);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                                  "version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+        if (sendAll(client_fd, header, header_len) == 0) sendAll(client_fd, body, len);
+        close(client_fd);
+    }
+    free(body);
+    return (void*) 0;
+}
+
+/* start serving metrics over HTTP on 127.0.0.1:port, 0 for no HTTP export */
+static int startMetricsHttp(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int yes = 1;
+    metrics.http_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics.http_fd == -1 ||
+            setsockopt(metrics.http_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+            bind(metrics.http_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+            listen(metrics.http_fd, METRICS_HTTP_BACKLOG) == -1) {
+        fprintf(stderr, "Failed to open metrics port %d\n", port);
+        if (metrics.http_fd != -1) close(metrics.http_fd);
+        metrics.http_fd = -1;
+        return -1;
+    }
+
+    atomic_store(&metrics.http_running, 1);
+    if (pthread_create(&metrics.http_thread, NULL, metricsHttpThread, NULL) != 0) {
+        fprintf(stderr, "Failed to create metrics thread\n");
+        atomic_store(&metrics.http_running, 0);
+        close(metrics.http_fd);
+        metrics.http_fd = -1;
+        return -1;
+    }
+    printf("Metrics served on 127.0.0.1:%d\n", port);
+    return 0;
+}
+
+/**************************************** Metrics setup and teardown *************************************/
+
+/* set up per-thread blocks, and the HTTP export if port isn't 0 */
+void initMetrics(int port)
+{
+    if (pthread_key_create(&metrics.key, retireThreadMetrics) == 0)
+        metrics.key_ready = 1;
+    if (port > 0) startMetricsHttp(port);
+}
+
+/* stop the HTTP export */
+void stopMetrics()
+{
+    if (metrics.http_fd == -1) return;
+    atomic_store(&metrics.http_running, 0);
+    pthread_join(metrics.http_thread, NULL);
+    close(metrics.http_fd);
+    metrics.http_fd = -1;
+}
@@ -0,0 +1,72 @@
+/***************************************************************************************
+ * Title: Metrics Specification
+ * Description: Specification for the server's built-in metrics. Every thread records
+ * 		into its own block of counters and log-linear (HDR style) histograms with
+ * 		plain relaxed stores, so recording never takes a lock or bounces a cache
+ * 		line between threads. Readers sum the blocks on demand. The totals are sent
+ * 		as Prometheus text in reply to the STATS command, and optionally served
+ * 		over HTTP on a local metrics port.
+ * ************************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS      4       // 16 buckets per power of two, ~6% resolution
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_HTTP_BACKLOG    8
+
+enum metric_counter {
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECTIONS_REJECTED,    // refused by admission control
+    METRIC_COMMANDS,
+    METRIC_COMMANDS_REJECTED,       // invalid, or no I/O buffer available
+    METRIC_TRANSFERS_COMPLETED,
+    METRIC_TRANSFERS_FAILED,
+    METRIC_BYTES_SENT,
+    METRIC_BYTES_RECEIVED,          // uploaded file bytes, stored or discarded
+    METRIC_SHAPER_WAITS,            // grants refused, the transfer waited for bandwidth
+    METRIC_LOG_DROPPED,             // log records dropped because their thread's ring was full
+    METRIC_COUNTERS
+};
+
+enum metric_histogram {
+    METRIC_ACCEPT_TO_COMMAND,       // microseconds from accept to a client's first command
+    METRIC_COMMAND_TO_FIRST_BYTE,   // microseconds from a command to its first response byte
+    METRIC_TRANSFER_DURATION,       // microseconds from a command to its last response byte
+    METRIC_TRANSFER_THROUGHPUT,     // bytes per second over a whole transfer
+    METRIC_HISTOGRAMS
+};
+
+struct histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+/* One thread's metrics. Only the owning thread writes it */
+struct thread_metrics {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    struct histogram histograms[METRIC_HISTOGRAMS];
+    struct thread_metrics* next;
+};
+
+/* Metrics setup and teardown */
+void initMetrics(int);
+void stopMetrics();
+
+/* Recording, safe to call from any thread */
+uint64_t monotonicNanos();
+void countMetric(enum metric_counter, uint64_t);
+void recordMetric(enum metric_histogram, uint64_t);
+
+/* Reporting */
+size_t formatMetrics(char*, size_t);
+
+#endif
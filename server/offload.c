@@ -0,0 +1,141 @@
+/********************************************************************************************
+ * Title: Offload implementation
+ * Description: A fixed pool of helper threads fed from one FIFO under a mutex and condition
+ * 		variable. Jobs are rare next to the sends the loops do themselves, one per
+ * 		checksum, delta or upload, so a single queue is never contended enough to
+ * 		need more. Finished jobs go onto their loop's completion queue, a list under
+ * 		a mutex of its own, and its eventfd wakes the loop once per batch of them.
+ * 		Helpers only stop once the loops have, so every job handed over completes.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+
+#include "download_server.h"
+#include "offload.h"
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    struct offload_job* head;
+    struct offload_job* tail;
+    int stopping;
+    int count;
+    pthread_t threads[OFFLOAD_HELPERS];
+} helpers = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER };
+
+/******************************************** Helper threads *********************************************/
+
+static void* helper_thread(void* arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&helpers.lock);
+    while (1) {
+        while (helpers.head == NULL && !helpers.stopping)
+            pthread_cond_wait(&helpers.wakeup, &helpers.lock);
+        if (helpers.head == NULL) break;			// stopping, and nothing left to run
+
+        struct offload_job* job = helpers.head;
+        helpers.head = job->next;
+        if (helpers.head == NULL) helpers.tail = NULL;
+        pthread_mutex_unlock(&helpers.lock);
+
+        job->run(job);
+
+        /* the loop is woken only by the first job of a batch, it takes them all at once */
+        struct offload_queue* queue = job->done;
+        pthread_mutex_lock(&queue->lock);
+        int was_empty = queue->finished == NULL;
+        job->next = queue->finished;
+        queue->finished = job;
+        pthread_mutex_unlock(&queue->lock);
+        if (was_empty) {
+            uint64_t one = 1;
+            ssize_t ignored = write(queue->event_fd, &one, sizeof(one));
+            (void) ignored;
+        }
+        pthread_mutex_lock(&helpers.lock);
+    }
+    pthread_mutex_unlock(&helpers.lock);
+    return NULL;
+}
+
+/* start count helper threads (at most OFFLOAD_HELPERS). Returns -1 if none could be started,
+ * in which case callers run their jobs themselves */
+int startHelpers(int count)
+{
+    if (count > OFFLOAD_HELPERS) count = OFFLOAD_HELPERS;
+    helpers.stopping = 0;
+    for (helpers.count = 0; helpers.count < count; helpers.count++) {
+        if (pthread_create(&helpers.threads[helpers.count], NULL, helper_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to create helper thread\n");
+            break;
+        }
+    }
+    return helpers.count > 0 ? 0 : -1;
+}
+
+/* stop the helpers once they have run every job queued, called after the event loops exit */
+void stopHelpers()
+{
+    pthread_mutex_lock(&helpers.lock);
+    helpers.stopping = 1;
+    pthread_cond_broadcast(&helpers.wakeup);
+    pthread_mutex_unlock(&helpers.lock);
+
+    for (int i = 0; i < helpers.count; i++)
+        pthread_join(helpers.threads[i], NULL);
+    helpers.count = 0;
+}
+
+/****************************************** Completion queues ********************************************/
+
+/* set up an empty completion queue. Returns -1 if its eventfd can't be created */
+int initOffloadQueue(struct offload_queue* queue)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->finished = NULL;
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return queue->event_fd == -1 ? -1 : 0;
+}
+
+void destroyOffloadQueue(struct offload_queue* queue)
+{
+    if (queue->event_fd != -1) close(queue->event_fd);
+    queue->event_fd = -1;
+    pthread_mutex_destroy(&queue->lock);
+}
+
+/********************************************* Jobs ******************************************************/
+
+/* hand a job to the helpers; it comes back through job->done once it has run. Returns -1 if
+ * there are no helpers to run it */
+int submitJob(struct offload_job* job)
+{
+    pthread_mutex_lock(&helpers.lock);
+    if (helpers.count == 0 || helpers.stopping) {
+        pthread_mutex_unlock(&helpers.lock);
+        return -1;
+    }
+    job->next = NULL;
+    if (helpers.tail != NULL) helpers.tail->next = job;
+    else helpers.head = job;
+    helpers.tail = job;
+    pthread_cond_signal(&helpers.wakeup);
+    pthread_mutex_unlock(&helpers.lock);
+    return 0;
+}
+
+/* take every job that has run, as a list linked through next, NULL if there are none */
+struct offload_job* takeFinishedJobs(struct offload_queue* queue)
+{
+    uint64_t signalled;
+    ssize_t ignored = read(queue->event_fd, &signalled, sizeof(signalled));
+    (void) ignored;
+
+    pthread_mutex_lock(&queue->lock);
+    struct offload_job* jobs = queue->finished;
+    queue->finished = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return jobs;
+}
@@ -0,0 +1,49 @@
+/***************************************************************************************
+ * Title: Offload Specification
+ * Description: Specification for the helper threads that run blocking work for the event
+ * 		loops: commands whose response reads a whole file before its first byte
+ * 		(checksums and deltas) and uploads waiting for the disk to commit them.
+ * 		A loop hands a job to the helpers and parks the connection; the helper
+ * 		runs it, queues it back on the loop's completion queue and signals the
+ * 		queue's eventfd, so the loop resumes the connection from its own thread.
+ * 		A job only touches state the loop leaves alone until it comes back.
+ * ************************************************************************************/
+
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <pthread.h>
+
+#define OFFLOAD_HELPERS     4           // helper threads shared by every event loop
+
+struct offload_queue;
+
+/* One piece of blocking work. run() is called on a helper thread */
+struct offload_job {
+    void (*run)(struct offload_job*);
+    void* owner;
+    int result;                 // set by run()
+    struct offload_queue* done; // the job is queued here once it has run
+    struct offload_job* next;
+};
+
+/* Jobs that have run, waiting for their event loop */
+struct offload_queue {
+    pthread_mutex_t lock;
+    struct offload_job* finished;
+    int event_fd;               // signalled whenever a job is queued
+};
+
+/* Helper threads, started and stopped by the main thread */
+int startHelpers(int);
+void stopHelpers();
+
+/* Completion queues, one per event loop */
+int initOffloadQueue(struct offload_queue*);
+void destroyOffloadQueue(struct offload_queue*);
+
+/* Jobs */
+int submitJob(struct offload_job*);
+struct offload_job* takeFinishedJobs(struct offload_queue*);
+
+#endif
@@ -0,0 +1,257 @@
+/********************************************************************************************
+ * Title: Read-ahead implementation
+ * Description: A buffered stream's read-ahead starts at READAHEAD_MIN_WINDOW. Whenever the
+ * 		sender is within half a window of what was last asked for, the next window
+ * 		is requested with WILLNEED, so one window is always being read while the
+ * 		sender drains the one before it. If the page the sender is at isn't cached
+ * 		yet (a one-byte RWF_NOWAIT read fails with EAGAIN) the disk has fallen behind
+ * 		and the window doubles, up to READAHEAD_MAX_WINDOW. A one-shot file is read
+ * 		with Linux native AIO, over the raw syscalls like the io_uring backend:
+ * 		DIRECT_CHUNKS reads of DIRECT_CHUNK_SIZE are kept in flight ahead of the
+ * 		sender, and each buffer is read again as soon as it has been sent. Reads
+ * 		start at the aligned offset below the stream's first byte, and whatever
+ * 		precedes that byte counts as already sent. A non-blocking sender is woken
+ * 		by an eventfd the reads signal; a blocking one waits for them. A checksum
+ * 		is summed from the chunks, so the file is never read through the cache.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "download_server.h"
+#include "transfer.h"
+#include "readahead.h"
+#include "checksum.h"
+
+static int aioSetup(unsigned int events, aio_context_t* ctx)
+{
+    return (int) syscall(__NR_io_setup, events, ctx);
+}
+
+static int aioSubmit(aio_context_t ctx, long count, struct iocb** iocbs)
+{
+    return (int) syscall(__NR_io_submit, ctx, count, iocbs);
+}
+
+static int aioGetEvents(aio_context_t ctx, long min, long max, struct io_event* events, struct timespec* timeout)
+{
+    return (int) syscall(__NR_io_getevents, ctx, min, max, events, timeout);
+}
+
+static int aioDestroy(aio_context_t ctx)
+{
+    return (int) syscall(__NR_io_destroy, ctx);
+}
+
+/************************************ Adaptive read-ahead of buffered streams ********************************/
+
+/* start read-ahead on a stream's first pass, if it is large enough to need it */
+static void startReadAhead(struct file_stream* stream)
+{
+    stream->dropped = stream->offset;
+    if (stream->end - stream->offset < READAHEAD_MIN_FILE) {
+        stream->readahead = -1;
+        return;
+    }
+    posix_fadvise(stream->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);	// widens the kernel's own read-ahead too
+    stream->readahead = READAHEAD_MIN_WINDOW;
+    if (stream->readahead_end < stream->offset) stream->readahead_end = stream->offset;
+}
+
+/* whether the page at the sender's offset is still to come from disk. Returns 0 if it is cached,
+ * or if the kernel can't tell without reading it */
+static int senderWaitsOnDisk(struct file_stream* stream)
+{
+    char probe;
+    struct iovec iov = { &probe, 1 };
+    return preadv2(stream->file_fd, &iov, 1, stream->offset, RWF_NOWAIT) == -1 && errno == EAGAIN;
+}
+
+/* keep WILLNEED requests a window ahead of the sender and, for a one-shot file, drop the pages it
+ * has sent. Returns the offset the sender may reach before calling again */
+off_t advanceReadAhead(struct file_stream* stream)
+{
+    if (stream->readahead == 0) startReadAhead(stream);
+    if (stream->drop_behind && stream->offset - stream->dropped >= READAHEAD_MIN_WINDOW) {
+        /* pages the socket still holds are skipped by the kernel */
+        posix_fadvise(stream->file_fd, stream->dropped, stream->offset - stream->dropped, POSIX_FADV_DONTNEED);
+        stream->dropped = stream->offset;
+    }
+    if (stream->readahead < 0) return stream->end;
+
+    off_t next = stream->readahead_end - stream->readahead / 2;
+    if (stream->offset >= next && stream->readahead_end < stream->end) {
+        if (stream->readahead < READAHEAD_MAX_WINDOW && senderWaitsOnDisk(stream))
+            stream->readahead *= 2;
+        off_t start = stream->readahead_end > stream->offset ? stream->readahead_end : stream->offset;
+        off_t len = stream->end - start < stream->readahead ? stream->end - start : stream->readahead;
+        posix_fadvise(stream->file_fd, start, len, POSIX_FADV_WILLNEED);
+        stream->readahead_end = start + len;
+        next = stream->readahead_end - stream->readahead / 2;
+    }
+    return next > stream->offset && next < stream->end ? next : stream->end;
+}
+
+/************************************** One-shot files read with O_DIRECT ************************************/
+
+/* open an O_DIRECT stream over the same file and range as a buffered one, which the caller still
+ * owns. blocking senders wait for reads, others get an eventfd to watch. Returns NULL if the file
+ * system refuses O_DIRECT or AIO can't be set up */
+struct direct_stream* openDirectStream(struct file_stream* file, int blocking)
+{
+    char path[64];
+    struct direct_stream* stream = calloc(1, sizeof(struct direct_stream));
+    if (stream == NULL) return NULL;
+    stream->event_fd = -1;
+
+    /* reopening through /proc gets the very file the stream has open, even if renamed since */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", file->file_fd);
+    if ((stream->file_fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC)) == -1 ||
+            aioSetup(DIRECT_CHUNKS, &stream->aio) == -1 ||
+            (!blocking && (stream->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)) {
+        releaseDirectStream(stream);
+        return NULL;
+    }
+    stream->buffers = mmap(NULL, (size_t) DIRECT_CHUNKS * DIRECT_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);		// page aligned, so O_DIRECT aligned
+    if (stream->buffers == MAP_FAILED) {
+        stream->buffers = NULL;
+        releaseDirectStream(stream);
+        return NULL;
+    }
+
+    for (int i = 0; i < DIRECT_CHUNKS; i++)
+        stream->chunks[i].data = stream->buffers + (size_t) i * DIRECT_CHUNK_SIZE;
+    stream->offset = file->offset;
+    stream->end = file->end;
+    stream->read_offset = file->offset & ~((off_t) DIRECT_ALIGNMENT - 1);
+    return stream;
+}
+
+/* read ahead into every free chunk, in ring order. Returns -1 if the kernel rejects the reads */
+static int fillDirectStream(struct direct_stream* stream)
+{
+    struct iocb* reads[DIRECT_CHUNKS];
+    int count = 0;
+
+    while (stream->read_offset < stream->end && stream->chunks[stream->read_chunk].state == DIRECT_FREE) {
+        struct direct_chunk* chunk = &stream->chunks[stream->read_chunk];
+        memset(&chunk->cb, 0, sizeof(chunk->cb));
+        chunk->cb.aio_data = stream->read_chunk;
+        chunk->cb.aio_lio_opcode = IOCB_CMD_PREAD;
+        chunk->cb.aio_fildes = (uint32_t) stream->file_fd;
+        chunk->cb.aio_buf = (uint64_t) (uintptr_t) chunk->data;
+        chunk->cb.aio_nbytes = DIRECT_CHUNK_SIZE;
+        chunk->cb.aio_offset = stream->read_offset;
+        if (stream->event_fd != -1) {
+            chunk->cb.aio_flags = IOCB_FLAG_RESFD;
+            chunk->cb.aio_resfd = (uint32_t) stream->event_fd;
+        }
+        chunk->offset = stream->read_offset;
+        chunk->sent = stream->offset > chunk->offset ? (size_t) (stream->offset - chunk->offset) : 0;
+        chunk->state = DIRECT_READING;
+        reads[count++] = &chunk->cb;
+        stream->read_offset += DIRECT_CHUNK_SIZE;
+        stream->read_chunk = (stream->read_chunk + 1) % DIRECT_CHUNKS;
+    }
+    if (count == 0) return 0;
+
+    int submitted = aioSubmit(stream->aio, count, reads);
+    if (submitted == -1 && errno != EAGAIN) return -1;
+    if (submitted == -1) submitted = 0;
+    /* take back reads the kernel had no room for, they go again on the next pump */
+    while (count > submitted) {
+        stream->read_chunk = (stream->read_chunk + DIRECT_CHUNKS - 1) % DIRECT_CHUNKS;
+        stream->chunks[stream->read_chunk].state = DIRECT_FREE;
+        stream->read_offset -= DIRECT_CHUNK_SIZE;
+        count--;
+    }
+    return 0;
+}
+
+/* collect completed reads, waiting up to timeout for at least min of them. A short read before
+ * the stream's end means the file shrank, and the stream ends there. Returns -1 if a read failed */
+static int reapDirectStream(struct direct_stream* stream, long min, struct timespec* timeout)
+{
+    struct io_event events[DIRECT_CHUNKS];
+    uint64_t signalled;
+
+    if (stream->event_fd != -1) {
+        ssize_t ignored = read(stream->event_fd, &signalled, sizeof(signalled));	// rearm it
+        (void) ignored;
+    }
+    int count = aioGetEvents(stream->aio, min, DIRECT_CHUNKS, events, timeout);
+    if (count == -1) return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < count; i++) {
+        struct direct_chunk* chunk = &stream->chunks[events[i].data % DIRECT_CHUNKS];
+        long long result = (long long) events[i].res;
+        if (result < 0) {
+            errno = (int) -result;
+            return -1;
+        }
+        off_t read_end = chunk->offset + (off_t) result;
+        if (result < DIRECT_CHUNK_SIZE && read_end < stream->end) stream->end = read_end;
+        chunk->len = stream->end > chunk->offset ? (size_t) (stream->end - chunk->offset) : 0;
+        if (chunk->len > (size_t) result) chunk->len = (size_t) result;
+        chunk->state = DIRECT_READY;
+    }
+    return 0;
+}
+
+/* send the stream's chunks as they are read, at most allowance bytes. Returns 1 once every byte
+ * is on the socket, 0 if the socket would block, the allowance is spent or a non-blocking sender
+ * must wait for the disk (its eventfd then fires), -1 on error */
+int pumpDirectStream(int sock_fd, struct direct_stream* stream, uint64_t allowance)
+{
+    struct timespec poll = { 0, 0 }, wait = { 0, DIRECT_WAIT_MS * 1000000L };
+    off_t start = stream->offset;
+
+    if (reapDirectStream(stream, 0, &poll) == -1) return -1;
+    while (stream->offset < stream->end) {
+        if (fillDirectStream(stream) == -1) return -1;
+        struct direct_chunk* chunk = &stream->chunks[stream->send_chunk];
+        if (chunk->state != DIRECT_READY) {
+            if (stream->event_fd != -1) return 0;
+            if (SERVER_DISCONNECT) return -1;
+            if (reapDirectStream(stream, 1, &wait) == -1) return -1;
+            continue;
+        }
+        if (chunk->sent >= chunk->len) {
+            chunk->state = DIRECT_FREE;		// read into again by the next fill
+            stream->send_chunk = (stream->send_chunk + 1) % DIRECT_CHUNKS;
+            continue;
+        }
+
+        uint64_t spent = (uint64_t) (stream->offset - start);
+        if (spent >= allowance) return 0;
+        size_t len = chunk->len - chunk->sent;
+        if (len > allowance - spent) len = (size_t) (allowance - spent);
+        ssize_t n = send(sock_fd, chunk->data + chunk->sent, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (stream->checksum != NULL) sumSentBytes(stream->checksum, chunk->data + chunk->sent, (size_t) n);
+        chunk->sent += n;
+        stream->offset += n;
+    }
+    return 1;
+}
+
+/* release the stream's file, buffers and AIO context, waiting out reads still in flight */
+void releaseDirectStream(struct direct_stream* stream)
+{
+    if (stream == NULL) return;
+    if (stream->aio != 0) aioDestroy(stream->aio);		// returns once in-flight reads are done
+    if (stream->buffers != NULL) munmap(stream->buffers, (size_t) DIRECT_CHUNKS * DIRECT_CHUNK_SIZE);
+    if (stream->event_fd != -1) close(stream->event_fd);
+    if (stream->file_fd != -1) close(stream->file_fd);
+    free(stream);
+}
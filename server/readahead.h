@@ -0,0 +1,71 @@
+/***************************************************************************************
+ * Title: Read-ahead Specification
+ * Description: Specification for keeping the disk ahead of the socket. A large buffered
+ * 		stream asks for a window of pages past the sender with WILLNEED, so the
+ * 		disk fills the page cache while sendfile() drains it, and widens the window
+ * 		whenever the sender catches up with the disk. Files of at least -D MB are
+ * 		treated as one-shot downloads: they are read with O_DIRECT into a ring of
+ * 		buffers by asynchronous reads that run ahead of the sender, so streaming
+ * 		them doesn't evict the hot working set from the page cache. Where O_DIRECT
+ * 		isn't possible their pages are dropped from the cache once sent instead.
+ * ************************************************************************************/
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/aio_abi.h>
+
+#define READAHEAD_MIN_FILE      (4 * 1024 * 1024)   // smaller streams are left to the kernel's read-ahead
+#define READAHEAD_MIN_WINDOW    (2 * 1024 * 1024)
+#define READAHEAD_MAX_WINDOW    (64 * 1024 * 1024)
+#define DIRECT_CHUNK_SIZE       (1024 * 1024)       // one O_DIRECT read
+#define DIRECT_CHUNKS           4                   // reads in flight or waiting to be sent
+#define DIRECT_ALIGNMENT        4096                // O_DIRECT buffer, offset and length alignment
+#define DIRECT_WAIT_MS          100                 // a blocking sender rechecks for shutdown this often
+
+struct file_stream;
+struct checksum_stream;
+
+enum direct_chunk_state {
+    DIRECT_FREE,
+    DIRECT_READING,
+    DIRECT_READY
+};
+
+/* One buffer of the ring, read from an aligned offset of the file */
+struct direct_chunk {
+    struct iocb cb;
+    unsigned char* data;
+    off_t offset;               // file offset of data[0]
+    size_t len;                 // bytes of data to send from, once read
+    size_t sent;                // bytes of data on the socket, or before the stream's first byte
+    enum direct_chunk_state state;
+};
+
+/* A file range streamed from its own O_DIRECT reads instead of the page cache. Chunks are
+ * read and sent in ring order */
+struct direct_stream {
+    int file_fd;                // the file reopened with O_DIRECT
+    aio_context_t aio;
+    int event_fd;               // signalled as reads complete, -1 if the sender blocks instead
+    unsigned char* buffers;     // DIRECT_CHUNKS aligned chunks, mmap'd
+    struct direct_chunk chunks[DIRECT_CHUNKS];
+    unsigned int send_chunk;    // chunk being sent
+    unsigned int read_chunk;    // chunk the next read goes into
+    off_t read_offset;          // aligned file offset of the next read
+    off_t offset;               // next byte of the file to send
+    off_t end;                  // one past the last byte to send
+    struct checksum_stream* checksum;   // +checksum: summed from the chunks as they go out
+};
+
+/* Adaptive read-ahead of buffered streams */
+off_t advanceReadAhead(struct file_stream*);
+
+/* One-shot files read with O_DIRECT */
+struct direct_stream* openDirectStream(struct file_stream*, int);
+int pumpDirectStream(int, struct direct_stream*, uint64_t);
+void releaseDirectStream(struct direct_stream*);
+
+#endif
@@ -0,0 +1,196 @@
+/********************************************************************************************
+ * Title: Transfer scheduler implementation
+ * Description: Token buckets kept as GCRA virtual clocks: a bucket's word is the time at
+ * 		which it is full again, every byte sent pushes it 1/rate further out, and
+ * 		the bucket allows sending while it is no more than a burst's worth of time
+ * 		ahead of now. A flow's grant is the smallest of what its client's bucket,
+ * 		the total bucket and its share of the total allow. A bucket that can't
+ * 		grant at least an eighth of its burst grants nothing and names the wait,
+ * 		so throttled senders wake for sizeable chunks rather than every packet.
+ * *****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "transfer.h"
+#include "compression.h"
+#include "delta.h"
+#include "readahead.h"
+#include "metrics.h"
+
+#define NANOS_PER_SECOND    1000000000ULL
+
+static struct {
+    uint64_t total_rate;            // bytes per second, 0 if unlimited
+    uint64_t total_burst;
+    uint64_t client_rate;
+    uint64_t client_burst;
+    uint64_t interactive_weight;
+    _Atomic uint64_t total_tat_ns;  // the total bucket, shared by every flow
+    _Atomic uint64_t active_weight;
+    _Atomic uint64_t active[FLOW_CLASSES];
+} scheduler;
+
+/*********************************************** Token buckets *********************************************/
+
+/* bucket depth for a rate */
+static uint64_t burstFor(uint64_t rate)
+{
+    uint64_t burst = rate * SCHEDULER_BURST_MS / 1000;
+    return burst > SCHEDULER_MIN_BURST ? burst : SCHEDULER_MIN_BURST;
+}
+
+/* nanoseconds len bytes take at rate */
+static uint64_t costNanos(uint64_t len, uint64_t rate)
+{
+    return len * NANOS_PER_SECOND / rate;
+}
+
+/* bytes the bucket full again at tat lets through now, UINT64_MAX if its rate is unlimited. If
+ * less than an eighth of the burst, returns 0 and raises *wait_ns to when that much is allowed */
+static uint64_t bucketAllowance(uint64_t tat, uint64_t rate, uint64_t burst, uint64_t now, uint64_t* wait_ns)
+{
+    if (rate == 0) return UINT64_MAX;
+    uint64_t tau = costNanos(burst, rate);
+    uint64_t debt = tat > now ? tat - now : 0;
+    uint64_t allowed = debt < tau ? (tau - debt) * rate / NANOS_PER_SECOND : 0;
+    uint64_t min_grant = burst / 8;
+    if (allowed >= min_grant) return allowed;
+
+    uint64_t wait = debt + costNanos(min_grant, rate) - tau;
+    if (wait > *wait_ns) *wait_ns = wait;
+    return 0;
+}
+
+/* charge len bytes at rate to a bucket only its owner updates */
+static void chargeBucket(uint64_t* tat, uint64_t rate, uint64_t len, uint64_t now)
+{
+    *tat = (*tat > now ? *tat : now) + costNanos(len, rate);
+}
+
+/* charge len bytes to the total bucket, racing every other sender */
+static void chargeTotal(uint64_t len, uint64_t now)
+{
+    uint64_t tat = atomic_load_explicit(&scheduler.total_tat_ns, memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = (tat > now ? tat : now) + costNanos(len, scheduler.total_rate);
+    } while (!atomic_compare_exchange_weak_explicit(&scheduler.total_tat_ns, &tat, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+}
+
+static uint64_t smaller(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+/*********************************************** Scheduler setup ********************************************/
+
+/* set the total and per-client rates in bytes per second (0 for unlimited) and the interactive
+ * class's weight. Shaping is off unless a rate is set */
+void initScheduler(uint64_t total_rate, uint64_t client_rate, uint64_t interactive_weight)
+{
+    scheduler.total_rate = total_rate;
+    scheduler.total_burst = burstFor(total_rate);
+    scheduler.client_rate = client_rate;
+    scheduler.client_burst = burstFor(client_rate);
+    scheduler.interactive_weight = interactive_weight > 0 ? interactive_weight : 1;
+    if (schedulerEnabled())
+        printf("Shaping to %llu bytes/s in total, %llu per client (0 = unlimited), interactive weight %llu\n",
+               (unsigned long long) total_rate, (unsigned long long) client_rate,
+               (unsigned long long) scheduler.interactive_weight);
+}
+
+/* returns 1 if responses are shaped */
+int schedulerEnabled()
+{
+    return scheduler.total_rate > 0 || scheduler.client_rate > 0;
+}
+
+/******************************************************* Flows *********************************************/
+
+/* bytes the transfer will send beyond its head and tail, as far as it can tell up front */
+static uint64_t expectedBytes(struct transfer* xfer)
+{
+    uint64_t bytes = xfer->body_len;
+    if (xfer->has_file) bytes += (uint64_t) (xfer->file.end - xfer->file.offset);
+    if (xfer->zstream != NULL) bytes += (uint64_t) (xfer->zstream->source.end - xfer->zstream->source.offset);
+    if (xfer->direct != NULL) bytes += (uint64_t) (xfer->direct->end - xfer->direct->offset);
+    if (xfer->delta != NULL) bytes += xfer->delta->literal_bytes;
+    return bytes;
+}
+
+/* open a flow for the transfer, charged to the client bucket at client_tat_ns. A blocking
+ * sender sleeps out its waits. Returns NULL if shaping is off */
+struct shaped_flow* openShapedFlow(struct transfer* xfer, uint64_t* client_tat_ns, int blocking)
+{
+    if (!schedulerEnabled()) return NULL;
+    struct shaped_flow* flow = calloc(1, sizeof(struct shaped_flow));
+    if (flow == NULL) return NULL;
+
+    flow->class = xfer->batch == NULL && expectedBytes(xfer) < SCHEDULER_INTERACTIVE_BYTES ? FLOW_INTERACTIVE
+                                                                                           : FLOW_BULK;
+    flow->weight = flow->class == FLOW_INTERACTIVE ? scheduler.interactive_weight : 1;
+    flow->client_tat_ns = client_tat_ns;
+    flow->blocking = blocking;
+    atomic_fetch_add(&scheduler.active_weight, flow->weight);
+    atomic_fetch_add(&scheduler.active[flow->class], 1);
+    return flow;
+}
+
+/* close a flow, if any, giving its share back */
+void closeShapedFlow(struct shaped_flow* flow)
+{
+    if (flow == NULL) return;
+    atomic_fetch_sub(&scheduler.active_weight, flow->weight);
+    atomic_fetch_sub(&scheduler.active[flow->class], 1);
+    free(flow);
+}
+
+/* bytes the flow may send now. Returns 0 with *wait_ns set if it must wait first */
+uint64_t grantShapedFlow(struct shaped_flow* flow, uint64_t* wait_ns)
+{
+    uint64_t now = monotonicNanos();
+    *wait_ns = 0;
+    flow->share_rate = 0;
+
+    uint64_t grant = bucketAllowance(*flow->client_tat_ns, scheduler.client_rate, scheduler.client_burst,
+                                     now, wait_ns);
+    if (scheduler.total_rate > 0) {
+        uint64_t total_tat = atomic_load_explicit(&scheduler.total_tat_ns, memory_order_relaxed);
+        grant = smaller(grant, bucketAllowance(total_tat, scheduler.total_rate, scheduler.total_burst, now, wait_ns));
+
+        /* while the total bucket is full nobody else wants its bandwidth, so the flow may
+         * borrow past its share; otherwise it gets its weight's part of the total rate */
+        if (total_tat > now) {
+            uint64_t active_weight = atomic_load_explicit(&scheduler.active_weight, memory_order_relaxed);
+            uint64_t share = scheduler.total_rate * flow->weight / (active_weight > 0 ? active_weight : 1);
+            flow->share_rate = share > 0 ? share : 1;
+            grant = smaller(grant, bucketAllowance(flow->share_tat_ns, flow->share_rate, burstFor(flow->share_rate),
+                                                   now, wait_ns));
+        }
+    }
+    if (grant == 0) countMetric(METRIC_SHAPER_WAITS, 1);
+    return grant;
+}
+
+/* charge len bytes the flow sent to every bucket it draws on */
+void chargeShapedFlow(struct shaped_flow* flow, uint64_t len)
+{
+    if (len == 0) return;
+    uint64_t now = monotonicNanos();
+    if (scheduler.client_rate > 0) chargeBucket(flow->client_tat_ns, scheduler.client_rate, len, now);
+    if (scheduler.total_rate > 0) chargeTotal(len, now);
+    if (flow->share_rate > 0) chargeBucket(&flow->share_tat_ns, flow->share_rate, len, now);
+}
+
+/* current configuration and active flows */
+void getSchedulerStats(struct scheduler_stats* stats)
+{
+    stats->total_rate = scheduler.total_rate;
+    stats->client_rate = scheduler.client_rate;
+    stats->interactive_weight = scheduler.interactive_weight;
+    for (int i = 0; i < FLOW_CLASSES; i++)
+        stats->active[i] = atomic_load_explicit(&scheduler.active[i], memory_order_relaxed);
+}
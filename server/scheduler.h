@@ -0,0 +1,64 @@
+/***************************************************************************************
+ * Title: Transfer Scheduler Specification
+ * Description: Specification for bandwidth shaping. Every response is a flow in one
+ * 		of two classes: interactive (LIST, STATS, checksums, errors and responses
+ * 		under SCHEDULER_INTERACTIVE_BYTES) or bulk. Token buckets cap the server's
+ * 		total rate (-R) and each client's (-r). Under the total rate, active flows
+ * 		share it in proportion to their class weight (-q for interactive, 1 for
+ * 		bulk), a fluid approximation of weighted fair queueing, and a flow may
+ * 		borrow beyond its share while the total bucket is full, so bandwidth
+ * 		nobody else wants isn't wasted. The buckets are GCRA virtual clocks, one
+ * 		word each, so the shared one is updated with a single CAS and no lock.
+ * ************************************************************************************/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SCHEDULER_INTERACTIVE_BYTES (1024 * 1024)  // smaller responses are interactive
+#define SCHEDULER_DEFAULT_WEIGHT    16              // interactive weight, bulk flows weigh 1
+#define SCHEDULER_BURST_MS          10              // buckets hold this much of their rate
+#define SCHEDULER_MIN_BURST         (64 * 1024)     // ... but never less than this
+#define SCHEDULER_MAX_SLEEP_MS      100             // blocking senders recheck for shutdown
+
+struct transfer;
+
+enum flow_class {
+    FLOW_INTERACTIVE,
+    FLOW_BULK,
+    FLOW_CLASSES
+};
+
+/* One shaped response. The sender asks for a grant before each pass and is charged what
+ * the pass put on the socket */
+struct shaped_flow {
+    enum flow_class class;
+    uint64_t weight;
+    uint64_t share_rate;        // its fair share at the last grant, 0 while borrowing past it
+    uint64_t share_tat_ns;      // its fair share's bucket: when the bucket is full again
+    uint64_t* client_tat_ns;    // the client's bucket, in its session
+    int blocking;               // sender sleeps out waits instead of returning
+    uint64_t wake_ns;           // non-blocking sender: when to ask again, 0 if not waiting
+};
+
+struct scheduler_stats {
+    uint64_t total_rate;        // bytes per second, 0 if unlimited
+    uint64_t client_rate;
+    uint64_t interactive_weight;
+    uint64_t active[FLOW_CLASSES];
+};
+
+/* Scheduler setup */
+void initScheduler(uint64_t, uint64_t, uint64_t);
+int schedulerEnabled();
+
+/* Flows, safe to call from any thread */
+struct shaped_flow* openShapedFlow(struct transfer*, uint64_t*, int);
+void closeShapedFlow(struct shaped_flow*);
+uint64_t grantShapedFlow(struct shaped_flow*, uint64_t*);
+void chargeShapedFlow(struct shaped_flow*, uint64_t);
+void getSchedulerStats(struct scheduler_stats*);
+
+#endif
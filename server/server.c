@@ -15,6 +15,8 @@ int main(int argc, char** argv)
 
     /* Register SIGINT handler */
     signal(SIGINT, sigint_intercept);
+    signal(SIGPIPE, SIG_IGN);          // peer resets surface as send() errors instead
+    signal(SIGUSR1, sigusr1_intercept);     // steps the log level up, wrapping from debug to error
 
     /* Validate server port number */
     char* port_str = getValidPort(argc, argv); 
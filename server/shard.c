@@ -0,0 +1,126 @@
+/********************************************************************************************
+ * Title: Listener shard implementation
+ * Description: Shard i is pinned to the i-th core the process may run on, wrapping around
+ * 		when there are more shards than cores. Shard 0 is the welcome socket the
+ * 		server already listens on; every other shard binds another with
+ * 		SO_REUSEPORT, in order, so a shard's index in the reuseport group is its
+ * 		loop's id. BPF steering attaches a classic BPF program to the group: it
+ * 		loads the receiving core, compares it with each shard's core in turn and
+ * 		returns the matching index, so it needs no eBPF loader or maps. Cores
+ * 		without a shard fall through to core modulo the shard count.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <linux/filter.h>
+
+#include "download_server.h"
+#include "shard.h"
+
+static struct {
+    int* cpus;                  // core each shard is pinned to
+    int count;
+} shards;
+
+static const char* steering_names[] = { "off", "hash", "cpu", "bpf" };
+
+/************************************* Shard setup, runs in main thread ************************************/
+
+/* the steering named by -S. Returns -1 if there is no such steering */
+int parseShardSteering(const char* name)
+{
+    for (int i = SHARD_HASH; i <= SHARD_BPF; i++)
+        if (strcmp(name, steering_names[i]) == 0) return i;
+    return -1;
+}
+
+const char* shardSteeringName(enum shard_steering steering)
+{
+    return steering_names[steering];
+}
+
+/* assign each of count shards a core from the ones the process may run on. Returns -1 on failure */
+int initShardCpus(int count)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) return -1;
+    if ((shards.cpus = calloc(count, sizeof(int))) == NULL) return -1;
+    shards.count = count;
+
+    int assigned = 0;
+    while (assigned < count) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && assigned < count; cpu++)
+            if (CPU_ISSET(cpu, &allowed)) shards.cpus[assigned++] = cpu;
+    }
+    return 0;
+}
+
+/* free the shards' core assignments once their loops have stopped */
+void releaseShardCpus()
+{
+    free(shards.cpus);
+    shards.cpus = NULL;
+    shards.count = 0;
+}
+
+/* the core shard i is pinned to */
+int shardCpu(int shard)
+{
+    return shards.cpus[shard];
+}
+
+/* bind and listen on another welcome socket in the server port's reuseport group. Exits if it
+ * can't, like the first */
+int openShardListener(char* port_str, int shard)
+{
+    int welcome_fd = createWelcomeSocket(port_str);
+    if (listen(welcome_fd, CONNECTION_BACKLOG) == -1) {
+        fprintf(stderr, "Shard %d failed to listen\n", shard);
+        exit(1);
+    }
+    return welcome_fd;
+}
+
+/* steer new connections to the shard pinned to the core that received them. welcome_fds holds
+ * every shard's welcome socket in shard order. Returns -1 if the kernel refuses, leaving hashing */
+int attachShardSteering(int* welcome_fds, int count)
+{
+    if (server_options.shard_steering == SHARD_CPU) {
+        for (int i = 0; i < count; i++) {
+            int cpu = shards.cpus[i];
+            if (setsockopt(welcome_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) return -1;
+        }
+        return 0;
+    }
+    if (server_options.shard_steering != SHARD_BPF) return 0;
+
+    /* A = core; for each shard: if A == its core return its index; else return A % count */
+    int matched = count <= (BPF_MAXINSNS - 3) / 2 ? count : 0;
+    struct sock_filter* code = calloc(2 * matched + 3, sizeof(struct sock_filter));
+    if (code == NULL) return -1;
+    int len = 0;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < matched; i++) {
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) shards.cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (uint32_t) i);
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t) count);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = { .len = (unsigned short) len, .filter = code };
+    int result = setsockopt(welcome_fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+    free(code);
+    return result;
+}
+
+/******************************************** Shard threads ***********************************************/
+
+/* pin the calling thread to shard i's core. Returns -1 on failure */
+int pinShardThread(int shard)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shards.cpus[shard], &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0 ? 0 : -1;
+}
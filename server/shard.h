@@ -0,0 +1,35 @@
+/***************************************************************************************
+ * Title: Listener Shard Specification
+ * Description: Specification for sharded listeners (-S). Each event loop binds its own
+ * 		welcome socket to the server port with SO_REUSEPORT and is pinned to a
+ * 		core, so accepts spread over every loop instead of contending for one
+ * 		socket, and a client stays on the loop, core and NUMA node that accepted
+ * 		it. The kernel spreads connections over the shards by hashing them, or,
+ * 		with steering, hands each to the shard pinned to the core that received
+ * 		its packets, so softirq and user-space processing share that core's caches.
+ * ************************************************************************************/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+/* How the kernel picks a shard for a new connection */
+enum shard_steering {
+    SHARD_OFF,                  // one welcome socket shared by every loop
+    SHARD_HASH,                 // SO_REUSEPORT's hash of the connection's addresses
+    SHARD_CPU,                  // SO_INCOMING_CPU: the shard pinned to the receiving core
+    SHARD_BPF                   // a classic BPF program mapping the receiving core to its shard
+};
+
+/* Shard setup, runs in main thread */
+int parseShardSteering(const char*);
+const char* shardSteeringName(enum shard_steering);
+int initShardCpus(int);
+void releaseShardCpus();
+int shardCpu(int);
+int openShardListener(char*, int);
+int attachShardSteering(int*, int);
+
+/* Shard threads */
+int pinShardThread(int);
+
+#endif
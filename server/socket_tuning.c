@@ -0,0 +1,195 @@
+/********************************************************************************************
+ * Title: Socket tuning implementation
+ * Description: Socket profiles are checked once at startup against a scratch socket, so
+ * 		options the kernel refuses (an unloaded congestion control module, say) are
+ * 		reported and dropped there instead of failing quietly on every connection.
+ * 		A growing transfer samples TCP_INFO every SOCKET_SAMPLE_BYTES and sizes its
+ * 		send buffer to hold twice the bandwidth-delay product: one BDP in flight and
+ * 		one queued behind it. As in BBR the BDP is the delivery rate times the
+ * 		minimum RTT, since the smoothed RTT grows with the queue it would size.
+ * 		Setting SO_SNDBUF turns the kernel's own autotuning off, so an autotuned
+ * 		buffer is only taken over once the BDP outgrows what autotuning would
+ * 		reach (tcp_wmem's maximum).
+ * *****************************************************************************************/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>         // the kernel's tcp_info, which has the delivery rate
+
+#include "socket_tuning.h"
+
+/* Profiles -t and -T may name */
+static const struct socket_profile socket_profiles[] = {
+    /* name          sndbuf             rcvbuf             nodelay cork lowat        congestion grow */
+    { "kernel",      0,                 0,                 0,      0,   0,           "",        0 },
+    { "interactive", 0,                 0,                 1,      0,   0,           "",        0 },
+    { "bulk",        0,                 0,                 0,      1,   0,           "",        1 },
+    { "throughput",  4 * 1024 * 1024,   4 * 1024 * 1024,   0,      1,   0,           "bbr",     1 },
+    { "latency",     0,                 0,                 1,      1,   16 * 1024,   "",        0 }
+};
+
+static struct {
+    struct socket_profile selected[SOCKET_ROLES];   // less whatever the kernel refused
+    int wmem_max;               // largest send buffer SO_SNDBUF may ask for
+    int autotune_max;           // largest send buffer the kernel's autotuning grows to
+    int can_force;              // SO_SNDBUFFORCE is permitted, so wmem_max doesn't apply
+} sockets;
+
+/*********************************************** Profile setup ********************************************/
+
+/* choose the profile for a role by name. Returns -1 if there is no such profile */
+int selectSocketProfile(enum socket_role role, const char* name)
+{
+    for (size_t i = 0; i < sizeof(socket_profiles) / sizeof(socket_profiles[0]); i++) {
+        if (strcmp(socket_profiles[i].name, name) == 0) {
+            sockets.selected[role] = socket_profiles[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* read the nth integer of a /proc/sys file, or return fallback */
+static int readSysctl(const char* path, int nth, int fallback)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return fallback;
+    int value = fallback;
+    for (int i = 0; i <= nth; i++)
+        if (fscanf(file, "%d", &value) != 1) {
+            value = fallback;
+            break;
+        }
+    fclose(file);
+    return value;
+}
+
+/* drop the options of a profile the kernel won't set, saying which */
+static void checkSocketProfile(struct socket_profile* profile)
+{
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    if (probe == -1) return;
+
+    if (profile->congestion[0] != '\0' &&
+            setsockopt(probe, IPPROTO_TCP, TCP_CONGESTION, profile->congestion, strlen(profile->congestion)) == -1) {
+        fprintf(stderr, "Socket profile %s: congestion control %s unavailable, using the system default\n",
+                profile->name, profile->congestion);
+        profile->congestion[0] = '\0';
+    }
+    if (profile->notsent_lowat > 0 &&
+            setsockopt(probe, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile->notsent_lowat, sizeof(int)) == -1) {
+        fprintf(stderr, "Socket profile %s: TCP_NOTSENT_LOWAT unsupported\n", profile->name);
+        profile->notsent_lowat = 0;
+    }
+    close(probe);
+}
+
+/* fill in unselected roles with their defaults, check the selected profiles and read the kernel's
+ * send buffer limits */
+void initSocketProfiles()
+{
+    if (sockets.selected[SOCKET_CONTROL].name[0] == '\0') selectSocketProfile(SOCKET_CONTROL, SOCKET_CONTROL_PROFILE);
+    if (sockets.selected[SOCKET_DATA].name[0] == '\0') selectSocketProfile(SOCKET_DATA, SOCKET_DATA_PROFILE);
+    for (int role = 0; role < SOCKET_ROLES; role++)
+        checkSocketProfile(&sockets.selected[role]);
+
+    sockets.wmem_max = readSysctl("/proc/sys/net/core/wmem_max", 0, 212992);
+    sockets.autotune_max = readSysctl("/proc/sys/net/ipv4/tcp_wmem", 2, 4 * 1024 * 1024);
+    int probe = socket(AF_INET, SOCK_STREAM, 0), size = SOCKET_MAX_SNDBUF / 2;
+    if (probe != -1) {
+        sockets.can_force = setsockopt(probe, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) == 0;
+        close(probe);
+    }
+    printf("Socket profiles: %s for control connections, %s for data\n",
+           sockets.selected[SOCKET_CONTROL].name, sockets.selected[SOCKET_DATA].name);
+}
+
+/* the profile selected for a role */
+const struct socket_profile* socketProfile(enum socket_role role)
+{
+    return &sockets.selected[role];
+}
+
+/******************************************** Applying profiles *******************************************/
+
+/* set a profile's options on a socket, before it listens or connects where it can be. Options
+ * were checked at startup, so failures here are ignored */
+void applySocketProfile(int sock_fd, const struct socket_profile* profile)
+{
+    if (profile->sndbuf > 0) setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &profile->sndbuf, sizeof(int));
+    if (profile->rcvbuf > 0) setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &profile->rcvbuf, sizeof(int));
+    if (profile->nodelay) setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &profile->nodelay, sizeof(int));
+    if (profile->notsent_lowat > 0)
+        setsockopt(sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile->notsent_lowat, sizeof(int));
+    if (profile->congestion[0] != '\0')
+        setsockopt(sock_fd, IPPROTO_TCP, TCP_CONGESTION, profile->congestion, strlen(profile->congestion));
+}
+
+/******************************************** Per-transfer tuning *****************************************/
+
+/* start tuning a transfer's socket to a profile, or to none if profile is NULL */
+void initSocketTuning(struct socket_tuning* tuning, const struct socket_profile* profile)
+{
+    memset(tuning, 0, sizeof(struct socket_tuning));
+    tuning->profile = profile;
+    tuning->next_sample = profile != NULL && profile->grow_to_bdp ? SOCKET_SAMPLE_BYTES : UINT64_MAX;
+}
+
+/* record the socket's RTT, delivery rate and send buffer. Returns -1 if it isn't TCP */
+static int readSocketInfo(int sock_fd, struct socket_tuning* tuning)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) return -1;
+
+    tuning->rtt_us = tuning->min_rtt_us = info.tcpi_rtt;
+    if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate)) {
+        tuning->delivery_rate = info.tcpi_delivery_rate;	// kernels before 4.9 don't report these
+        tuning->min_rtt_us = info.tcpi_min_rtt;
+    }
+    uint64_t bdp = tuning->delivery_rate * tuning->min_rtt_us / 1000000;
+    if (bdp > tuning->bdp) tuning->bdp = bdp;
+
+    len = sizeof(tuning->sndbuf);
+    getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, &len);
+    return 0;
+}
+
+/* once bytes_sent reaches the next sample point, measure the socket and grow its send buffer to
+ * twice the bandwidth-delay product if it is smaller */
+void sampleSocket(int sock_fd, struct socket_tuning* tuning, uint64_t bytes_sent)
+{
+    if (bytes_sent < tuning->next_sample) return;
+    tuning->next_sample = bytes_sent + SOCKET_SAMPLE_BYTES;
+    if (readSocketInfo(sock_fd, tuning) == -1) {
+        tuning->next_sample = UINT64_MAX;
+        return;
+    }
+
+    /* the kernel doubles the size it is given to cover its bookkeeping, and reports the doubled size */
+    uint64_t want = 2 * tuning->bdp;
+    if (want > SOCKET_MAX_SNDBUF / 2) want = SOCKET_MAX_SNDBUF / 2;
+    if (want * 2 <= (uint64_t) tuning->sndbuf) return;
+    int locked = tuning->profile->sndbuf > 0 || tuning->grown > 0;
+    if (!locked && want * 2 <= (uint64_t) sockets.autotune_max) return;	// autotuning will get there
+
+    int size = (int) want;
+    if (!sockets.can_force && size > sockets.wmem_max) size = sockets.wmem_max;
+    if ((uint64_t) size * 2 <= (uint64_t) tuning->sndbuf) return;		// capped no bigger than it is
+    if (setsockopt(sock_fd, SOL_SOCKET, sockets.can_force ? SO_SNDBUFFORCE : SO_SNDBUF, &size, sizeof(size)) == -1)
+        return;
+    socklen_t len = sizeof(tuning->sndbuf);
+    getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, &len);
+    tuning->grown++;
+}
+
+/* take a last measurement of the socket for the transfer's log line */
+void finishSocketTuning(int sock_fd, struct socket_tuning* tuning)
+{
+    if (tuning->profile != NULL) readSocketInfo(sock_fd, tuning);
+}
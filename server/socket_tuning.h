@@ -0,0 +1,66 @@
+/***************************************************************************************
+ * Title: Socket Tuning Specification
+ * Description: Specification for socket profiles. A profile names the buffer sizes,
+ * 		Nagle, unsent-data watermark and congestion control a socket gets, and
+ * 		is applied to each listener before it listens, so accepted sockets
+ * 		inherit it, and to data sockets before they connect. Control connections
+ * 		use one profile (-T) and data connections another (-t). A profile may
+ * 		also grow a transfer's send buffer to the bandwidth-delay product that
+ * 		TCP_INFO measures while the transfer runs.
+ * ************************************************************************************/
+
+#ifndef SOCKET_TUNING_H
+#define SOCKET_TUNING_H
+
+#include <stdint.h>
+
+#define SOCKET_CONTROL_PROFILE  "interactive"   // default for control connections
+#define SOCKET_DATA_PROFILE     "bulk"          // default for data connections
+#define SOCKET_SAMPLE_BYTES     (1024 * 1024)   // a growing transfer samples TCP_INFO this often
+#define SOCKET_MAX_SNDBUF       (64 * 1024 * 1024)
+#define SOCKET_CONGESTION_MAX   16
+
+/* Which kind of connection a profile is for */
+enum socket_role {
+    SOCKET_CONTROL,
+    SOCKET_DATA,                // also a +mux control connection, which carries the responses
+    SOCKET_ROLES
+};
+
+struct socket_profile {
+    char name[16];
+    int sndbuf;                 // bytes, 0 leaves the kernel autotuning it
+    int rcvbuf;
+    int nodelay;                // TCP_NODELAY
+    int cork_headers;           // hold a response's head back to share segments with the file
+    int notsent_lowat;          // TCP_NOTSENT_LOWAT, 0 for the kernel default
+    char congestion[SOCKET_CONGESTION_MAX];    // TCP_CONGESTION, "" for the system default
+    int grow_to_bdp;            // grow the send buffer to the measured bandwidth-delay product
+};
+
+/* One transfer's view of its socket, filled in by sampling TCP_INFO */
+struct socket_tuning {
+    const struct socket_profile* profile;
+    uint64_t next_sample;       // bytes_sent at which to sample next, UINT64_MAX if not sampling
+    uint32_t rtt_us;            // smoothed RTT at the last sample
+    uint32_t min_rtt_us;        // lowest RTT seen, free of queueing delay
+    uint64_t delivery_rate;     // bytes per second at the last sample
+    uint64_t bdp;               // largest delivery rate times the lowest RTT measured
+    int sndbuf;                 // send buffer at the last sample, as the kernel reports it
+    int grown;                  // times the send buffer was grown
+};
+
+/* Profile setup */
+int selectSocketProfile(enum socket_role, const char*);
+void initSocketProfiles();
+const struct socket_profile* socketProfile(enum socket_role);
+
+/* Applying profiles, safe to call from any thread */
+void applySocketProfile(int, const struct socket_profile*);
+
+/* Per-transfer tuning */
+void initSocketTuning(struct socket_tuning*, const struct socket_profile*);
+void sampleSocket(int, struct socket_tuning*, uint64_t);
+void finishSocketTuning(int, struct socket_tuning*);
+
+#endif
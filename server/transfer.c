@@ -0,0 +1,552 @@
+/********************************************************************************************
+ * Title: Transfer implementation
+ * Description: Response transfers and zero-copy file streaming. pumpTransfer() pushes a
+ * 		transfer as far as the socket allows, so the threaded engine calls it once
+ * 		on a blocking socket and the epoll engine calls it on every EPOLLOUT edge.
+ * 		Head, body and tail go out together in gathered writes where they can.
+ * 		Files are fstat()ed once so exactly st_size bytes are sent, whatever they
+ * 		contain. A file that shrinks meanwhile ends a legacy response early, at its
+ * 		END_DATA trailer, but fails a framed one, whose length is already on the
+ * 		wire, so the data connection closes instead of falling out of step.
+ * 		sendfile() moves the pages straight from the page cache to the socket; if
+ * 		the kernel refuses sendfile() for this file, splice() moves them through a
+ * 		pipe instead. Batch entries are started lazily; when an entry is
+ * 		started, the following one is opened and its first pages are requested with
+ * 		posix_fadvise(WILLNEED) so the disk reads overlap the current send.
+ * 		A delta keeps its file open and sends it run by run: the head holds the
+ * 		block references up to the next literal run, the file slot that run.
+ * 		A checksummed transfer sums what each pass put on the socket and writes
+ * 		the result into its END frame just before the tail goes out.
+ * 		A shaped transfer is pumped in passes no bigger than its flow's grant:
+ * 		file and compressed stages stop once the pass's allowance is spent, and
+ * 		head, body and tail, which are small, go out whole and are charged after.
+ * 		Passes also end at the socket's sample points, where its send buffer may
+ * 		grow to the measured BDP. A profile that corks headers sends a head that
+ * 		a file follows with MSG_MORE, so they share segments, and the pump never
+ * 		leaves the socket corked the way TCP_CORK would.
+ * 		The file slot is sent in steps between read-ahead points, each of which
+ * 		asks for the next window of the file before the sender reaches it.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "download_server.h"
+#include "transfer.h"
+#include "compression.h"
+#include "file_cache.h"
+#include "uring.h"
+#include "checksum.h"
+#include "delta.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "readahead.h"
+#include "log.h"
+
+/************************************* Transfer construction and sending ***********************************/
+
+/* reset a transfer to an empty response */
+void initTransfer(struct transfer* xfer)
+{
+    memset(xfer, 0, sizeof(struct transfer));
+    xfer->allowance = UINT64_MAX;
+    initSocketTuning(&xfer->tuning, NULL);
+    xfer->file.file_fd = xfer->file.pipe_fds[0] = xfer->file.pipe_fds[1] = -1;
+}
+
+/* append bytes to the head. Returns -1 if they don't fit */
+int appendTransferHead(struct transfer* xfer, const void* bytes, size_t len)
+{
+    if (xfer->head_len + len > TRANSFER_INLINE_SIZE) return -1;
+    memcpy(xfer->head + xfer->head_len, bytes, len);
+    xfer->head_len += len;
+    return 0;
+}
+
+/* append bytes to the tail. Returns -1 if they don't fit */
+int appendTransferTail(struct transfer* xfer, const void* bytes, size_t len)
+{
+    if (xfer->tail_len + len > TRANSFER_INLINE_SIZE) return -1;
+    memcpy(xfer->tail + xfer->tail_len, bytes, len);
+    xfer->tail_len += len;
+    return 0;
+}
+
+/* send a run of bytes, advancing *offset. Returns 1 when complete, 0 if the socket would
+ * block, -1 on error */
+int pumpBytes(int sock_fd, const unsigned char* bytes, size_t len, size_t* offset)
+{
+    while (*offset < len) {
+        ssize_t n = send(sock_fd, bytes + *offset, len - *offset, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        *offset += n;
+    }
+    return 1;
+}
+
+/* open the batch entry at batch->next and prefetch the one after it. Entries that can no
+ * longer be opened are skipped. Returns 0 once the batch is exhausted */
+static int startNextEntry(struct transfer* xfer)
+{
+    struct transfer_batch* batch = xfer->batch;
+
+    while (batch->next < batch->count) {
+        const char* name = batch->names[batch->next++];
+        if (batch->prefetched) {
+            xfer->file = batch->prefetch;
+            batch->prefetched = 0;
+        } else if (openFileStream(&xfer->file, name) == -1) {
+            continue;
+        }
+
+        /* warm the page cache for the next entry while this one is on the wire */
+        while (batch->next < batch->count) {
+            if (openFileStream(&batch->prefetch, batch->names[batch->next]) == 0) {
+                prefetchFileStream(&batch->prefetch);
+                batch->prefetched = 1;
+                break;
+            }
+            batch->next++;
+        }
+
+        xfer->head_len = xfer->head_off = 0;
+        batch->entry_head(xfer, name, xfer->file.end);
+        xfer->has_file = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* put the next run of delta operations in the head, ending with a literal run's header if
+ * one fits, which then goes out through the file slot. Returns 0 once the delta is exhausted */
+static int startNextRun(struct transfer* xfer)
+{
+    struct transfer_delta* delta = xfer->delta;
+
+    xfer->head_len = xfer->head_off = 0;
+    while (delta->next < delta->count) {
+        const struct delta_op* op = &delta->ops[delta->next];
+        if (delta->op_head(xfer, op) == -1) break;
+        delta->next++;
+        if (op->kind == DELTA_LITERAL) {
+            xfer->file.offset = (off_t) op->start;
+            xfer->file.end = (off_t) (op->start + op->count);
+            xfer->has_file = 1;
+            break;
+        }
+    }
+    return xfer->head_len > 0;
+}
+
+/* start the next batch entry or delta run. Returns 0 once the response has no more */
+static int startNextStage(struct transfer* xfer)
+{
+    if (xfer->batch != NULL) return startNextEntry(xfer);
+    if (xfer->delta != NULL) return startNextRun(xfer);
+    return 0;
+}
+
+/* account for n bytes of the transfer put on the socket */
+static void noteSent(struct transfer* xfer, uint64_t n)
+{
+    if (n == 0) return;
+    if (xfer->bytes_sent == 0 && xfer->command_ns != 0)
+        recordMetric(METRIC_COMMAND_TO_FIRST_BYTE, (monotonicNanos() - xfer->command_ns) / 1000);
+    xfer->bytes_sent += n;
+    xfer->allowance -= n < xfer->allowance ? n : xfer->allowance;
+    countMetric(METRIC_BYTES_SENT, n);
+}
+
+/* pumpBytes() one of the transfer's buffers, counting what goes out */
+static int pumpCounted(int sock_fd, struct transfer* xfer, const unsigned char* bytes, size_t len, size_t* offset)
+{
+    size_t before = *offset;
+    int result = pumpBytes(sock_fd, bytes, len, offset);
+    noteSent(xfer, *offset - before);
+    return result;
+}
+
+/* send what's left of the head and body, and of the tail when nothing goes out between them, as
+ * one gathered write per pass, so a small response is one system call and one segment. flags go
+ * to sendmsg(). Returns 1 once they are sent, 0 if the socket would block, -1 on error */
+static int pumpInline(int sock_fd, struct transfer* xfer, int with_tail, int flags)
+{
+    struct { unsigned char* bytes; size_t len; size_t* offset; } parts[3] = {
+        { xfer->head, xfer->head_len, &xfer->head_off },
+        { xfer->body, xfer->body_len, &xfer->body_off },
+        { xfer->tail, with_tail ? xfer->tail_len : 0, &xfer->tail_off }
+    };
+
+    while (1) {
+        struct iovec iov[3];
+        struct msghdr msg;
+        int count = 0;
+        for (int i = 0; i < 3; i++) {
+            if (*parts[i].offset >= parts[i].len) continue;
+            iov[count].iov_base = parts[i].bytes + *parts[i].offset;
+            iov[count++].iov_len = parts[i].len - *parts[i].offset;
+        }
+        if (count == 0) return 1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(sock_fd, &msg, MSG_NOSIGNAL | flags);	// writev() with MSG_NOSIGNAL
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        noteSent(xfer, (uint64_t) n);
+        for (int i = 0; i < 3 && n > 0; i++) {
+            size_t left = parts[i].len > *parts[i].offset ? parts[i].len - *parts[i].offset : 0;
+            size_t taken = (size_t) n < left ? (size_t) n : left;
+            *parts[i].offset += taken;
+            n -= taken;
+        }
+    }
+}
+
+/* sum the file up to offset, which has been sent, and no further than end, where the file
+ * stopped if it shrank */
+static void sumSent(struct transfer* xfer, off_t offset, off_t end)
+{
+    if (xfer->checksum == NULL) return;
+    if (end < xfer->checksum->end) xfer->checksum->end = end;
+    advanceChecksum(xfer->checksum, offset);
+}
+
+/* fill in the CRC-32 that ends the tail's END frame */
+static void finishTransferChecksum(struct transfer* xfer)
+{
+    uint32_t crc = htonl(finishChecksum(xfer->checksum));
+    memcpy(xfer->tail + xfer->tail_len - CHECKSUM_LENGTH, &crc, CHECKSUM_LENGTH);
+    releaseChecksumStream(xfer->checksum);
+    xfer->checksum = NULL;
+}
+
+/* send the file slot as far as the pass's allowance, in steps that keep its read-ahead ahead of
+ * it. Bytes already spliced into the pipe were counted against an earlier allowance, so they are
+ * drained whatever is left of this one. Returns 1 once the allowance or the file is used up and
+ * the pipe is empty, 0 if the socket would block (or a ring chain is in flight), -1 on error or
+ * if a framed transfer's file shrank */
+static int pumpFileSlot(int sock_fd, struct transfer* xfer)
+{
+    struct file_stream* file = &xfer->file;
+    int result = 1;
+
+    while (result == 1 && (file->pipe_bytes > 0 || (file->offset < file->end && xfer->allowance > 0))) {
+        off_t before = file->offset, end = file->end;
+        off_t limit = advanceReadAhead(file);
+        if (xfer->allowance < (uint64_t) (limit - before))
+            limit = before + (off_t) xfer->allowance;		// a shaped pass stops at its allowance
+        file->end = limit;
+        result = xfer->ring != NULL ? pumpRingTransfer(sock_fd, xfer->ring, file) : pumpFileStream(sock_fd, file);
+        int shrank = file->end != limit;
+        if (!shrank) file->end = end;
+        noteSent(xfer, (uint64_t) (file->offset - before));
+        sumSent(xfer, file->offset, file->end);
+        /* the client was promised every byte, and would take what follows for the rest of them */
+        if (shrank && xfer->framed) result = -1;
+    }
+    return result;
+}
+
+/* push every stage of the transfer as far as the socket allows */
+static int pumpStages(int sock_fd, struct transfer* xfer)
+{
+    int result;
+    do {
+        int last = !xfer->has_file && xfer->zstream == NULL && xfer->direct == NULL && xfer->batch == NULL &&
+                   xfer->delta == NULL && xfer->checksum == NULL;
+        int cork = xfer->tuning.profile != NULL && xfer->tuning.profile->cork_headers &&
+                   ((xfer->has_file && xfer->file.offset < xfer->file.end) || xfer->zstream != NULL ||
+                    xfer->direct != NULL);
+        if ((result = pumpInline(sock_fd, xfer, last, cork ? MSG_MORE : 0)) != 1)
+            return result;
+        if (xfer->has_file) {
+            if ((result = pumpFileSlot(sock_fd, xfer)) != 1)
+                return result;
+            if (xfer->file.offset < xfer->file.end || xfer->file.pipe_bytes > 0)
+                return 0;						// the rest waits for the next pass
+            if (xfer->delta == NULL) closeFileStream(&xfer->file);	// a delta's next run reuses it
+            xfer->has_file = 0;
+        }
+        if (xfer->zstream != NULL) {
+            uint64_t before = xfer->zstream->wire_bytes;
+            result = pumpCompressStream(sock_fd, xfer->zstream, xfer->allowance);
+            noteSent(xfer, xfer->zstream->wire_bytes - before);
+            sumSent(xfer, xfer->zstream->source.offset, xfer->zstream->source.end);
+            if (result != 1)
+                return result;
+            releaseCompressStream(xfer->zstream);
+            xfer->zstream = NULL;
+        }
+        if (xfer->direct != NULL) {
+            off_t before = xfer->direct->offset, end = xfer->direct->end;
+            result = pumpDirectStream(sock_fd, xfer->direct, xfer->allowance);
+            noteSent(xfer, (uint64_t) (xfer->direct->offset - before));
+            sumSent(xfer, xfer->direct->offset, xfer->direct->end);	// already summed, just the end
+            if (xfer->direct->end < end && xfer->framed) result = -1;		// the file shrank
+            if (result != 1)
+                return result;
+            releaseDirectStream(xfer->direct);
+            xfer->direct = NULL;
+        }
+    } while (startNextStage(xfer));
+    if (xfer->checksum != NULL) finishTransferChecksum(xfer);
+    return pumpCounted(sock_fd, xfer, xfer->tail, xfer->tail_len, &xfer->tail_off);
+}
+
+/* bytes a pass may send: at most grant, and no further than the socket's next sample */
+static uint64_t passAllowance(struct transfer* xfer, uint64_t grant)
+{
+    if (xfer->tuning.next_sample == UINT64_MAX) return grant;
+    uint64_t to_sample = xfer->tuning.next_sample > xfer->bytes_sent ? xfer->tuning.next_sample - xfer->bytes_sent : 0;
+    return to_sample < grant ? to_sample : grant;
+}
+
+/* pump an unshaped transfer a pass at a time, sampling its socket between passes */
+static int pumpSampled(int sock_fd, struct transfer* xfer)
+{
+    while (1) {
+        xfer->allowance = passAllowance(xfer, UINT64_MAX);
+        int result = pumpStages(sock_fd, xfer);
+        if (result != 0 || xfer->allowance > 0) return result;	// done, failed, or the socket is full
+        sampleSocket(sock_fd, &xfer->tuning, xfer->bytes_sent);
+    }
+}
+
+/* pump a shaped transfer a pass at a time, each no bigger than its flow's grant. A blocking
+ * sender sleeps until the next grant; a non-blocking one returns 0 with the flow's wake_ns set */
+static int pumpShaped(int sock_fd, struct transfer* xfer)
+{
+    struct shaped_flow* flow = xfer->flow;
+
+    while (1) {
+        uint64_t wait_ns;
+        uint64_t grant = grantShapedFlow(flow, &wait_ns);
+        if (grant == 0) {
+            if (!flow->blocking) {
+                flow->wake_ns = monotonicNanos() + wait_ns;
+                return 0;
+            }
+            if (SERVER_DISCONNECT) return -1;
+            uint64_t max_sleep = SCHEDULER_MAX_SLEEP_MS * 1000000ULL;
+            if (wait_ns > max_sleep) wait_ns = max_sleep;
+            struct timespec pause = { (time_t) (wait_ns / 1000000000ULL), (long) (wait_ns % 1000000000ULL) };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        flow->wake_ns = 0;
+        xfer->allowance = passAllowance(xfer, grant);
+        uint64_t before = xfer->bytes_sent;
+        int result = pumpStages(sock_fd, xfer);
+        chargeShapedFlow(flow, xfer->bytes_sent - before);
+        sampleSocket(sock_fd, &xfer->tuning, xfer->bytes_sent);
+        if (result != 0 || xfer->allowance > 0) return result;	// done, failed, or the socket is full
+    }
+}
+
+/* log a completed transfer's throughput and how its socket was tuned */
+static void logTransfer(int sock_fd, struct transfer* xfer, uint64_t elapsed)
+{
+    struct socket_tuning* tuning = &xfer->tuning;
+    double mbit = elapsed > 0 ? xfer->bytes_sent * 8e3 / elapsed : 0;
+    if (tuning->profile == NULL) {
+        logEvent(xfer->conn, LOG_TRANSFER_COMPLETE, NULL, xfer->bytes_sent, logDouble(elapsed / 1e6), logDouble(mbit));
+        return;
+    }
+    finishSocketTuning(sock_fd, tuning);
+    logEvent(xfer->conn, LOG_TRANSFER_TUNED, tuning->profile->name, xfer->bytes_sent, logDouble(elapsed / 1e6),
+             logDouble(mbit), tuning->rtt_us, tuning->min_rtt_us, tuning->bdp, tuning->sndbuf, tuning->grown);
+}
+
+/* send as much of the transfer as the socket accepts. Returns 1 once every byte is sent,
+ * 0 if the socket would block (or a shaped transfer must wait), -1 on error. Records the
+ * transfer's metrics and logs it when it ends */
+int pumpTransfer(int sock_fd, struct transfer* xfer)
+{
+    int result = xfer->flow != NULL ? pumpShaped(sock_fd, xfer) : pumpSampled(sock_fd, xfer);
+    if (result == 0 || xfer->command_ns == 0) return result;
+
+    if (result == 1) {
+        uint64_t elapsed = monotonicNanos() - xfer->command_ns;
+        countMetric(METRIC_TRANSFERS_COMPLETED, 1);
+        recordMetric(METRIC_TRANSFER_DURATION, elapsed / 1000);
+        if (elapsed > 0)
+            recordMetric(METRIC_TRANSFER_THROUGHPUT, (uint64_t) (xfer->bytes_sent * 1e9 / elapsed));
+        logTransfer(sock_fd, xfer, elapsed);
+    } else {
+        countMetric(METRIC_TRANSFERS_FAILED, 1);
+    }
+    xfer->command_ns = 0;
+    return result;
+}
+
+/* release the heap body, files, cache entry, ring slot, O_DIRECT stream, batch, delta and flow held
+ * by a transfer */
+void releaseTransfer(struct transfer* xfer)
+{
+    closeShapedFlow(xfer->flow);
+    if (xfer->has_file || xfer->delta != NULL) closeFileStream(&xfer->file);
+    if (xfer->body_on_heap) free(xfer->body);
+    releaseCompressStream(xfer->zstream);
+    releaseCachedFile(xfer->cached);
+    releaseRingTransfer(xfer->ring);
+    releaseDirectStream(xfer->direct);
+    releaseChecksumStream(xfer->checksum);
+    releaseDelta(xfer->delta);
+    if (xfer->batch != NULL) {
+        if (xfer->batch->prefetched) closeFileStream(&xfer->batch->prefetch);
+        for (size_t i = 0; i < xfer->batch->count; i++)
+            free(xfer->batch->names[i]);
+        free(xfer->batch->names);
+        free(xfer->batch);
+    }
+    initTransfer(xfer);
+}
+
+/* append a file name to a batch. Returns -1 if out of memory */
+int addBatchEntry(struct transfer_batch* batch, const char* name)
+{
+    /* capacity is 16, then doubles whenever count reaches a power of two */
+    if (batch->count == 0 || (batch->count >= 16 && (batch->count & (batch->count - 1)) == 0)) {
+        char** names = realloc(batch->names, (batch->count ? batch->count * 2 : 16) * sizeof(char*));
+        if (names == NULL) return -1;
+        batch->names = names;
+    }
+    if ((batch->names[batch->count] = strdup(name)) == NULL) return -1;
+    batch->count++;
+    return 0;
+}
+
+/* send a whole buffer on a blocking socket. Returns 0 on success, -1 on error */
+int sendAll(int sock_fd, const void* bytes, size_t len)
+{
+    size_t offset = 0;
+    return pumpBytes(sock_fd, (const unsigned char*) bytes, len, &offset) == 1 ? 0 : -1;
+}
+
+/* returns 1 if the peer has closed or reset an idle connection, without consuming data */
+int peerClosed(int sock_fd)
+{
+    char probe;
+    ssize_t n = recv(sock_fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/************************************** Zero-copy file streaming ****************************************/
+
+/* open a regular file for streaming from offset 0 to its current size. Returns 0 on success,
+ * -1 if the file can't be opened or is not a regular file */
+int openFileStream(struct file_stream* stream, const char* file_name)
+{
+    struct stat file_stat;
+
+    memset(stream, 0, sizeof(struct file_stream));
+    stream->pipe_fds[0] = stream->pipe_fds[1] = -1;
+
+    if ((stream->file_fd = open(file_name, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if (fstat(stream->file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        close(stream->file_fd);
+        stream->file_fd = -1;
+        return -1;
+    }
+    stream->end = file_stat.st_size;
+    stream->dev = file_stat.st_dev;
+    stream->inode = file_stat.st_ino;
+    stream->mtime = file_stat.st_mtim;
+    return 0;
+}
+
+/* move bytes from the pipe onto the socket. Returns 0 when the pipe is drained, -1 with errno set
+ * otherwise (EAGAIN if the socket is full) */
+static int drainPipe(int sock_fd, struct file_stream* stream)
+{
+    while (stream->pipe_bytes > 0) {
+        ssize_t n = splice(stream->pipe_fds[0], NULL, sock_fd, NULL, stream->pipe_bytes,
+                           SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        stream->pipe_bytes -= n;
+    }
+    return 0;
+}
+
+/* send the remainder of the stream. Returns 1 once every byte is on the socket, 0 if the
+ * socket would block, -1 on error */
+int pumpFileStream(int sock_fd, struct file_stream* stream)
+{
+    while (stream->offset < stream->end || stream->pipe_bytes > 0) {
+        size_t remaining = stream->end - stream->offset;
+        ssize_t n;
+
+        if (!stream->use_splice) {
+            n = sendfile(sock_fd, stream->file_fd, &stream->offset, remaining);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                /* file system can't feed sendfile(), switch to splice() */
+                if (pipe2(stream->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+                stream->use_splice = 1;
+                continue;
+            }
+        } else {
+            if (drainPipe(sock_fd, stream) == -1) {
+                n = -1;
+            } else if (remaining == 0) {
+                break;
+            } else {
+                n = splice(stream->file_fd, &stream->offset, stream->pipe_fds[1], NULL, remaining,
+                           SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                if (n > 0) stream->pipe_bytes = n;
+            }
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0 && stream->pipe_bytes == 0) {
+            /* file shrank underneath us: the stream ends here, and pumpFileSlot() fails a framed transfer */
+            stream->end = stream->offset;
+        }
+    }
+    return 1;
+}
+
+/* ask the kernel to start reading the stream's first read-ahead window into the page cache; the
+ * rest is read ahead as it goes out, so a huge entry doesn't flood the cache before it starts */
+void prefetchFileStream(struct file_stream* stream)
+{
+    off_t len = stream->end - stream->offset;
+    if (len > READAHEAD_MIN_WINDOW) len = READAHEAD_MIN_WINDOW;
+    posix_fadvise(stream->file_fd, stream->offset, len, POSIX_FADV_WILLNEED);
+    stream->readahead_end = stream->offset + len;
+}
+
+/* release the file and pipe held by a stream */
+void closeFileStream(struct file_stream* stream)
+{
+    if (stream->file_fd != -1) close(stream->file_fd);
+    if (stream->pipe_fds[0] != -1) close(stream->pipe_fds[0]);
+    if (stream->pipe_fds[1] != -1) close(stream->pipe_fds[1]);
+    stream->file_fd = stream->pipe_fds[0] = stream->pipe_fds[1] = -1;
+    stream->pipe_bytes = 0;
+}
@@ -0,0 +1,112 @@
+/***************************************************************************************
+ * Title: Transfer Specification
+ * Description: Specification for the response transfer helpers shared by both server
+ * 		engines. A transfer is a short head (frame header or error), a body (heap
+ * 		buffer and/or file) and a short tail (END frame or END_DATA_MESSAGE).
+ * 		Files are streamed to the data socket with sendfile(), falling back to
+ * 		splice() through a pipe, so file contents never pass through a user-space
+ * 		buffer. Works on blocking and non-blocking sockets alike. A batch transfer
+ * 		repeats head -> file for every entry of a list of files, opening each entry
+ * 		only when the previous one is on the wire and prefetching the one after.
+ * 		Small hot files are sent from a cached mapping as the body instead.
+ * 		Large files are read ahead of the sender, and one-shot ones with O_DIRECT.
+ * 		A shaped transfer sends in passes of whatever its flow is granted, and
+ * 		a tuned one in passes between samples of its socket.
+ * ************************************************************************************/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "socket_tuning.h"
+
+#define TRANSFER_INLINE_SIZE    512     // fits a batch entry's headers and a NAME_MAX name
+
+/* A byte range of an open file being streamed to a socket */
+struct file_stream {
+    int file_fd;
+    off_t offset;           // next byte of the file to send
+    off_t end;              // one past the last byte to send
+    int use_splice;         // sendfile() unsupported for this file, splice through pipe_fds
+    int pipe_fds[2];
+    size_t pipe_bytes;      // spliced into the pipe but not yet onto the socket
+    off_t readahead;        // read-ahead window, 0 until the first pass, -1 if left to the kernel
+    off_t readahead_end;    // pages before here have been asked for with WILLNEED
+    int drop_behind;        // one-shot file: pages are dropped from the page cache once sent
+    off_t dropped;          // pages before here have been dropped
+    dev_t dev;              // identity of the file version opened, for the caches
+    ino_t inode;
+    struct timespec mtime;
+};
+
+struct transfer;
+struct compress_stream;
+struct cached_file;
+struct ring_transfer;
+struct checksum_stream;
+struct transfer_delta;
+struct shaped_flow;
+struct direct_stream;
+
+/* Files sent back to back in one response */
+struct transfer_batch {
+    char** names;               // heap, owned by the batch
+    size_t count;
+    size_t next;                // next entry to start
+    struct file_stream prefetch;
+    int prefetched;             // prefetch already holds names[next]
+    void (*entry_head)(struct transfer*, const char*, off_t);  // appends an entry's head
+};
+
+/* Response for one command, sent head -> body -> file -> tail, with head -> file repeated
+ * for every batch entry and every run of delta operations */
+struct transfer {
+    unsigned char head[TRANSFER_INLINE_SIZE];
+    size_t head_len;
+    size_t head_off;
+    unsigned char* body;        // e.g. a directory listing, in an arena buffer, on the heap or mmap'd
+    int body_on_heap;           // body is owned by the transfer and freed with it
+    size_t body_len;
+    size_t body_off;
+    int has_file;
+    struct file_stream file;
+    unsigned char tail[TRANSFER_INLINE_SIZE];
+    size_t tail_len;
+    size_t tail_off;
+    struct transfer_batch* batch;   // NULL unless the response streams several files
+    struct transfer_delta* delta;   // NULL unless the response is a delta, whose literal runs share the file slot
+    struct compress_stream* zstream;    // file compressed on the fly, sent after the file slot
+    struct cached_file* cached;         // hot-file cache entry the body points into
+    struct ring_transfer* ring;         // file sent through the loop's io_uring instead of sendfile()
+    struct direct_stream* direct;       // one-shot file read with O_DIRECT, sent instead of the file slot
+    struct checksum_stream* checksum;   // +checksum: sums the file as it goes out, into the tail's END frame
+    struct shaped_flow* flow;           // NULL unless responses are shaped
+    uint64_t allowance;         // bytes the current pass may still send, UINT64_MAX if unlimited
+    struct socket_tuning tuning;        // the socket's profile and what TCP_INFO says about it
+    int framed;                 // lengths were announced up front, so a file that shrinks fails the transfer
+    uint64_t command_ns;        // when the command arrived, 0 once the transfer's metrics are recorded
+    uint64_t conn;              // session id its log records carry
+    uint64_t bytes_sent;
+};
+
+/* Transfer construction and sending */
+void initTransfer(struct transfer*);
+int appendTransferHead(struct transfer*, const void*, size_t);
+int appendTransferTail(struct transfer*, const void*, size_t);
+int pumpTransfer(int, struct transfer*);
+int pumpBytes(int, const unsigned char*, size_t, size_t*);
+void releaseTransfer(struct transfer*);
+int sendAll(int, const void*, size_t);
+int peerClosed(int);
+int addBatchEntry(struct transfer_batch*, const char*);
+
+/* Zero-copy file streaming */
+int openFileStream(struct file_stream*, const char*);
+int pumpFileStream(int, struct file_stream*);
+void closeFileStream(struct file_stream*);
+void prefetchFileStream(struct file_stream*);
+
+#endif
@@ -0,0 +1,370 @@
+/********************************************************************************************
+ * Title: io_uring Backend implementation
+ * Description: A minimal io_uring driver over the raw syscalls. Each ring transfer slot
+ * 		sends its file in chains of at most URING_CHAIN_DEPTH read/send pairs, all
+ * 		linked so the sends reach the socket in order. A short read or send breaks
+ * 		the chain (the kernel cancels what follows), so once every SQE of a chain
+ * 		has completed the bytes actually sent are folded into the file stream and
+ * 		the next chain starts from there. A short read means the file shrank, and
+ * 		the stream's end is pulled back to where the read found it ending.
+ * 		Slots never touch their connection: they hand an owner pointer back when a
+ * 		chain finishes, and a slot released mid-chain is only reused after its last
+ * 		completion and fixed-file clear.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "download_server.h"
+#include "uring.h"
+
+#define USER_DATA(slot, op, seq)    (((uint64_t) (slot) << 16) | ((uint64_t) (op) << 8) | (seq))
+#define USER_DATA_SLOT(data)        ((unsigned int) ((data) >> 16))
+#define USER_DATA_OP(data)          ((int) (((data) >> 8) & 0xff))
+
+static int ringSetup(unsigned int entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ringEnter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ringRegister(int ring_fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/************************************* Ring setup and teardown ******************************************/
+
+/* whether the kernel supports every opcode a chain uses */
+static int ringSupportsOps(int ring_fd)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, len);
+    if (probe == NULL) return 0;
+
+    int supported = 0;
+    if (ringRegister(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        int ops[] = { IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_FILES_UPDATE };
+        supported = 1;
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = 0;
+    }
+    free(probe);
+    return supported;
+}
+
+/* map the submission and completion rings */
+static int mapRing(struct uring* ring, struct io_uring_params* params)
+{
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) return -1;
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) return -1;
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) return -1;
+
+    unsigned char* sq = ring->sq_ring;
+    unsigned char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned int*) (sq + params->sq_off.head);
+    ring->sq_tail = (unsigned int*) (sq + params->sq_off.tail);
+    ring->sq_array = (unsigned int*) (sq + params->sq_off.array);
+    ring->sq_mask = *(unsigned int*) (sq + params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+    ring->sq_queued = *ring->sq_tail;
+    ring->cq_head = (unsigned int*) (cq + params->cq_off.head);
+    ring->cq_tail = (unsigned int*) (cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned int*) (cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params->cq_off.cqes);
+    return 0;
+}
+
+/* register the transfer buffers, an empty fixed-file table and the completion eventfd */
+static int registerResources(struct uring* ring)
+{
+    unsigned int nr_buffers = URING_SLOTS * URING_CHAIN_DEPTH;
+    ring->buffers_size = (size_t) nr_buffers * URING_CHUNK_SIZE;
+    ring->buffers = mmap(NULL, ring->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        return -1;
+    }
+
+    struct iovec iovecs[URING_SLOTS * URING_CHAIN_DEPTH];
+    for (unsigned int i = 0; i < nr_buffers; i++) {
+        iovecs[i].iov_base = ring->buffers + (size_t) i * URING_CHUNK_SIZE;
+        iovecs[i].iov_len = URING_CHUNK_SIZE;
+    }
+    if (ringRegister(ring->ring_fd, IORING_REGISTER_BUFFERS, iovecs, nr_buffers) == -1) return -1;
+
+    int files[URING_SLOTS * 2];
+    for (int i = 0; i < URING_SLOTS * 2; i++) files[i] = -1;
+    if (ringRegister(ring->ring_fd, IORING_REGISTER_FILES, files, URING_SLOTS * 2) == -1) return -1;
+
+    if ((ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) return -1;
+    return ringRegister(ring->ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1);
+}
+
+/* create a ring for one event loop. Returns NULL if io_uring is unavailable, in which case the
+ * loop keeps sending files with sendfile() */
+struct uring* createRing()
+{
+    struct uring* ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) return NULL;
+    ring->event_fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if ((ring->ring_fd = ringSetup(URING_ENTRIES, &params)) == -1) {
+        free(ring);
+        return NULL;
+    }
+    if (!ringSupportsOps(ring->ring_fd) || mapRing(ring, &params) == -1 || registerResources(ring) == -1) {
+        destroyRing(ring);
+        return NULL;
+    }
+
+    for (int i = URING_SLOTS - 1; i >= 0; i--) {
+        struct ring_transfer* slot = &ring->slots[i];
+        slot->ring = ring;
+        slot->index = i;
+        slot->file_fd = slot->sock_fd = -1;
+        slot->next_free = ring->free_slots;
+        ring->free_slots = slot;
+    }
+    return ring;
+}
+
+/* close the ring, which cancels anything still in flight, and unmap it */
+void destroyRing(struct uring* ring)
+{
+    if (ring == NULL) return;
+    close(ring->ring_fd);
+    if (ring->event_fd != -1) close(ring->event_fd);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->buffers != NULL) munmap(ring->buffers, ring->buffers_size);
+    free(ring);
+}
+
+/*********************************** Batched submission and completion ***********************************/
+
+/* free submission entries. Every slot's longest chain fits at once, so this never runs out */
+static unsigned int ringSpace(struct uring* ring)
+{
+    return ring->sq_entries - (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* claim the next submission entry, cleared. Nothing reaches the kernel before submitRing() */
+static struct io_uring_sqe* queueSqe(struct uring* ring, int opcode, uint64_t user_data)
+{
+    unsigned int index = ring->sq_queued & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = (uint8_t) opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->sq_queued++;
+    return sqe;
+}
+
+/* hand every queued SQE to the kernel in one io_uring_enter(). Returns -1 on error */
+int submitRing(struct uring* ring)
+{
+    unsigned int tail = *ring->sq_tail;
+    if (ring->sq_queued == tail) return 0;
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+    unsigned int to_submit = ring->sq_queued - tail;
+    while (to_submit > 0) {
+        int submitted = ringEnter(ring->ring_fd, to_submit, 0, 0);
+        if (submitted == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            fprintf(stderr, "io_uring_enter() failed\n");
+            return -1;
+        }
+        to_submit -= submitted;
+    }
+    return 0;
+}
+
+/* queue a fixed-file update for a slot */
+static void queueFilesUpdate(struct ring_transfer* slot, int op, int file_fd, int sock_fd)
+{
+    slot->fds[0] = file_fd;
+    slot->fds[1] = sock_fd;
+    struct io_uring_sqe* sqe = queueSqe(slot->ring, IORING_OP_FILES_UPDATE, USER_DATA(slot->index, op, 0));
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) slot->fds;
+    sqe->len = 2;
+    sqe->off = slot->index * 2;
+    slot->file_fd = file_fd;
+    slot->sock_fd = sock_fd;
+    slot->inflight++;
+}
+
+/* apply one completion to its slot. Returns 1 once the slot's chain has fully completed */
+static int completeSqe(struct ring_transfer* slot, uint64_t user_data, int res)
+{
+    switch (USER_DATA_OP(user_data)) {
+        case URING_OP_UPDATE:
+            if (res < 0 && res != -ECANCELED) slot->error = 1;
+            break;
+        case URING_OP_READ:
+            if (res < 0) {
+                if (res != -ECANCELED) slot->error = 1;
+            } else {
+                off_t offset = slot->chain_offset + (off_t) (user_data & 0xff) * URING_CHUNK_SIZE;
+                off_t end = slot->chain_end - offset < URING_CHUNK_SIZE ? slot->chain_end : offset + URING_CHUNK_SIZE;
+                if (offset + res < end) slot->eof = offset + res;		// file shrank under us
+            }
+            break;
+        case URING_OP_SEND:
+            if (res >= 0) slot->sent += res;		// a short send cancels the rest of the chain
+            else if (res != -ECANCELED) slot->error = 1;
+            break;
+        case URING_OP_CLEAR:
+            slot->state = RING_SLOT_FREE;
+            slot->file_fd = slot->sock_fd = -1;
+            slot->next_free = slot->ring->free_slots;
+            slot->ring->free_slots = slot;
+            slot->inflight--;
+            return 0;
+    }
+    return --slot->inflight == 0;
+}
+
+/* drain the completion ring. done() is called with the owner of every slot whose chain has
+ * finished, so its connection can carry on */
+void reapRing(struct uring* ring, void (*done)(void*))
+{
+    uint64_t signalled;
+    ssize_t ignored = read(ring->event_fd, &signalled, sizeof(signalled));
+    (void) ignored;
+
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        struct ring_transfer* slot = &ring->slots[USER_DATA_SLOT(cqe->user_data)];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (!completeSqe(slot, cqe->user_data, cqe->res)) continue;
+        if (slot->owner != NULL) {
+            done(slot->owner);
+        } else if (slot->state == RING_SLOT_ACTIVE) {
+            slot->state = RING_SLOT_CLEARING;	// released mid-chain, drop its files now
+            queueFilesUpdate(slot, URING_OP_CLEAR, -1, -1);
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+/************************************** Transfers sent through the ring **********************************/
+
+/* take a free slot for a transfer, NULL if every slot is busy and the transfer should use
+ * sendfile() instead */
+struct ring_transfer* attachRingTransfer(struct uring* ring, void* owner)
+{
+    struct ring_transfer* slot = ring->free_slots;
+    if (slot == NULL) return NULL;
+    ring->free_slots = slot->next_free;
+    slot->state = RING_SLOT_ACTIVE;
+    slot->owner = owner;
+    slot->inflight = 0;
+    slot->sent = 0;
+    slot->eof = -1;
+    slot->error = 0;
+    return slot;
+}
+
+/* send the file through the ring. Queues the next chain whenever the previous one has
+ * completed. Returns 1 once the file is sent, or up to where it ended if it shrank (with
+ * file->end pulled back, as pumpFileStream() does), 0 while a chain is in flight, -1 on error */
+int pumpRingTransfer(int sock_fd, struct ring_transfer* slot, struct file_stream* file)
+{
+    if (slot->inflight > 0) return 0;
+    file->offset += slot->sent;
+    slot->sent = 0;
+    if (slot->error) return -1;
+    if (slot->eof != -1 && slot->eof < file->end) file->end = slot->eof < file->offset ? file->offset : slot->eof;
+    slot->eof = -1;
+    if (file->offset >= file->end) {
+        slot->file_fd = -1;		// the next batch entry may reuse the fd number, always repoint
+        return 1;
+    }
+    if (ringSpace(slot->ring) < 1 + 2 * URING_CHAIN_DEPTH) return -1;
+
+    /* batch entries and cached copies swap the file, repoint the slot first */
+    if (slot->file_fd != file->file_fd || slot->sock_fd != sock_fd) {
+        queueFilesUpdate(slot, URING_OP_UPDATE, file->file_fd, sock_fd);
+        slot->ring->sqes[(slot->ring->sq_queued - 1) & slot->ring->sq_mask].flags = IOSQE_IO_LINK;
+    }
+
+    off_t offset = file->offset;
+    slot->chain_offset = offset;
+    slot->chain_end = file->end;
+    for (unsigned int k = 0; k < URING_CHAIN_DEPTH && offset < file->end; k++) {
+        unsigned int buffer = slot->index * URING_CHAIN_DEPTH + k;
+        unsigned char* data = slot->ring->buffers + (size_t) buffer * URING_CHUNK_SIZE;
+        size_t len = file->end - offset < URING_CHUNK_SIZE ? (size_t) (file->end - offset) : URING_CHUNK_SIZE;
+
+        struct io_uring_sqe* sqe = queueSqe(slot->ring, IORING_OP_READ_FIXED, USER_DATA(slot->index, URING_OP_READ, k));
+        sqe->fd = slot->index * 2;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->addr = (uint64_t) (uintptr_t) data;
+        sqe->len = (uint32_t) len;
+        sqe->off = (uint64_t) offset;
+        sqe->buf_index = (uint16_t) buffer;
+
+        offset += len;
+        sqe = queueSqe(slot->ring, IORING_OP_SEND, USER_DATA(slot->index, URING_OP_SEND, k));
+        sqe->fd = slot->index * 2 + 1;
+        sqe->flags = IOSQE_FIXED_FILE | (k + 1 < URING_CHAIN_DEPTH && offset < file->end ? IOSQE_IO_LINK : 0);
+        sqe->addr = (uint64_t) (uintptr_t) data;
+        sqe->len = (uint32_t) len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        slot->inflight += 2;
+    }
+    return 0;
+}
+
+/* detach a transfer from its slot. A chain still in flight is cut short by shutting the socket
+ * down, and the slot is recycled once its completions are in */
+void releaseRingTransfer(struct ring_transfer* slot)
+{
+    if (slot == NULL) return;
+    slot->owner = NULL;
+    if (slot->inflight > 0) {
+        if (slot->sock_fd != -1) shutdown(slot->sock_fd, SHUT_RDWR);
+        return;
+    }
+    slot->state = RING_SLOT_CLEARING;
+    queueFilesUpdate(slot, URING_OP_CLEAR, -1, -1);
+}
@@ -0,0 +1,100 @@
+/***************************************************************************************
+ * Title: io_uring Backend Specification
+ * Description: Specification for the io_uring file sender used by the uring engine
+ * 		(./server {PORT} -e uring), the epoll engine with each loop owning a ring.
+ * 		A transfer's file is sent as a chain of linked SQEs, READ_FIXED into a
+ * 		registered buffer then SEND from it, against a registered (fixed) file
+ * 		table. SQEs from every client a loop serves are queued during an epoll
+ * 		batch and submitted with a single io_uring_enter() at its end. Completions
+ * 		are signalled through an eventfd watched by the loop's epoll set.
+ * ************************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "transfer.h"
+
+#define URING_ENTRIES       1024            // SQ size, covers every slot's longest chain
+#define URING_SLOTS         64              // transfers a loop may send through its ring at once
+#define URING_CHAIN_DEPTH   4               // read/send pairs linked in one chain
+#define URING_CHUNK_SIZE    (32 * 1024)     // bytes per registered buffer
+
+/* What a completion belongs to, kept in the low bits of user_data */
+enum uring_op {
+    URING_OP_UPDATE = 1,        // point the slot's fixed files at the transfer's file and socket
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_CLEAR              // drop the slot's fixed files once the transfer is done
+};
+
+enum ring_slot_state {
+    RING_SLOT_FREE,
+    RING_SLOT_ACTIVE,           // attached to a transfer
+    RING_SLOT_CLEARING          // released, waiting for its fixed files to be dropped
+};
+
+struct uring;
+
+/* One transfer's use of the ring. Owns fixed files 2 * index (file) and 2 * index + 1 (socket)
+ * and registered buffers index * URING_CHAIN_DEPTH onwards */
+struct ring_transfer {
+    struct uring* ring;
+    unsigned int index;
+    enum ring_slot_state state;
+    void* owner;                // handed back by reapRing() when a chain finishes, NULL once released
+    int fds[2];                 // FILES_UPDATE argument, must outlive the SQE
+    int file_fd;                // fds currently registered in the slot, -1 if none
+    int sock_fd;
+    unsigned int inflight;      // SQEs submitted but not completed
+    off_t sent;                 // bytes the finished chain put on the wire
+    off_t chain_offset;         // file range the chain was queued for
+    off_t chain_end;
+    off_t eof;                  // where a short READ found the file ending, -1 if none did
+    int error;
+    struct ring_transfer* next_free;
+};
+
+struct uring {
+    int ring_fd;
+    int event_fd;               // signalled on every completion
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_queued;     // local tail, published by submitRing()
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned char* buffers;     // URING_SLOTS * URING_CHAIN_DEPTH registered buffers
+    size_t buffers_size;
+    struct ring_transfer slots[URING_SLOTS];
+    struct ring_transfer* free_slots;
+};
+
+/* Ring setup and teardown, per event loop */
+struct uring* createRing();
+void destroyRing(struct uring*);
+
+/* Batched submission and completion */
+int submitRing(struct uring*);
+void reapRing(struct uring*, void (*)(void*));
+
+/* Transfers sent through the ring */
+struct ring_transfer* attachRingTransfer(struct uring*, void*);
+int pumpRingTransfer(int, struct ring_transfer*, struct file_stream*);
+void releaseRingTransfer(struct ring_transfer*);
+
+#endif
@@ -0,0 +1,390 @@
+/********************************************************************************************
+ * Title: Worker pool engine implementation
+ * Description: Implementation for the threads engine. The main thread is a dispatcher. It
+ * 		accepts clients, applies admission control and turns control connection
+ * 		readiness into tasks. A fixed set of worker threads runs those tasks with
+ * 		the blocking handshake and command handlers in download_server.c. Each
+ * 		worker pops from its own deque and steals from the others when that
+ * 		is empty. Thread count and stack memory no longer grow with the number of
+ * 		connected clients.
+ * *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "download_server.h"
+#include "worker_pool.h"
+#include "event_loop.h"
+#include "buffer_arena.h"
+#include "metrics.h"
+#include "log.h"
+
+static struct {
+    struct pool_worker* workers;
+    int num_workers;
+    int max_clients;
+    int epoll_fd;
+    int wakeup_fd;
+    unsigned int next_worker;       // round-robin target for new tasks, main thread only
+
+    pthread_mutex_t lock;           // client list and admission state
+    struct pool_client* clients;
+    struct pool_client* waiting_head;
+    struct pool_client* waiting_tail;
+    int admitted;
+    int waiting;
+    int stopping;
+
+    pthread_mutex_t idle_lock;      // idle workers sleep on work_available
+    pthread_cond_t work_available;
+    _Atomic int queued;             // tasks across every deque, changed under idle_lock when rising
+} pool = {
+    .epoll_fd = -1,
+    .wakeup_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_available = PTHREAD_COND_INITIALIZER
+};
+
+/************************************* Engine startup and shutdown **************************************/
+
+/* start the workers and dispatch client input to them until the server shuts down */
+void runWorkerPool(int server_welcome_fd, char* port_str)
+{
+    struct epoll_event ev, events[POOL_MAX_EVENTS];
+
+    pool.num_workers = server_options.num_workers;
+    if (pool.num_workers <= 0) {
+        int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        pool.num_workers = (cores > 0 ? cores : 1) * POOL_THREADS_PER_CORE;
+    }
+    pool.max_clients = server_options.max_clients;
+
+    if (setNonBlocking(server_welcome_fd) == -1) {
+        fprintf(stderr, "Failed to make welcome socket non-blocking\n");
+        exit(1);
+    }
+    if ((pool.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            (pool.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        fprintf(stderr, "Failed to create worker pool dispatcher\n");
+        exit(1);
+    }
+
+    /* the welcome socket is tagged NULL and the wakeup eventfd by its own address */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, server_welcome_fd, &ev) == -1) {
+        fprintf(stderr, "Failed to register welcome socket\n");
+        exit(1);
+    }
+    ev.data.ptr = &pool.wakeup_fd;
+    if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, pool.wakeup_fd, &ev) == -1) {
+        fprintf(stderr, "Failed to register wakeup fd\n");
+        exit(1);
+    }
+
+    pool.workers = calloc(pool.num_workers, sizeof(struct pool_worker));
+    for (int i = 0; i < pool.num_workers; i++) {
+        pool.workers[i].id = i;
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        if (pthread_create(&pool.workers[i].thread, NULL, pool_worker_thread, &pool.workers[i]) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            exit(1);
+        }
+    }
+    printf("Server listening on %s (%d worker threads, up to %d clients)\n", port_str,
+           pool.num_workers, pool.max_clients);
+
+    while (!SERVER_DISCONNECT) {
+        int ready = epoll_wait(pool.epoll_fd, events, POOL_MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait() failed\n");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptPoolClients(server_welcome_fd);
+            } else if (events[i].data.ptr != &pool.wakeup_fd) {
+                pushTask(&pool.workers[pool.next_worker++ % pool.num_workers], events[i].data.ptr);
+            }									// wakeup: SERVER_DISCONNECT checked by loop condition
+        }
+    }
+
+    /* workers finish the task they are on; one stuck on a slow client is left behind */
+    pthread_mutex_lock(&pool.idle_lock);
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_cond_broadcast(&pool.work_available);
+    pthread_mutex_unlock(&pool.idle_lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += POOL_SHUTDOWN_GRACE_SEC;
+    for (int i = 0; i < pool.num_workers; i++) {
+        if (pthread_timedjoin_np(pool.workers[i].thread, NULL, &deadline) != 0)
+            fprintf(stderr, "Worker thread %d still busy at shutdown\n", i);
+    }
+
+    /* tell every idle or waiting client to shut down */
+    pthread_mutex_lock(&pool.lock);
+    for (struct pool_client* client = pool.clients; client != NULL; client = client->next) {
+        if (client->busy) continue;
+        if (!(client->session.capabilities & CAP_MUX)) sendKillToClient(client->cmd_fd);	// +mux clients only read frames
+        closeSessionDataConnection(&client->session);
+        close(client->cmd_fd);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    close(pool.wakeup_fd);
+    close(pool.epoll_fd);
+    close(server_welcome_fd);
+    serverTearDown();
+}
+
+/* wake the dispatcher so it notices SERVER_DISCONNECT, safe to call from a signal handler */
+void wakeWorkerPool()
+{
+    if (pool.wakeup_fd != -1) {
+        uint64_t one = 1;
+        ssize_t ignored = write(pool.wakeup_fd, &one, sizeof(one));
+        (void) ignored;
+    }
+}
+
+/******************************************** Worker threads ********************************************/
+
+/* worker main function. Runs tasks from its own deque, then stolen ones, then sleeps */
+void* pool_worker_thread(void* arg)
+{
+    struct pool_worker* self = (struct pool_worker*) arg;
+
+    for (;;) {
+        struct pool_client* client = popTask(self);
+        if (client == NULL) client = stealTask(self);
+        if (client != NULL) {
+            runClientTask(client);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.idle_lock);
+        while (atomic_load(&pool.queued) == 0 && !pool.stopping)
+            pthread_cond_wait(&pool.work_available, &pool.idle_lock);
+        int stopping = pool.stopping;
+        pthread_mutex_unlock(&pool.idle_lock);
+        if (stopping) break;
+    }
+
+    flushThreadBufferCache();				// cached buffers would be lost with the thread
+    return NULL;
+}
+
+/* run a client's handshake, or every command it has sent, then wait for more input */
+void runClientTask(struct pool_client* client)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.stopping) {
+        pthread_mutex_unlock(&pool.lock);
+        return;						// the dispatcher sends the kill message
+    }
+    client->busy = 1;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (client->stage == POOL_CLIENT_HANDSHAKE) {
+        if (getClientDataSocketInfo(client->cmd_fd, &client->session) == -1) {
+            logEvent(client->session.id, LOG_HANDSHAKE_FAILED, NULL);
+            status = CLIENT_DISCONNECTED;
+        } else {
+            client->stage = POOL_CLIENT_READY;
+            logEvent(client->session.id, LOG_WORKER_CONNECTED, client->session.data_addr,
+                     strtoul(client->session.data_port, NULL, 10), client->session.protocol);
+        }
+    } else {
+        status = handleClientCmd(client->cmd_fd, &client->session);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    client->busy = 0;
+    int stopping = pool.stopping;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (status == CLIENT_DISCONNECTED || stopping) {
+        if (stopping && status != CLIENT_DISCONNECTED && !(client->session.capabilities & CAP_MUX))
+            sendKillToClient(client->cmd_fd);
+        retirePoolClient(client);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_MOD, client->cmd_fd, &ev) == -1) {
+        logEvent(client->session.id, LOG_REGISTER_FAILED, NULL, logLiteral("re-arm"));
+        retirePoolClient(client);
+    }
+}
+
+/********************************************* Work queues **********************************************/
+
+/* queue a client on a worker's deque and wake a sleeping worker */
+void pushTask(struct pool_worker* worker, struct pool_client* client)
+{
+    pthread_mutex_lock(&worker->lock);
+    client->task_next = NULL;
+    client->task_prev = worker->tail;
+    if (worker->tail != NULL) worker->tail->task_next = client;
+    else worker->head = client;
+    worker->tail = client;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&pool.idle_lock);
+    atomic_fetch_add(&pool.queued, 1);
+    pthread_cond_signal(&pool.work_available);
+    pthread_mutex_unlock(&pool.idle_lock);
+}
+
+/* take the oldest task from the worker's own deque */
+struct pool_client* popTask(struct pool_worker* worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    struct pool_client* client = worker->head;
+    if (client != NULL) {
+        worker->head = client->task_next;
+        if (worker->head != NULL) worker->head->task_prev = NULL;
+        else worker->tail = NULL;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (client != NULL) atomic_fetch_sub(&pool.queued, 1);
+    return client;
+}
+
+/* take the newest task from the first other worker that has one */
+struct pool_client* stealTask(struct pool_worker* self)
+{
+    for (int i = 1; i < pool.num_workers; i++) {
+        struct pool_worker* victim = &pool.workers[(self->id + i) % pool.num_workers];
+        pthread_mutex_lock(&victim->lock);
+        struct pool_client* client = victim->tail;
+        if (client != NULL) {
+            victim->tail = client->task_prev;
+            if (victim->tail != NULL) victim->tail->task_next = NULL;
+            else victim->head = NULL;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (client != NULL) {
+            atomic_fetch_sub(&pool.queued, 1);
+            return client;
+        }
+    }
+    return NULL;
+}
+
+/****************************************** Admission control *******************************************/
+
+/* accept every pending client, admitting, queueing or refusing each */
+void acceptPoolClients(int server_welcome_fd)
+{
+    struct timeval timeout = { .tv_sec = POOL_HANDSHAKE_TIMEOUT_SEC, .tv_usec = 0 };
+
+    for (;;) {
+        int cmd_fd = accept4(server_welcome_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (cmd_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;						// EAGAIN, or out of descriptors until a client leaves
+        }
+
+        struct pool_client* client = calloc(1, sizeof(struct pool_client));
+        if (client == NULL) {
+            close(cmd_fd);
+            continue;
+        }
+        client->cmd_fd = cmd_fd;
+        initSession(&client->session);
+        setsockopt(cmd_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&pool.lock);
+        int admit = pool.admitted < pool.max_clients;
+        int queue = !admit && pool.waiting < POOL_ADMISSION_QUEUE;
+        if (admit) {
+            pool.admitted++;
+            client->stage = POOL_CLIENT_HANDSHAKE;
+        } else if (queue) {
+            pool.waiting++;
+            client->stage = POOL_CLIENT_WAITING;
+            client->task_prev = pool.waiting_tail;
+            if (pool.waiting_tail != NULL) pool.waiting_tail->task_next = client;
+            else pool.waiting_head = client;
+            pool.waiting_tail = client;
+        }
+        if (admit || queue) {
+            client->next = pool.clients;
+            if (pool.clients != NULL) pool.clients->prev = client;
+            pool.clients = client;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!admit && !queue) {
+            logEvent(0, LOG_CLIENT_REFUSED, NULL);
+            send(cmd_fd, ERROR_SERVER_BUSY, strlen(ERROR_SERVER_BUSY), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(cmd_fd);
+            free(client);
+            countMetric(METRIC_CONNECTIONS_REJECTED, 1);
+            continue;
+        }
+        countMetric(METRIC_CONNECTIONS_OPENED, 1);
+        if (admit && admitClient(client) == -1) retirePoolClient(client);
+    }
+}
+
+/* start watching an admitted client's control connection, its handshake runs once input arrives */
+int admitClient(struct pool_client* client)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, client->cmd_fd, &ev) == -1) {
+        logEvent(client->session.id, LOG_REGISTER_FAILED, NULL, logLiteral("register"));
+        return -1;
+    }
+    return 0;
+}
+
+/* close a client's connections and hand its slot to the longest waiting client */
+void retirePoolClient(struct pool_client* client)
+{
+    struct pool_client* next = NULL;
+
+    closeSessionDataConnection(&client->session);
+    closePassiveListener(&client->session);
+    releaseUpload(&client->session);
+    close(client->cmd_fd);					// also drops it from the epoll set
+    countMetric(METRIC_CONNECTIONS_CLOSED, 1);
+
+    pthread_mutex_lock(&pool.lock);
+    if (client->prev != NULL) client->prev->next = client->next;
+    else pool.clients = client->next;
+    if (client->next != NULL) client->next->prev = client->prev;
+    if (client->stage == POOL_CLIENT_WAITING) {
+        pool.waiting--;
+    } else if (pool.waiting_head != NULL && !pool.stopping) {
+        next = pool.waiting_head;			// the slot passes straight to the next client
+        pool.waiting_head = next->task_next;
+        if (pool.waiting_head != NULL) pool.waiting_head->task_prev = NULL;
+        else pool.waiting_tail = NULL;
+        next->task_next = NULL;
+        next->stage = POOL_CLIENT_HANDSHAKE;
+        pool.waiting--;
+    } else {
+        pool.admitted--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    free(client);
+
+    if (next != NULL && admitClient(next) == -1) retirePoolClient(next);
+}
@@ -0,0 +1,74 @@
+/***************************************************************************************
+ * Title: Worker Pool Specification
+ * Description: Specification for the threads engine (./server {PORT} -e threads). A
+ * 		fixed pool of blocking worker threads serves every client. The main thread
+ * 		accepts clients and watches their control connections with epoll
+ * 		(EPOLLONESHOT). When a client has input, it is queued as a task on one
+ * 		worker's deque, and the worker runs its handshake or commands to
+ * 		completion before re-arming it. An idle worker steals from the far end of
+ * 		another worker's deque. Admission control caps the clients being served.
+ * 		Beyond the cap, new clients wait in a bounded queue, and once that is
+ * 		full they are turned away with ERROR_SERVER_BUSY.
+ * ************************************************************************************/
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "download_server.h"
+
+#define POOL_THREADS_PER_CORE       4       // workers block on sockets, so several share a core
+#define POOL_DEFAULT_MAX_CLIENTS    1024    // clients served at once, changed with -a
+#define POOL_ADMISSION_QUEUE        256     // clients waiting for a slot before new ones are refused
+#define POOL_HANDSHAKE_TIMEOUT_SEC  5       // a worker waits at most this long on a stalled handshake
+#define POOL_SHUTDOWN_GRACE_SEC     5       // workers finishing a transfer get this long to exit
+#define POOL_MAX_EVENTS             64
+
+enum pool_client_stage {
+    POOL_CLIENT_WAITING,        // accepted, waiting in the admission queue
+    POOL_CLIENT_HANDSHAKE,      // admitted, data address and port not yet received
+    POOL_CLIENT_READY           // handshake done, commands run as they arrive
+};
+
+struct pool_client {
+    int cmd_fd;
+    enum pool_client_stage stage;
+    int busy;                   // a worker is running this client's task
+    struct client_session session;
+    struct pool_client* prev;   // every client, for shutdown
+    struct pool_client* next;
+    struct pool_client* task_prev;      // position in a worker's deque, or the admission queue
+    struct pool_client* task_next;
+};
+
+/* One worker's deque of runnable clients. The owner takes the oldest task from the head;
+ * thieves take the newest from the tail, so the two rarely contend for the same end */
+struct pool_worker {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct pool_client* head;
+    struct pool_client* tail;
+};
+
+/* Engine startup and shutdown, runs in main thread */
+void runWorkerPool(int, char*);
+void wakeWorkerPool();
+
+/* Worker threads */
+void* pool_worker_thread(void*);
+void runClientTask(struct pool_client*);
+
+/* Work queues */
+void pushTask(struct pool_worker*, struct pool_client*);
+struct pool_client* popTask(struct pool_worker*);
+struct pool_client* stealTask(struct pool_worker*);
+
+/* Admission control */
+void acceptPoolClients(int);
+int admitClient(struct pool_client*);
+void retirePoolClient(struct pool_client*);
+
+#endif
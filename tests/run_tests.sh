@@ -0,0 +1,37 @@
+#!/bin/sh
+# Title: Test Runner
+# Description: Runs the server's regression tests over loopback against every engine, each in
+# 		a scratch directory of its own. Egress is shaped per client so the tests can
+# 		change files while a response is still going out. Tunables come from the
+# 		environment: ENGINES (threads epoll uring), PORT (47000), PYTHON (python2)
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+server="$here/../server/server"
+
+ENGINES=${ENGINES:-threads epoll uring}
+PORT=${PORT:-47000}
+PYTHON=${PYTHON:-python2}
+
+files=$(mktemp -d)
+server_pid=
+trap 'kill $server_pid 2>/dev/null || true; wait $server_pid 2>/dev/null || true; rm -rf "$files"' EXIT
+
+failed=0
+for engine in $ENGINES; do
+	for mode in framed legacy; do
+		head -c 8388608 /dev/urandom > "$files/large.bin"
+		(cd "$files" && exec "$server" "$PORT" -e "$engine" -r 16 > /dev/null 2>&1) &
+		server_pid=$!
+		sleep 0.5
+
+		printf '%s %s: ' "$engine" "$mode"
+		"$PYTHON" "$here/truncate_during_get.py" "$PORT" $((PORT + 1)) "$files/large.bin" "$mode" || failed=1
+
+		kill -INT $server_pid 2>/dev/null; wait $server_pid 2>/dev/null || true
+		server_pid=
+		PORT=$((PORT + 2))
+	done
+done
+exit $failed
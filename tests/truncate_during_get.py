@@ -0,0 +1,147 @@
+#!/usr/bin/env python2
+# Title: Truncation During GET
+# Description: Requests a large file from a running server and truncates it once part of it has
+# 		arrived. A framed +persist session must see its data connection closed before
+# 		the announced length, and its next command must get a whole response on a new
+# 		data connection. A legacy session must get what was left of the file followed
+# 		by @@END_DATA.
+# Usage: truncate_during_get.py SERVER_PORT DATA_PORT FILE_PATH framed|legacy
+
+import os
+import socket
+import struct
+import sys
+
+END_DATA_MESSAGE = "@@END_DATA"
+DATA_GREETING = "Data connection established!"
+FRAME_HEADER_SIZE = 16
+FRAME_DATA, FRAME_END = 1, 2
+TRUNCATE_AFTER = 512 * 1024         # bytes received before the file is truncated
+TRUNCATE_TO = 2 * 1024 * 1024
+TIMEOUT = 20
+
+
+def fail(message):
+    print "FAIL: " + message
+    sys.exit(1)
+
+
+def recvExactly(sock, length):
+    data = ""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def acceptData(welcome):
+    data, addr = welcome.accept()
+    data.settimeout(TIMEOUT)
+    data.sendall(DATA_GREETING)
+    return data
+
+
+def handshake(port, data_port, capabilities):
+    control = socket.create_connection(("127.0.0.1", port), TIMEOUT)
+    control.sendall("127.0.0.1")
+    control.recv(64)
+    control.sendall(str(data_port) + capabilities)
+    ack = control.recv(256)
+    if capabilities and "+persist" not in ack:
+        fail("server refused framing: " + ack)
+    return control
+
+
+def truncateFile(path):
+    with open(path, "r+b") as f:
+        f.truncate(TRUNCATE_TO)
+
+
+def framedCase(port, welcome, data_port, path, size):
+    control = handshake(port, data_port, " FRAME/1 +persist")
+    control.sendall("-g " + os.path.basename(path) + "\n")
+    data = acceptData(welcome)
+
+    header = recvExactly(data, FRAME_HEADER_SIZE)
+    version, opcode, flags, reserved, length = struct.unpack("!BBHIQ", header)
+    if opcode != FRAME_DATA or length != size:
+        fail("expected a DATA frame of %d bytes, got opcode %d length %d" % (size, opcode, length))
+
+    received, truncated = 0, False
+    while received < length:
+        try:
+            chunk = data.recv(min(65536, length - received))
+        except socket.timeout:
+            fail("data connection stalled at %d of %d bytes" % (received, length))
+        if not chunk:
+            break
+        received += len(chunk)
+        if not truncated and received >= TRUNCATE_AFTER:
+            truncateFile(path)
+            truncated = True
+    if received >= length:
+        fail("received all %d announced bytes of a truncated file" % length)
+    data.close()
+
+    # the session carries on, with a new data connection for its next response
+    control.sendall("-g " + os.path.basename(path) + "\n")
+    data = acceptData(welcome)
+    header = recvExactly(data, FRAME_HEADER_SIZE)
+    version, opcode, flags, reserved, length = struct.unpack("!BBHIQ", header)
+    if opcode != FRAME_DATA or length != TRUNCATE_TO or recvExactly(data, length) is None:
+        fail("next response after the failed one was not the truncated file")
+    header = recvExactly(data, FRAME_HEADER_SIZE)
+    if header is None or struct.unpack("!BBHIQ", header)[1] != FRAME_END:
+        fail("next response did not end with END")
+    print "framed: connection closed at %d of %d bytes, next response whole" % (received, size)
+
+
+def legacyCase(port, welcome, data_port, path, size):
+    control = handshake(port, data_port, "")
+    control.sendall("-g " + os.path.basename(path))
+    data = acceptData(welcome)
+
+    received, truncated = "", False
+    while not received.endswith(END_DATA_MESSAGE):
+        try:
+            chunk = data.recv(65536)
+        except socket.timeout:
+            fail("data connection stalled at %d bytes" % len(received))
+        if not chunk:
+            break
+        received += chunk
+        if not truncated and len(received) >= TRUNCATE_AFTER:
+            truncateFile(path)
+            truncated = True
+    if not received.endswith(END_DATA_MESSAGE):
+        fail("response ended without " + END_DATA_MESSAGE)
+    data.sendall(END_DATA_MESSAGE)
+    body = len(received) - len(END_DATA_MESSAGE)
+    if body != TRUNCATE_TO:
+        fail("expected the %d bytes left of the file, got %d" % (TRUNCATE_TO, body))
+    print "legacy: %d of %d bytes, then %s" % (body, size, END_DATA_MESSAGE)
+
+
+def main():
+    if len(sys.argv) != 5 or sys.argv[4] not in ("framed", "legacy"):
+        print "Usage: truncate_during_get.py SERVER_PORT DATA_PORT FILE_PATH framed|legacy"
+        sys.exit(2)
+    port, data_port, path = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+
+    welcome = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    welcome.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    welcome.bind(("", data_port))
+    welcome.listen(1)
+    welcome.settimeout(TIMEOUT)
+
+    size = os.path.getsize(path)
+    if sys.argv[4] == "framed":
+        framedCase(port, welcome, data_port, path, size)
+    else:
+        legacyCase(port, welcome, data_port, path, size)
+
+
+if __name__ == "__main__":
+    main()